@@ -0,0 +1,806 @@
+/** \file ssdp_bench.c
+ * Benchmarks of the hot paths (make bench).
+ *
+ * Every benchmark runs over the datagrams of the corpus directory (one
+ * datagram per file, "\n" line endings are sent as "\r\n") and is repeated
+ * until it has run for at least the minimum time. The results are written
+ * one benchmark per line:
+ *
+ *     <name> <iterations> <ns/op> <allocs/op> <msgs/s>
+ *
+ * and compared to the same lines of a stored baseline, if one is given.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common_definitions.h"
+#include "configuration.h"
+#include "net_definitions.h"
+#include "ssdp_capture.h"
+#include "ssdp_cache.h"
+#include "ssdp_cache_display.h"
+#include "ssdp_cache_output_format.h"
+#include "ssdp_common.h"
+#include "ssdp_filter.h"
+#include "ssdp_listener.h"
+#include "ssdp_message.h"
+#include "string_buffer.h"
+
+/** The most datagrams read from the corpus. */
+#define BENCH_MAX_DATAGRAMS 256
+/** The most header names taken from the corpus. */
+#define BENCH_MAX_HEADERS 4096
+/** The devices (IPs) the cache and pipeline benchmarks spread over. */
+#define BENCH_DEVICES 1024
+/** The devices shown by the display benchmark. */
+#define BENCH_DISPLAY_DEVICES 64
+/** How many times every device sends every datagram in the pipeline. */
+#define BENCH_PIPELINE_ROUNDS 2
+/** The default minimum time (in ms) every benchmark runs for. */
+#define BENCH_DEFAULT_TIME 500
+/** The default slow down (in percent) reported as a regression. */
+#define BENCH_DEFAULT_THRESHOLD 10
+/** The most benchmarks in a baseline. */
+#define BENCH_MAX_RESULTS 32
+/** The filters of the filter benchmark. */
+#define BENCH_FILTERS "nts=ssdp:alive,server=UPnP"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *pointer);
+
+/** The number of heap allocations made so far. */
+static unsigned long long allocations;
+
+/*
+ * The allocation functions are replaced (see the glibc manual, "Replacing
+ * malloc") to count the allocations of the benchmarked code.
+ */
+void *malloc(size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(pointer, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **pointer, size_t alignment, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  *pointer = __libc_memalign(alignment, size);
+  return *pointer ? 0 : 12 /* ENOMEM */;
+}
+
+void free(void *pointer) {
+  __libc_free(pointer);
+}
+
+/** A datagram of the corpus. */
+typedef struct bench_datagram_struct {
+  /** The datagram, null-terminated. */
+  char *data;
+  /** The length of the datagram. */
+  int length;
+} bench_datagram_s;
+
+/** What the benchmarks run over. */
+typedef struct bench_context_struct {
+  /** The datagrams of the corpus. */
+  bench_datagram_s datagrams[BENCH_MAX_DATAGRAMS];
+  /** The number of datagrams. */
+  unsigned int datagrams_count;
+  /** The header names of the corpus. */
+  char *headers[BENCH_MAX_HEADERS];
+  /** The number of header names. */
+  unsigned int headers_count;
+  /** The corpus parsed, one message per device (BENCH_DEVICES). */
+  ssdp_message_s *messages[BENCH_DEVICES];
+  /** The number of parsed messages. */
+  unsigned int messages_count;
+  /** The filters of the filter benchmark. */
+  filters_factory_s *filters;
+  /** Two caches the display switches between. */
+  ssdp_cache_s *display_caches[2];
+  /** The capture the pipeline reads. */
+  char pipeline_file[64];
+  /** The number of datagrams in the capture. */
+  unsigned int pipeline_datagrams;
+  /** The output buffer of the output benchmarks. */
+  string_buffer_s output;
+} bench_context_s;
+
+/**
+ * Runs a benchmark a number of times.
+ *
+ * @param context What the benchmark runs over.
+ * @param iterations The number of times to run it.
+ *
+ * @return The number of messages it went through.
+ */
+typedef unsigned long long (*bench_function)(bench_context_s *context,
+    unsigned long long iterations);
+
+/** A benchmark. */
+typedef struct bench_struct {
+  /** The name in the results. */
+  const char *name;
+  /** The benchmark. */
+  bench_function function;
+} bench_s;
+
+/** The result of a benchmark. */
+typedef struct bench_result_struct {
+  /** The name of the benchmark. */
+  char name[64];
+  /** The iterations run. */
+  unsigned long long iterations;
+  /** The time per iteration. */
+  double ns_per_op;
+  /** The allocations per iteration. */
+  double allocs_per_op;
+  /** The messages gone through per second. */
+  double msgs_per_s;
+} bench_result_s;
+
+/**
+ * Get the monotonic time in ns.
+ *
+ * @return The time.
+ */
+static unsigned long long now_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Make the IP of a benchmarked device.
+ *
+ * @param device The number of the device.
+ * @param ip The IP buffer (IPv4_STR_MAX_SIZE).
+ */
+static void device_ip(unsigned int device, char *ip) {
+  snprintf(ip, IPv4_STR_MAX_SIZE, "10.%u.%u.%u", (device >> 16) & 0xff,
+      (device >> 8) & 0xff, device & 0xff);
+}
+
+/**
+ * Read a corpus file, with "\r\n" line endings.
+ *
+ * @param path The file.
+ * @param datagram The datagram to fill.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL read_datagram(const char *path, bench_datagram_s *datagram) {
+  char raw[SSDP_RECV_DATA_LEN];
+  size_t raw_length;
+  size_t i;
+  int length = 0;
+  FILE *file;
+
+  file = fopen(path, "r");
+  if (!file) {
+    return FALSE;
+  }
+  raw_length = fread(raw, 1, sizeof(raw) / 2 - 1, file);
+  fclose(file);
+
+  datagram->data = (char *)malloc(raw_length * 2 + 1);
+  if (!datagram->data) {
+    return FALSE;
+  }
+  for (i = 0; i < raw_length; i++) {
+    if (raw[i] == '\n' && (i == 0 || raw[i - 1] != '\r')) {
+      datagram->data[length++] = '\r';
+    }
+    datagram->data[length++] = raw[i];
+  }
+  datagram->data[length] = '\0';
+  datagram->length = length;
+
+  return TRUE;
+}
+
+/**
+ * Take the header names of a datagram.
+ *
+ * @param context The context to add them to.
+ * @param datagram The datagram.
+ */
+static void collect_headers(bench_context_s *context,
+    const bench_datagram_s *datagram) {
+  const char *line = strstr(datagram->data, "\r\n");
+
+  while (line && context->headers_count < BENCH_MAX_HEADERS) {
+    const char *colon;
+    line += 2;
+    colon = strchr(line, ':');
+    if (!colon || colon > strstr(line, "\r\n")) {
+      break;
+    }
+    context->headers[context->headers_count] = strndup(line, colon - line);
+    if (!context->headers[context->headers_count]) {
+      break;
+    }
+    context->headers_count++;
+    line = strstr(line, "\r\n");
+  }
+}
+
+/**
+ * Parse a datagram of the corpus as sent by a device.
+ *
+ * @param context The context.
+ * @param index The datagram.
+ * @param device The device that sent it.
+ *
+ * @return The message, NULL on failure.
+ */
+static ssdp_message_s *parse_datagram(bench_context_s *context,
+    unsigned int index, unsigned int device) {
+  bench_datagram_s *datagram = &context->datagrams[index];
+  ssdp_message_s *message = NULL;
+  char ip[IPv4_STR_MAX_SIZE];
+  char mac[MAC_STR_MAX_SIZE] = "0:11:22:33:44:55";
+
+  device_ip(device, ip);
+  if (!init_ssdp_message(&message)) {
+    return NULL;
+  }
+  if (!build_ssdp_message(message, ip, mac, datagram->length,
+      datagram->data)) {
+    free_ssdp_message(&message);
+    return NULL;
+  }
+
+  return message;
+}
+
+/**
+ * Write the pipeline capture: every device sends every datagram.
+ *
+ * @param context The context.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL write_pipeline_capture(bench_context_s *context) {
+  unsigned char frame[CAPTURE_FRAME_HEADERS + SSDP_RECV_DATA_LEN];
+  unsigned int round, device, index;
+  BOOL written;
+  FILE *file;
+  int fd;
+
+  strcpy(context->pipeline_file, "/tmp/ssdp_bench_XXXXXX");
+  fd = mkstemp(context->pipeline_file);
+  if (fd < 0 || !(file = fdopen(fd, "w"))) {
+    return FALSE;
+  }
+  written = capture_write_pcap_header(file);
+
+  for (round = 0; round < BENCH_PIPELINE_ROUNDS; round++) {
+    for (index = 0; index < context->datagrams_count; index++) {
+      for (device = 0; device < BENCH_DEVICES; device++) {
+        bench_datagram_s *datagram =
+            &context->datagrams[(index + device) % context->datagrams_count];
+        size_t length = capture_build_frame(frame, device, datagram->data,
+            datagram->length);
+
+        written &= capture_write_pcap_record(file, 1000000000 + round,
+            device, frame, length);
+        context->pipeline_datagrams++;
+      }
+    }
+  }
+
+  return fclose(file) == 0 && written;
+}
+
+/**
+ * Load the corpus and prepare what the benchmarks run over.
+ *
+ * @param context The context to fill.
+ * @param corpus The corpus directory.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL init_context(bench_context_s *context, const char *corpus) {
+  char filters[] = BENCH_FILTERS;
+  struct dirent **entries;
+  char path[4096];
+  unsigned int i;
+  int count;
+
+  memset(context, 0, sizeof(bench_context_s));
+
+  /* In name order, so the runs are the same everywhere */
+  count = scandir(corpus, &entries, NULL, alphasort);
+  if (count < 0) {
+    fprintf(stderr, "Could not read the corpus '%s'\n", corpus);
+    return FALSE;
+  }
+  for (i = 0; i < (unsigned int)count; i++) {
+    if (entries[i]->d_name[0] != '.' &&
+        context->datagrams_count < BENCH_MAX_DATAGRAMS) {
+      snprintf(path, sizeof(path), "%s/%s", corpus, entries[i]->d_name);
+      if (read_datagram(path,
+          &context->datagrams[context->datagrams_count])) {
+        collect_headers(context,
+            &context->datagrams[context->datagrams_count]);
+        context->datagrams_count++;
+      }
+    }
+    free(entries[i]);
+  }
+  free(entries);
+  if (context->datagrams_count == 0) {
+    fprintf(stderr, "The corpus '%s' is empty\n", corpus);
+    return FALSE;
+  }
+
+  for (i = 0; i < BENCH_DEVICES; i++) {
+    ssdp_message_s *message = parse_datagram(context,
+        i % context->datagrams_count, i);
+    if (message) {
+      context->messages[context->messages_count++] = message;
+    }
+  }
+
+  parse_filters(filters, &context->filters, FALSE);
+
+  /* Caches of different devices, every frame redraws all the rows */
+  for (i = 0; i < 2 * BENCH_DISPLAY_DEVICES; i++) {
+    ssdp_message_s *message = parse_datagram(context,
+        i % context->datagrams_count, i);
+    if (message) {
+      add_ssdp_message_to_cache(
+          &context->display_caches[i / BENCH_DISPLAY_DEVICES], &message, NULL);
+    }
+  }
+
+  return string_buffer_init(&context->output, XML_BUFFER_SIZE) &&
+      write_pipeline_capture(context);
+}
+
+/**
+ * Free what the benchmarks ran over.
+ *
+ * @param context The context.
+ */
+static void free_context(bench_context_s *context) {
+  unsigned int i;
+
+  for (i = 0; i < context->datagrams_count; i++) {
+    free(context->datagrams[i].data);
+  }
+  for (i = 0; i < context->headers_count; i++) {
+    free(context->headers[i]);
+  }
+  for (i = 0; i < context->messages_count; i++) {
+    free_ssdp_message(&context->messages[i]);
+  }
+  free_ssdp_filters_factory(context->filters);
+  free_ssdp_cache(&context->display_caches[0]);
+  free_ssdp_cache(&context->display_caches[1]);
+  string_buffer_free(&context->output);
+  if (context->pipeline_file[0]) {
+    unlink(context->pipeline_file);
+  }
+}
+
+/** Parse (and free) a datagram. */
+static unsigned long long bench_build_ssdp_message(bench_context_s *context,
+    unsigned long long iterations) {
+  unsigned long long i;
+
+  for (i = 0; i < iterations; i++) {
+    ssdp_message_s *message = parse_datagram(context,
+        i % context->datagrams_count, 0);
+    if (message) {
+      free_ssdp_message(&message);
+    }
+  }
+
+  return iterations;
+}
+
+/** Look up the type of a header name. */
+static unsigned long long bench_get_header_type(bench_context_s *context,
+    unsigned long long iterations) {
+  volatile unsigned int types = 0;
+  unsigned long long i;
+
+  for (i = 0; i < iterations; i++) {
+    types += get_header_type(context->headers[i % context->headers_count]);
+  }
+
+  return iterations;
+}
+
+/** Filter a parsed message. */
+static unsigned long long bench_filter(bench_context_s *context,
+    unsigned long long iterations) {
+  volatile unsigned int dropped = 0;
+  unsigned long long i;
+
+  for (i = 0; i < iterations; i++) {
+    dropped += filter(context->messages[i % context->messages_count],
+        context->filters);
+  }
+
+  return iterations;
+}
+
+/** Copy a parsed message, the baseline of bench_add_to_cache(). */
+static unsigned long long bench_copy_ssdp_message(bench_context_s *context,
+    unsigned long long iterations) {
+  unsigned long long i;
+
+  for (i = 0; i < iterations; i++) {
+    ssdp_message_s *message =
+        copy_ssdp_message(context->messages[i % context->messages_count]);
+    free_ssdp_message(&message);
+  }
+
+  return iterations;
+}
+
+/** Add (a copy of) a parsed message to a cache of BENCH_DEVICES devices. */
+static unsigned long long bench_add_to_cache(bench_context_s *context,
+    unsigned long long iterations) {
+  ssdp_cache_s *cache = NULL;
+  unsigned long long i;
+
+  for (i = 0; i < iterations; i++) {
+    ssdp_message_s *message =
+        copy_ssdp_message(context->messages[i % context->messages_count]);
+    add_ssdp_message_to_cache(&cache, &message, NULL);
+  }
+  free_ssdp_cache(&cache);
+
+  return iterations;
+}
+
+/** Convert a parsed message to XML. */
+static unsigned long long bench_to_xml(bench_context_s *context,
+    unsigned long long iterations) {
+  unsigned long long i;
+
+  for (i = 0; i < iterations; i++) {
+    string_buffer_reset(&context->output);
+    to_xml(context->messages[i % context->messages_count], TRUE,
+        &context->output);
+  }
+
+  return iterations;
+}
+
+/** Convert a parsed message to JSON. */
+static unsigned long long bench_to_json(bench_context_s *context,
+    unsigned long long iterations) {
+  unsigned long long i;
+
+  for (i = 0; i < iterations; i++) {
+    string_buffer_reset(&context->output);
+    to_json(context->messages[i % context->messages_count], TRUE,
+        &context->output);
+  }
+
+  return iterations;
+}
+
+/** Draw a whole table of BENCH_DISPLAY_DEVICES devices (to /dev/null). */
+static unsigned long long bench_display_ssdp_cache(bench_context_s *context,
+    unsigned long long iterations) {
+  unsigned long long i;
+
+  for (i = 0; i < iterations; i++) {
+    display_ssdp_cache(context->display_caches[i % 2], FALSE);
+  }
+
+  return iterations * BENCH_DISPLAY_DEVICES;
+}
+
+/** Run the listener over the capture, with the events streamed out. */
+static unsigned long long bench_pipeline(bench_context_s *context,
+    unsigned long long iterations) {
+  unsigned long long i;
+
+  for (i = 0; i < iterations; i++) {
+    ssdp_listener_s listener;
+    configuration_s conf;
+
+    memset(&listener, 0, sizeof(listener));
+    set_default_configuration(&conf);
+    conf.listen_for_upnp_notif = TRUE;
+    conf.fetch_info = FALSE;
+    conf.quiet_mode = TRUE;
+    conf.event_stream_output = TRUE;
+    conf.offline = TRUE;
+    conf.pcap_file = context->pipeline_file;
+    ssdp_listener_start(&listener, &conf);
+  }
+
+  return iterations * context->pipeline_datagrams;
+}
+
+/** The benchmarks, in the order they run. */
+static const bench_s benchmarks[] = {
+  { "build_ssdp_message", bench_build_ssdp_message },
+  { "get_header_type", bench_get_header_type },
+  { "filter", bench_filter },
+  { "copy_ssdp_message", bench_copy_ssdp_message },
+  { "add_ssdp_message_to_cache", bench_add_to_cache },
+  { "to_xml", bench_to_xml },
+  { "to_json", bench_to_json },
+  { "display_ssdp_cache", bench_display_ssdp_cache },
+  { "pipeline", bench_pipeline }
+};
+
+/**
+ * Run a benchmark for at least a minimum time.
+ *
+ * @param context What it runs over.
+ * @param bench The benchmark.
+ * @param min_time The minimum time (in ms).
+ * @param result The result to fill.
+ */
+static void run_bench(bench_context_s *context, const bench_s *bench,
+    unsigned int min_time, bench_result_s *result) {
+  unsigned long long iterations = 1;
+  unsigned long long elapsed;
+  unsigned long long allocated;
+  unsigned long long messages;
+
+  /* The first run warms up the caches (and the intern table) */
+  bench->function(context, 1);
+
+  while (TRUE) {
+    unsigned long long start = now_ns();
+    allocated = allocations;
+    messages = bench->function(context, iterations);
+    elapsed = now_ns() - start;
+    allocated = allocations - allocated;
+    if (elapsed >= min_time * 1000000ULL || iterations >= 1ULL << 40) {
+      break;
+    }
+    /* Aim for the minimum time, at most 10 times more iterations */
+    if (elapsed < 1000) {
+      iterations *= 10;
+    }
+    else {
+      unsigned long long next =
+          iterations * min_time * 1200000ULL / elapsed;
+      iterations = next > iterations * 10 ? iterations * 10 :
+          next > iterations ? next : iterations + 1;
+    }
+  }
+
+  snprintf(result->name, sizeof(result->name), "%s", bench->name);
+  result->iterations = iterations;
+  result->ns_per_op = (double)elapsed / iterations;
+  result->allocs_per_op = (double)allocated / iterations;
+  result->msgs_per_s = messages * 1e9 / elapsed;
+}
+
+/**
+ * Read a baseline.
+ *
+ * @param path The baseline.
+ * @param baseline The results to fill.
+ *
+ * @return The number of results read.
+ */
+static unsigned int read_baseline(const char *path,
+    bench_result_s *baseline) {
+  unsigned int count = 0;
+  char line[256];
+  FILE *file;
+
+  file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Could not read the baseline '%s'\n", path);
+    return 0;
+  }
+  while (count < BENCH_MAX_RESULTS && fgets(line, sizeof(line), file)) {
+    if (line[0] != '#' && sscanf(line, "%63s %llu %lf %lf %lf",
+        baseline[count].name, &baseline[count].iterations,
+        &baseline[count].ns_per_op, &baseline[count].allocs_per_op,
+        &baseline[count].msgs_per_s) == 5) {
+      count++;
+    }
+  }
+  fclose(file);
+
+  return count;
+}
+
+/**
+ * Print a result, and how it compares to its baseline.
+ *
+ * @param file Where to print it.
+ * @param result The result.
+ * @param baseline The baseline, NULL if none.
+ * @param threshold The slow down (in percent) reported as a regression.
+ *
+ * @return TRUE if it regressed, FALSE otherwise.
+ */
+static BOOL print_result(FILE *file, const bench_result_s *result,
+    const bench_result_s *baseline, unsigned int threshold) {
+  double change;
+  BOOL regressed;
+
+  fprintf(file, "%-26s %12llu %14.1f %10.2f %14.0f", result->name,
+      result->iterations, result->ns_per_op, result->allocs_per_op,
+      result->msgs_per_s);
+  if (!baseline) {
+    fprintf(file, "\n");
+    return FALSE;
+  }
+
+  change = (result->ns_per_op / baseline->ns_per_op - 1.0) * 100.0;
+  regressed = change > threshold ||
+      result->allocs_per_op > baseline->allocs_per_op + 0.005;
+  fprintf(file, " %+7.1f%% %+8.2f%s\n", change,
+      result->allocs_per_op - baseline->allocs_per_op,
+      regressed ? " REGRESSION" : "");
+
+  return regressed;
+}
+
+/**
+ * Print the usage.
+ *
+ * @param program The name of the program.
+ */
+static void bench_usage(const char *program) {
+  printf("USAGE: %s -c <corpus dir> [-o <results>] [-b <baseline>]\n"
+      "       [-t <ms>] [-r <percent>] [<benchmark>...]\n", program);
+  printf("\t-c <dir>      The corpus, one datagram per file\n");
+  printf("\t-o <file>     Also write the results to <file>\n");
+  printf("\t-b <file>     Compare the results to a baseline (earlier -o)\n");
+  printf("\t-t <ms>       Run every benchmark at least this long, default is %d\n",
+      BENCH_DEFAULT_TIME);
+  printf("\t-r <percent>  Report slow downs over this as regressions, default is %d\n",
+      BENCH_DEFAULT_THRESHOLD);
+}
+
+int main(int argc, char **argv) {
+  bench_result_s baseline[BENCH_MAX_RESULTS];
+  bench_result_s result;
+  static bench_context_s context;
+  unsigned int threshold = BENCH_DEFAULT_THRESHOLD;
+  unsigned int min_time = BENCH_DEFAULT_TIME;
+  unsigned int baseline_count = 0;
+  unsigned int regressions = 0;
+  const char *corpus = NULL;
+  const char *output = NULL;
+  FILE *results = NULL;
+  unsigned int i, j;
+  int stdout_copy;
+  int null_fd;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:o:b:t:r:h")) > 0) {
+    switch (opt) {
+    case 'c':
+      corpus = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    case 'b':
+      baseline_count = read_baseline(optarg, baseline);
+      break;
+    case 't':
+      min_time = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      threshold = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    default:
+      bench_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!corpus) {
+    bench_usage(argv[0]);
+    return 1;
+  }
+
+  if (!init_context(&context, corpus)) {
+    free_context(&context);
+    return 1;
+  }
+  if (output && !(results = fopen(output, "w"))) {
+    fprintf(stderr, "Could not write the results to '%s'\n", output);
+    free_context(&context);
+    return 1;
+  }
+
+  printf("# %u datagrams, %u header names, %u devices, %u pipeline "
+      "datagrams\n", context.datagrams_count, context.headers_count,
+      BENCH_DEVICES, context.pipeline_datagrams);
+  printf("# %-24s %12s %14s %10s %14s%s\n", "name", "iterations", "ns/op",
+      "allocs/op", "msgs/s", baseline_count ? "   ns/op allocs/op" : "");
+  if (results) {
+    fprintf(results, "# name iterations ns/op allocs/op msgs/s\n");
+  }
+  fflush(stdout);
+
+  /* The table and the events go nowhere */
+  stdout_copy = dup(STDOUT_FILENO);
+  null_fd = open("/dev/null", O_WRONLY);
+  display_ssdp_cache_init(0);
+
+  for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+    const bench_result_s *base = NULL;
+
+    /* Only the benchmarks named, if any */
+    if (optind < argc) {
+      for (j = optind; j < (unsigned int)argc; j++) {
+        if (strcmp(argv[j], benchmarks[i].name) == 0) {
+          break;
+        }
+      }
+      if (j == (unsigned int)argc) {
+        continue;
+      }
+    }
+
+    dup2(null_fd, STDOUT_FILENO);
+    run_bench(&context, &benchmarks[i], min_time, &result);
+    dup2(stdout_copy, STDOUT_FILENO);
+
+    for (j = 0; j < baseline_count; j++) {
+      if (strcmp(baseline[j].name, result.name) == 0) {
+        base = &baseline[j];
+      }
+    }
+    regressions += print_result(stdout, &result, base, threshold);
+    fflush(stdout);
+    if (results) {
+      print_result(results, &result, NULL, threshold);
+    }
+  }
+
+  dup2(null_fd, STDOUT_FILENO);
+  display_ssdp_cache_close();
+  dup2(stdout_copy, STDOUT_FILENO);
+  close(null_fd);
+  close(stdout_copy);
+  if (results) {
+    fclose(results);
+  }
+  free_context(&context);
+
+  if (regressions > 0) {
+    printf("# %u regressions against the baseline\n", regressions);
+  }
+
+  return 0;
+}
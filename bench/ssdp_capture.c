@@ -0,0 +1,61 @@
+/** \file ssdp_capture.c
+ * Write the captures that the benchmarks and the checks read with -P.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common_definitions.h"
+#include "ssdp_capture.h"
+
+size_t capture_build_frame(unsigned char *frame, unsigned int device,
+    const char *datagram, size_t length) {
+  size_t udp_length = 8 + length;
+  size_t ip_length = 20 + udp_length;
+
+  memset(frame, 0, CAPTURE_FRAME_HEADERS);
+  memcpy(frame, "\x01\x00\x5e\x7f\xff\xfa\x00\x11\x22", 9);
+  frame[9] = (device >> 16) & 0xff;
+  frame[10] = (device >> 8) & 0xff;
+  frame[11] = device & 0xff;
+  frame[12] = 0x08;
+  frame[14] = 0x45;
+  frame[16] = (ip_length >> 8) & 0xff;
+  frame[17] = ip_length & 0xff;
+  frame[22] = 1;
+  frame[23] = 17;
+  frame[26] = 10;
+  frame[27] = (device >> 16) & 0xff;
+  frame[28] = (device >> 8) & 0xff;
+  frame[29] = device & 0xff;
+  memcpy(frame + 30, "\xef\xff\xff\xfa", 4);
+  frame[34] = frame[36] = 1900 >> 8;
+  frame[35] = frame[37] = 1900 & 0xff;
+  frame[38] = (udp_length >> 8) & 0xff;
+  frame[39] = udp_length & 0xff;
+  memcpy(frame + CAPTURE_FRAME_HEADERS, datagram, length);
+
+  return 14 + ip_length;
+}
+
+BOOL capture_write_pcap_header(FILE *file) {
+  /* pcap, microsecond timestamps, Ethernet */
+  const uint32_t header[6] = { 0xa1b2c3d4, 0x00040002, 0, 0, 65535, 1 };
+
+  return fwrite(header, sizeof(header), 1, file) == 1;
+}
+
+BOOL capture_write_pcap_record(FILE *file, uint32_t seconds,
+    uint32_t microseconds, const unsigned char *frame, size_t length) {
+  uint32_t record[4];
+
+  record[0] = seconds;
+  record[1] = microseconds;
+  record[2] = record[3] = (uint32_t)length;
+
+  return fwrite(record, sizeof(record), 1, file) == 1 &&
+      fwrite(frame, length, 1, file) == 1;
+}
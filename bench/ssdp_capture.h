@@ -0,0 +1,59 @@
+/** \file ssdp_capture.h
+ * Header file for ssdp_capture.c.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_CAPTURE_H__
+#define __SSDP_CAPTURE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common_definitions.h"
+
+/** The length of the Ethernet, IPv4 and UDP headers of a built frame. */
+#define CAPTURE_FRAME_HEADERS 42
+
+/**
+ * Builds the Ethernet frame of a datagram multicast by a device. Device n
+ * sends from the IP 10.x.y.z and the MAC 00:11:22:x:y:z, where x, y and z
+ * are the three low bytes of n.
+ *
+ * @param frame The buffer to build the frame in, it has to hold
+ *        CAPTURE_FRAME_HEADERS more bytes than the datagram.
+ * @param device The number of the device.
+ * @param datagram The datagram.
+ * @param length The length of the datagram.
+ *
+ * @return The length of the frame.
+ */
+size_t capture_build_frame(unsigned char *frame, unsigned int device,
+    const char *datagram, size_t length);
+
+/**
+ * Writes the header of a pcap file with microsecond timestamps and
+ * Ethernet frames, in the byte order of the machine.
+ *
+ * @param file The file to write to.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL capture_write_pcap_header(FILE *file);
+
+/**
+ * Writes a frame to a pcap file.
+ *
+ * @param file The file to write to.
+ * @param seconds When the frame was captured, the seconds since the epoch.
+ * @param microseconds When the frame was captured, the microseconds.
+ * @param frame The frame.
+ * @param length The length of the frame.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL capture_write_pcap_record(FILE *file, uint32_t seconds,
+    uint32_t microseconds, const unsigned char *frame, size_t length);
+
+#endif /* __SSDP_CAPTURE_H__ */
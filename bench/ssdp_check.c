@@ -0,0 +1,928 @@
+/** \file ssdp_check.c
+ * Checks of the formats and the structures the listener shares (make check).
+ *
+ * The checks run over the datagrams of the benchmark corpus (one datagram
+ * per file, "\n" line endings are sent as "\r\n"). Every check prints one
+ * line:
+ *
+ *     <name> ok|FAILED
+ *
+ * preceded by the conditions that did not hold, and the program exits with
+ * the number of failed checks.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common_definitions.h"
+#include "net_definitions.h"
+#include "ssdp_capture.h"
+#include "ssdp_cache.h"
+#include "ssdp_cache_binary_format.h"
+#include "ssdp_common.h"
+#include "ssdp_journal.h"
+#include "ssdp_message.h"
+#include "ssdp_pcap.h"
+#include "ssdp_snapshot.h"
+#include "string_buffer.h"
+
+/** The most datagrams read from the corpus. */
+#define CHECK_MAX_DATAGRAMS 256
+/** The devices the cache of the checks holds. */
+#define CHECK_DEVICES 96
+/** The room for the frames the capture checks build. */
+#define CHECK_FRAME_SIZE (CAPTURE_FRAME_HEADERS + 32 + SSDP_RECV_DATA_LEN)
+/** The name of the interface in the pcapng capture. */
+#define CHECK_INTERFACE "check0"
+/** The snapshots the writer of the stress check publishes. */
+#define CHECK_STRESS_ROUNDS 2000
+/** The readers of the stress check. */
+#define CHECK_STRESS_READERS 4
+/** The description every other device is given (see parse_custom_fields()). */
+#define CHECK_DESCRIPTION \
+  "<root><device><serialNumber>ACCC8E%06u</serialNumber>" \
+  "<friendlyName>Check device</friendlyName>" \
+  "<manufacturer>Axis</manufacturer><modelName>P1448-LE</modelName>" \
+  "<modelNumber>%u.%u</modelNumber></device></root>"
+
+/** Check that a condition holds, count and print it if it does not. */
+#define CHECK(condition) check_that((condition), #condition, __LINE__)
+
+/** A datagram of the corpus. */
+typedef struct check_datagram_struct {
+  /** The datagram, null-terminated. */
+  char *data;
+  /** The length of the datagram. */
+  int length;
+} check_datagram_s;
+
+/** What the checks run over. */
+typedef struct check_context_struct {
+  /** The datagrams of the corpus. */
+  check_datagram_s datagrams[CHECK_MAX_DATAGRAMS];
+  /** The number of datagrams. */
+  unsigned int datagrams_count;
+  /** The corpus sent by CHECK_DEVICES devices. */
+  ssdp_cache_s *ssdp_cache;
+} check_context_s;
+
+/**
+ * Runs a check.
+ *
+ * @param context What the check runs over.
+ */
+typedef void (*check_function)(check_context_s *context);
+
+/** A check. */
+typedef struct check_struct {
+  /** The name of the check. */
+  const char *name;
+  /** The check. */
+  check_function function;
+} check_s;
+
+/** What a capture was read as. */
+typedef struct check_capture_struct {
+  /** The records of the datagrams, in the order they were read. */
+  ssdp_journal_record_s records[CHECK_DEVICES];
+  /** The datagrams. */
+  char datagrams[CHECK_DEVICES][SSDP_RECV_DATA_LEN];
+  /** The number of datagrams read, including those that did not fit. */
+  unsigned int count;
+} check_capture_s;
+
+/** A reader of the stress check. */
+typedef struct check_reader_struct {
+  /** The snapshots read. */
+  ssdp_snapshots_s *snapshots;
+  /** The writer has published the last snapshot (accessed atomically). */
+  int *done;
+  /** The snapshots walked. */
+  unsigned long walks;
+  /** The snapshots that were not whole or went back in time. */
+  unsigned long broken;
+} check_reader_s;
+
+/** The number of conditions that did not hold in the running check. */
+static unsigned int failures;
+
+/**
+ * Count and print a condition that did not hold.
+ *
+ * @param holds The condition held.
+ * @param condition The condition.
+ * @param line The line of the condition.
+ */
+static void check_that(BOOL holds, const char *condition, int line) {
+  if (!holds) {
+    printf("  %s:%d: %s\n", __FILE__, line, condition);
+    failures++;
+  }
+}
+
+/**
+ * Read a corpus file, with "\r\n" line endings.
+ *
+ * @param path The file.
+ * @param datagram The datagram to fill.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL read_datagram(const char *path, check_datagram_s *datagram) {
+  char raw[SSDP_RECV_DATA_LEN];
+  size_t raw_length;
+  size_t i;
+  int length = 0;
+  FILE *file;
+
+  file = fopen(path, "r");
+  if (!file) {
+    return FALSE;
+  }
+  raw_length = fread(raw, 1, sizeof(raw) / 2 - 1, file);
+  fclose(file);
+
+  datagram->data = (char *)malloc(raw_length * 2 + 1);
+  if (!datagram->data) {
+    return FALSE;
+  }
+  for (i = 0; i < raw_length; i++) {
+    if (raw[i] == '\n' && (i == 0 || raw[i - 1] != '\r')) {
+      datagram->data[length++] = '\r';
+    }
+    datagram->data[length++] = raw[i];
+  }
+  datagram->data[length] = '\0';
+  datagram->length = length;
+
+  return TRUE;
+}
+
+/**
+ * Parse a datagram of the corpus as sent by a device. The devices cover
+ * every way the binary format encodes the sender: IPv4, IPv6 and other
+ * addresses, with and without a MAC and a description.
+ *
+ * @param context The context.
+ * @param device The device that sent it.
+ *
+ * @return The message, NULL on failure.
+ */
+static ssdp_message_s *parse_datagram(check_context_s *context,
+    unsigned int device) {
+  check_datagram_s *datagram =
+      &context->datagrams[device % context->datagrams_count];
+  ssdp_message_s *message = NULL;
+  char ip[IPv6_STR_MAX_SIZE];
+  char mac[MAC_STR_MAX_SIZE] = "";
+  char description[sizeof(CHECK_DESCRIPTION) + 32];
+
+  switch (device % 4) {
+  case 2:
+    snprintf(ip, sizeof(ip), "fd00::%x", device + 1);
+    break;
+  case 3:
+    snprintf(ip, sizeof(ip), "device-%u.local", device);
+    break;
+  default:
+    snprintf(ip, sizeof(ip), "10.0.%u.%u", device >> 8, device & 0xff);
+    break;
+  }
+  /* As decoded, "%x" without leading zeros */
+  if (device % 3 != 0) {
+    snprintf(mac, sizeof(mac), "0:11:22:33:%x:%x", device >> 8,
+        device & 0xff);
+  }
+
+  if (!init_ssdp_message(&message)) {
+    return NULL;
+  }
+  if (!build_ssdp_message(message, ip, mac, datagram->length,
+      datagram->data)) {
+    free_ssdp_message(&message);
+    return NULL;
+  }
+  if (device % 2 == 0) {
+    snprintf(description, sizeof(description), CHECK_DESCRIPTION, device,
+        device / 10, device % 10);
+    parse_custom_fields(message, description);
+  }
+
+  return message;
+}
+
+/**
+ * Load the corpus and cache it as sent by CHECK_DEVICES devices.
+ *
+ * @param context The context to fill.
+ * @param corpus The corpus directory.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL init_context(check_context_s *context, const char *corpus) {
+  struct dirent **entries;
+  char path[4096];
+  unsigned int i;
+  int count;
+
+  memset(context, 0, sizeof(check_context_s));
+
+  /* In name order, so the runs are the same everywhere */
+  count = scandir(corpus, &entries, NULL, alphasort);
+  if (count < 0) {
+    fprintf(stderr, "Could not read the corpus '%s'\n", corpus);
+    return FALSE;
+  }
+  for (i = 0; i < (unsigned int)count; i++) {
+    if (entries[i]->d_name[0] != '.' &&
+        context->datagrams_count < CHECK_MAX_DATAGRAMS) {
+      snprintf(path, sizeof(path), "%s/%s", corpus, entries[i]->d_name);
+      if (read_datagram(path,
+          &context->datagrams[context->datagrams_count])) {
+        context->datagrams_count++;
+      }
+    }
+    free(entries[i]);
+  }
+  free(entries);
+  if (context->datagrams_count == 0) {
+    fprintf(stderr, "The corpus '%s' is empty\n", corpus);
+    return FALSE;
+  }
+
+  for (i = 0; i < CHECK_DEVICES; i++) {
+    ssdp_message_s *message = parse_datagram(context, i);
+    if (!message ||
+        !add_ssdp_message_to_cache(&context->ssdp_cache, &message, NULL)) {
+      fprintf(stderr, "Could not cache the corpus\n");
+      free_ssdp_message(&message);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/**
+ * Free what the checks ran over.
+ *
+ * @param context The context.
+ */
+static void free_context(check_context_s *context) {
+  unsigned int i;
+
+  for (i = 0; i < context->datagrams_count; i++) {
+    free(context->datagrams[i].data);
+  }
+  free_ssdp_cache(&context->ssdp_cache);
+}
+
+/**
+ * Silence the errors that are expected, until restore_stderr().
+ *
+ * @return A copy of the stderr to restore.
+ */
+static int silence_stderr(void) {
+  int stderr_copy = dup(STDERR_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+
+  dup2(null_fd, STDERR_FILENO);
+  close(null_fd);
+
+  return stderr_copy;
+}
+
+/**
+ * Restore the stderr silenced by silence_stderr().
+ *
+ * @param stderr_copy The copy of the stderr.
+ */
+static void restore_stderr(int stderr_copy) {
+  dup2(stderr_copy, STDERR_FILENO);
+  close(stderr_copy);
+}
+
+/**
+ * Decode a binary batch with the errors it logs silenced.
+ *
+ * @param data The batch.
+ * @param length The length of the batch.
+ * @param ssdp_cache_pointer The cache to decode to, it is freed on failure.
+ *
+ * @return TRUE if the batch was decoded, FALSE if it was rejected.
+ */
+static BOOL decode_quietly(const unsigned char *data, size_t length,
+    ssdp_cache_s **ssdp_cache_pointer) {
+  int stderr_copy = silence_stderr();
+  BOOL decoded;
+
+  decoded = binary_to_cache(data, length, ssdp_cache_pointer);
+  restore_stderr(stderr_copy);
+
+  if (!decoded) {
+    free_ssdp_cache(ssdp_cache_pointer);
+  }
+
+  return decoded;
+}
+
+/** Encode the corpus, decode it and encode it again to the same bytes. */
+static void check_binary_round_trip(check_context_s *context) {
+  string_buffer_s encoded, reencoded;
+  ssdp_cache_s *decoded = NULL;
+
+  if (!string_buffer_init(&encoded, XML_BUFFER_SIZE) ||
+      !string_buffer_init(&reencoded, XML_BUFFER_SIZE)) {
+    CHECK(!"Out of memory");
+    return;
+  }
+
+  CHECK(cache_to_binary(context->ssdp_cache, &encoded) > 0);
+  CHECK(binary_to_cache((unsigned char *)encoded.data, encoded.length,
+      &decoded));
+  CHECK(decoded && *decoded->ssdp_messages_count ==
+      *context->ssdp_cache->ssdp_messages_count);
+  CHECK(cache_to_binary(decoded, &reencoded) > 0);
+  CHECK(reencoded.length == encoded.length &&
+      0 == memcmp(reencoded.data, encoded.data, encoded.length));
+
+  free_ssdp_cache(&decoded);
+  string_buffer_free(&reencoded);
+  string_buffer_free(&encoded);
+}
+
+/** Reject the truncated and the corrupted batches. */
+static void check_binary_rejects(check_context_s *context) {
+  /* Hand made: no strings, one message whose IP is string 1 */
+  const unsigned char bad_index[] = { 'S', 'S', 'D', 'B', SSDP_BINARY_VERSION,
+      0x00, 0x01, SSDP_BINARY_FLAG_IP_STRING, 0x01 };
+  /* A string table count whose LEB128 is cut after a continuation byte */
+  const unsigned char cut_count[] = { 'S', 'S', 'D', 'B', SSDP_BINARY_VERSION,
+      0x81 };
+  /* A message length whose LEB128 never ends */
+  const unsigned char long_varint[] = { 'S', 'S', 'D', 'B',
+      SSDP_BINARY_VERSION, 0x00, 0x01, 0x00, 10, 0, 0, 1, 0xff, 0xff, 0xff,
+      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01 };
+  ssdp_cache_s *decoded = NULL;
+  string_buffer_s encoded;
+  unsigned char *corrupted;
+  size_t length;
+  unsigned int accepted = 0;
+
+  if (!string_buffer_init(&encoded, XML_BUFFER_SIZE) ||
+      cache_to_binary(context->ssdp_cache, &encoded) == 0) {
+    CHECK(!"Could not encode the corpus");
+    string_buffer_free(&encoded);
+    return;
+  }
+  corrupted = (unsigned char *)malloc(encoded.length);
+  if (!corrupted) {
+    CHECK(!"Out of memory");
+    string_buffer_free(&encoded);
+    return;
+  }
+
+  /* Bad magic and an unknown version */
+  memcpy(corrupted, encoded.data, encoded.length);
+  corrupted[0] = 'X';
+  CHECK(!decode_quietly(corrupted, encoded.length, &decoded));
+  memcpy(corrupted, encoded.data, encoded.length);
+  corrupted[4] = SSDP_BINARY_VERSION + 1;
+  CHECK(!decode_quietly(corrupted, encoded.length, &decoded));
+
+  /* String indexes out of range and cut or endless LEB128 varints */
+  CHECK(!decode_quietly(bad_index, sizeof(bad_index), &decoded));
+  CHECK(!decode_quietly(cut_count, sizeof(cut_count), &decoded));
+  CHECK(!decode_quietly(long_varint, sizeof(long_varint), &decoded));
+
+  /* Every cut of the batch misses something */
+  for (length = 0; length < encoded.length; length++) {
+    memcpy(corrupted, encoded.data, length);
+    if (decode_quietly(corrupted, length, &decoded)) {
+      accepted++;
+      free_ssdp_cache(&decoded);
+    }
+  }
+  CHECK(accepted == 0);
+
+  free(corrupted);
+  string_buffer_free(&encoded);
+}
+
+/**
+ * Keep a datagram read from a capture (see ssdp_pcap_read()).
+ *
+ * @param data The capture (check_capture_s).
+ * @param record The record of the datagram.
+ * @param datagram The datagram.
+ *
+ * @return TRUE to go on.
+ */
+static BOOL collect_datagram(void *data, const ssdp_journal_record_s *record,
+    const char *datagram) {
+  check_capture_s *capture = (check_capture_s *)data;
+
+  if (capture->count < CHECK_DEVICES &&
+      record->length <= SSDP_RECV_DATA_LEN) {
+    capture->records[capture->count] = *record;
+    memcpy(capture->datagrams[capture->count], datagram, record->length);
+  }
+  capture->count++;
+
+  return TRUE;
+}
+
+/**
+ * Read a capture with the errors it logs silenced.
+ *
+ * @param path The capture.
+ * @param capture What it was read as.
+ *
+ * @return TRUE if it was read whole, FALSE otherwise.
+ */
+static BOOL read_capture_quietly(const char *path, check_capture_s *capture) {
+  int stderr_copy = silence_stderr();
+  BOOL read;
+
+  memset(capture, 0, sizeof(check_capture_s));
+  read = ssdp_pcap_read(path, collect_datagram, capture);
+  restore_stderr(stderr_copy);
+
+  return read;
+}
+
+/**
+ * Check a datagram read from a capture.
+ *
+ * @param capture The capture.
+ * @param index The index of the datagram.
+ * @param ip The IP it was sent from.
+ * @param device The device that sent it (see capture_build_frame()).
+ * @param datagram The datagram that was sent.
+ * @param time When it was captured (in ns since the epoch).
+ */
+static void check_captured(const check_capture_s *capture,
+    unsigned int index, const char *ip, unsigned int device,
+    const check_datagram_s *datagram, unsigned long long time) {
+  const ssdp_journal_record_s *record = &capture->records[index];
+  char mac[MAC_STR_MAX_SIZE];
+
+  /* As read, "%x" without leading zeros */
+  snprintf(mac, sizeof(mac), "0:11:22:%x:%x:%x", (device >> 16) & 0xff,
+      (device >> 8) & 0xff, device & 0xff);
+
+  CHECK(0 == strcmp(record->ip, ip));
+  CHECK(0 == strcmp(record->mac, mac));
+  CHECK(record->time == time);
+  CHECK(record->length == (uint32_t)datagram->length &&
+      0 == memcmp(capture->datagrams[index], datagram->data,
+      datagram->length));
+}
+
+/**
+ * Build the Ethernet frame of a datagram multicast over IPv6 by a device,
+ * with a hop-by-hop options header before the UDP header. The device sends
+ * from fd00::n and the MAC of capture_build_frame().
+ *
+ * @param frame The buffer to build the frame in (CHECK_FRAME_SIZE).
+ * @param device The number of the device.
+ * @param datagram The datagram.
+ * @param length The length of the datagram.
+ *
+ * @return The length of the frame.
+ */
+static size_t build_ipv6_frame(unsigned char *frame, unsigned int device,
+    const char *datagram, size_t length) {
+  size_t udp_length = 8 + length;
+  size_t payload_length = 8 + udp_length;
+
+  memset(frame, 0, 70);
+  memcpy(frame, "\x33\x33\x00\x00\x00\x0c\x00\x11\x22", 9);
+  frame[9] = (device >> 16) & 0xff;
+  frame[10] = (device >> 8) & 0xff;
+  frame[11] = device & 0xff;
+  frame[12] = 0x86;
+  frame[13] = 0xdd;
+  frame[14] = 0x60;
+  frame[18] = (payload_length >> 8) & 0xff;
+  frame[19] = payload_length & 0xff;
+  frame[20] = 0;
+  frame[21] = 1;
+  frame[22] = 0xfd;
+  frame[36] = (device >> 8) & 0xff;
+  frame[37] = device & 0xff;
+  frame[38] = 0xff;
+  frame[39] = 0x02;
+  frame[53] = 0x0c;
+  /* Hop-by-hop options: UDP next, 8 bytes, PadN */
+  frame[54] = 17;
+  frame[56] = 1;
+  frame[57] = 4;
+  frame[62] = frame[64] = 1900 >> 8;
+  frame[63] = frame[65] = 1900 & 0xff;
+  frame[66] = (udp_length >> 8) & 0xff;
+  frame[67] = udp_length & 0xff;
+  memcpy(frame + 70, datagram, length);
+
+  return 70 + length;
+}
+
+/**
+ * Build a pcapng block, its body is padded to 32 bits.
+ *
+ * @param block The buffer to build the block in.
+ * @param type The type of the block.
+ * @param body The body of the block.
+ * @param length The length of the body.
+ *
+ * @return The length of the block.
+ */
+static size_t build_pcapng_block(unsigned char *block, uint32_t type,
+    const unsigned char *body, size_t length) {
+  uint32_t total = (uint32_t)(12 + ((length + 3) & ~(size_t)3));
+
+  memcpy(block, &type, 4);
+  memcpy(block + 4, &total, 4);
+  memset(block + 8, 0, total - 12);
+  memcpy(block + 8, body, length);
+  memcpy(block + total - 4, &total, 4);
+
+  return total;
+}
+
+/**
+ * Build a pcapng enhanced packet block of the first interface.
+ *
+ * @param block The buffer to build the block in.
+ * @param timestamp When the frame was captured (in us since the epoch).
+ * @param frame The frame.
+ * @param length The length of the frame.
+ *
+ * @return The length of the block.
+ */
+static size_t build_pcapng_packet(unsigned char *block,
+    unsigned long long timestamp, const unsigned char *frame,
+    size_t length) {
+  unsigned char body[20 + CHECK_FRAME_SIZE];
+  uint32_t fields[5];
+
+  fields[0] = 0;
+  fields[1] = (uint32_t)(timestamp >> 32);
+  fields[2] = (uint32_t)timestamp;
+  fields[3] = fields[4] = (uint32_t)length;
+  memcpy(body, fields, sizeof(fields));
+  memcpy(body + sizeof(fields), frame, length);
+
+  return build_pcapng_block(block, 0x00000006, body, 20 + length);
+}
+
+/** Read the pcap of the pipeline benchmark, and what precedes a cut frame. */
+static void check_pcap(check_context_s *context) {
+  static check_capture_s capture;
+  unsigned char frame[CHECK_FRAME_SIZE];
+  char path[] = "/tmp/ssdp_check_XXXXXX";
+  char ip[IPv6_STR_MAX_SIZE];
+  unsigned int device;
+  long last = 0;
+  BOOL written;
+  FILE *file;
+  int fd;
+
+  fd = mkstemp(path);
+  if (fd < 0 || !(file = fdopen(fd, "w"))) {
+    CHECK(!"Could not create a capture");
+    if (fd >= 0) {
+      close(fd);
+      unlink(path);
+    }
+    return;
+  }
+  written = capture_write_pcap_header(file);
+  for (device = 0; device < CHECK_DEVICES; device++) {
+    check_datagram_s *datagram =
+        &context->datagrams[device % context->datagrams_count];
+    last = ftell(file);
+    written &= capture_write_pcap_record(file, 1000000000, device, frame,
+        capture_build_frame(frame, device, datagram->data,
+        datagram->length));
+  }
+  written &= fclose(file) == 0;
+  CHECK(written);
+
+  CHECK(read_capture_quietly(path, &capture));
+  CHECK(capture.count == CHECK_DEVICES);
+  for (device = 0; device < CHECK_DEVICES && device < capture.count;
+      device++) {
+    snprintf(ip, sizeof(ip), "10.%u.%u.%u", (device >> 16) & 0xff,
+        (device >> 8) & 0xff, device & 0xff);
+    check_captured(&capture, device, ip, device,
+        &context->datagrams[device % context->datagrams_count],
+        1000000000000000000ULL + device * 1000ULL);
+  }
+
+  /* A cut last frame is an error, the frames before it are read */
+  CHECK(truncate(path, last + 16 + CAPTURE_FRAME_HEADERS) == 0);
+  CHECK(!read_capture_quietly(path, &capture));
+  CHECK(capture.count == CHECK_DEVICES - 1);
+
+  unlink(path);
+}
+
+/**
+ * Read a pcapng with a VLAN tagged frame and an IPv6 extension header, and
+ * what precedes a cut last block.
+ */
+static void check_pcapng(check_context_s *context) {
+  static check_capture_s capture;
+  static unsigned char block[CHECK_FRAME_SIZE + 64];
+  /* Byte order magic, version 1.0, unknown section length */
+  const uint32_t section[4] = { 0x1a2b3c4d, 0x00000001, 0xffffffff,
+      0xffffffff };
+  /* Ethernet, if_name and the end of the options */
+  const unsigned char interface[] = { 1, 0, 0, 0, 0xff, 0xff, 0, 0,
+      2, 0, sizeof(CHECK_INTERFACE) - 1, 0, 'c', 'h', 'e', 'c', 'k', '0',
+      0, 0, 0, 0, 0, 0 };
+  unsigned char frame[CHECK_FRAME_SIZE];
+  unsigned char tagged[CHECK_FRAME_SIZE];
+  const check_datagram_s *datagrams[4];
+  char path[] = "/tmp/ssdp_check_XXXXXX";
+  size_t length;
+  BOOL written;
+  unsigned int i;
+  FILE *file;
+  int fd;
+
+  for (i = 0; i < 4; i++) {
+    datagrams[i] = &context->datagrams[i % context->datagrams_count];
+  }
+
+  fd = mkstemp(path);
+  if (fd < 0 || !(file = fdopen(fd, "w"))) {
+    CHECK(!"Could not create a capture");
+    if (fd >= 0) {
+      close(fd);
+      unlink(path);
+    }
+    return;
+  }
+  length = build_pcapng_block(block, 0x0a0d0d0a,
+      (const unsigned char *)section, sizeof(section));
+  written = fwrite(block, length, 1, file) == 1;
+  length = build_pcapng_block(block, 0x00000001, interface,
+      sizeof(interface));
+  written &= fwrite(block, length, 1, file) == 1;
+
+  /* Device 1 behind an 802.1Q tag (VLAN 5) */
+  length = capture_build_frame(frame, 1, datagrams[1]->data,
+      datagrams[1]->length);
+  memcpy(tagged, frame, 12);
+  memcpy(tagged + 12, "\x81\x00\x00\x05", 4);
+  memcpy(tagged + 16, frame + 12, length - 12);
+  length = build_pcapng_packet(block, 1000000000000001ULL, tagged,
+      length + 4);
+  written &= fwrite(block, length, 1, file) == 1;
+
+  /* Device 2 over IPv6 */
+  length = build_ipv6_frame(frame, 2, datagrams[2]->data,
+      datagrams[2]->length);
+  length = build_pcapng_packet(block, 1000000000000002ULL, frame, length);
+  written &= fwrite(block, length, 1, file) == 1;
+
+  /* Device 3 in a block cut in the middle */
+  length = capture_build_frame(frame, 3, datagrams[3]->data,
+      datagrams[3]->length);
+  length = build_pcapng_packet(block, 1000000000000003ULL, frame, length);
+  written &= fwrite(block, length / 2, 1, file) == 1;
+  written &= fclose(file) == 0;
+  CHECK(written);
+
+  CHECK(!read_capture_quietly(path, &capture));
+  CHECK(capture.count == 2);
+  if (capture.count >= 2) {
+    check_captured(&capture, 0, "10.0.0.1", 1, datagrams[1],
+        1000000000000001000ULL);
+    check_captured(&capture, 1, "fd00::2", 2, datagrams[2],
+        1000000000000002000ULL);
+    CHECK(0 == strcmp(capture.records[0].interface, CHECK_INTERFACE));
+    CHECK(0 == strcmp(capture.records[1].interface, CHECK_INTERFACE));
+  }
+
+  unlink(path);
+}
+
+/**
+ * Walk the published snapshots until the writer is done, touching all they
+ * hold so the sanitizers see a snapshot freed under a reader.
+ *
+ * @param data The reader (check_reader_s).
+ *
+ * @return NULL.
+ */
+static void *stress_reader(void *data) {
+  check_reader_s *reader = (check_reader_s *)data;
+  unsigned long last_generation = 0;
+  int slot = ssdp_snapshots_register(reader->snapshots);
+
+  if (slot < 0) {
+    reader->broken++;
+    return NULL;
+  }
+
+  while (!__atomic_load_n(reader->done, __ATOMIC_ACQUIRE)) {
+    const ssdp_snapshot_s *snapshot = ssdp_snapshots_enter(reader->snapshots,
+        slot);
+    size_t length = 0;
+    unsigned int i;
+
+    if (snapshot->generation < last_generation ||
+        snapshot->count != CHECK_DEVICES) {
+      reader->broken++;
+    }
+    last_generation = snapshot->generation;
+    for (i = 0; i < snapshot->count; i++) {
+      const ssdp_message_s *message = snapshot->entries[i]->ssdp_message;
+      length += strlen(message->ip) + strlen(message->mac) +
+          message->header_count;
+      if (snapshot->entries[i]->changed > snapshot->time) {
+        reader->broken++;
+      }
+    }
+    for (i = 0; i < snapshot->removed_count; i++) {
+      length += strlen(snapshot->removed[i].ip);
+    }
+    if (length == 0) {
+      reader->broken++;
+    }
+    /* Let the writer replace the snapshot while it is held, even on one
+       CPU, then touch it again */
+    sched_yield();
+    if (snapshot->count != CHECK_DEVICES ||
+        !snapshot->entries[snapshot->count - 1]->ssdp_message->ip) {
+      reader->broken++;
+    }
+    ssdp_snapshots_leave(reader->snapshots, slot);
+    reader->walks++;
+  }
+
+  ssdp_snapshots_unregister(reader->snapshots, slot);
+
+  return NULL;
+}
+
+/**
+ * Publish snapshots of a churning cache while readers walk them. Every
+ * round the oldest device leaves and a new one comes, so every snapshot
+ * replaces entries, records a removal and retires the previous one under
+ * the readers.
+ */
+static void check_snapshot_stress(check_context_s *context) {
+  check_reader_s readers[CHECK_STRESS_READERS];
+  pthread_t threads[CHECK_STRESS_READERS];
+  ssdp_snapshots_s snapshots;
+  ssdp_cache_s *ssdp_cache = NULL;
+  unsigned int started = 0;
+  unsigned int round;
+  unsigned int i;
+  int done = 0;
+
+  for (i = 0; i < CHECK_DEVICES; i++) {
+    ssdp_message_s *message = parse_datagram(context, i);
+    if (!message ||
+        !add_ssdp_message_to_cache(&ssdp_cache, &message, NULL)) {
+      CHECK(!"Could not cache the corpus");
+      free_ssdp_message(&message);
+      free_ssdp_cache(&ssdp_cache);
+      return;
+    }
+  }
+  if (!ssdp_snapshots_init(&snapshots)) {
+    CHECK(!"Could not initialize the snapshots");
+    free_ssdp_cache(&ssdp_cache);
+    return;
+  }
+  CHECK(ssdp_snapshots_publish(&snapshots, ssdp_cache));
+
+  memset(readers, 0, sizeof(readers));
+  for (i = 0; i < CHECK_STRESS_READERS; i++) {
+    readers[i].snapshots = &snapshots;
+    readers[i].done = &done;
+    if (pthread_create(&threads[i], NULL, stress_reader, &readers[i]) != 0) {
+      CHECK(!"Could not start a reader");
+      break;
+    }
+    started++;
+  }
+
+  for (round = 0; round < CHECK_STRESS_ROUNDS; round++) {
+    ssdp_message_s *message = remove_ssdp_message_from_cache(&ssdp_cache,
+        ssdp_cache->first->ssdp_message->ip);
+    free_ssdp_message(&message);
+    message = parse_datagram(context, CHECK_DEVICES + round);
+    if (!message ||
+        !add_ssdp_message_to_cache(&ssdp_cache, &message, NULL)) {
+      CHECK(!"Could not cache a device");
+      free_ssdp_message(&message);
+      break;
+    }
+    CHECK(ssdp_snapshots_publish(&snapshots, ssdp_cache));
+    sched_yield();
+  }
+
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+    CHECK(readers[i].walks > 0);
+    CHECK(readers[i].broken == 0);
+  }
+
+  /* With no reader left every replaced snapshot can be freed */
+  CHECK(ssdp_snapshots_publish(&snapshots, ssdp_cache));
+  CHECK(snapshots.retired == NULL);
+  CHECK(snapshots.current->removed_count == SSDP_SNAPSHOT_MAX_REMOVED);
+
+  ssdp_snapshots_close(&snapshots);
+  free_ssdp_cache(&ssdp_cache);
+}
+
+/** The checks, in the order they run. */
+static const check_s checks[] = {
+  { "binary_round_trip", check_binary_round_trip },
+  { "binary_rejects", check_binary_rejects },
+  { "pcap", check_pcap },
+  { "pcapng", check_pcapng },
+  { "snapshot_stress", check_snapshot_stress }
+};
+
+/**
+ * Print the usage.
+ *
+ * @param program The name of the program.
+ */
+static void check_usage(const char *program) {
+  printf("USAGE: %s -c <corpus dir> [<check>...]\n", program);
+  printf("\t-c <dir>      The corpus, one datagram per file\n");
+}
+
+int main(int argc, char **argv) {
+  static check_context_s context;
+  const char *corpus = NULL;
+  unsigned int failed = 0;
+  unsigned int i;
+  int j;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:h")) > 0) {
+    switch (opt) {
+    case 'c':
+      corpus = optarg;
+      break;
+    default:
+      check_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!corpus) {
+    check_usage(argv[0]);
+    return 1;
+  }
+
+  if (!init_context(&context, corpus)) {
+    free_context(&context);
+    return 1;
+  }
+
+  for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+    /* Only the checks named, if any */
+    if (optind < argc) {
+      for (j = optind; j < argc; j++) {
+        if (strcmp(argv[j], checks[i].name) == 0) {
+          break;
+        }
+      }
+      if (j == argc) {
+        continue;
+      }
+    }
+
+    failures = 0;
+    checks[i].function(&context);
+    printf("%-24s %s\n", checks[i].name, failures ? "FAILED" : "ok");
+    fflush(stdout);
+    if (failures) {
+      failed++;
+    }
+  }
+
+  free_context(&context);
+
+  return (int)failed;
+}
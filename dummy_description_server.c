@@ -0,0 +1,582 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *
+ *  dummy_description_server.c - A program for serving the description
+ *                               documents of many dummy UPnP devices
+ *  Copyright(C) 2014 by Andreas Bank, andreas.mikael.bank@gmail.com
+ *
+ *  Build: gcc -O2 -o dummy_description_server dummy_description_server.c
+ *
+ *  Serves /device/<n>/description.xml (the locations dummy_device
+ *  announces) with a description generated from udhisapi.xml, on every
+ *  local address (127.1.0.0 and up included). The answers can be delayed,
+ *  dripped out slowly, reset or oversized, to load test the description
+ *  fetching of the listener end to end:
+ *    ./dummy_description_server -l 20,80 -R 1 -O 2 &
+ *    ./dummy_device -n 5000 -r 20000 &
+ *    scanssdp -u -L
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+#define _GNU_SOURCE
+#define VERSION "1.0"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+
+#define TRUE 1
+#define FALSE 0
+#define DEFAULT_PORT 49152
+#define DEFAULT_OVERSIZE_KIB 64
+#define REQUEST_BUFFER 4096
+#define MAX_EVENTS 256
+#define DEVICE_PATH_FORMAT "/device/%u/description.xml"
+
+/* Where a connection is at */
+typedef enum {
+  READING,
+  WAITING,
+  WRITING
+} connection_state_t;
+
+/* A client connection */
+typedef struct {
+  int fd;
+  connection_state_t state;
+  char request[REQUEST_BUFFER];
+  size_t request_length;
+  char *response;
+  size_t response_length;
+  size_t response_sent;
+  unsigned long long due;
+} connection_t;
+
+void cleanup(const char *error);
+void exitSig(int sig);
+
+int sock;
+static int epoll_fd = -1;
+static volatile sig_atomic_t stop;
+static connection_t **connections;
+static int connections_size;
+static unsigned int waiting_count;
+static unsigned int seed = 1;
+static unsigned int random_state = 1;
+static unsigned int latency;
+static unsigned int jitter;
+static unsigned int drip_bytes;
+static unsigned int drip_interval;
+static unsigned int reset_percent;
+static unsigned int oversize_percent;
+static unsigned int oversize_kib = DEFAULT_OVERSIZE_KIB;
+static unsigned long long accepted;
+static unsigned long long served;
+static unsigned long long not_found;
+static unsigned long long resets;
+static unsigned long long oversized;
+static unsigned int active;
+
+/* A reproducible pseudo random number (xorshift) */
+static unsigned int nextRandom(void) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+/* Get the monotonic time in ns */
+static unsigned long long nowNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Build the description of a device, padded to the oversize if asked */
+static char *buildDescription(unsigned int device, int oversize,
+    size_t *length) {
+  size_t size = 4096 + (oversize ? oversize_kib * 1024 : 0);
+  char *body = (char *)malloc(size);
+  char uuid[64];
+  int written;
+
+  if(!body) {
+    return NULL;
+  }
+  /* The same UUID dummy_device announces with the same seed */
+  snprintf(uuid, sizeof(uuid), "uuid:%08x-ab05-4ed0-8000-%012x", seed, device);
+  written = snprintf(body, size,
+      "<?xml version=\"1.0\"?>\n"
+      "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">\n"
+      "\t<specVersion>\n"
+      "\t\t<major>1</major>\n"
+      "\t\t<minor>0</minor>\n"
+      "\t</specVersion>\n"
+      "\t<device>\n"
+      "\t\t<deviceType>urn:libssdp-com:device:SyncServer:1</deviceType>\n"
+      "\t\t<friendlyName>libSSDP-DUMMY-%u</friendlyName>\n"
+      "\t\t<manufacturer>AndreasBank-Electronics</manufacturer>\n"
+      "\t\t<manufacturerURL>http://www.andreasbank.com</manufacturerURL>\n"
+      "\t\t<modelDescription>libSSDP dummy device</modelDescription>\n"
+      "\t\t<modelName>libSSDP</modelName>\n"
+      "\t\t<modelNumber>0.%u</modelNumber>\n"
+      "\t\t<serialNumber>%08u</serialNumber>\n"
+      "\t\t<modelURL>http://www.andreasbank.com/libssdp</modelURL>\n"
+      "\t\t<UDN>%s</UDN>\n"
+      "\t\t<serviceList>\n"
+      "\t\t\t<service>\n"
+      "\t\t\t\t<serviceType>urn:libssdp-com:service:SyncManager:1</serviceType>\n"
+      "\t\t\t\t<serviceId>urn:libssdp-com:serviceId:SyncManager</serviceId>\n"
+      "\t\t\t\t<controlURL>/device/%u/control</controlURL>\n"
+      "\t\t\t\t<eventSubURL>/device/%u/event</eventSubURL>\n"
+      "\t\t\t\t<SCPDURL>/device/%u/scpd.xml</SCPDURL>\n"
+      "\t\t\t</service>\n"
+      "\t\t</serviceList>\n"
+      "\t</device>\n",
+      device, device % 10, device, uuid, device, device, device);
+
+  /* Padded with a comment, the way some devices bloat their documents */
+  if(oversize) {
+    size_t padding = oversize_kib * 1024;
+    memcpy(body + written, "<!--", 4);
+    memset(body + written + 4, 'x', padding - 7);
+    memcpy(body + written + padding - 3, "-->", 3);
+    written += padding;
+  }
+  written += snprintf(body + written, size - written, "</root>\n");
+  *length = written;
+  return body;
+}
+
+/* Close a connection, with a TCP reset if asked */
+static void closeConnection(connection_t *connection, int reset) {
+  if(reset) {
+    struct linger linger = { 1, 0 };
+    setsockopt(connection->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    resets++;
+  }
+  if(connection->state == WAITING) {
+    waiting_count--;
+  }
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  connections[connection->fd] = NULL;
+  free(connection->response);
+  free(connection);
+  active--;
+}
+
+/* Wait until a time before writing (more of) the answer */
+static void waitUntil(connection_t *connection, unsigned long long due) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.data.fd = connection->fd;
+  connection->due = due;
+  if(connection->state != WAITING) {
+    waiting_count++;
+  }
+  connection->state = WAITING;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+/* Start writing the answer */
+static void startWriting(connection_t *connection) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLOUT;
+  event.data.fd = connection->fd;
+  if(connection->state == WAITING) {
+    waiting_count--;
+  }
+  connection->state = WRITING;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+/* Answer a complete request, or reset it */
+static void answerRequest(connection_t *connection) {
+  char header[256];
+  char *body = NULL;
+  size_t body_length = 0;
+  unsigned int device;
+  char path[256];
+  int header_length;
+  int oversize;
+  unsigned int delay;
+
+  if(reset_percent > 0 && nextRandom() % 100 < reset_percent) {
+    closeConnection(connection, TRUE);
+    return;
+  }
+
+  path[0] = '\0';
+  sscanf(connection->request, "GET %255s", path);
+  if(sscanf(path, DEVICE_PATH_FORMAT, &device) == 1) {
+    oversize = oversize_percent > 0 && nextRandom() % 100 < oversize_percent;
+    body = buildDescription(device, oversize, &body_length);
+    if(!body) {
+      closeConnection(connection, TRUE);
+      return;
+    }
+    if(oversize) {
+      oversized++;
+    }
+    header_length = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n", body_length);
+    served++;
+  }
+  else {
+    header_length = snprintf(header, sizeof(header),
+        "HTTP/1.1 404 Not Found\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n\r\n");
+    not_found++;
+  }
+
+  connection->response = (char *)malloc(header_length + body_length);
+  if(!connection->response) {
+    free(body);
+    closeConnection(connection, TRUE);
+    return;
+  }
+  memcpy(connection->response, header, header_length);
+  if(body) {
+    memcpy(connection->response + header_length, body, body_length);
+    free(body);
+  }
+  connection->response_length = header_length + body_length;
+
+  delay = latency + (jitter > 0 ? nextRandom() % (jitter + 1) : 0);
+  if(delay > 0) {
+    waitUntil(connection, nowNs() + delay * 1000000ULL);
+  }
+  else {
+    startWriting(connection);
+  }
+}
+
+/* Read the request of a connection */
+static void readRequest(connection_t *connection) {
+  ssize_t length = recv(connection->fd,
+      connection->request + connection->request_length,
+      REQUEST_BUFFER - 1 - connection->request_length, 0);
+  if(length < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  if(length <= 0) {
+    closeConnection(connection, FALSE);
+    return;
+  }
+  connection->request_length += length;
+  connection->request[connection->request_length] = '\0';
+  if(strstr(connection->request, "\r\n\r\n") ||
+      connection->request_length == REQUEST_BUFFER - 1) {
+    answerRequest(connection);
+  }
+}
+
+/* Write (a drip of) the answer of a connection */
+static void writeResponse(connection_t *connection) {
+  size_t left = connection->response_length - connection->response_sent;
+  ssize_t length;
+
+  if(drip_bytes > 0 && left > drip_bytes) {
+    left = drip_bytes;
+  }
+  length = send(connection->fd, connection->response + connection->response_sent,
+      left, MSG_NOSIGNAL);
+  if(length < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  if(length < 0) {
+    closeConnection(connection, FALSE);
+    return;
+  }
+  connection->response_sent += length;
+  if(connection->response_sent == connection->response_length) {
+    closeConnection(connection, FALSE);
+  }
+  else if(drip_bytes > 0) {
+    waitUntil(connection, nowNs() + drip_interval * 1000000ULL);
+  }
+}
+
+/* Accept all pending connections */
+static void acceptConnections(void) {
+  while(TRUE) {
+    struct epoll_event event;
+    connection_t *connection;
+    int fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK);
+    if(fd < 0) {
+      return;
+    }
+    if(fd >= connections_size ||
+        !(connection = (connection_t *)calloc(1, sizeof(connection_t)))) {
+      close(fd);
+      continue;
+    }
+    connection->fd = fd;
+    connection->state = READING;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      free(connection);
+      close(fd);
+      continue;
+    }
+    connections[fd] = connection;
+    accepted++;
+    active++;
+  }
+}
+
+/* Go on with the connections that are due, return ms to the next one */
+static int runTimers(void) {
+  unsigned long long now = nowNs();
+  unsigned long long next = 0;
+  int fd;
+
+  if(waiting_count == 0) {
+    return -1;
+  }
+  for(fd = 0; fd < connections_size; fd++) {
+    connection_t *connection = connections[fd];
+    if(!connection || connection->state != WAITING) {
+      continue;
+    }
+    if(connection->due <= now) {
+      startWriting(connection);
+    }
+    else if(next == 0 || connection->due < next) {
+      next = connection->due;
+    }
+  }
+  return next == 0 ? -1 : (int)((next - now) / 1000000ULL) + 1;
+}
+
+static void usage(const char *program) {
+  printf("Usage:\n\t%s [-a <ip>] [-p <port>] [-l <ms>[,<jitter ms>]]\n"
+      "\t\t[-d <bytes>,<ms>] [-R <percent>] [-O <percent>[,<KiB>]]\n"
+      "\t\t[-s <seed>] [-q]\n\n", program);
+  printf("\t-a: address to listen on, default is all (127.1.0.0 and up too)\n");
+  printf("\t-p: port to listen on, default is %d\n", DEFAULT_PORT);
+  printf("\t-l: wait this long (plus a random jitter) before answering\n");
+  printf("\t-d: drip the answers out, <bytes> every <ms>\n");
+  printf("\t-R: chance (in percent) to reset a connection instead of answering\n");
+  printf("\t-O: chance (in percent) to pad a document to <KiB>, default is %d\n",
+      DEFAULT_OVERSIZE_KIB);
+  printf("\t-s: seed of the devices (see dummy_device), default is 1\n");
+  printf("\t-q: do not print the statistics\n");
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_in addr;
+  struct epoll_event events[MAX_EVENTS];
+  struct rlimit limit;
+  const char *address = "0.0.0.0";
+  unsigned short port = DEFAULT_PORT;
+  unsigned long long last_print;
+  unsigned long long last_served = 0;
+  int quiet = FALSE;
+  int reuse = 1;
+  int opt;
+  char *pend;
+
+  printf("\ndummy_description_server.c - ABUSED UPnP Dummy description server version %s\nCopyright(C) 2014 by Andreas Bank, <andreas.mikael.bank@gmail.com>\n\n", VERSION);
+
+  /* sort out arguments */
+  while((opt = getopt(argc, argv, "a:p:l:d:R:O:s:qh")) > 0) {
+    switch(opt) {
+    case 'a':
+      address = optarg;
+      break;
+    case 'p':
+      port = (unsigned short)strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+      latency = (unsigned int)strtoul(optarg, &pend, 10);
+      if(*pend == ',') {
+        jitter = (unsigned int)strtoul(pend + 1, NULL, 10);
+      }
+      break;
+    case 'd':
+      drip_bytes = (unsigned int)strtoul(optarg, &pend, 10);
+      drip_interval = *pend == ',' ?
+          (unsigned int)strtoul(pend + 1, NULL, 10) : 0;
+      if(drip_bytes == 0 || drip_interval == 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'R':
+      reset_percent = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'O':
+      oversize_percent = (unsigned int)strtoul(optarg, &pend, 10);
+      if(*pend == ',') {
+        oversize_kib = (unsigned int)strtoul(pend + 1, NULL, 10);
+      }
+      break;
+    case 's':
+      seed = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'q':
+      quiet = TRUE;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(reset_percent > 100 || oversize_percent > 100 || oversize_kib == 0 ||
+      seed == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  random_state = seed;
+
+  /* As many connections as there may be open files */
+  if(getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+  }
+  connections_size = limit.rlim_cur > 1048576 ? 1048576 : (int)limit.rlim_cur;
+  connections = (connection_t **)calloc(connections_size, sizeof(connection_t *));
+  if(!connections) {
+    cleanup("calloc");
+  }
+
+  /* init socket */
+  sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if(sock < 0) {
+    cleanup("socket");
+  }
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if(inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+    errno = EINVAL;
+    cleanup("inet_pton");
+  }
+  if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    cleanup("bind");
+  }
+  if(listen(sock, SOMAXCONN) < 0) {
+    cleanup("listen");
+  }
+
+  epoll_fd = epoll_create1(0);
+  if(epoll_fd < 0) {
+    cleanup("epoll_create1");
+  }
+  memset(&events[0], 0, sizeof(events[0]));
+  events[0].events = EPOLLIN;
+  events[0].data.fd = sock;
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &events[0]) < 0) {
+    cleanup("epoll_ctl");
+  }
+
+  /* signal management */
+  signal(SIGTERM, &exitSig);
+  signal(SIGABRT, &exitSig);
+  signal(SIGINT, &exitSig);
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("Serving descriptions on %s:%u...\n\n", address, port);
+
+  last_print = nowNs();
+  while(!stop) {
+    unsigned long long now;
+    int timeout = runTimers();
+    int ready;
+    int i;
+
+    if(!quiet && (timeout < 0 || timeout > 1000)) {
+      timeout = 1000;
+    }
+    ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    if(ready < 0 && errno != EINTR) {
+      cleanup("epoll_wait");
+    }
+    for(i = 0; i < ready; i++) {
+      connection_t *connection;
+      if(events[i].data.fd == sock) {
+        acceptConnections();
+        continue;
+      }
+      connection = connections[events[i].data.fd];
+      if(!connection) {
+        continue;
+      }
+      if(connection->state == READING) {
+        readRequest(connection);
+      }
+      else if(connection->state == WRITING) {
+        writeResponse(connection);
+      }
+    }
+
+    now = nowNs();
+    if(!quiet && now - last_print >= 1000000000ULL) {
+      printf("\rserved \e[31;1m%llu\e[m (404 %llu, resets %llu, oversized %llu,"
+          " open %u) \e[1;37;40m%llu rps\e[m     ", served, not_found, resets,
+          oversized, active,
+          (served - last_served) * 1000000000ULL / (now - last_print));
+      fflush(stdout);
+      last_served = served;
+      last_print = now;
+    }
+  }
+
+  printf("\nAccepted %llu connections, served %llu descriptions (404 %llu, "
+      "resets %llu, oversized %llu)\n", accepted, served, not_found, resets,
+      oversized);
+  cleanup(NULL);
+  return 0;
+}
+
+void cleanup(const char *error) {
+  int fd;
+  if(connections) {
+    for(fd = 0; fd < connections_size; fd++) {
+      if(connections[fd]) {
+        close(fd);
+        free(connections[fd]->response);
+        free(connections[fd]);
+      }
+    }
+    free(connections);
+    connections = NULL;
+  }
+  if(epoll_fd >= 0) {
+    close(epoll_fd);
+    epoll_fd = -1;
+  }
+  if(sock) {
+    close(sock);
+    sock = 0;
+  }
+  if(error) {
+    perror(error);
+    exit(1);
+  }
+}
+
+void exitSig(int sig) {
+  (void)sig;
+  stop = TRUE;
+}
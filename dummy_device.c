@@ -1,10 +1,26 @@
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
  *
- *  dummy_device.c - A simple program for sending upnp multicast notifs
+ *  dummy_device.c - A program for simulating many UPnP devices, a load
+ *                   generator for the listener
  *  Copyright(C) 2014 by Andreas Bank, andreas.mikael.bank@gmail.com
  *
+ *  Build: gcc -O2 -o dummy_device dummy_device.c
+ *
+ *  Every simulated device has its own UUID, a set of NTs (root device,
+ *  UUID, device type and services) taken from a few real device profiles,
+ *  a max-age and, on the loopback interface (the default), its own source
+ *  address (127.1.0.0 + its number) so the listener sees it as a separate
+ *  device. The devices announce themselves round-robin at the given rate,
+ *  sent in batches with sendmmsg(), may leave with a byebye and come back
+ *  (churn) and can answer M-SEARCH requests.
+ *
+ *  Stress the listener on a single box with:
+ *    ./dummy_device -n 5000 -r 20000 -b 2 -m &
+ *    scanssdp -u -L -F
+ *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
-#define VERSION "1.0"
+#define _GNU_SOURCE
+#define VERSION "2.0"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -12,6 +28,7 @@
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <time.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -28,58 +45,504 @@
 #define FALSE 0
 #define SPAM_PORT 1900
 #define SPAM_GROUP_ADDRESS "239.255.255.250"
-#define SPAM_INTERVAL 1
 #define SEND_BUFFER 1024
+#define RECV_BUFFER 2048
+#define BATCH_SIZE 64
+#define MAX_DEVICES 1000000
+#define MAX_NTS 8
+#define MAX_SEARCHES 16
+#define DEFAULT_DEVICES 1
+#define DEFAULT_RATE 100
+#define DEFAULT_PORT 49152
+#define LOOPBACK_DEVICE_BASE 0x7f010000
+
+/* A kind of device, with the NTs it announces besides root device and UUID */
+typedef struct {
+  const char *server;
+  const char *types[MAX_NTS - 2];
+} profile_t;
+
+/* A simulated device */
+typedef struct {
+  const profile_t *profile;
+  unsigned int nt_count;
+  unsigned int max_age;
+  unsigned int boot_id;
+  int leaving;
+  int gone;
+} device_t;
+
+/* An M-SEARCH being answered */
+typedef struct {
+  struct sockaddr_in from;
+  char st[256];
+  unsigned int device;
+  unsigned int nt;
+} search_t;
+
+static const profile_t profiles[] = {
+  { "Linux/3.10 UPnP/1.0 DLNADOC/1.50 MediaRenderer/1.0",
+    { "urn:schemas-upnp-org:device:MediaRenderer:1",
+      "urn:schemas-upnp-org:service:AVTransport:1",
+      "urn:schemas-upnp-org:service:RenderingControl:1",
+      "urn:schemas-upnp-org:service:ConnectionManager:1", NULL } },
+  { "Linux/4.4 UPnP/1.0 MiniDLNA/1.2.1",
+    { "urn:schemas-upnp-org:device:MediaServer:1",
+      "urn:schemas-upnp-org:service:ContentDirectory:1",
+      "urn:schemas-upnp-org:service:ConnectionManager:1",
+      "urn:microsoft.com:service:X_MS_MediaReceiverRegistrar:1", NULL } },
+  { "Linux/2.6 UPnP/1.0 miniupnpd/2.1",
+    { "urn:schemas-upnp-org:device:InternetGatewayDevice:1",
+      "urn:schemas-upnp-org:device:WANDevice:1",
+      "urn:schemas-upnp-org:device:WANConnectionDevice:1",
+      "urn:schemas-upnp-org:service:Layer3Forwarding:1",
+      "urn:schemas-upnp-org:service:WANIPConnection:1", NULL } },
+  { "Linux/4.9 UPnP/1.0 Cast/1.0",
+    { "urn:dial-multiscreen-org:device:dial:1",
+      "urn:dial-multiscreen-org:service:dial:1", NULL } },
+  { "Microsoft-Windows-NT/5.1 UPnP/1.0 UPnP-Device-Host/1.0",
+    { "urn:schemas-upnp-org:device:Basic:1", NULL } },
+  { "AXIS/5.50 UPnP/1.0 Network Camera/1.0",
+    { "urn:axis-com:service:BasicService:1", NULL } }
+};
+
+static const unsigned int max_ages[] = { 120, 300, 900, 1800, 1800, 3600 };
 
-void cleanup();
-void exitSig();
-char *findArgumentValue(const char *arg, int argc, char **argv);
+void cleanup(const char *error);
+void exitSig(int sig);
 int findInterface(struct in_addr *interface, const char *address, int af_family);
 
 int sock;
-char *message;
-char *time_string;
+static volatile sig_atomic_t stop;
+static device_t *devices;
+static unsigned int device_count = DEFAULT_DEVICES;
+static unsigned int seed = 1;
+static unsigned int device_seed;
+static unsigned int churn;
+static unsigned short location_port = DEFAULT_PORT;
+static int device_sources;
+static struct in_addr source_address;
+static unsigned int cursor_device;
+static unsigned int cursor_nt;
+static search_t searches[MAX_SEARCHES];
+static unsigned int searches_count;
+static unsigned long long sent_alive;
+static unsigned long long sent_byebye;
+static unsigned long long sent_responses;
+static unsigned long long send_errors;
+
+static char buffers[BATCH_SIZE][SEND_BUFFER];
+static struct mmsghdr messages[BATCH_SIZE];
+static struct iovec iovecs[BATCH_SIZE];
+static struct sockaddr_in destinations[BATCH_SIZE];
+static union {
+  char buffer[CMSG_SPACE(sizeof(struct in_pktinfo))];
+  struct cmsghdr align;
+} controls[BATCH_SIZE];
+
+/* A reproducible pseudo random number (xorshift) */
+static unsigned int nextRandom(void) {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+/* Get the monotonic time in ns */
+static unsigned long long nowNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Get the source address of a device */
+static struct in_addr deviceAddress(unsigned int index) {
+  struct in_addr address;
+  if(device_sources) {
+    address.s_addr = htonl(LOOPBACK_DEVICE_BASE + index);
+  }
+  else {
+    address = source_address;
+  }
+  return address;
+}
+
+/* Get the UUID of a device, changing the seed changes all of them */
+static void deviceUuid(unsigned int index, char *uuid, size_t size) {
+  snprintf(uuid, size, "uuid:%08x-ab05-4ed0-8000-%012x", device_seed, index);
+}
+
+/* Get the NT and USN of one of the NTs of a device */
+static void deviceNt(unsigned int index, unsigned int nt, char *nt_string,
+    size_t nt_size, char *usn, size_t usn_size) {
+  char uuid[64];
+  deviceUuid(index, uuid, sizeof(uuid));
+  if(nt == 0) {
+    snprintf(nt_string, nt_size, "upnp:rootdevice");
+    snprintf(usn, usn_size, "%s::upnp:rootdevice", uuid);
+  }
+  else if(nt == 1) {
+    snprintf(nt_string, nt_size, "%s", uuid);
+    snprintf(usn, usn_size, "%s", uuid);
+  }
+  else {
+    snprintf(nt_string, nt_size, "%s", devices[index].profile->types[nt - 2]);
+    snprintf(usn, usn_size, "%s::%s", uuid, nt_string);
+  }
+}
+
+/* Set up the devices, all different but the same for the same seed */
+static int createDevices(void) {
+  unsigned int i;
+  device_seed = seed;
+  devices = (device_t *)calloc(device_count, sizeof(device_t));
+  if(!devices) {
+    return FALSE;
+  }
+  for(i = 0; i < device_count; i++) {
+    const profile_t *profile =
+        &profiles[nextRandom() % (sizeof(profiles) / sizeof(profiles[0]))];
+    devices[i].profile = profile;
+    devices[i].nt_count = 2;
+    while(devices[i].nt_count < MAX_NTS &&
+        profile->types[devices[i].nt_count - 2]) {
+      devices[i].nt_count++;
+    }
+    devices[i].max_age =
+        max_ages[nextRandom() % (sizeof(max_ages) / sizeof(max_ages[0]))];
+    devices[i].boot_id = 1;
+  }
+  return TRUE;
+}
+
+/* Prepare a message of the batch, sent from a device to an address */
+static char *prepareMessage(unsigned int slot, unsigned int device,
+    const struct sockaddr_in *to) {
+  messages[slot].msg_hdr.msg_name = &destinations[slot];
+  messages[slot].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+  messages[slot].msg_hdr.msg_iov = &iovecs[slot];
+  messages[slot].msg_hdr.msg_iovlen = 1;
+  messages[slot].msg_hdr.msg_control = NULL;
+  messages[slot].msg_hdr.msg_controllen = 0;
+  messages[slot].msg_hdr.msg_flags = 0;
+  destinations[slot] = *to;
+  iovecs[slot].iov_base = buffers[slot];
+
+  /* Sent from the device's own address */
+  if(device_sources) {
+    struct cmsghdr *cmsg;
+    struct in_pktinfo pktinfo;
+    memset(&pktinfo, 0, sizeof(pktinfo));
+    pktinfo.ipi_spec_dst = deviceAddress(device);
+    messages[slot].msg_hdr.msg_control = controls[slot].buffer;
+    messages[slot].msg_hdr.msg_controllen = sizeof(controls[slot].buffer);
+    cmsg = CMSG_FIRSTHDR(&messages[slot].msg_hdr);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_PKTINFO;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+    memcpy(CMSG_DATA(cmsg), &pktinfo, sizeof(pktinfo));
+  }
+
+  return buffers[slot];
+}
+
+/* Write the announcement of the current NT of the current device */
+static void buildNotify(unsigned int slot, const struct sockaddr_in *group) {
+  device_t *device = &devices[cursor_device];
+  char *message = prepareMessage(slot, cursor_device, group);
+  char nt[128];
+  char usn[192];
+  char ip[INET_ADDRSTRLEN];
+  struct in_addr address = deviceAddress(cursor_device);
+  int length;
+
+  deviceNt(cursor_device, cursor_nt, nt, sizeof(nt), usn, sizeof(usn));
+  if(device->leaving) {
+    length = snprintf(message, SEND_BUFFER,
+        "NOTIFY * HTTP/1.1\r\n"
+        "HOST: 239.255.255.250:1900\r\n"
+        "NT: %s\r\n"
+        "NTS: ssdp:byebye\r\n"
+        "USN: %s\r\n"
+        "BOOTID.UPNP.ORG: %u\r\n\r\n",
+        nt, usn, device->boot_id);
+    sent_byebye++;
+  }
+  else {
+    inet_ntop(AF_INET, &address, ip, sizeof(ip));
+    length = snprintf(message, SEND_BUFFER,
+        "NOTIFY * HTTP/1.1\r\n"
+        "HOST: 239.255.255.250:1900\r\n"
+        "CACHE-CONTROL: max-age=%u\r\n"
+        "LOCATION: http://%s:%u/device/%u/description.xml\r\n"
+        "NT: %s\r\n"
+        "NTS: ssdp:alive\r\n"
+        "SERVER: %s\r\n"
+        "USN: %s\r\n"
+        "BOOTID.UPNP.ORG: %u\r\n\r\n",
+        device->max_age, ip, location_port, cursor_device, nt,
+        device->profile->server, usn, device->boot_id);
+    sent_alive++;
+  }
+  iovecs[slot].iov_len = length < SEND_BUFFER ? length : SEND_BUFFER - 1;
+}
+
+/* Move on to the next NT, and to the next device after its last one */
+static void advanceCursor(void) {
+  device_t *device = &devices[cursor_device];
+
+  if(++cursor_nt < device->nt_count) {
+    return;
+  }
+  cursor_nt = 0;
+  device->gone = device->leaving;
+  cursor_device = (cursor_device + 1) % device_count;
+
+  /* A device that left comes back (rebooted) the next time around, one
+     that is there leaves by chance */
+  device = &devices[cursor_device];
+  if(device->gone) {
+    device->leaving = FALSE;
+    device->boot_id++;
+  }
+  else {
+    device->leaving = churn > 0 && nextRandom() % 1000 < churn * 10;
+  }
+}
+
+/* Check if an NT of a device matches a search target */
+static int matchesSearch(const search_t *search, unsigned int device,
+    unsigned int nt) {
+  char nt_string[128];
+  char usn[192];
+  if(strcmp(search->st, "ssdp:all") == 0) {
+    return TRUE;
+  }
+  deviceNt(device, nt, nt_string, sizeof(nt_string), usn, sizeof(usn));
+  return strcmp(search->st, nt_string) == 0;
+}
+
+/* Write the next answer to the oldest search, FALSE if it is answered */
+static int buildResponse(unsigned int slot) {
+  search_t *search = &searches[0];
+  char date[64];
+  char nt[128];
+  char usn[192];
+  char ip[INET_ADDRSTRLEN];
+  struct in_addr address;
+  device_t *device;
+  char *message;
+  time_t t;
+  int length;
+
+  while(search->device < device_count &&
+      (devices[search->device].gone ||
+      !matchesSearch(search, search->device, search->nt))) {
+    if(++search->nt >= devices[search->device].nt_count) {
+      search->nt = 0;
+      search->device++;
+    }
+  }
+  if(search->device >= device_count) {
+    return FALSE;
+  }
+
+  device = &devices[search->device];
+  address = deviceAddress(search->device);
+  inet_ntop(AF_INET, &address, ip, sizeof(ip));
+  deviceNt(search->device, search->nt, nt, sizeof(nt), usn, sizeof(usn));
+  t = time(NULL);
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t));
+  message = prepareMessage(slot, search->device, &search->from);
+  length = snprintf(message, SEND_BUFFER,
+      "HTTP/1.1 200 OK\r\n"
+      "CACHE-CONTROL: max-age=%u\r\n"
+      "DATE: %s\r\n"
+      "EXT:\r\n"
+      "LOCATION: http://%s:%u/device/%u/description.xml\r\n"
+      "SERVER: %s\r\n"
+      "ST: %s\r\n"
+      "USN: %s\r\n"
+      "BOOTID.UPNP.ORG: %u\r\n\r\n",
+      device->max_age, date, ip, location_port, search->device,
+      device->profile->server, nt, usn, device->boot_id);
+  iovecs[slot].iov_len = length < SEND_BUFFER ? length : SEND_BUFFER - 1;
+  sent_responses++;
+
+  if(++search->nt >= device->nt_count) {
+    search->nt = 0;
+    search->device++;
+  }
+  return TRUE;
+}
+
+/* Queue the M-SEARCH requests received on the responder socket */
+static void readSearches(int responder) {
+  char data[RECV_BUFFER];
+  struct sockaddr_in from;
+  socklen_t from_length;
+  ssize_t length;
+
+  while(TRUE) {
+    char *st;
+    char *end;
+    from_length = sizeof(from);
+    length = recvfrom(responder, data, sizeof(data) - 1, MSG_DONTWAIT,
+        (struct sockaddr *)&from, &from_length);
+    if(length <= 0) {
+      return;
+    }
+    data[length] = '\0';
+    if(strncmp(data, "M-SEARCH", 8) != 0) {
+      continue;
+    }
+    st = strcasestr(data, "\r\nST:");
+    if(!st || searches_count >= MAX_SEARCHES) {
+      continue;
+    }
+    st += 5;
+    while(*st == ' ') {
+      st++;
+    }
+    end = strstr(st, "\r\n");
+    if(end) {
+      *end = '\0';
+    }
+    memset(&searches[searches_count], 0, sizeof(search_t));
+    searches[searches_count].from = from;
+    snprintf(searches[searches_count].st, sizeof(searches[0].st), "%s", st);
+    searches_count++;
+  }
+}
+
+/* Send a batch, searches are answered before announcing */
+static unsigned int sendBatch(unsigned int count,
+    const struct sockaddr_in *group) {
+  unsigned int filled = 0;
+  int sent;
+
+  while(filled < count && searches_count > 0) {
+    if(buildResponse(filled)) {
+      filled++;
+    }
+    else {
+      memmove(&searches[0], &searches[1],
+          (searches_count - 1) * sizeof(search_t));
+      searches_count--;
+    }
+  }
+  while(filled < count) {
+    buildNotify(filled++, group);
+    advanceCursor();
+  }
+
+  sent = sendmmsg(sock, messages, filled, 0);
+  if(sent < 0) {
+    /* The loopback queue is full, the messages are lost like on a network */
+    if(errno != ENOBUFS && errno != EAGAIN && errno != EINTR) {
+      cleanup("sendmmsg");
+    }
+    sent = 0;
+  }
+  send_errors += filled - sent;
+  return filled;
+}
+
+static void usage(const char *program) {
+  printf("Usage:\n\t%s [-i <if>] [-n <devices>] [-r <pps>] [-b <percent>] [-m]\n"
+      "\t\t[-p <port>] [-s <seed>] [-t <seconds>] [-q]\n\n", program);
+  printf("\t-i: interface (name or IP) to use, default is the loopback,\n"
+      "\t    where every device sends from its own address\n");
+  printf("\t-n: number of devices to simulate, default is %d\n", DEFAULT_DEVICES);
+  printf("\t-r: messages sent per second, default is %d (0 for no limit)\n",
+      DEFAULT_RATE);
+  printf("\t-b: chance (in percent) that a device leaves with a byebye every\n"
+      "\t    time it announces itself, it comes back the time after\n");
+  printf("\t-m: answer M-SEARCH requests\n");
+  printf("\t-p: port in the devices' locations, default is %d\n", DEFAULT_PORT);
+  printf("\t-s: seed of the devices, the same seed gives the same devices\n");
+  printf("\t-t: stop after this many seconds, default is never\n");
+  printf("\t-q: do not print the statistics\n");
+}
 
 int main(int argc, char **argv) {
   struct sockaddr_in addr;
-  int success;
-  unsigned int count = 0;
   struct in_addr mcast_address;
   unsigned short mcast_port = htons(SPAM_PORT);
-  char *arg_value;
   struct in_addr mcast_interface;
+  const char *interface_name = "127.0.0.1";
+  unsigned int rate = DEFAULT_RATE;
+  unsigned int duration = 0;
+  int responder = -1;
+  int respond = FALSE;
+  int quiet = FALSE;
   u_char ttl = 1;
+  u_char loop = 1;
+  int opt;
+  unsigned long long start;
+  unsigned long long last_refill;
+  unsigned long long last_print;
+  unsigned long long last_sent = 0;
+  double tokens = BATCH_SIZE;
   inet_pton(AF_INET, SPAM_GROUP_ADDRESS, &mcast_address);
-  mcast_interface.s_addr = htonl(INADDR_ANY);
-  char *message = (char *)malloc(sizeof(char) * SEND_BUFFER);
-  memset(message, '\0', SEND_BUFFER);
-  strcat(message, "NOTIFY * HTTP/1.1\r\n");
-  strcat(message, "Host:239.255.255.250:1900\r\n");
-  strcat(message, "NT:urn:microsoft.com:service:X_MS_MediaReceiverRegistrar:1\r\n");
-  strcat(message, "NTS:ssdp:alive\r\n");
-  strcat(message, "Location:http://10.0.0.2:80/upnphost/udhisapi.dll?content=uuid:d910f885-192e-4344-baa7-610083434017\r\n");
-//  strcat(message, "Location:http://10.83.128.16:2869/upnphost/udhisapi.dll?content=uuid:d910f885-192e-4344-baa7-610083434017\r\n");
-  strcat(message, "USN:uuid:d910f885-192e-4344-baa7-610083434017::urn:microsoft.com:service:X_MS_MediaReceiverRegistrar:1\r\n");
-  strcat(message, "Cache-Control:max-age=900\r\n");
-  strcat(message, "Server:Microsoft-Windows-NT/5.1 UPnP/1.0 UPnP-Device-Host/1.0\r\n");
-  strcat(message, "OPT:\"http://schemas.upnp.org/upnp/1/0/\"; ns=01\r\n");
-  strcat(message, "01-NLS:c6d434f85431d29de259ea9a6b9fc7d7\r\n\r\n");
+
+  printf("\ndummy_device.c - ABUSED UPnP Dummy device version %s\nCopyright(C) 2014 by Andreas Bank, <andreas.mikael.bank@gmail.com>\n\n", VERSION);
 
   /* sort out arguments */
-  arg_value = findArgumentValue("-i", argc, argv);
-  if(arg_value) {
-    if(findInterface(&mcast_interface, arg_value, AF_INET)) {
-      printf("mcast_interface=%s\n", arg_value);
-    }
-    else {
-      errno = EINVAL;
-      cleanup("findInterface");
+  while((opt = getopt(argc, argv, "i:n:r:b:mp:s:t:qh")) > 0) {
+    switch(opt) {
+    case 'i':
+      interface_name = optarg;
+      break;
+    case 'n':
+      device_count = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      rate = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'b':
+      churn = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'm':
+      respond = TRUE;
+      break;
+    case 'p':
+      location_port = (unsigned short)strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      seed = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      duration = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'q':
+      quiet = TRUE;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
     }
   }
+  if(device_count < 1 || device_count > MAX_DEVICES || churn > 100 ||
+      seed == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if(findInterface(&mcast_interface, interface_name, AF_INET)) {
+    printf("mcast_interface=%s\n", interface_name);
+  }
   else {
-    printf("mcast_interface=INADDR_ANY (default)\n");
+    errno = EINVAL;
+    cleanup("findInterface");
+  }
+  source_address = mcast_interface;
+  /* Every device gets an address of its own on the loopback */
+  device_sources = (ntohl(mcast_interface.s_addr) >> 24) == 127;
+
+  if(!createDevices()) {
+    cleanup("calloc");
   }
-  ttl = 1;
 
   /* init socket */
   sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -96,34 +559,109 @@ int main(int argc, char **argv) {
   signal(SIGABRT, &exitSig);
   signal(SIGINT, &exitSig);
 
-  printf("\ndummy_device.c - ABUSED UPnP Dummy device version %s\nCopyright(C) 2014 by Andreas Bank, <andreas.mikael.bank@gmail.com>\n\n", VERSION);
-  printf("Usage:\n\t%s [-i]\n\n", argv[0]);
-  printf("\t-i: interface to use\n");
-
-  /* client mode */
-  printf("Starting a UPnP dummy device...\n\n");
   if(setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl))){
     perror("setcoskopt() TTL:");
   }
   if(setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &mcast_interface, sizeof(mcast_interface))) {
     perror("setcoskopt() IF:");
   }
+  if(setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop))) {
+    perror("setcoskopt() LOOP:");
+  }
+
+  /* The responder listens on the SSDP port next to the listener */
+  if(respond) {
+    struct sockaddr_in bind_addr;
+    struct ip_mreq mreq;
+    int reuse = 1;
+    responder = socket(AF_INET, SOCK_DGRAM, 0);
+    if(responder < 0) {
+      cleanup("socket");
+    }
+    setsockopt(responder, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    memset(&bind_addr, 0, sizeof(bind_addr));
+    bind_addr.sin_family = AF_INET;
+    bind_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    bind_addr.sin_port = mcast_port;
+    if(bind(responder, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) < 0) {
+      close(responder);
+      cleanup("bind");
+    }
+    mreq.imr_multiaddr = mcast_address;
+    mreq.imr_interface = mcast_interface;
+    if(setsockopt(responder, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))) {
+      close(responder);
+      cleanup("setsockopt() IP_ADD_MEMBERSHIP");
+    }
+    /* Searches multicast (and looped back) on the default interface too */
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    setsockopt(responder, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+  }
 
-  printf("String that will be spammed with:\n\n%s\n", message);
+  printf("Simulating %u UPnP dummy devices%s, %u messages per second...\n\n",
+      device_count, device_sources ? " (127.1.0.0 and up)" : "", rate);
 
-  time_string = (char *)malloc(sizeof(char) * 20);
-  while(TRUE) {
-    time_t t = time(NULL);
-    strftime(time_string, 20, "%Y-%m-%d %H:%M:%S", localtime(&t));
-    printf("\rsending(\e[31;1m%d\e[m) \e[1;37;40m[%s]\e[m     ", ++count, time_string);
-    fflush(stdout);
-    success = sendto(sock, message, strlen(message), 0, (struct sockaddr *) &addr, sizeof(addr));
-    if(success < 0) {
-       cleanup("sendto");
+  start = nowNs();
+  last_refill = start;
+  last_print = start;
+  while(!stop) {
+    unsigned long long now = nowNs();
+    unsigned int count = BATCH_SIZE;
+    int timeout = 0;
+
+    /* Token bucket, bursts of at most one batch */
+    if(rate > 0) {
+      tokens += (double)(now - last_refill) * rate / 1e9;
+      if(tokens > BATCH_SIZE) {
+        tokens = BATCH_SIZE;
+      }
+      count = (unsigned int)tokens;
+      if(count == 0) {
+        timeout = (int)((1.0 - tokens) * 1000.0 / rate) + 1;
+      }
+    }
+    last_refill = now;
+
+    if(responder >= 0) {
+      struct pollfd pfd = { responder, POLLIN, 0 };
+      if(poll(&pfd, 1, timeout) > 0) {
+        readSearches(responder);
+      }
+    }
+    else if(timeout > 0) {
+      struct timespec wait = { timeout / 1000, (timeout % 1000) * 1000000L };
+      nanosleep(&wait, NULL);
+    }
+
+    if(count > 0) {
+      count = sendBatch(count, &addr);
+      if(rate > 0) {
+        tokens -= count;
+      }
+    }
+
+    now = nowNs();
+    if(!quiet && now - last_print >= 1000000000ULL) {
+      unsigned long long sent = sent_alive + sent_byebye + sent_responses;
+      printf("\rsent \e[31;1m%llu\e[m (alive %llu, byebye %llu, responses %llu,"
+          " lost %llu) \e[1;37;40m%llu pps\e[m     ", sent, sent_alive,
+          sent_byebye, sent_responses, send_errors,
+          (sent - last_sent) * 1000000000ULL / (now - last_print));
+      fflush(stdout);
+      last_sent = sent;
+      last_print = now;
+    }
+    if(duration > 0 && now - start >= duration * 1000000000ULL) {
+      break;
     }
-    sleep(SPAM_INTERVAL);
   }
 
+  printf("\nSent %llu messages (alive %llu, byebye %llu, responses %llu, "
+      "lost %llu)\n", sent_alive + sent_byebye + sent_responses, sent_alive,
+      sent_byebye, sent_responses, send_errors);
+  if(responder >= 0) {
+    close(responder);
+  }
   cleanup(NULL);
   return 0;
 }
@@ -133,13 +671,9 @@ void cleanup(const char *error) {
     close(sock);
     sock = 0;
   }
-  if(message) {
-    free(message);
-    message = NULL;
-  }
-  if(time_string) {
-    free(time_string);
-    time_string = NULL;
+  if(devices) {
+    free(devices);
+    devices = NULL;
   }
   if(error) {
     perror(error);
@@ -147,32 +681,9 @@ void cleanup(const char *error) {
   }
 }
 
-void exitSig() {
-  cleanup(NULL);
-  printf("\nCaught exit signal, exitting the dummy device...\n\n");
-  exit(0);
-}
-
-char *findArgumentValue(const char *arg, int argc, char **argv) {
-  int i;
-  char *tmpStr = malloc(sizeof(char)*50);
-  for(i=1; i<argc; i++) {
-    if(strcmp(arg, argv[i]) == 0) {
-      switch(argv[i][1]) {
-
-      case 'i':
-        /* interface to use */
-        if(i==argc-1 || (i<argc-1 && argv[i+1][0] == '-')) {
-          sprintf(tmpStr, "No interface given after '-i'");
-          errno = EINVAL;
-          cleanup(tmpStr);
-        }
-        return argv[i+1];
-
-      }
-    }
-  }
-  return NULL;
+void exitSig(int sig) {
+  (void)sig;
+  stop = TRUE;
 }
 
 int findInterface(struct in_addr *interface, const char *address, int af_family) {
@@ -183,20 +694,21 @@ int findInterface(struct in_addr *interface, const char *address, int af_family)
   if(getifaddrs(&interfaces)<0) {
     cleanup("getifaddr");
   }
-  for(ifa=interfaces; ifa&&ifa->ifa_next; ifa=ifa->ifa_next) {
+  for(ifa=interfaces; ifa; ifa=ifa->ifa_next) {
+    if(!ifa->ifa_addr || ifa->ifa_addr->sa_family != af_family) {
+      continue;
+    }
     paddr = inet_ntoa(((struct sockaddr_in *)ifa->ifa_addr)->sin_addr);
     if((strcmp(address, ifa->ifa_name) == 0) || (strcmp(address, paddr) == 0)) {
-      if(ifa->ifa_addr->sa_family == AF_INET) {
-        if(strcmp(address, ifa->ifa_name) == 0) {
-          printf("Matched ifa_name: %s (paddr: %s)\n", ifa->ifa_name, paddr);
-        }
-        else if(strcmp(address, paddr) == 0) {
-          printf("Matched paddr: %s (ifa_name: %s)\n", paddr, ifa->ifa_name);
-        }
-        found = TRUE;
-        interface->s_addr = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr;
-        break;
+      if(strcmp(address, ifa->ifa_name) == 0) {
+        printf("Matched ifa_name: %s (paddr: %s)\n", ifa->ifa_name, paddr);
+      }
+      else if(strcmp(address, paddr) == 0) {
+        printf("Matched paddr: %s (ifa_name: %s)\n", paddr, ifa->ifa_name);
       }
+      found = TRUE;
+      interface->s_addr = ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr;
+      break;
     }
   }
   if(interfaces) {
@@ -204,4 +716,3 @@ int findInterface(struct in_addr *interface, const char *address, int af_family)
   }
   return found;
 }
-
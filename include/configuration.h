@@ -8,6 +8,7 @@
 #define __CONFIGURATION_H__
 
 #include "common_definitions.h"
+#include "log.h"
 #include "net_definitions.h"
 
 /** A container for the program/lib configuration. */
@@ -35,10 +36,23 @@ typedef struct configuration_struct {
   BOOL                fetch_info;
   /** The size of the ssdp_cache list. */
   BOOL                ssdp_cache_size;
+  /**
+   * Forward only the changed devices, and all of them this often (in s), 0
+   * to forward and empty the whole cache every time.
+   */
+  unsigned int        resync_interval;
   /** Convert to JSON before forwarding. */
   BOOL                json_output;
   /** Convert to XML before outputting/forwarding. */
   BOOL                xml_output;
+  /** Convert to the compact binary format before forwarding. */
+  BOOL                binary_output;
+  /** Output a newline-delimited JSON stream of device events. */
+  BOOL                event_stream_output;
+  /** The time (in ms) device events are buffered before they are written. */
+  unsigned int        event_flush_interval;
+  /** The maximum number of times per second the table is redrawn. */
+  unsigned int        display_fps;
   /** Mopnochrome mode, disable all colors */
   BOOL                monochrome;
   /** Convert to oneline before outputting/forwarding. */
@@ -60,6 +74,44 @@ typedef struct configuration_struct {
   BOOL                quiet_mode;
   /** The time to wait for a device to answer a query. */
   int                 upnp_timeout;
+  /** Comma separated search targets (ST) to probe for. */
+  char               *search_targets;
+  /** How many times every probe is resent. */
+  unsigned int        probe_retransmits;
+  /** The maximum number of probes sent per second. */
+  unsigned int        probe_rate;
+  /** Comma separated IPv4 CIDR ranges to sweep with unicast probes. */
+  char               *sweep_ranges;
+  /** The maximum number of unicast probes sent per second. */
+  unsigned int        sweep_rate;
+  /** End a scan when the responses stop instead of waiting out MX (-E). */
+  BOOL                adaptive_scan;
+  /** End a scan when this many devices answered, 0 if not known. */
+  unsigned int        expected_devices;
+  /** The shortest time (in s) between continuous scans, 0 to scan once. */
+  unsigned int        scan_interval;
+  /** The file the listener's device table is saved to and restored from. */
+  char               *checkpoint_file;
+  /** The directory the received datagrams are journaled to. */
+  char               *journal_directory;
+  /** The total size (in MiB) the journal is kept under. */
+  unsigned int        journal_retention;
+  /** Replay the journal instead of listening. */
+  BOOL                journal_replay;
+  /** The start of the replayed time range (in ns since the epoch). */
+  unsigned long long  replay_from;
+  /** The end of the replayed time range (in ns since the epoch). */
+  unsigned long long  replay_to;
+  /** The capture file to read instead of listening. */
+  char               *pcap_file;
+  /** Read recorded traffic (-Y or -P) instead of listening. */
+  BOOL                offline;
+  /** Pace the recorded traffic to the times it was received. */
+  BOOL                replay_paced;
+  /** The [<ip>:]<port> the metrics are served on, NULL to not serve them. */
+  char               *metrics_address;
+  /** The level logged at (-V). */
+  log_level_e         log_level;
   /** Enable multicast loopback traffic. */
   BOOL                enable_loopback;
 } configuration_s;
@@ -0,0 +1,119 @@
+/** \file event_loop.h
+ * Header file for event_loop.c.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+#include "common_definitions.h"
+
+/** The file descriptor is readable. */
+#define EVENT_LOOP_READ  0x01
+/** The file descriptor is writable. */
+#define EVENT_LOOP_WRITE 0x02
+/** The file descriptor has an error or was hung up. */
+#define EVENT_LOOP_ERROR 0x04
+
+/**
+ * The function called when a watched file descriptor is ready.
+ *
+ * @param data The data given when the file descriptor was added.
+ * @param events The EVENT_LOOP_* flags that are set.
+ */
+typedef void (*event_loop_callback)(void *data, unsigned int events);
+
+/** A watched file descriptor. */
+typedef struct event_loop_handler_struct {
+  /** The file descriptor, -1 once removed. */
+  int fd;
+  /** The EVENT_LOOP_READ and EVENT_LOOP_WRITE flags to watch for. */
+  unsigned int events;
+  /** The function to call. */
+  event_loop_callback callback;
+  /** The data to pass to the callback. */
+  void *data;
+  /** The next handler in the list. */
+  struct event_loop_handler_struct *next;
+} event_loop_handler_s;
+
+/**
+ * Waits for any number of file descriptors at once with epoll (or with
+ * poll() where epoll is not available) and calls their callbacks. The
+ * callbacks may add and remove file descriptors.
+ */
+typedef struct event_loop_struct {
+  /** The epoll instance, -1 when poll() is used. */
+  int epoll_fd;
+  /** The watched file descriptors. */
+  event_loop_handler_s *handlers;
+  /** The removed handlers, freed after the callbacks have run. */
+  event_loop_handler_s *removed;
+  /** The number of watched file descriptors. */
+  unsigned int count;
+} event_loop_s;
+
+/**
+ * Initializes an event loop.
+ *
+ * @param loop The loop to initialize.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL event_loop_init(event_loop_s *loop);
+
+/**
+ * Starts watching a file descriptor.
+ *
+ * @param loop The loop to add the file descriptor to.
+ * @param fd The file descriptor, it should be non-blocking.
+ * @param events The EVENT_LOOP_READ and EVENT_LOOP_WRITE flags to watch for.
+ * @param callback The function to call when the file descriptor is ready.
+ * @param data The data to pass to the callback.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL event_loop_add(event_loop_s *loop, int fd, unsigned int events,
+    event_loop_callback callback, void *data);
+
+/**
+ * Changes what a watched file descriptor is watched for.
+ *
+ * @param loop The loop watching the file descriptor.
+ * @param fd The file descriptor.
+ * @param events The EVENT_LOOP_READ and EVENT_LOOP_WRITE flags to watch for.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL event_loop_modify(event_loop_s *loop, int fd, unsigned int events);
+
+/**
+ * Stops watching a file descriptor. It has to be removed before it is
+ * closed.
+ *
+ * @param loop The loop watching the file descriptor.
+ * @param fd The file descriptor.
+ */
+void event_loop_remove(event_loop_s *loop, int fd);
+
+/**
+ * Waits until at least one file descriptor is ready or the timeout passed
+ * and calls the callbacks of the ready ones.
+ *
+ * @param loop The loop to wait with.
+ * @param timeout The maximum time to wait (in ms), -1 for no limit.
+ *
+ * @return The number of file descriptors that were ready, 0 on timeout or
+ *         -1 on error.
+ */
+int event_loop_wait(event_loop_s *loop, int timeout);
+
+/**
+ * Frees an event loop, the file descriptors are not closed.
+ *
+ * @param loop The loop to free.
+ */
+void event_loop_close(event_loop_s *loop);
+
+#endif /* __EVENT_LOOP_H__ */
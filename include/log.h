@@ -1,6 +1,14 @@
 /** \file log.h
  * The logging system header file.
  *
+ * Logging is asynchronous: a message is not formatted where it is logged,
+ * its format (a string literal) and the values of its arguments are copied
+ * to a ring buffer and a thread of its own formats and writes them, in
+ * batches. The messages above the current level cost a load and a branch,
+ * so debug messages are always compiled in and enabled at runtime (-V, or
+ * SIGUSR2 on a running process). Until log_init() (and after log_stop())
+ * messages are written as they are logged.
+ *
  * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
  */
 
@@ -11,9 +19,9 @@
 
 #include "common_definitions.h"
 
-/** Uncomment this line to enable detailed debug information */
+/** Uncomment this line to start at the most detailed level */
 //#define DEBUG___
-/** Uncomment this line to write to a to a file instead of stdout */
+/** Uncomment this line to write to a file instead of stderr (with DEBUG___) */
 #define DEBUG_TO_FILE___
 
 /** Terminal code for the purple color */
@@ -31,41 +39,109 @@
 /** Terminal code for resetting the color */
 #define ANSI_COLOR_RESET   "\x1b[0m"
 
+/** The number of messages the ring buffer holds, a power of two. */
+#define LOG_RING_SIZE 2048
+/** The space for the arguments of a message, longer strings are cut. */
+#define LOG_ARGS_SIZE 208
+/** The longest line written, longer ones are cut. */
+#define LOG_LINE_SIZE 2048
+/** The size of the batches the lines are written in. */
+#define LOG_BATCH_SIZE 65536
+/** The time (in ms) the writer sleeps when there is nothing to write. */
+#define LOG_WRITER_INTERVAL 10
+/** The file written to with DEBUG_TO_FILE___. */
+#define LOG_DEBUG_FILE "debug.log"
+/** The size (in Bytes) the debug file is truncated at. */
+#define LOG_DEBUG_FILE_MAX_SIZE 512000
+
+/** The log levels, every level includes the ones before it. */
+typedef enum log_level_enum {
+  /** Errors. */
+  LOG_LEVEL_ERROR,
+  /** Warnings. */
+  LOG_LEVEL_WARN,
+  /** Information. */
+  LOG_LEVEL_INFO,
+  /** Debug information. */
+  LOG_LEVEL_DEBUG,
+  /** Development details. */
+  LOG_LEVEL_DEV,
+  /** The number of levels. */
+  LOG_LEVELS_COUNT
+} log_level_e;
+
 #ifdef DEBUG___
-  #define PRINT_DEV(...)  print_debug(NULL, ANSI_COLOR_PURPLE, __FILE__, \
-      __LINE__, __VA_ARGS__)
-  #define PRINT_DEBUG(...)  print_debug(NULL, ANSI_COLOR_GRAY, __FILE__, \
-      __LINE__, __VA_ARGS__)
-  #define PRINT_INFO(...)  print_debug(NULL, ANSI_COLOR_DEFAULT, __FILE__, \
-      __LINE__, __VA_ARGS__)
-  #define PRINT_WARN(...)  print_debug(NULL, ANSI_COLOR_YELLOW, __FILE__, \
-      __LINE__, __VA_ARGS__)
-  #define PRINT_ERROR(...)  print_debug(stderr, ANSI_COLOR_RED, __FILE__, \
-      __LINE__, __VA_ARGS__)
+  /** The level logged at until it is set. */
+  #define LOG_LEVEL_DEFAULT LOG_LEVEL_DEV
 #else
-  #define PRINT_DEV(...)    do { } while (FALSE)
-  #define PRINT_DEBUG(...)  do { } while (FALSE)
-  #define PRINT_INFO(...)   fprintf(stderr, "[INFO] " __VA_ARGS__)
-  #define PRINT_WARN(...)   fprintf(stderr, "[WARN] " __VA_ARGS__)
-  #define PRINT_ERROR(...)  fprintf(stderr, "[ERR] " __VA_ARGS__)
+  /** The level logged at until it is set. */
+  #define LOG_LEVEL_DEFAULT LOG_LEVEL_INFO
 #endif
 
-#ifdef DEBUG___
+/** The current log level, read with LOG_ENABLED(). */
+extern int log_current_level;
+
+/** Whether messages of a level are logged. */
+#define LOG_ENABLED(level) \
+    (__atomic_load_n(&log_current_level, __ATOMIC_RELAXED) >= (level))
+
+/** Logs a message, the format has to be a string literal. */
+#define PRINT_LOG(level, ...) \
+    do { \
+      if (LOG_ENABLED(level)) { \
+        log_write(level, __FILE__, __LINE__, "" __VA_ARGS__); \
+      } \
+    } while (FALSE)
+
+#define PRINT_DEV(...)    PRINT_LOG(LOG_LEVEL_DEV, __VA_ARGS__)
+#define PRINT_DEBUG(...)  PRINT_LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define PRINT_INFO(...)   PRINT_LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#define PRINT_WARN(...)   PRINT_LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define PRINT_ERROR(...)  PRINT_LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+
 /**
- * Prints a debug message, mimicking printf-like function, supports
- * only %d, %s and %c
+ * Logs a message, mimicking printf. Use the PRINT_* macros instead.
  *
- * @param std Standard output to use.
- * @paran color Color to print the message in.
- * @param file The file the debug message generated in.
- * @param line The line number in the file the debug message generated at.
- * @param message The debug message to be displayed.
- * @param ... Variable number of optional arguments that match with the
- *        va_format.
+ * @param level The level of the message.
+ * @param file The file the message was logged in.
+ * @param line The line number in the file the message was logged at.
+ * @param format The format of the message, a string literal.
+ * @param ... The arguments of the format.
  */
-void print_debug(FILE *std, const char *color, const char* file, int line,
-    char *va_format, ...);
-#endif
+void log_write(log_level_e level, const char *file, int line,
+    const char *format, ...) __attribute__((format(printf, 4, 5)));
+
+/**
+ * Sets the log level, it can be changed at any time from any thread.
+ *
+ * @param level The new level.
+ */
+void log_set_level(log_level_e level);
+
+/**
+ * Parses the name of a log level (error, warn, info, debug or dev).
+ *
+ * @param name The name.
+ * @param level The level to fill.
+ *
+ * @return TRUE on success, FALSE if the name is unknown.
+ */
+BOOL log_parse_level(const char *name, log_level_e *level);
+
+/**
+ * Starts the writer thread, and switching between the set level and debug
+ * on SIGUSR2. The writer is stopped at exit.
+ *
+ * @return TRUE on success, FALSE otherwise (the messages are then written
+ *         as they are logged).
+ */
+BOOL log_init(void);
+
+/**
+ * Writes the messages left and stops the writer thread. Messages are
+ * written as they are logged again.
+ */
+void log_stop(void);
 
 /**
  * Logs the command line arguments the process was started with.
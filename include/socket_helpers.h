@@ -123,11 +123,12 @@ int disable_multicast_loopback(SOCKET sock, int family);
  *
  * @param multicast_group The group to join.
  * @param interface_ip The interface to join on.
+ * @param loopback Also join on the loopback interfaces.
  *
  * @return 0 on success, errno otherwise.
  */
 int join_multicast_group(SOCKET sock, char *multicast_group,
-    char *interface_ip);
+    char *interface_ip, BOOL loopback);
 
 /**
  * Create and configure a new socket.
@@ -27,20 +27,178 @@ typedef struct ssdp_cache_struct {
   struct ssdp_cache_struct *next;
   /** A pointer to the total number of cache elements in the list. */
   unsigned int *ssdp_messages_count;
+  /** The SSDP_CACHE_* changes that have not been collected yet. */
+  unsigned int changes;
+  /** The device has been heard from since the last collection. */
+  BOOL seen;
+  /** The number of collections in a row the device was not heard from. */
+  unsigned int missed;
+  /** When the device was added or last changed (see ssdp_cache_now()). */
+  unsigned long long changed;
+  /** Increased every time the message is updated. */
+  unsigned long revision;
+  /** The revision of the message copy in the last published snapshot. */
+  unsigned long published_revision;
+  /** The message copy in the last published snapshot, if any. */
+  struct ssdp_snapshot_entry_struct *snapshot_entry;
+  /** The SSDP_CACHE_FIELD_* that changed since the device was forwarded. */
+  unsigned int dirty;
+  /** The device has been forwarded (see forward_ssdp_cache_changes()). */
+  BOOL forwarded;
+  /**
+   * The description of the device is being fetched, it is neither reported
+   * nor forwarded before that is done.
+   */
+  BOOL fetching;
 } ssdp_cache_s;
 
+/** The message was from a new device and was added to the cache. */
+#define SSDP_CACHE_ADDED    0x01
+/** The message was from a cached device whose description changed. */
+#define SSDP_CACHE_UPDATED  0x02
+/** The device left or stopped answering and was removed from the cache. */
+#define SSDP_CACHE_REMOVED  0x04
+/**
+ * The device left before its addition was reported and was removed from the
+ * cache without being counted as a change.
+ */
+#define SSDP_CACHE_DROPPED  0x08
+
+/** The MAC of the device was found. */
+#define SSDP_CACHE_FIELD_MAC       0x01
+/** The LOCATION header (the description URL) changed. */
+#define SSDP_CACHE_FIELD_LOCATION  0x02
+/** The SERVER header (the OS and UPnP versions) changed. */
+#define SSDP_CACHE_FIELD_SERVER    0x04
+/** All the fields, the device is new. */
+#define SSDP_CACHE_FIELD_ALL       0x07
+
+/**
+ * The function called for every changed device by
+ * collect_ssdp_cache_changes().
+ *
+ * @param data The data given to collect_ssdp_cache_changes().
+ * @param change SSDP_CACHE_ADDED, SSDP_CACHE_UPDATED, SSDP_CACHE_REMOVED or
+ *        SSDP_CACHE_DROPPED.
+ * @param ssdp_message The message of the device, a removed or dropped one is
+ *        freed when the function returns.
+ */
+typedef void (*ssdp_cache_change_callback)(void *data, unsigned int change,
+    ssdp_message_s *ssdp_message);
+
+/**
+ * Returns the current time the way the cache time stamps its elements.
+ *
+ * @return The milliseconds since the epoch.
+ */
+unsigned long long ssdp_cache_now(void);
+
 /**
  * Adds a ssdp message to a ssdp messages list. If the list hasn't been
- * initialized then it is initialized first.
+ * initialized then it is initialized first. If the device (IP) is already in
+ * the list the cached message is updated instead and the passed message is
+ * freed and replaced with the cached one.
  *
  * @param ssdp_cache_pointer The address of a pointer to a ssdp cache list.
  * @param ssdp_message_pointer The ssdp message to be appended to the cache
  *        list.
+ * @param changes If not NULL, set to SSDP_CACHE_ADDED, SSDP_CACHE_UPDATED or
+ *        0 if the device was already cached and nothing changed.
  *
  * @return TRUE on success, exits on failure.
  */
 BOOL add_ssdp_message_to_cache(ssdp_cache_s **ssdp_cache_pointer,
-    ssdp_message_s **ssdp_message_pointer);
+    ssdp_message_s **ssdp_message_pointer, unsigned int *changes);
+
+/**
+ * Removes the message of a device from a ssdp messages list. If it was the
+ * last message in the list the list is freed.
+ *
+ * @param ssdp_cache_pointer The address of a pointer to a ssdp cache list.
+ * @param ip The (interned) IP of the device to remove.
+ *
+ * @return The removed message, which the caller has to free, or NULL if the
+ *         device was not in the list.
+ */
+ssdp_message_s *remove_ssdp_message_from_cache(
+    ssdp_cache_s **ssdp_cache_pointer, const char *ip);
+
+/**
+ * Marks a device as gone (it said goodbye), it is removed by the next
+ * collect_ssdp_cache_changes() unless it is heard from again before that.
+ *
+ * @param ssdp_cache The ssdp cache list.
+ * @param ip The (interned) IP of the device.
+ * @param max_missed The max_missed that collect_ssdp_cache_changes() is
+ *        called with.
+ *
+ * @return TRUE if the device was in the list, FALSE otherwise.
+ */
+BOOL mark_ssdp_cache_device_gone(ssdp_cache_s *ssdp_cache, const char *ip,
+    unsigned int max_missed);
+
+/**
+ * Marks that the description of a device is being fetched, or is done.
+ * Until it is done the device is neither reported by
+ * collect_ssdp_cache_changes() nor forwarded by forward_ssdp_cache_changes().
+ *
+ * @param ssdp_cache The ssdp cache list.
+ * @param ip The (interned) IP of the device.
+ * @param fetching TRUE while the description is being fetched.
+ *
+ * @return TRUE if the device was in the list, FALSE otherwise.
+ */
+BOOL set_ssdp_cache_device_fetching(ssdp_cache_s *ssdp_cache, const char *ip,
+    BOOL fetching);
+
+/**
+ * Keeps the goodbye of a removed device to forward with the changes (see
+ * forward_ssdp_cache_changes()).
+ *
+ * @param removed_pointer The address of a pointer to the goodbyes (a ssdp
+ *        cache list).
+ * @param ssdp_message The goodbye, owned by the list on success.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL add_ssdp_cache_goodbye(ssdp_cache_s **removed_pointer,
+    ssdp_message_s *ssdp_message);
+
+/**
+ * Checks if a device has been forwarded (see forward_ssdp_cache_changes()).
+ *
+ * @param ssdp_cache The ssdp cache list.
+ * @param ip The (interned) IP of the device.
+ *
+ * @return TRUE if the device is in the list and has been forwarded, FALSE
+ *         otherwise.
+ */
+BOOL is_ssdp_cache_device_forwarded(const ssdp_cache_s *ssdp_cache,
+    const char *ip);
+
+/**
+ * Reports the devices that were added or updated since the last call, and
+ * removes (and reports) the ones that have not been heard from in
+ * max_missed calls in a row. A removed device whose addition was never
+ * reported is passed as SSDP_CACHE_DROPPED.
+ *
+ * @param ssdp_cache_pointer The address of a pointer to a ssdp cache list.
+ * @param max_missed The number of calls a device may go unheard.
+ * @param callback The function to call for every change.
+ * @param data The data to pass to the callback.
+ *
+ * @return The number of changes, the dropped devices are not counted.
+ */
+unsigned int collect_ssdp_cache_changes(ssdp_cache_s **ssdp_cache_pointer,
+    unsigned int max_missed, ssdp_cache_change_callback callback,
+    void *data);
+
+/**
+ * Frees all the elements in the ssdp messages list.
+ *
+ * @param ssdp_cache_pointer The ssdp cache list to be cleared.
+ */
+void free_ssdp_cache(ssdp_cache_s **ssdp_cache_pointer);
 
 /**
  * Send and free the passed SSDP cache.
@@ -58,4 +216,27 @@ int flush_ssdp_cache(configuration_s *conf, ssdp_cache_s **ssdp_cache_pointer,
     const char *url, struct sockaddr_storage *sockaddr_recipient, int port,
     int timeout);
 
+/**
+ * Send the goodbyes of the removed devices, and the devices of a SSDP cache
+ * that are new or changed since they were last sent (or all of them). The
+ * cache is kept, the sent devices are marked as forwarded and the goodbyes
+ * are freed. If sending fails nothing is marked or freed, it is sent again
+ * the next time.
+ *
+ * @param conf The configuration to use.
+ * @param ssdp_cache The SSDP cache to send the changes of, NULL if empty.
+ * @param removed_pointer The goodbyes (a SSDP cache) to send first.
+ * @param everything Send all the devices, changed or not.
+ * @param url The URL (without the protocol and IP) to send the data to.
+ * @param sockaddr_recipient The socket address to send to.
+ * @param port The port to send to.
+ * @param timeout The send-timeout to set.
+ *
+ * @return TRUE if sent (or there was nothing to send), FALSE otherwise.
+ */
+BOOL forward_ssdp_cache_changes(configuration_s *conf,
+    ssdp_cache_s *ssdp_cache, ssdp_cache_s **removed_pointer,
+    BOOL everything, const char *url,
+    struct sockaddr_storage *sockaddr_recipient, int port, int timeout);
+
 #endif /* __SSDP_CACHE_H__ */
@@ -0,0 +1,72 @@
+/** \file ssdp_cache_binary_format.h
+ * Header file for ssdp_cache_binary_format.c.
+ *
+ * A forwarded batch is encoded as follows (all integers are unsigned LEB128
+ * varints unless stated otherwise):
+ *
+ *     batch    := "SSDB" version:u8 strings messages
+ *     strings  := count { length bytes }
+ *     messages := count { message }
+ *     message  := flags:u8 ip [mac:6 bytes] message_length datetime
+ *                 request protocol
+ *                 header_count { type [name] contents }
+ *                 custom_field_count { name contents }
+ *
+ * Strings are references into the per-batch string table, 0 meaning NULL and
+ * n meaning the n:th string. The ip is 4 raw bytes, 16 raw bytes if
+ * SSDP_BINARY_FLAG_IPV6 is set or a string reference if
+ * SSDP_BINARY_FLAG_IP_STRING is set. The mac is only present if
+ * SSDP_BINARY_FLAG_MAC is set. The datetime is in seconds since the epoch
+ * (local time) and a header name is only present for unknown header types.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_CACHE_BINARY_FORMAT_H__
+#define __SSDP_CACHE_BINARY_FORMAT_H__
+
+#include <stddef.h>
+
+#include "common_definitions.h"
+#include "ssdp_cache.h"
+#include "string_buffer.h"
+
+/** The magic bytes every binary batch starts with. */
+#define SSDP_BINARY_MAGIC           "SSDB"
+/** The current version of the binary format. */
+#define SSDP_BINARY_VERSION         1
+
+/** The ip is an IPv6 address (16 bytes). */
+#define SSDP_BINARY_FLAG_IPV6       0x01
+/** The ip could not be parsed and is sent as a string reference. */
+#define SSDP_BINARY_FLAG_IP_STRING  0x02
+/** The message has a MAC address. */
+#define SSDP_BINARY_FLAG_MAC        0x04
+
+/**
+ * Converts a SSDP cache list to one binary batch.
+ *
+ * @param ssdp_cache The SSDP cache list to convert.
+ * @param binary_buffer The buffer to append the batch to.
+ *
+ * @return The number of bytes written, 0 on failure.
+ */
+unsigned int cache_to_binary(ssdp_cache_s *ssdp_cache,
+    string_buffer_s *binary_buffer);
+
+/**
+ * Decodes a binary batch and adds the messages to a SSDP cache list. If the
+ * batch is malformed the messages decoded so far are kept in the cache.
+ *
+ * @param data The binary batch.
+ * @param length The length of the batch.
+ * @param ssdp_cache_pointer The address of a pointer to the SSDP cache list
+ *        to add the messages to. If the list hasn't been initialized then it
+ *        is initialized first.
+ *
+ * @return TRUE on success, FALSE if the batch is malformed or on failure.
+ */
+BOOL binary_to_cache(const unsigned char *data, size_t length,
+    ssdp_cache_s **ssdp_cache_pointer);
+
+#endif /* __SSDP_CACHE_BINARY_FORMAT_H__ */
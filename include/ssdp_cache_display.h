@@ -9,8 +9,23 @@
 
 #include "ssdp_cache.h"
 
+/** The default maximum number of table redraws per second. */
+#define DISPLAY_DEFAULT_FPS 10
+
+/**
+ * Prepares the terminal for displaying the SSDP cache table (alternate
+ * screen, hidden cursor and unbuffered key input for scrolling and sorting).
+ *
+ * @param max_fps The maximum number of redraws per second, 0 for no limit.
+ */
+void display_ssdp_cache_init(unsigned int max_fps);
+
 /**
- * Displays the SSDP cache list as a table in the terminal.
+ * Displays the SSDP cache list as a table in the terminal. Only the cells
+ * that changed since the last frame are redrawn and redraws are capped at
+ * the configured frame rate, so the frame may be deferred until
+ * display_ssdp_cache_tick() is called. The cache is not kept, the deferred
+ * frame is drawn from the one given to display_ssdp_cache_tick().
  *
  * @param ssdp_cache The SSDP cache to display.
  * @param draw_asci Draw the table with ASCII characters only as oposed to
@@ -18,4 +33,32 @@
  */
 void display_ssdp_cache(ssdp_cache_s *ssdp_cache, BOOL draw_asci);
 
+/**
+ * Returns the time left until a deferred frame is due.
+ *
+ * @return The time left in ms, 0 if it is due now or -1 if there is no
+ *         deferred frame.
+ */
+int display_ssdp_cache_timeout(void);
+
+/**
+ * Returns the file descriptor to poll for key presses.
+ *
+ * @return The file descriptor or -1 if key input is not enabled.
+ */
+int display_ssdp_cache_input_fd(void);
+
+/**
+ * Handles pending key presses and draws the deferred frame if it is due.
+ *
+ * @param ssdp_cache The SSDP cache to display, it may have changed since
+ *        display_ssdp_cache() was called.
+ */
+void display_ssdp_cache_tick(ssdp_cache_s *ssdp_cache);
+
+/**
+ * Restores the terminal and frees the display resources.
+ */
+void display_ssdp_cache_close(void);
+
 #endif /* __SSDP_CACHE_DISPLAY_H__ */
@@ -9,52 +9,55 @@
 
 #include "ssdp_cache.h"
 #include "ssdp_message.h"
+#include "string_buffer.h"
 
 /**
  * Convert a ssdp cache list (multiple ssdp_messages) to a single JSON blob
  *
  * @param ssdp_cache The SSDP messages to convert
- * @param json_message The buffer to write to
- * @param json_buffer_size The buffer size
+ * @param json_buffer The (growable) buffer to append to
  *
- * @return The number of byter written
+ * @return The number of bytes written, 0 on failure
  */
-unsigned int cache_to_json(ssdp_cache_s *ssdp_cache, char *json_buffer,
-    unsigned int json_buffer_size);
+unsigned int cache_to_json(ssdp_cache_s *ssdp_cache,
+    string_buffer_s *json_buffer);
 
 /**
  * Convert a ssdp cache list (multiple ssdp_messages) to a single XML blob
  *
  * @param ssdp_cache The SSDP messages to convert
- * @param xml_message The buffer to write to
- * @param xml_buffer_size The buffer size
+ * @param xml_buffer The (growable) buffer to append to
  *
- * @return The number of byter written
+ * @return The number of bytes written, 0 on failure
  */
-unsigned int cache_to_xml(ssdp_cache_s *ssdp_cache, char *xml_buffer,
-    unsigned int xml_buffer_size);
+unsigned int cache_to_xml(ssdp_cache_s *ssdp_cache,
+    string_buffer_s *xml_buffer);
 
 /**
 * Converts a UPnP message to a JSON string
 *
 * @param ssdp_message The message to be converted
-* @param full_json Whether to contain the JSON opening hash
-* @param json_buffer The JSON buffer to write the JSON document to
-* @param json_size The size of the passed buffer (json_buffer)
+* @param full_json Whether to output a complete (newline-terminated) document
+*        or only the message object (for embedding it in a list)
+* @param json_buffer The (growable) buffer to append the JSON document to
+*
+* @return The number of bytes written, 0 on failure
 */
-unsigned int to_json(const ssdp_message_s *, BOOL full_json,
-    char *json_buffer, int json_buffer_size);
+unsigned int to_json(const ssdp_message_s *ssdp_message, BOOL full_json,
+    string_buffer_s *json_buffer);
 
 /**
-* Converts a UPnP message to a XML string
+* Converts a UPnP message to a XML string. All values are escaped and the
+* output is never truncated.
 *
 * @param ssdp_message The message to be converted
 * @param full_xml Whether to contain the XML declaration and the root tag
-* @param xml_buffer The XML buffer to write the XML document to
-* @param xml_buffer_size The size of the passed buffer (xml_buffer)
+* @param xml_buffer The (growable) buffer to append the XML document to
+*
+* @return The number of bytes written, 0 on failure
 */
 unsigned int to_xml(const ssdp_message_s *ssdp_message, BOOL full_xml,
-    char *xml_buffer, int xml_buffer_size);
+    string_buffer_s *xml_buffer);
 
 /**
  * Return an oneline string with the message ID, IP and (if present) the model.
@@ -0,0 +1,97 @@
+/** \file ssdp_checkpoint.h
+ * Header file for ssdp_checkpoint.c.
+ *
+ * The checkpoint file (-D) is one binary batch (see
+ * ssdp_cache_binary_format.h) holding the whole device table, including the
+ * fetched custom fields. It is replaced atomically (written to
+ * <file>.tmp and renamed), so a crash leaves the last complete checkpoint.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_CHECKPOINT_H__
+#define __SSDP_CHECKPOINT_H__
+
+#include <time.h>
+
+#include "common_definitions.h"
+#include "ssdp_cache.h"
+
+/** The shortest time (in ms) between two checkpoints of a changing table. */
+#define SSDP_CHECKPOINT_INTERVAL 30000
+
+/**
+ * Periodically saves a SSDP cache to a file and restores it at startup, so
+ * a restarted listener does not have to rediscover (and refetch) every
+ * device.
+ */
+typedef struct ssdp_checkpoint_struct {
+  /** The checkpoint file. */
+  const char *path;
+  /** The table has changed since the last checkpoint. */
+  BOOL dirty;
+  /** When the last checkpoint was saved. */
+  struct timespec saved;
+} ssdp_checkpoint_s;
+
+/**
+ * Initializes a checkpoint.
+ *
+ * @param checkpoint The checkpoint to initialize.
+ * @param path The checkpoint file.
+ */
+void ssdp_checkpoint_init(ssdp_checkpoint_s *checkpoint, const char *path);
+
+/**
+ * Adds the devices in the checkpoint file to a SSDP cache. The file is
+ * mapped to memory and decoded in place.
+ *
+ * @param checkpoint The checkpoint.
+ * @param ssdp_cache_pointer The address of a pointer to the SSDP cache list
+ *        to add the devices to.
+ *
+ * @return TRUE on success or if there is no checkpoint file yet, FALSE if
+ *         the file is unreadable or malformed (the devices decoded so far
+ *         are kept).
+ */
+BOOL ssdp_checkpoint_load(ssdp_checkpoint_s *checkpoint,
+    ssdp_cache_s **ssdp_cache_pointer);
+
+/**
+ * Tells the checkpoint that the table has changed.
+ *
+ * @param checkpoint The checkpoint.
+ */
+void ssdp_checkpoint_changed(ssdp_checkpoint_s *checkpoint);
+
+/**
+ * Returns the time left until a checkpoint is due.
+ *
+ * @param checkpoint The checkpoint.
+ *
+ * @return The time left in ms, 0 if it is due now or -1 if the table has
+ *         not changed.
+ */
+int ssdp_checkpoint_timeout(ssdp_checkpoint_s *checkpoint);
+
+/**
+ * Saves the table to the checkpoint file.
+ *
+ * @param checkpoint The checkpoint.
+ * @param ssdp_cache The SSDP cache list, NULL if it is empty.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_checkpoint_save(ssdp_checkpoint_s *checkpoint,
+    ssdp_cache_s *ssdp_cache);
+
+/**
+ * Saves the table if a checkpoint is due.
+ *
+ * @param checkpoint The checkpoint.
+ * @param ssdp_cache The SSDP cache list, NULL if it is empty.
+ */
+void ssdp_checkpoint_update(ssdp_checkpoint_s *checkpoint,
+    ssdp_cache_s *ssdp_cache);
+
+#endif /* __SSDP_CHECKPOINT_H__ */
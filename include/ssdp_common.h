@@ -26,6 +26,15 @@ typedef struct ssdp_recv_node_s {
   char recv_data[SSDP_RECV_DATA_LEN];
 } ssdp_recv_node_s;
 
+/**
+ * Read a message from a socket. Blocks until the receive timeout of the
+ * socket if there is no data to read.
+ *
+ * @param sock The socket to read from.
+ * @param recv_node Information about the node (client) that sent data.
+ */
+void ssdp_recv_node_read(SOCKET sock, ssdp_recv_node_s *recv_node);
+
 /**
  * Print forwarding status (after being parsed into a network-order address).
  *
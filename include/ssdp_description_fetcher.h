@@ -0,0 +1,180 @@
+/** \file ssdp_description_fetcher.h
+ * Header file for ssdp_description_fetcher.c.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_DESCRIPTION_FETCHER_H__
+#define __SSDP_DESCRIPTION_FETCHER_H__
+
+#include <sys/socket.h> /* struct sockaddr_storage */
+#include <time.h>
+
+#include "common_definitions.h"
+#include "event_loop.h"
+#include "ssdp_message.h"
+#include "string_buffer.h"
+
+/** The default number of descriptions fetched at the same time. */
+#define SSDP_FETCHER_MAX_ACTIVE 32
+/** The default time (in ms) a description fetch may take. */
+#define SSDP_FETCHER_TIMEOUT 5000
+
+/**
+ * The function called when a fetch is done, whether it succeeded or not.
+ *
+ * @param data The data given to the fetcher.
+ * @param ssdp_message The message the description was fetched for.
+ */
+typedef void (*ssdp_fetcher_callback)(void *data,
+    ssdp_message_s *ssdp_message);
+
+/** The state of a description fetch. */
+typedef enum ssdp_fetch_state_enum {
+  /** Waiting for a free slot. */
+  SSDP_FETCH_QUEUED,
+  /** Waiting for the connection to be established. */
+  SSDP_FETCH_CONNECTING,
+  /** Sending the request. */
+  SSDP_FETCH_SENDING,
+  /** Receiving the description. */
+  SSDP_FETCH_RECEIVING
+} ssdp_fetch_state_e;
+
+/** A description fetch for one device. */
+typedef struct ssdp_fetch_struct {
+  /** The fetcher the fetch belongs to. */
+  struct ssdp_fetcher_struct *fetcher;
+  /** The message to add the description fields to. */
+  ssdp_message_s *ssdp_message;
+  /** The state of the fetch. */
+  ssdp_fetch_state_e state;
+  /** The connection to the device. */
+  SOCKET sock;
+  /** The address of the device web server. */
+  struct sockaddr_storage addr;
+  /** The HTTP request. */
+  string_buffer_s request;
+  /** How much of the request has been sent. */
+  size_t request_sent;
+  /** The response, null-terminated. */
+  char *response;
+  /** The length of the response. */
+  size_t response_length;
+  /** When the fetch was started. */
+  struct timespec started;
+  /** The next fetch in the list. */
+  struct ssdp_fetch_struct *next;
+} ssdp_fetch_s;
+
+/**
+ * Fetches the description documents of devices (the "Location" header)
+ * without blocking, so that many devices can be fetched at once while the
+ * caller keeps receiving. The number of simultaneous connections is capped,
+ * fetches beyond it are queued.
+ */
+typedef struct ssdp_fetcher_struct {
+  /** The loop the connections are watched with. */
+  event_loop_s *loop;
+  /** The fetches in progress. */
+  ssdp_fetch_s *active;
+  /** The number of fetches in progress. */
+  unsigned int active_count;
+  /** The first queued fetch. */
+  ssdp_fetch_s *queued;
+  /** The last queued fetch. */
+  ssdp_fetch_s *queued_last;
+  /** The number of queued fetches. */
+  unsigned int queued_count;
+  /** The maximum number of fetches in progress. */
+  unsigned int max_active;
+  /** The time (in ms) a fetch may take. */
+  unsigned int timeout;
+  /** The function to call when a fetch is done. */
+  ssdp_fetcher_callback callback;
+  /** The data to pass to the callback. */
+  void *data;
+} ssdp_fetcher_s;
+
+/**
+ * Initializes a description fetcher.
+ *
+ * @param fetcher The fetcher to initialize.
+ * @param loop The loop to watch the connections with.
+ * @param max_active The maximum number of fetches in progress.
+ * @param timeout The time (in ms) a fetch may take.
+ * @param callback The function to call when a fetch is done.
+ * @param data The data to pass to the callback.
+ */
+void ssdp_fetcher_init(ssdp_fetcher_s *fetcher, event_loop_s *loop,
+    unsigned int max_active, unsigned int timeout,
+    ssdp_fetcher_callback callback, void *data);
+
+/**
+ * Starts (or queues) fetching the description of a device. The message has
+ * to stay valid until the callback is called.
+ *
+ * @param fetcher The fetcher to use.
+ * @param ssdp_message The message whose "Location" header to fetch.
+ *
+ * @return TRUE if the callback will be called, FALSE if there is nothing to
+ *         fetch (no usable "Location" header or already fetched).
+ */
+BOOL ssdp_fetcher_fetch(ssdp_fetcher_s *fetcher,
+    ssdp_message_s *ssdp_message);
+
+/**
+ * Checks if the description of a device is being fetched.
+ *
+ * @param fetcher The fetcher to check.
+ * @param ssdp_message The message of the device.
+ *
+ * @return TRUE if a fetch is queued or in progress, FALSE otherwise.
+ */
+BOOL ssdp_fetcher_is_fetching(ssdp_fetcher_s *fetcher,
+    const ssdp_message_s *ssdp_message);
+
+/**
+ * Aborts fetching the description of a device, without calling the
+ * callback, so that the message can be freed.
+ *
+ * @param fetcher The fetcher to use.
+ * @param ssdp_message The message of the device.
+ */
+void ssdp_fetcher_cancel(ssdp_fetcher_s *fetcher,
+    const ssdp_message_s *ssdp_message);
+
+/**
+ * Returns the number of fetches queued or in progress.
+ *
+ * @param fetcher The fetcher to check.
+ *
+ * @return The number of fetches.
+ */
+unsigned int ssdp_fetcher_pending(ssdp_fetcher_s *fetcher);
+
+/**
+ * Returns the time left until the first fetch in progress times out.
+ *
+ * @param fetcher The fetcher to check.
+ *
+ * @return The time left in ms, 0 if one has timed out or -1 if there are no
+ *         fetches in progress.
+ */
+int ssdp_fetcher_timeout(ssdp_fetcher_s *fetcher);
+
+/**
+ * Aborts the fetches that have timed out.
+ *
+ * @param fetcher The fetcher to check.
+ */
+void ssdp_fetcher_expire(ssdp_fetcher_s *fetcher);
+
+/**
+ * Aborts all the fetches, the callback is still called for each.
+ *
+ * @param fetcher The fetcher to close.
+ */
+void ssdp_fetcher_close(ssdp_fetcher_s *fetcher);
+
+#endif /* __SSDP_DESCRIPTION_FETCHER_H__ */
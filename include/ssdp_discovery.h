@@ -0,0 +1,173 @@
+/** \file ssdp_discovery.h
+ * Header file for ssdp_discovery.c.
+ *
+ * The API for embedding libssdp. A discovery context listens for the SSDP
+ * notifications, keeps a table of the devices and calls back when a device
+ * is added, updated or removed. The callbacks are passed the parsed
+ * messages the table holds, not copies, they are only valid during the
+ * callback. The context never blocks, it is driven from the event loop of
+ * the application:
+ *
+ *     fd = ssdp_discovery_get_fd(discovery);
+ *     while (running) {
+ *       struct pollfd pfd = { fd, POLLIN, 0 };
+ *       poll(&pfd, 1, ssdp_discovery_timeout(discovery));
+ *       ssdp_discovery_process(discovery);
+ *     }
+ *
+ * New devices are reported once their description is fetched (unless
+ * conf->fetch_info is unset). The messages are logged with the log
+ * level set with log_set_level().
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_DISCOVERY_H__
+#define __SSDP_DISCOVERY_H__
+
+#include "common_definitions.h"
+#include "configuration.h"
+#include "event_loop.h"
+#include "ssdp_cache.h"
+#include "ssdp_common.h"
+#include "ssdp_description_fetcher.h"
+#include "ssdp_filter.h"
+#include "ssdp_listener.h"
+#include "ssdp_message.h"
+
+/** The most datagrams read per ssdp_discovery_process(). */
+#define SSDP_DISCOVERY_MAX_READS 64
+/**
+ * The time (in ms) between two ssdp_discovery_process() while fetching,
+ * on systems without epoll (where only the listener is polled).
+ */
+#define SSDP_DISCOVERY_POLL_INTERVAL 50
+
+/** What happened to a device. */
+typedef enum ssdp_discovery_event_enum {
+  /** The device was heard from for the first time. */
+  SSDP_DISCOVERY_ADDED,
+  /** The headers (or the MAC) of the device changed. */
+  SSDP_DISCOVERY_UPDATED,
+  /** The device left (ssdp:byebye). */
+  SSDP_DISCOVERY_REMOVED,
+  /** The number of events. */
+  SSDP_DISCOVERY_EVENTS_COUNT
+} ssdp_discovery_event_e;
+
+/**
+ * The function called when a device is added, updated or removed. It must
+ * not close the context.
+ *
+ * @param data The data given when the callback was registered.
+ * @param event What happened to the device.
+ * @param device The device, only valid until the callback returns.
+ */
+typedef void (*ssdp_discovery_callback)(void *data,
+    ssdp_discovery_event_e event, const ssdp_message_s *device);
+
+/** A registered callback. */
+typedef struct ssdp_discovery_handler_struct {
+  /** The function to call, NULL if none. */
+  ssdp_discovery_callback callback;
+  /** The data to pass to it. */
+  void *data;
+} ssdp_discovery_handler_s;
+
+/** A discovery context. */
+typedef struct ssdp_discovery_struct {
+  /** The configuration, owned by the application. */
+  configuration_s *conf;
+  /** The listener receiving the notifications. */
+  ssdp_listener_s listener;
+  /** The loop the listener and the description fetches are watched with. */
+  event_loop_s loop;
+  /** The description fetcher, used if conf->fetch_info is set. */
+  ssdp_fetcher_s fetcher;
+  /** The filters to apply (conf->filter). */
+  filters_factory_s *filters_factory;
+  /** The devices heard from. */
+  ssdp_cache_s *ssdp_cache;
+  /** The last datagram read. */
+  ssdp_recv_node_s recv_node;
+  /** The registered callbacks, indexed by ssdp_discovery_event_e. */
+  ssdp_discovery_handler_s handlers[SSDP_DISCOVERY_EVENTS_COUNT];
+  /** The context is being closed, nothing is reported anymore. */
+  BOOL closing;
+} ssdp_discovery_s;
+
+/**
+ * Creates a discovery context and starts listening. The interface, ip,
+ * use_ipv4, use_ipv6, enable_loopback, filter, ignore_search_msgs and
+ * fetch_info fields of the configuration are used.
+ *
+ * @param conf The configuration (see set_default_configuration()), it has
+ *        to stay valid until the context is closed.
+ *
+ * @return The context or NULL on failure.
+ */
+ssdp_discovery_s *ssdp_discovery_create(configuration_s *conf);
+
+/**
+ * Registers the callback of an event, replacing the previous one.
+ *
+ * @param discovery The context.
+ * @param event The event.
+ * @param callback The function to call, NULL to not be called anymore.
+ * @param data The data to pass to it.
+ */
+void ssdp_discovery_on(ssdp_discovery_s *discovery,
+    ssdp_discovery_event_e event, ssdp_discovery_callback callback,
+    void *data);
+
+/**
+ * Get the file descriptor that becomes readable when there is something to
+ * process.
+ *
+ * @param discovery The context.
+ *
+ * @return The file descriptor.
+ */
+int ssdp_discovery_get_fd(ssdp_discovery_s *discovery);
+
+/**
+ * Get the longest time to wait for the file descriptor before processing.
+ *
+ * @param discovery The context.
+ *
+ * @return The time in ms, -1 for no limit.
+ */
+int ssdp_discovery_timeout(ssdp_discovery_s *discovery);
+
+/**
+ * Reads the waiting notifications, advances the description fetches and
+ * calls the callbacks of what changed. It never blocks.
+ *
+ * @param discovery The context.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_discovery_process(ssdp_discovery_s *discovery);
+
+/**
+ * Get a field of a device: "ip", "mac", "request", "protocol", "datetime",
+ * a header (eg. "location" or "usn") or a field of its description (eg.
+ * "friendlyName" or "modelName"). The value is not copied.
+ *
+ * @param device The device.
+ * @param name The name of the field.
+ *
+ * @return The value, valid as long as the device, or NULL if it has none.
+ */
+const char *ssdp_discovery_get_field(const ssdp_message_s *device,
+    const char *name);
+
+/**
+ * Stops listening and frees a context and its devices, nothing is reported
+ * anymore.
+ *
+ * @param discovery The context to close.
+ */
+void ssdp_discovery_close(ssdp_discovery_s *discovery);
+
+#endif /* __SSDP_DISCOVERY_H__ */
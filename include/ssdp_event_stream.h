@@ -0,0 +1,97 @@
+/** \file ssdp_event_stream.h
+ * Header file for ssdp_event_stream.c.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_EVENT_STREAM_H__
+#define __SSDP_EVENT_STREAM_H__
+
+#include <time.h>
+
+#include "common_definitions.h"
+#include "ssdp_message.h"
+#include "string_buffer.h"
+
+/** The default time (in ms) events are buffered before they are written. */
+#define SSDP_EVENT_STREAM_FLUSH_INTERVAL 200
+
+/** The type of a device event. */
+typedef enum ssdp_event_type_enum {
+  /** A new device was discovered. */
+  SSDP_EVENT_ADD,
+  /** The description of a known device changed. */
+  SSDP_EVENT_UPDATE,
+  /** A device said goodbye (ssdp:byebye). */
+  SSDP_EVENT_REMOVE
+} ssdp_event_type_e;
+
+/**
+ * A newline-delimited JSON (NDJSON) stream of device events. Every event is
+ * one line, the lines are buffered and written with a single write() when
+ * the flush interval has passed.
+ */
+typedef struct ssdp_event_stream_struct {
+  /** The file descriptor to write to. */
+  int fd;
+  /** The events not written yet. */
+  string_buffer_s buffer;
+  /** The time (in ms) events are buffered before they are written. */
+  unsigned int flush_interval;
+  /** When the buffer was last written. */
+  struct timespec last_flush;
+} ssdp_event_stream_s;
+
+/**
+ * Initializes an event stream.
+ *
+ * @param stream The stream to initialize.
+ * @param fd The file descriptor to write the events to.
+ * @param flush_interval The time (in ms) to buffer events, 0 writes every
+ *        event immediately.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_event_stream_init(ssdp_event_stream_s *stream, int fd,
+    unsigned int flush_interval);
+
+/**
+ * Adds a device event to the stream. The buffered events are written if the
+ * flush interval has passed.
+ *
+ * @param stream The stream to add the event to.
+ * @param type The type of the event.
+ * @param ssdp_message The message describing the device.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_event_stream_emit(ssdp_event_stream_s *stream,
+    ssdp_event_type_e type, const ssdp_message_s *ssdp_message);
+
+/**
+ * Returns the time left until the buffered events are due to be written.
+ *
+ * @param stream The stream to check.
+ *
+ * @return The time left in ms, 0 if they are due now or -1 if there is
+ *         nothing buffered.
+ */
+int ssdp_event_stream_timeout(ssdp_event_stream_s *stream);
+
+/**
+ * Writes all the buffered events.
+ *
+ * @param stream The stream to flush.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_event_stream_flush(ssdp_event_stream_s *stream);
+
+/**
+ * Writes all the buffered events and frees the stream.
+ *
+ * @param stream The stream to close.
+ */
+void ssdp_event_stream_close(ssdp_event_stream_s *stream);
+
+#endif /* __SSDP_EVENT_STREAM_H__ */
@@ -15,6 +15,11 @@ typedef struct filter_struct {
   char *header;
   /** The filter value. */
   char *value;
+  /**
+   * The interned filter value, a header holding exactly this value shares
+   * the pointer and matches without a substring search.
+   */
+  const char *interned_value;
 } filter_s;
 
 /** Filters factory. */
@@ -0,0 +1,167 @@
+/** \file ssdp_journal.h
+ * Header file for ssdp_journal.c.
+ *
+ * The journal (-J) is a directory of segment files, each named after the
+ * time (in ns since the epoch) of its first datagram:
+ *
+ *     <time>.ssj  := header { record datagram padding }
+ *     <time>.ssx  := { index_entry }
+ *
+ * A record is a fixed size ssdp_journal_record_s followed by the raw
+ * datagram, padded to a multiple of 8 bytes, so every record of a mapped
+ * segment is aligned and can be read in place. The index (.ssx) holds the
+ * offset of a record at most every SSDP_JOURNAL_INDEX_INTERVAL ns, so a
+ * replay can start in the middle of a segment. Everything is in the byte
+ * order of the machine that wrote it.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_JOURNAL_H__
+#define __SSDP_JOURNAL_H__
+
+#include <limits.h>
+#include <net/if.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common_definitions.h"
+#include "net_definitions.h"
+
+/** The magic bytes every segment starts with. */
+#define SSDP_JOURNAL_MAGIC "SSDJ"
+/** The current version of the segment format. */
+#define SSDP_JOURNAL_VERSION 1
+/** The size a segment grows to before a new one is started. */
+#define SSDP_JOURNAL_SEGMENT_SIZE (16 * 1024 * 1024)
+/** The smallest segment size, with a retention below 4 segments. */
+#define SSDP_JOURNAL_MIN_SEGMENT_SIZE (64 * 1024)
+/** The default total size (in MiB) the journal is kept under. */
+#define SSDP_JOURNAL_DEFAULT_RETENTION 256
+/** The shortest time (in ns) between two index entries. */
+#define SSDP_JOURNAL_INDEX_INTERVAL 1000000000ULL
+
+/** The header of a segment. */
+typedef struct ssdp_journal_header_struct {
+  /** SSDP_JOURNAL_MAGIC. */
+  char magic[4];
+  /** SSDP_JOURNAL_VERSION. */
+  uint32_t version;
+} ssdp_journal_header_s;
+
+/** A received datagram, followed by its data in the segment. */
+typedef struct ssdp_journal_record_struct {
+  /** When it was received, in ns since the epoch. */
+  uint64_t time;
+  /** The length of the datagram. */
+  uint32_t length;
+  /** Unused, 0. */
+  uint32_t reserved;
+  /** The IP of the sender. */
+  char ip[IPv6_STR_MAX_SIZE];
+  /** The MAC of the sender, empty if unknown. */
+  char mac[MAC_STR_MAX_SIZE];
+  /** The interface it was received on, empty if any. */
+  char interface[IFNAMSIZ];
+} ssdp_journal_record_s;
+
+/** An entry of a segment index. */
+typedef struct ssdp_journal_index_entry_struct {
+  /** The time of the record. */
+  uint64_t time;
+  /** The offset of the record in the segment. */
+  uint64_t offset;
+} ssdp_journal_index_entry_s;
+
+/** Appends datagrams to a journal. */
+typedef struct ssdp_journal_struct {
+  /** The journal directory. */
+  char directory[PATH_MAX];
+  /** The total size (in bytes) the journal is kept under. */
+  unsigned long long retention;
+  /** The size a segment grows to, a quarter of the retention at most. */
+  unsigned long long segment_limit;
+  /** The segment being written, -1 before the first datagram. */
+  int segment_fd;
+  /** The index of the segment being written. */
+  int index_fd;
+  /** The time in the name of the segment being written. */
+  unsigned long long segment_start;
+  /** The size of the segment being written. */
+  unsigned long long segment_size;
+  /** The time of the last indexed record. */
+  unsigned long long last_indexed;
+} ssdp_journal_s;
+
+/**
+ * Called for every replayed datagram.
+ *
+ * @param data The data passed to ssdp_journal_replay().
+ * @param record The record of the datagram.
+ * @param datagram The datagram (record->length bytes, not null-terminated).
+ *
+ * @return TRUE to go on, FALSE to stop the replay.
+ */
+typedef BOOL (*ssdp_journal_replay_cb)(void *data,
+    const ssdp_journal_record_s *record, const char *datagram);
+
+/**
+ * Returns the current time the way it is recorded in a journal.
+ *
+ * @return The time in ns since the epoch.
+ */
+unsigned long long ssdp_journal_now(void);
+
+/**
+ * Opens a journal for appending, the directory is created if needed.
+ *
+ * @param journal The journal to open.
+ * @param directory The journal directory.
+ * @param retention The total size (in MiB) to keep the journal under, the
+ *        oldest segments are deleted first.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_journal_open(ssdp_journal_s *journal, const char *directory,
+    unsigned int retention);
+
+/**
+ * Appends a received datagram to a journal.
+ *
+ * @param journal The journal.
+ * @param time When it was received (see ssdp_journal_now()).
+ * @param ip The IP of the sender.
+ * @param mac The MAC of the sender, NULL if unknown.
+ * @param interface The interface it was received on, NULL if any.
+ * @param datagram The datagram.
+ * @param length The length of the datagram.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_journal_append(ssdp_journal_s *journal, unsigned long long time,
+    const char *ip, const char *mac, const char *interface,
+    const char *datagram, size_t length);
+
+/**
+ * Closes a journal.
+ *
+ * @param journal The journal to close.
+ */
+void ssdp_journal_close(ssdp_journal_s *journal);
+
+/**
+ * Replays the datagrams of a journal received in a time range, oldest
+ * first and as fast as the callback takes them.
+ *
+ * @param directory The journal directory.
+ * @param from The start of the range (in ns since the epoch).
+ * @param to The end of the range (in ns since the epoch, inclusive).
+ * @param callback The function to call for every datagram.
+ * @param data Passed to the callback.
+ *
+ * @return TRUE on success, FALSE if the journal could not be read.
+ */
+BOOL ssdp_journal_replay(const char *directory, unsigned long long from,
+    unsigned long long to, ssdp_journal_replay_cb callback, void *data);
+
+#endif /* __SSDP_JOURNAL_H__ */
@@ -12,7 +12,7 @@
 // TODO: move daemon port to daemon.h ?
 /** Port the daemon will listen on. */
 #define DAEMON_PORT           43210
-/** XML buffer/container string. */
+/** Initial size of the XML/JSON output buffer for one message. */
 #define XML_BUFFER_SIZE       2048
 /** Size of the extra device info buffer. */
 #define DEVICE_INFO_SIZE      16384
@@ -56,10 +56,13 @@
 typedef struct ssdp_header_struct {
   /** The header type. Types are defined in this file. */
   unsigned char type;
-  /** If header type is non-standard type this is its type name. */
-  char *unknown_type;
-  /** The contents (value) of the custom field. */
-  char *contents;
+  /**
+   * If header type is non-standard type this is its type name (interned, see
+   * string_intern.h).
+   */
+  const char *unknown_type;
+  /** The contents (value) of the header (interned). */
+  const char *contents;
   /** The first header in the list. */
   struct ssdp_header_struct *first;
   /** The next header in the list. */
@@ -68,10 +71,10 @@ typedef struct ssdp_header_struct {
 
 /** SSDP custom field. */
 typedef struct ssdp_custom_field_struct {
-  /** The name of the custom field. */
-  char *name;
-  /** The contents (value) of the custom field. */
-  char *contents;
+  /** The name of the custom field (interned, see string_intern.h). */
+  const char *name;
+  /** The contents (value) of the custom field (interned). */
+  const char *contents;
   /** The first custom field in the list. */
   struct ssdp_custom_field_struct *first;
   /** The next custom field in the list. */
@@ -82,19 +85,19 @@ typedef struct ssdp_custom_field_struct {
 typedef struct ssdp_message_struct {
   /** The MAC address of the sender (node). */
   char *mac;
-  /** The IP address of the sender (node). */
-  char *ip;
+  /** The IP address of the sender (node, interned). */
+  const char *ip;
   /** The message length. */
   int  message_length;
   /** The date and time when the message was received. */
   char *datetime;
   /**
    * The request (message) type. Eg. a search, an announcement (hello,
-   * alive or bye) or a response to a search.
+   * alive or bye) or a response to a search (interned).
    */
-  char *request;
-  /** The protocol used to send the message (HTTP) */
-  char *protocol;
+  const char *request;
+  /** The protocol used to send the message (HTTP, interned) */
+  const char *protocol;
   /** The answer to a SEARCH request (eg. OK 200, or other HTTP responses). */
   char *answer;
   /**
@@ -123,6 +126,29 @@ typedef struct ssdp_message_struct {
 ssdp_custom_field_s *get_custom_field(const ssdp_message_s *ssdp_message,
     const char *custom_field);
 
+/**
+ * Searches the SSDP message headers for the first header of the given type.
+ *
+ * @param ssdp_message The SSDP message to search in.
+ * @param header_type The header type to search for.
+ *
+ * @return Returns the found header or NULL.
+ */
+ssdp_header_s *get_header(const ssdp_message_s *ssdp_message,
+    unsigned char header_type);
+
+/**
+ * Parses the device description fields (serial number, friendly name,
+ * manufacturer and model) from a device description document and stores
+ * them in the custom_fields of the ssdp_message.
+ *
+ * @param ssdp_message The message to add the fields to.
+ * @param response The (null-terminated) device description.
+ *
+ * @return The number of custom fields the message has.
+ */
+int parse_custom_fields(ssdp_message_s *ssdp_message, const char *response);
+
 /**
  * Fetches additional info from a UPnP message "Location" header
  * and stores it in the custom_fields in the ssdp_message.
@@ -134,6 +160,16 @@ ssdp_custom_field_s *get_custom_field(const ssdp_message_s *ssdp_message,
  */
 int fetch_custom_fields(configuration_s *conf, ssdp_message_s *ssdp_message);
 
+/**
+ * Returns the appropriate unsigned char (number) representation of the header
+ * string.
+ *
+ * @param header_string The header string to be looked up.
+ *
+ * @return A unsigned char representing the header type.
+ */
+unsigned char get_header_type(const char *header_string);
+
 /**
  * Returns the appropriate string representation of the header type.
  *
@@ -174,5 +210,14 @@ BOOL build_ssdp_message(ssdp_message_s *message, char *ip, char *mac,
  */
 void free_ssdp_message(ssdp_message_s **message_pointer);
 
+/**
+ * Makes a deep copy of a SSDP message, the interned strings are shared.
+ *
+ * @param message The message to copy.
+ *
+ * @return The copy, which the caller has to free, or NULL on failure.
+ */
+ssdp_message_s *copy_ssdp_message(const ssdp_message_s *message);
+
 #endif /* __SSDP_MESSAGE_H__ */
 
@@ -0,0 +1,275 @@
+/** \file ssdp_metrics.h
+ * Header file for ssdp_metrics.c.
+ *
+ * The counters of every stage of the pipeline (received, parsed, filtered,
+ * cached, fetched and forwarded) and the latency histograms between the
+ * stages. Every thread counts in a slot of its own, on a cache line of its
+ * own, and the slots are summed up when the metrics are read, so counting
+ * never contends. The metrics are read in the Prometheus text format, from
+ *
+ *     GET /metrics HTTP/1.0
+ *
+ * on the metrics address (-G), or dumped to stderr on SIGUSR1.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_METRICS_H__
+#define __SSDP_METRICS_H__
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "common_definitions.h"
+#include "configuration.h"
+#include "string_buffer.h"
+
+/** The most threads with slots of their own, the rest share one. */
+#define SSDP_METRICS_MAX_THREADS 32
+/** The size of a cache line, which every slot is padded to. */
+#define SSDP_METRICS_CACHE_LINE 64
+/** The IP the metrics are served on when -G only gives a port. */
+#define SSDP_METRICS_DEFAULT_IP "127.0.0.1"
+/** The time (in s) a metrics client has to send its request. */
+#define SSDP_METRICS_CLIENT_TIMEOUT 2
+/** The largest request (line and headers) accepted. */
+#define SSDP_METRICS_MAX_REQUEST 2048
+/** The queue length of the metrics server socket. */
+#define SSDP_METRICS_LISTEN_QUEUE 8
+/** The quantiles the histograms are summarized with. */
+#define SSDP_METRICS_QUANTILES { 0.5, 0.9, 0.99, 0.999 }
+/** The initial size of the buffer the metrics are written to. */
+#define SSDP_METRICS_BUFFER_SIZE 4096
+/**
+ * The histograms are log-linear, every power of two is split into
+ * 2^SSDP_HISTOGRAM_SUB_BITS buckets, so a value is off by at most 1/16.
+ */
+#define SSDP_HISTOGRAM_SUB_BITS 4
+/** The values (in ns) are recorded up to 2^SSDP_HISTOGRAM_MAX_BITS (68 s). */
+#define SSDP_HISTOGRAM_MAX_BITS 36
+/** The number of buckets of a histogram. */
+#define SSDP_HISTOGRAM_BUCKETS \
+    ((SSDP_HISTOGRAM_MAX_BITS - SSDP_HISTOGRAM_SUB_BITS + 1) << \
+    SSDP_HISTOGRAM_SUB_BITS)
+
+/** The counters, they only ever grow. */
+typedef enum ssdp_counter_enum {
+  /** Datagrams received (or replayed). */
+  SSDP_COUNTER_DATAGRAMS,
+  /** Bytes received (or replayed). */
+  SSDP_COUNTER_BYTES,
+  /** Datagrams that could not be parsed. */
+  SSDP_COUNTER_PARSE_FAILURES,
+  /** M-SEARCH messages ignored (without -M). */
+  SSDP_COUNTER_SEARCHES_IGNORED,
+  /** Messages dropped by the filters (-f). */
+  SSDP_COUNTER_FILTER_DROPS,
+  /** Devices added to the table. */
+  SSDP_COUNTER_DEVICES_ADDED,
+  /** Devices whose cached message changed. */
+  SSDP_COUNTER_DEVICES_UPDATED,
+  /** Devices removed from the table. */
+  SSDP_COUNTER_DEVICES_REMOVED,
+  /** Descriptions fetched. */
+  SSDP_COUNTER_FETCHES,
+  /** Descriptions that could not be fetched. */
+  SSDP_COUNTER_FETCH_FAILURES,
+  /** Batches of devices forwarded (-a). */
+  SSDP_COUNTER_FORWARDS,
+  /** Batches of devices that could not be forwarded. */
+  SSDP_COUNTER_FORWARD_FAILURES,
+  /** Bytes forwarded. */
+  SSDP_COUNTER_FORWARDED_BYTES,
+  /** The number of counters. */
+  SSDP_COUNTERS_COUNT
+} ssdp_counter_e;
+
+/** The gauges, they are set to their current value. */
+typedef enum ssdp_gauge_enum {
+  /** Devices in the table. */
+  SSDP_GAUGE_DEVICES,
+  /** Descriptions queued or being fetched. */
+  SSDP_GAUGE_FETCHES_PENDING,
+  /** The number of gauges. */
+  SSDP_GAUGES_COUNT
+} ssdp_gauge_e;
+
+/**
+ * The latency histograms, the stages follow a message from when it was
+ * received until it was output (written to the event stream, drawn or
+ * forwarded).
+ */
+typedef enum ssdp_histogram_enum {
+  /** Received until parsed. */
+  SSDP_HISTOGRAM_PARSE,
+  /** Parsed until filtered. */
+  SSDP_HISTOGRAM_FILTER,
+  /** Filtered until cached. */
+  SSDP_HISTOGRAM_CACHE,
+  /** Cached until enriched (its description fetched, if fetching). */
+  SSDP_HISTOGRAM_ENRICH,
+  /** Enriched until output. */
+  SSDP_HISTOGRAM_EMIT,
+  /** Received until output. */
+  SSDP_HISTOGRAM_TOTAL,
+  /** The time it took to fetch the description of a device. */
+  SSDP_HISTOGRAM_FETCH,
+  /** The number of histograms. */
+  SSDP_HISTOGRAMS_COUNT
+} ssdp_histogram_e;
+
+/** A latency histogram, the values are in ns. */
+typedef struct ssdp_histogram_struct {
+  /** The number of values in every bucket. */
+  unsigned long long buckets[SSDP_HISTOGRAM_BUCKETS];
+  /** The number of values. */
+  unsigned long long count;
+  /** The sum of the values. */
+  unsigned long long sum;
+  /** The largest value. */
+  unsigned long long max;
+} ssdp_histogram_s;
+
+/** The counters and histograms of a thread, alone on their cache lines. */
+typedef struct ssdp_metrics_slot_struct {
+  /** The counters, indexed by ssdp_counter_e. */
+  unsigned long long counters[SSDP_COUNTERS_COUNT];
+  /** The histograms, indexed by ssdp_histogram_e. */
+  ssdp_histogram_s histograms[SSDP_HISTOGRAMS_COUNT];
+} __attribute__((aligned(SSDP_METRICS_CACHE_LINE))) ssdp_metrics_slot_s;
+
+/** A snapshot of all the metrics but the histograms. */
+typedef struct ssdp_metrics_values_struct {
+  /** The counters summed up over all the threads. */
+  unsigned long long counters[SSDP_COUNTERS_COUNT];
+  /** The gauges. */
+  long long gauges[SSDP_GAUGES_COUNT];
+} ssdp_metrics_values_s;
+
+/** Serves the metrics over HTTP (-G), from a thread of its own. */
+typedef struct ssdp_metrics_server_struct {
+  /** The server socket. */
+  SOCKET sock;
+  /** Written to stop the thread. */
+  int wake[2];
+  /** The thread serving the clients. */
+  pthread_t thread;
+  /** The thread was started. */
+  BOOL running;
+} ssdp_metrics_server_s;
+
+/**
+ * Starts dumping the metrics to stderr on SIGUSR1. It has to be called
+ * before any other thread is started, from the main thread (after any
+ * fork()), since SIGUSR1 is blocked in all threads and waited for by one.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_metrics_init(void);
+
+/**
+ * Adds to a counter of the calling thread.
+ *
+ * @param counter The counter.
+ * @param value The value to add.
+ */
+void ssdp_metrics_add(ssdp_counter_e counter, unsigned long long value);
+
+/**
+ * Adds one to a counter of the calling thread.
+ *
+ * @param counter The counter.
+ */
+void ssdp_metrics_inc(ssdp_counter_e counter);
+
+/**
+ * Sets a gauge.
+ *
+ * @param gauge The gauge.
+ * @param value The current value.
+ */
+void ssdp_metrics_set(ssdp_gauge_e gauge, long long value);
+
+/**
+ * Get the time to record latencies with.
+ *
+ * @return The monotonic time in ns.
+ */
+unsigned long long ssdp_metrics_now(void);
+
+/**
+ * Records a latency in a histogram of the calling thread.
+ *
+ * @param histogram The histogram.
+ * @param value The latency (in ns).
+ */
+void ssdp_metrics_record(ssdp_histogram_e histogram,
+    unsigned long long value);
+
+/**
+ * Reads a histogram, summed up over all the threads.
+ *
+ * @param histogram The histogram.
+ * @param values The histogram to fill.
+ */
+void ssdp_metrics_read_histogram(ssdp_histogram_e histogram,
+    ssdp_histogram_s *values);
+
+/**
+ * Gets a percentile of a histogram.
+ *
+ * @param histogram The histogram.
+ * @param percentile The percentile (0-100).
+ *
+ * @return The largest value (in ns) of the bucket of the percentile, 0 if
+ *         the histogram is empty.
+ */
+unsigned long long ssdp_histogram_percentile(const ssdp_histogram_s *histogram,
+    double percentile);
+
+/**
+ * Prints the percentiles of the histograms that have values.
+ *
+ * @param file Where to print them.
+ */
+void ssdp_metrics_print_latencies(FILE *file);
+
+/**
+ * Reads all the metrics, the counters are summed up over all the threads.
+ * The counters of the other threads may be mid-update, every counter is
+ * exact but they are not read at the same instant.
+ *
+ * @param values The snapshot to fill.
+ */
+void ssdp_metrics_read(ssdp_metrics_values_s *values);
+
+/**
+ * Writes all the metrics in the Prometheus text format, the histograms as
+ * summaries (with the SSDP_METRICS_QUANTILES).
+ *
+ * @param buffer The buffer to append to.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_metrics_to_prometheus(string_buffer_s *buffer);
+
+/**
+ * Starts serving the metrics on conf->metrics_address.
+ *
+ * @param server The server to start.
+ * @param conf The global configuration.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_metrics_server_start(ssdp_metrics_server_s *server,
+    configuration_s *conf);
+
+/**
+ * Stops serving the metrics and waits for the thread to end. A server that
+ * was not started (but zeroed) is left as is.
+ *
+ * @param server The server to stop.
+ */
+void ssdp_metrics_server_stop(ssdp_metrics_server_s *server);
+
+#endif /* __SSDP_METRICS_H__ */
@@ -0,0 +1,142 @@
+/** \file ssdp_monitor.h
+ * Header file for ssdp_monitor.c.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_MONITOR_H__
+#define __SSDP_MONITOR_H__
+
+#include <poll.h>
+#include <time.h>
+
+#include "common_definitions.h"
+#include "configuration.h"
+#include "ssdp_common.h"
+#include "ssdp_message.h"
+#include "ssdp_probe_scheduler.h"
+#include "ssdp_prober.h"
+#include "ssdp_scan_policy.h"
+
+/** The number of cycles a device may go unheard before it is removed. */
+#define SSDP_MONITOR_MAX_MISSED 2
+/** How many times the base interval the interval may grow to. */
+#define SSDP_MONITOR_MAX_BACKOFF 8
+/** The part of the devices that has to change to reset the interval. */
+#define SSDP_MONITOR_HIGH_CHURN 0.1
+/** The most probe sockets a monitor has (IPv4 and IPv6). */
+#define SSDP_MONITOR_MAX_FDS 2
+
+/**
+ * The function called for every new response a probe cycle gets.
+ *
+ * @param data The data given to the monitor.
+ * @param ssdp_message The response, owned by the function.
+ */
+typedef void (*ssdp_monitor_callback)(void *data,
+    ssdp_message_s *ssdp_message);
+
+/**
+ * Probes for devices in cycles, for as long as the program runs. The
+ * interval between the cycles adapts to the churn: it is reset when many
+ * devices changed in the last cycle, shortened when a few did and grows
+ * (up to SSDP_MONITOR_MAX_BACKOFF times the base) while nothing changes.
+ */
+typedef struct ssdp_monitor_struct {
+  /** The global configuration. */
+  configuration_s *conf;
+  /** The probe sockets. */
+  ssdp_prober_s prober;
+  /** The schedule of the current cycle. */
+  ssdp_probe_scheduler_s scheduler;
+  /** Decides when the current cycle has ended. */
+  ssdp_scan_policy_s policy;
+  /** A cycle is in progress. */
+  BOOL probing;
+  /** When the responses of the current cycle are due. */
+  struct timespec deadline;
+  /** When the next cycle starts. */
+  struct timespec next_cycle;
+  /** The shortest interval between cycles (in ms). */
+  unsigned long base_interval;
+  /** The current interval between cycles (in ms). */
+  unsigned long interval;
+  /** The number of finished cycles. */
+  unsigned long cycles;
+  /** Reused for every received packet. */
+  ssdp_recv_node_s recv_node;
+  /** The function to pass the responses to. */
+  ssdp_monitor_callback callback;
+  /** The data to pass to the callback. */
+  void *data;
+} ssdp_monitor_s;
+
+/**
+ * Initializes a monitor, the first cycle starts right away. Without a scan
+ * interval (conf->scan_interval of 0) it is the only cycle.
+ *
+ * @param monitor The monitor to initialize.
+ * @param conf The global configuration.
+ * @param callback The function to pass the responses to.
+ * @param data The data to pass to the callback.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_monitor_init(ssdp_monitor_s *monitor, configuration_s *conf,
+    ssdp_monitor_callback callback, void *data);
+
+/**
+ * Fills in the sockets to poll for responses.
+ *
+ * @param monitor The monitor.
+ * @param pfds The array to fill, at least SSDP_MONITOR_MAX_FDS long.
+ *
+ * @return The number of filled in entries.
+ */
+unsigned int ssdp_monitor_fill_pollfds(ssdp_monitor_s *monitor,
+    struct pollfd *pfds);
+
+/**
+ * Returns the time left until the monitor has something to do.
+ *
+ * @param monitor The monitor.
+ *
+ * @return The time left in ms, 0 if it is due now or -1 if the only cycle
+ *         has ended.
+ */
+int ssdp_monitor_timeout(ssdp_monitor_s *monitor);
+
+/**
+ * Starts a cycle when one is due, sends the probes that are due and reads
+ * the responses.
+ *
+ * @param monitor The monitor.
+ * @param pfds The entries filled in by ssdp_monitor_fill_pollfds(), after
+ *        they have been polled.
+ * @param pfds_count The number of entries.
+ *
+ * @return TRUE if a cycle ended, FALSE otherwise.
+ */
+BOOL ssdp_monitor_process(ssdp_monitor_s *monitor, const struct pollfd *pfds,
+    unsigned int pfds_count);
+
+/**
+ * Adapts the interval to the churn of the cycle that ended and schedules
+ * the next cycle.
+ *
+ * @param monitor The monitor.
+ * @param changes The number of devices that appeared, changed or
+ *        disappeared since the last cycle.
+ * @param devices The number of known devices.
+ */
+void ssdp_monitor_cycle_done(ssdp_monitor_s *monitor, unsigned int changes,
+    unsigned int devices);
+
+/**
+ * Frees a monitor and closes its sockets.
+ *
+ * @param monitor The monitor to free.
+ */
+void ssdp_monitor_close(ssdp_monitor_s *monitor);
+
+#endif /* __SSDP_MONITOR_H__ */
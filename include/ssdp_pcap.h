@@ -0,0 +1,37 @@
+/** \file ssdp_pcap.h
+ * Header file for ssdp_pcap.c.
+ *
+ * Reads the SSDP datagrams (UDP to or from port 1900, over IPv4 or IPv6)
+ * out of pcap and pcapng capture files, without libpcap. The supported link
+ * types are Ethernet (with any number of VLAN tags), Linux cooked (v1 and
+ * v2), raw IP and BSD loopback. Fragmented datagrams are skipped.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_PCAP_H__
+#define __SSDP_PCAP_H__
+
+#include "common_definitions.h"
+#include "ssdp_journal.h"
+
+/** The port SSDP datagrams are sent to or from. */
+#define SSDP_PCAP_PORT 1900
+
+/**
+ * Reads the SSDP datagrams of a capture file, in the order they were
+ * captured and as fast as the callback takes them. Every datagram is passed
+ * as a journal record (see ssdp_journal.h), so captures are replayed like
+ * journals.
+ *
+ * @param path The capture file (pcap or pcapng).
+ * @param callback The function to call for every datagram.
+ * @param data Passed to the callback.
+ *
+ * @return TRUE on success, FALSE if the file could not be read or is not a
+ *         capture (the datagrams read so far have been passed on).
+ */
+BOOL ssdp_pcap_read(const char *path, ssdp_journal_replay_cb callback,
+    void *data);
+
+#endif /* __SSDP_PCAP_H__ */
@@ -0,0 +1,215 @@
+/** \file ssdp_probe_scheduler.h
+ * Header file for ssdp_probe_scheduler.c.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_PROBE_SCHEDULER_H__
+#define __SSDP_PROBE_SCHEDULER_H__
+
+#include <stdio.h>
+#include <sys/socket.h> /* struct sockaddr_storage */
+#include <time.h>
+
+#include "common_definitions.h"
+#include "net_definitions.h"
+#include "ssdp_message.h"
+#include "string_buffer.h"
+
+/** The search target used when none is given. */
+#define SSDP_PROBE_DEFAULT_TARGET "ssdp:all"
+/** The maximum number of search targets probed at once. */
+#define SSDP_PROBE_MAX_TARGETS 16
+/** The maximum number of multicast groups probed at once. */
+#define SSDP_PROBE_MAX_DESTINATIONS 4
+/** How many times every M-SEARCH is resent by default. */
+#define SSDP_PROBE_DEFAULT_RETRANSMITS 2
+/** The default send rate (M-SEARCH packets per second). */
+#define SSDP_PROBE_DEFAULT_RATE 50
+/** The time (in ms) between two sends of the same M-SEARCH. */
+#define SSDP_PROBE_RETRANSMIT_INTERVAL 300
+/** The maximum random delay (in ms) added to every retransmission. */
+#define SSDP_PROBE_MAX_JITTER 100
+/** The time (in ms) responses are waited for after the MX delay. */
+#define SSDP_PROBE_DEADLINE_GRACE 500
+
+/** A search target (ST) and the responses it got. */
+typedef struct ssdp_probe_target_struct {
+  /** The search target (interned). */
+  const char *st;
+  /** The number of M-SEARCH packets sent for the target. */
+  unsigned int sent;
+  /** The number of responses, including repeated ones. */
+  unsigned int responses;
+  /** The number of distinct devices that responded. */
+  unsigned int devices;
+  /** The time (in ms) until the first response, -1 if none. */
+  long first_response;
+} ssdp_probe_target_s;
+
+/** A multicast group the M-SEARCH packets are sent to. */
+typedef struct ssdp_probe_destination_struct {
+  /** The socket to send with. */
+  SOCKET sock;
+  /** The group address and port. */
+  struct sockaddr_storage addr;
+  /** The length of the address. */
+  socklen_t addr_length;
+  /** The value of the HOST header. */
+  char host[IPv6_STR_MAX_SIZE + 8];
+} ssdp_probe_destination_s;
+
+/** A scheduled M-SEARCH send. */
+typedef struct ssdp_probe_send_struct {
+  /** The index of the search target. */
+  unsigned char target;
+  /** The index of the destination. */
+  unsigned char destination;
+  /** When to send (in us since the start). */
+  long due;
+} ssdp_probe_send_s;
+
+/** A set of interned string tuples, used to recognize repeated answers. */
+typedef struct ssdp_probe_seen_struct {
+  /** The tuples, two pointers each. */
+  const char **entries;
+  /** The number of tuples in the set. */
+  unsigned int count;
+  /** The number of tuple slots. */
+  unsigned int capacity;
+} ssdp_probe_seen_s;
+
+/**
+ * Sends M-SEARCH packets for several search targets to several multicast
+ * groups. Every packet is resent a number of times with a random delay,
+ * because UDP loss would otherwise hide devices, and all the sends are paced
+ * to a maximum rate so that big target lists do not flood the network.
+ */
+typedef struct ssdp_probe_scheduler_struct {
+  /** The search targets. */
+  ssdp_probe_target_s targets[SSDP_PROBE_MAX_TARGETS];
+  /** The number of search targets. */
+  unsigned int target_count;
+  /** The multicast groups. */
+  ssdp_probe_destination_s destinations[SSDP_PROBE_MAX_DESTINATIONS];
+  /** The number of multicast groups. */
+  unsigned int destination_count;
+  /** How many times every M-SEARCH is resent. */
+  unsigned int retransmits;
+  /** The maximum number of sends per second, 0 for no limit. */
+  unsigned int rate;
+  /** The MX value (in seconds) of the M-SEARCH packets. */
+  unsigned int mx;
+  /** The sends ordered by when they are due. */
+  ssdp_probe_send_s *sends;
+  /** The number of sends. */
+  unsigned int send_count;
+  /** The next send to do. */
+  unsigned int next_send;
+  /** When the first send was scheduled. */
+  struct timespec start;
+  /** Used for composing the M-SEARCH packets. */
+  string_buffer_s message;
+  /** The (IP, USN) tuples already answered. */
+  ssdp_probe_seen_s seen_responses;
+  /** The (IP, search target) tuples already counted. */
+  ssdp_probe_seen_s seen_devices;
+  /** The IPs that have responded, the second string is always NULL. */
+  ssdp_probe_seen_s seen_hosts;
+} ssdp_probe_scheduler_s;
+
+/**
+ * Initializes a probe scheduler.
+ *
+ * @param scheduler The scheduler to initialize.
+ * @param targets A comma separated list of search targets, NULL probes for
+ *        SSDP_PROBE_DEFAULT_TARGET.
+ * @param retransmits How many times every M-SEARCH is resent.
+ * @param rate The maximum number of sends per second, 0 for no limit.
+ * @param mx The MX value (in seconds) to use, clamped to 1-5.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_probe_scheduler_init(ssdp_probe_scheduler_s *scheduler,
+    const char *targets, unsigned int retransmits, unsigned int rate,
+    unsigned int mx);
+
+/**
+ * Adds a multicast group to send the M-SEARCH packets to.
+ *
+ * @param scheduler The scheduler to add the group to.
+ * @param sock The socket to send with, its family has to match the group.
+ * @param group The IPv4 or IPv6 multicast group address.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_probe_scheduler_add_destination(ssdp_probe_scheduler_s *scheduler,
+    SOCKET sock, const char *group);
+
+/**
+ * Schedules all the sends, starting now.
+ *
+ * @param scheduler The scheduler to start.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_probe_scheduler_start(ssdp_probe_scheduler_s *scheduler);
+
+/**
+ * Returns the time left until the next send is due.
+ *
+ * @param scheduler The scheduler to check.
+ *
+ * @return The time left in ms, 0 if it is due now or -1 if everything has
+ *         been sent.
+ */
+int ssdp_probe_scheduler_timeout(ssdp_probe_scheduler_s *scheduler);
+
+/**
+ * Calculates when the last response can be expected, that is the MX delay
+ * (plus SSDP_PROBE_DEADLINE_GRACE) after the last scheduled send.
+ *
+ * @param scheduler The started scheduler.
+ * @param deadline The point in time (CLOCK_MONOTONIC) to fill.
+ */
+void ssdp_probe_scheduler_deadline(ssdp_probe_scheduler_s *scheduler,
+    struct timespec *deadline);
+
+/**
+ * Does all the sends that are due.
+ *
+ * @param scheduler The scheduler to send with.
+ *
+ * @return The number of packets sent.
+ */
+unsigned int ssdp_probe_scheduler_send(ssdp_probe_scheduler_s *scheduler);
+
+/**
+ * Counts a response to the statistics of the search target it answers.
+ *
+ * @param scheduler The scheduler that sent the search.
+ * @param ssdp_message The response.
+ *
+ * @return FALSE if the same device already gave the same answer (to an
+ *         earlier copy of the M-SEARCH), TRUE otherwise.
+ */
+BOOL ssdp_probe_scheduler_account(ssdp_probe_scheduler_s *scheduler,
+    const ssdp_message_s *ssdp_message);
+
+/**
+ * Prints the per search target statistics.
+ *
+ * @param scheduler The scheduler to print the statistics of.
+ * @param stream The stream to print to.
+ */
+void ssdp_probe_scheduler_print_stats(ssdp_probe_scheduler_s *scheduler,
+    FILE *stream);
+
+/**
+ * Frees the resources of a probe scheduler, the sockets are not closed.
+ *
+ * @param scheduler The scheduler to free.
+ */
+void ssdp_probe_scheduler_close(ssdp_probe_scheduler_s *scheduler);
+
+#endif /* __SSDP_PROBE_SCHEDULER_H__ */
@@ -14,7 +14,11 @@
 
 /** A container struct for the SSDP prober. */
 typedef struct ssdp_prober_s {
+  /** The IPv4 socket, probes are sent and answered on it. */
   SOCKET sock;
+  /** The IPv6 socket, SOCKET_ERROR unless IPv6 is used. */
+  SOCKET sock6;
+  /** The forward address where results will be sent. */
   struct sockaddr_storage forwarder;
 } ssdp_prober_s;
 
@@ -0,0 +1,138 @@
+/** \file ssdp_scan_policy.h
+ * Header file for ssdp_scan_policy.c.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_SCAN_POLICY_H__
+#define __SSDP_SCAN_POLICY_H__
+
+#include <stdio.h>
+#include <time.h>
+
+#include "common_definitions.h"
+
+/** The number of response gaps needed before the scan can end early. */
+#define SSDP_SCAN_POLICY_MIN_GAPS 3
+/** The shortest silence (in ms) that ends a scan early. */
+#define SSDP_SCAN_POLICY_MIN_QUIET 150
+/** How many mean deviations above the mean gap counts as silence. */
+#define SSDP_SCAN_POLICY_QUIET_DEVIATIONS 4
+/** The part (in percent) of the MX window that passes before silence can
+    end a scan, devices pick their answer time at random over all of it. */
+#define SSDP_SCAN_POLICY_MIN_WINDOW 75
+
+/** Why a scan ended. */
+typedef enum ssdp_scan_end_enum {
+  /** The scan has not ended. */
+  SSDP_SCAN_END_NONE,
+  /** The MX delay after the last probe passed. */
+  SSDP_SCAN_END_DEADLINE,
+  /** The responses stopped arriving. */
+  SSDP_SCAN_END_QUIET,
+  /** The expected number of devices answered. */
+  SSDP_SCAN_END_EXPECTED
+} ssdp_scan_end_e;
+
+/**
+ * Decides when an active scan is complete. Devices spread their answers
+ * over the MX delay, so instead of always waiting it out the gaps between
+ * the first answers of the devices are tracked (a smoothed mean and mean
+ * deviation) and, if the policy is adaptive, the scan ends once most of
+ * the MX window has passed and the silence is far longer than a normal gap.
+ * It also ends as soon as the expected number of devices has answered.
+ */
+typedef struct ssdp_scan_policy_struct {
+  /** End the scan when the responses stop arriving. */
+  BOOL adaptive;
+  /** The number of devices to wait for, 0 if not known. */
+  unsigned int expected;
+  /** The number of responses, including repeated ones. */
+  unsigned long responses;
+  /** The number of devices that answered. */
+  unsigned long devices;
+  /** The number of responses received after the scan ended. */
+  unsigned long late;
+  /** The number of measured gaps between responses. */
+  unsigned int gaps;
+  /** The weighted mean gap (in ms). */
+  double gap_mean;
+  /** The weighted mean deviation of the gaps (in ms). */
+  double gap_deviation;
+  /** When the scan started. */
+  struct timespec start;
+  /** When the last device answered for the first time. */
+  struct timespec last_response;
+  /** The time (in ms since the start) until the MX deadline. */
+  long window;
+  /** When the scan ended. */
+  struct timespec end;
+  /** The time (in ms since the start) the MX deadline was at. */
+  long deadline;
+  /** Why the scan ended. */
+  ssdp_scan_end_e reason;
+} ssdp_scan_policy_s;
+
+/**
+ * Initializes a scan policy and starts its clock.
+ *
+ * @param policy The policy to initialize.
+ * @param adaptive End the scan when the responses stop arriving.
+ * @param expected The number of devices to wait for, 0 if not known.
+ * @param window The time (in ms) until the MX deadline.
+ */
+void ssdp_scan_policy_init(ssdp_scan_policy_s *policy, BOOL adaptive,
+    unsigned int expected, long window);
+
+/**
+ * Records the arrival of a response, after the scan ended it is counted
+ * as late. Devices answer with a burst of datagrams (one per type and
+ * service) for every copy of a probe, so only the first answer of each
+ * device is a gap in the arrivals.
+ *
+ * @param policy The policy to update.
+ * @param new_device The response is the first one from its device.
+ */
+void ssdp_scan_policy_response(ssdp_scan_policy_s *policy,
+    BOOL new_device);
+
+/**
+ * Returns the time left until the responses count as stopped.
+ *
+ * @param policy The policy to check.
+ *
+ * @return The time left in ms, 0 if they have stopped or -1 if too few
+ *         devices answered to tell (or the policy is not adaptive).
+ */
+int ssdp_scan_policy_timeout(ssdp_scan_policy_s *policy);
+
+/**
+ * Checks if the expected number of devices has answered.
+ *
+ * @param policy The policy to check.
+ * @param devices The number of distinct devices that answered.
+ *
+ * @return TRUE if the scan is complete, FALSE otherwise.
+ */
+BOOL ssdp_scan_policy_has_expected(ssdp_scan_policy_s *policy,
+    unsigned int devices);
+
+/**
+ * Ends the scan, the responses received after this are late.
+ *
+ * @param policy The policy to end.
+ * @param reason Why the scan ended.
+ * @param deadline The time left until the MX deadline (in ms).
+ */
+void ssdp_scan_policy_end(ssdp_scan_policy_s *policy, ssdp_scan_end_e reason,
+    long deadline);
+
+/**
+ * Prints how long the scan took, why it ended and the late responses.
+ *
+ * @param policy The ended policy.
+ * @param stream The stream to print to.
+ */
+void ssdp_scan_policy_print_stats(ssdp_scan_policy_s *policy, FILE *stream);
+
+#endif /* __SSDP_SCAN_POLICY_H__ */
@@ -0,0 +1,145 @@
+/** \file ssdp_server.h
+ * Header file for ssdp_server.c.
+ *
+ * The server (-S) answers HTTP/1.0 requests on DAEMON_PORT with the devices
+ * in the listener's table, without sending any searches:
+ *
+ *     GET /devices[?<parameter>=<value>[&...]] HTTP/1.0
+ *
+ * The (URL-encoded) parameters are:
+ *
+ *     format=xml|json|binary  The format of the response body, the default
+ *                             is the one set with -j, -x or -b (else XML).
+ *     filter=<filters>        Only the devices matching the filters, in the
+ *                             same syntax as -f.
+ *     since=<time>            Only the devices that were added or changed at
+ *                             or after <time>.
+ *
+ * Every response has an X-Abused-Time header with the time (in ms since the
+ * epoch) of the table snapshot it was built from, to pass as since=<time> in
+ * the next request. The snapshots lag the table by up to
+ * SSDP_SNAPSHOT_INTERVAL ms. A response
+ * to a since request also has an X-Abused-Delta header. If it is "yes" the
+ * response only holds the changed devices and the X-Abused-Removed header
+ * lists the IPs of the devices that were removed (apply the removals first).
+ * If it is "no" the server could not tell what was removed since then and
+ * the response holds all the devices.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_SERVER_H__
+#define __SSDP_SERVER_H__
+
+#include <time.h>
+
+#include "common_definitions.h"
+#include "configuration.h"
+#include "event_loop.h"
+#include "ssdp_snapshot.h"
+#include "string_buffer.h"
+
+/** The most clients served at once, the rest are turned away. */
+#define SSDP_SERVER_MAX_CLIENTS 256
+/** The largest request (line and headers) accepted. */
+#define SSDP_SERVER_MAX_REQUEST 4096
+/** The time (in ms) a client has to send its request and read the answer. */
+#define SSDP_SERVER_CLIENT_TIMEOUT 5000
+/** The queue length of the server socket. */
+#define SSDP_SERVER_LISTEN_QUEUE 64
+/** How often (in ms) the clients are served where epoll is not available. */
+#define SSDP_SERVER_POLL_INTERVAL 50
+
+struct ssdp_server_struct;
+
+/** A connected client. */
+typedef struct ssdp_server_client_struct {
+  /** The server the client is connected to. */
+  struct ssdp_server_struct *server;
+  /** The client connection. */
+  SOCKET sock;
+  /** The request received so far. */
+  string_buffer_s request;
+  /** The response, once the request is complete. */
+  string_buffer_s response;
+  /** The number of response bytes sent. */
+  size_t response_sent;
+  /** The request is complete and the response is being sent. */
+  BOOL responding;
+  /** When the client connected. */
+  struct timespec connected;
+  /** The next client in the list. */
+  struct ssdp_server_client_struct *next;
+} ssdp_server_client_s;
+
+/**
+ * Serves the snapshots of a SSDP cache to any number of clients at once. The
+ * server runs its own event loop, which is nested in the caller's poll()
+ * through ssdp_server_fd(). It never touches the cache itself, so it does not
+ * have to run in the thread that owns it.
+ */
+typedef struct ssdp_server_struct {
+  /** The global configuration. */
+  configuration_s *conf;
+  /** Waits for the server socket and the clients. */
+  event_loop_s loop;
+  /** The server socket. */
+  SOCKET sock;
+  /** The snapshots of the table to serve. */
+  ssdp_snapshots_s *snapshots;
+  /** The reader slot of the server. */
+  int reader;
+  /** The connected clients. */
+  ssdp_server_client_s *clients;
+  /** The number of connected clients. */
+  unsigned int clients_count;
+} ssdp_server_s;
+
+/**
+ * Initializes a server and starts listening on DAEMON_PORT.
+ *
+ * @param server The server to initialize.
+ * @param conf The global configuration.
+ * @param snapshots The snapshots of the table to serve.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_server_init(ssdp_server_s *server, configuration_s *conf,
+    ssdp_snapshots_s *snapshots);
+
+/**
+ * Returns a file descriptor that is readable when the server has something
+ * to do.
+ *
+ * @param server The server.
+ *
+ * @return The file descriptor, or -1 if the server has to be processed
+ *         every ssdp_server_timeout() instead.
+ */
+int ssdp_server_fd(ssdp_server_s *server);
+
+/**
+ * Returns the time left until a client times out.
+ *
+ * @param server The server.
+ *
+ * @return The time left in ms, or -1 if there are no clients.
+ */
+int ssdp_server_timeout(ssdp_server_s *server);
+
+/**
+ * Accepts the new clients, answers the complete requests and drops the
+ * clients that timed out. It does not block.
+ *
+ * @param server The server.
+ */
+void ssdp_server_process(ssdp_server_s *server);
+
+/**
+ * Disconnects all the clients and closes the server.
+ *
+ * @param server The server to close.
+ */
+void ssdp_server_close(ssdp_server_s *server);
+
+#endif /* __SSDP_SERVER_H__ */
@@ -0,0 +1,202 @@
+/** \file ssdp_snapshot.h
+ * Header file for ssdp_snapshot.c.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_SNAPSHOT_H__
+#define __SSDP_SNAPSHOT_H__
+
+#include <time.h>
+
+#include "common_definitions.h"
+#include "ssdp_cache.h"
+#include "ssdp_message.h"
+
+/** The most readers that can be registered at once. */
+#define SSDP_SNAPSHOT_MAX_READERS 16
+/** The shortest time (in ms) between two published snapshots. */
+#define SSDP_SNAPSHOT_INTERVAL 100
+/** The number of removed devices remembered for the readers. */
+#define SSDP_SNAPSHOT_MAX_REMOVED 256
+/** The size of a cache line, the reader slots do not share lines. */
+#define SSDP_SNAPSHOT_CACHE_LINE 64
+
+/** An immutable copy of a device, shared by the snapshots it is in. */
+typedef struct ssdp_snapshot_entry_struct {
+  /** The copy of the message. */
+  ssdp_message_s *ssdp_message;
+  /** When the device was added or last changed (see ssdp_cache_now()). */
+  unsigned long long changed;
+  /** The number of snapshots holding the entry (only the writer uses it). */
+  unsigned int refs;
+  /** The last snapshot the device was in (only the writer uses it). */
+  unsigned long generation;
+} ssdp_snapshot_entry_s;
+
+/** A device removed from the table. */
+typedef struct ssdp_snapshot_removed_struct {
+  /** The (interned) IP of the device. */
+  const char *ip;
+  /** When it was removed (see ssdp_cache_now()). */
+  unsigned long long time;
+} ssdp_snapshot_removed_s;
+
+/** A consistent, immutable view of the device table. */
+typedef struct ssdp_snapshot_struct {
+  /** The number of the snapshot, counting from 1. */
+  unsigned long generation;
+  /** When the snapshot was taken (see ssdp_cache_now()). */
+  unsigned long long time;
+  /** The number of devices. */
+  unsigned int count;
+  /** The devices, in the order of the table. */
+  ssdp_snapshot_entry_s **entries;
+  /** The last removed devices, oldest first. */
+  ssdp_snapshot_removed_s *removed;
+  /** The number of removed devices. */
+  unsigned int removed_count;
+  /** All the devices removed since this time are in removed. */
+  unsigned long long complete_since;
+  /** The epoch the snapshot was replaced in. */
+  unsigned long retired_epoch;
+  /** The next replaced snapshot waiting to be freed. */
+  struct ssdp_snapshot_struct *next_retired;
+} ssdp_snapshot_s;
+
+/** A reader slot, on a cache line of its own. */
+typedef struct ssdp_snapshot_reader_struct {
+  /** The epoch the reader entered in, 0 when it is not reading. */
+  unsigned long epoch;
+  /** The slot is taken. */
+  int used;
+  /** Fills the rest of the cache line. */
+  char padding[SSDP_SNAPSHOT_CACHE_LINE - sizeof(unsigned long) -
+      sizeof(int)];
+} ssdp_snapshot_reader_s;
+
+/**
+ * Publishes snapshots of a SSDP cache to readers, which may run in other
+ * threads, without locks (epoch based reclamation). The writer (the thread
+ * owning the cache) publishes a new snapshot after the cache has changed,
+ * copying only the devices that changed since the last one. Readers enter,
+ * use the current snapshot and leave. A replaced snapshot is freed by the
+ * writer once every reader that could still see it has left, so the writer
+ * never waits for a reader.
+ */
+typedef struct ssdp_snapshots_struct {
+  /** The current snapshot (accessed atomically). */
+  ssdp_snapshot_s *current;
+  /** The current epoch, starting at 1 (accessed atomically). */
+  unsigned long epoch;
+  /** The reader slots (accessed atomically). */
+  ssdp_snapshot_reader_s readers[SSDP_SNAPSHOT_MAX_READERS];
+  /** The replaced snapshots that may still be in use. */
+  ssdp_snapshot_s *retired;
+  /** The last removed devices (a ring). */
+  ssdp_snapshot_removed_s removed[SSDP_SNAPSHOT_MAX_REMOVED];
+  /** The index of the oldest removed device. */
+  unsigned int removed_first;
+  /** The number of removed devices remembered. */
+  unsigned int removed_count;
+  /** All the removals since this time are remembered. */
+  unsigned long long complete_since;
+  /** The cache has changed since the last snapshot. */
+  BOOL dirty;
+  /** When the last snapshot was published. */
+  struct timespec published;
+} ssdp_snapshots_s;
+
+/**
+ * Initializes the snapshots of a cache and publishes an empty one.
+ *
+ * @param snapshots The snapshots to initialize.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_snapshots_init(ssdp_snapshots_s *snapshots);
+
+/**
+ * Registers a reader.
+ *
+ * @param snapshots The snapshots to read.
+ *
+ * @return The reader slot, -1 if all the slots are taken.
+ */
+int ssdp_snapshots_register(ssdp_snapshots_s *snapshots);
+
+/**
+ * Unregisters a reader, it must not be reading.
+ *
+ * @param snapshots The snapshots.
+ * @param reader The reader slot.
+ */
+void ssdp_snapshots_unregister(ssdp_snapshots_s *snapshots, int reader);
+
+/**
+ * Starts reading the current snapshot, it stays valid until
+ * ssdp_snapshots_leave() is called. Never blocks.
+ *
+ * @param snapshots The snapshots.
+ * @param reader The reader slot.
+ *
+ * @return The current snapshot.
+ */
+const ssdp_snapshot_s *ssdp_snapshots_enter(ssdp_snapshots_s *snapshots,
+    int reader);
+
+/**
+ * Stops reading the snapshot returned by ssdp_snapshots_enter().
+ *
+ * @param snapshots The snapshots.
+ * @param reader The reader slot.
+ */
+void ssdp_snapshots_leave(ssdp_snapshots_s *snapshots, int reader);
+
+/**
+ * Tells the writer that the cache has changed.
+ *
+ * @param snapshots The snapshots.
+ */
+void ssdp_snapshots_changed(ssdp_snapshots_s *snapshots);
+
+/**
+ * Returns the time left until a new snapshot is due.
+ *
+ * @param snapshots The snapshots.
+ *
+ * @return The time left in ms, 0 if it is due now or -1 if the cache has
+ *         not changed.
+ */
+int ssdp_snapshots_timeout(ssdp_snapshots_s *snapshots);
+
+/**
+ * Publishes a new snapshot if one is due and frees the replaced snapshots
+ * no reader uses anymore. Only the writer may call it.
+ *
+ * @param snapshots The snapshots.
+ * @param ssdp_cache The cache, NULL if it is empty.
+ */
+void ssdp_snapshots_update(ssdp_snapshots_s *snapshots,
+    ssdp_cache_s *ssdp_cache);
+
+/**
+ * Publishes a new snapshot right away. Only the writer may call it.
+ *
+ * @param snapshots The snapshots.
+ * @param ssdp_cache The cache, NULL if it is empty.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_snapshots_publish(ssdp_snapshots_s *snapshots,
+    ssdp_cache_s *ssdp_cache);
+
+/**
+ * Frees all the snapshots, there must be no readers left. The cache must
+ * not be published again.
+ *
+ * @param snapshots The snapshots to free.
+ */
+void ssdp_snapshots_close(ssdp_snapshots_s *snapshots);
+
+#endif /* __SSDP_SNAPSHOT_H__ */
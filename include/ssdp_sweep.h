@@ -0,0 +1,121 @@
+/** \file ssdp_sweep.h
+ * Header file for ssdp_sweep.c.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __SSDP_SWEEP_H__
+#define __SSDP_SWEEP_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "common_definitions.h"
+#include "ssdp_probe_scheduler.h"
+#include "string_buffer.h"
+
+/** The default sweep rate (unicast M-SEARCH packets per second). */
+#define SSDP_SWEEP_DEFAULT_RATE 500
+/** The maximum number of address ranges swept at once. */
+#define SSDP_SWEEP_MAX_RANGES 32
+/** The time (in ms) answers are waited for after the last unicast send. */
+#define SSDP_SWEEP_ANSWER_WAIT 1000
+
+/** An inclusive range of IPv4 addresses (in host byte order). */
+typedef struct ssdp_sweep_range_struct {
+  /** The first address. */
+  uint32_t first;
+  /** The last address. */
+  uint32_t last;
+} ssdp_sweep_range_s;
+
+/**
+ * Sends a unicast M-SEARCH to every address of a set of CIDR ranges, for
+ * networks where the multicast probes are not routed. The sends are paced
+ * with a token bucket so that big ranges do not flood the network.
+ */
+typedef struct ssdp_sweep_struct {
+  /** The ranges to sweep. */
+  ssdp_sweep_range_s ranges[SSDP_SWEEP_MAX_RANGES];
+  /** The number of ranges. */
+  unsigned int range_count;
+  /** The range currently swept. */
+  unsigned int range;
+  /** The next address to send to. */
+  uint32_t next;
+  /** The next search target to send for the next address. */
+  unsigned int target;
+  /** The number of addresses in all the ranges. */
+  unsigned long total;
+  /** The number of addresses swept. */
+  unsigned long swept;
+  /** The sends per second. */
+  unsigned int rate;
+  /** The number of sends available right now. */
+  double tokens;
+  /** The maximum number of tokens (the largest burst). */
+  double burst;
+  /** When the tokens were last refilled. */
+  struct timespec last_refill;
+  /** When the sweep started. */
+  struct timespec start;
+  /** When the last address was swept. */
+  struct timespec end;
+  /** Used for composing the M-SEARCH packets. */
+  string_buffer_s message;
+} ssdp_sweep_s;
+
+/**
+ * Initializes a sweep.
+ *
+ * @param sweep The sweep to initialize.
+ * @param ranges A comma separated list of IPv4 CIDR ranges (a.b.c.d/n), an
+ *        address without a prefix length is a single address.
+ * @param rate The maximum number of sends per second.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL ssdp_sweep_init(ssdp_sweep_s *sweep, const char *ranges,
+    unsigned int rate);
+
+/**
+ * Returns the time left until the next send is allowed.
+ *
+ * @param sweep The sweep to check.
+ *
+ * @return The time left in ms, 0 if a send is allowed now or -1 if every
+ *         address has been swept.
+ */
+int ssdp_sweep_timeout(ssdp_sweep_s *sweep);
+
+/**
+ * Sends as many M-SEARCH packets as the rate allows. Every address gets one
+ * packet per search target.
+ *
+ * @param sweep The sweep to continue.
+ * @param sock The non-blocking IPv4 socket to send with.
+ * @param targets The search targets, their send counters are updated.
+ * @param target_count The number of search targets.
+ *
+ * @return The number of packets sent.
+ */
+unsigned int ssdp_sweep_send(ssdp_sweep_s *sweep, SOCKET sock,
+    ssdp_probe_target_s *targets, unsigned int target_count);
+
+/**
+ * Prints how many addresses were swept and how long it took.
+ *
+ * @param sweep The sweep to print the progress of.
+ * @param stream The stream to print to.
+ */
+void ssdp_sweep_print_stats(ssdp_sweep_s *sweep, FILE *stream);
+
+/**
+ * Frees the resources of a sweep.
+ *
+ * @param sweep The sweep to free.
+ */
+void ssdp_sweep_close(ssdp_sweep_s *sweep);
+
+#endif /* __SSDP_SWEEP_H__ */
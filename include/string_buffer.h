@@ -0,0 +1,104 @@
+/** \file string_buffer.h
+ * Header file for string_buffer.c.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __STRING_BUFFER_H__
+#define __STRING_BUFFER_H__
+
+#include <stddef.h>
+
+#include "common_definitions.h"
+
+/**
+ * A growable output buffer. The data is always null-terminated so it can be
+ * passed on as a regular string.
+ */
+typedef struct string_buffer_struct {
+  /** The buffer data. */
+  char *data;
+  /** The number of bytes used (excluding the null-terminator). */
+  size_t length;
+  /** The allocated size of the data. */
+  size_t size;
+} string_buffer_s;
+
+/**
+ * Initializes a string buffer.
+ *
+ * @param buffer The buffer to initialize.
+ * @param initial_size The number of bytes to allocate up-front.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL string_buffer_init(string_buffer_s *buffer, size_t initial_size);
+
+/**
+ * Frees the data of a string buffer.
+ *
+ * @param buffer The buffer to free.
+ */
+void string_buffer_free(string_buffer_s *buffer);
+
+/**
+ * Empties a string buffer but keeps its allocation for reuse.
+ *
+ * @param buffer The buffer to empty.
+ */
+void string_buffer_reset(string_buffer_s *buffer);
+
+/**
+ * Makes sure there is room for extra bytes in the buffer, growing it if
+ * needed.
+ *
+ * @param buffer The buffer to grow.
+ * @param extra The number of bytes needed.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL string_buffer_reserve(string_buffer_s *buffer, size_t extra);
+
+/**
+ * Appends bytes to the buffer.
+ *
+ * @param buffer The buffer to append to.
+ * @param data The data to append.
+ * @param length The number of bytes to append.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL string_buffer_append(string_buffer_s *buffer, const char *data,
+    size_t length);
+
+/**
+ * Appends a null-terminated string to the buffer.
+ *
+ * @param buffer The buffer to append to.
+ * @param string The string to append.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL string_buffer_append_str(string_buffer_s *buffer, const char *string);
+
+/**
+ * Appends a single character to the buffer.
+ *
+ * @param buffer The buffer to append to.
+ * @param c The character to append.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL string_buffer_append_char(string_buffer_s *buffer, char c);
+
+/**
+ * Appends the decimal representation of a number to the buffer.
+ *
+ * @param buffer The buffer to append to.
+ * @param value The number to append.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+BOOL string_buffer_append_uint(string_buffer_s *buffer, unsigned long value);
+
+#endif /* __STRING_BUFFER_H__ */
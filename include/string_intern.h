@@ -0,0 +1,68 @@
+/** \file string_intern.h
+ * Header file for string_intern.c.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#ifndef __STRING_INTERN_H__
+#define __STRING_INTERN_H__
+
+#include <stddef.h>
+
+/**
+ * Interns a string. Identical strings share the same storage, so two
+ * interned strings are equal if, and only if, their pointers are equal.
+ * Every call takes a reference that must be given back with
+ * string_intern_release().
+ *
+ * @param string The string to intern.
+ *
+ * @return The interned (read-only) string or NULL if out of memory.
+ */
+const char *string_intern(const char *string);
+
+/**
+ * Interns the first length characters of a string (the string does not need
+ * to be null-terminated).
+ *
+ * @param string The string to intern.
+ * @param length The number of characters to intern.
+ *
+ * @return The interned (read-only) string or NULL if out of memory.
+ */
+const char *string_intern_n(const char *string, size_t length);
+
+/**
+ * Takes an extra reference to an already interned string.
+ *
+ * @param interned The interned string to reference.
+ *
+ * @return The same interned string.
+ */
+const char *string_intern_ref(const char *interned);
+
+/**
+ * Gives back a reference to an interned string. The storage is freed when
+ * the last reference is released.
+ *
+ * @param interned The interned string to release, NULL is ignored.
+ */
+void string_intern_release(const char *interned);
+
+/**
+ * Returns the length of an interned string without scanning it.
+ *
+ * @param interned The interned string.
+ *
+ * @return The length of the string.
+ */
+size_t string_intern_length(const char *interned);
+
+/**
+ * Returns the number of distinct strings currently interned.
+ *
+ * @return The number of distinct interned strings.
+ */
+unsigned int string_intern_count(void);
+
+#endif /* __STRING_INTERN_H__ */
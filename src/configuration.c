@@ -4,6 +4,7 @@
  * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
  */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -13,7 +14,15 @@
 #include "configuration.h"
 #include "log.h"
 #include "net_utils.h"
+#include "ssdp_cache_display.h"
+#include "ssdp_checkpoint.h"
+#include "ssdp_event_stream.h"
+#include "ssdp_journal.h"
 #include "ssdp_message.h"
+#include "ssdp_metrics.h"
+#include "ssdp_probe_scheduler.h"
+#include "ssdp_scan_policy.h"
+#include "ssdp_sweep.h"
 
 void set_default_configuration(configuration_s *c) {
 
@@ -23,14 +32,19 @@ void set_default_configuration(configuration_s *c) {
   c->run_as_daemon         = FALSE;
   c->run_as_server         = FALSE;
   c->listen_for_upnp_notif = FALSE;
-  c->scan_for_upnp_devices = TRUE;
+  c->scan_for_upnp_devices = FALSE;
   c->forward_address       = NULL;
   c->ssdp_cache_size       = 10;
+  c->resync_interval       = 0;
   c->fetch_info            = TRUE;
   c->json_output           = FALSE;
   c->xml_output            = FALSE;
+  c->binary_output         = FALSE;
+  c->event_stream_output   = FALSE;
+  c->event_flush_interval  = SSDP_EVENT_STREAM_FLUSH_INTERVAL;
   c->oneline_output        = TRUE;
   c->monochrome            = FALSE;
+  c->display_fps           = DISPLAY_DEFAULT_FPS;
   c->ttl                   = 64;
   c->filter                = NULL;
   c->ignore_search_msgs    = TRUE;
@@ -38,6 +52,25 @@ void set_default_configuration(configuration_s *c) {
   c->use_ipv6              = FALSE;
   c->quiet_mode            = FALSE;
   c->upnp_timeout          = MULTICAST_TIMEOUT;
+  c->search_targets        = NULL;
+  c->probe_retransmits     = SSDP_PROBE_DEFAULT_RETRANSMITS;
+  c->probe_rate            = SSDP_PROBE_DEFAULT_RATE;
+  c->sweep_ranges          = NULL;
+  c->sweep_rate            = SSDP_SWEEP_DEFAULT_RATE;
+  c->adaptive_scan         = FALSE;
+  c->expected_devices      = 0;
+  c->scan_interval         = 0;
+  c->checkpoint_file       = NULL;
+  c->journal_directory     = NULL;
+  c->journal_retention     = SSDP_JOURNAL_DEFAULT_RETENTION;
+  c->journal_replay        = FALSE;
+  c->replay_from           = 0;
+  c->replay_to             = ULLONG_MAX;
+  c->pcap_file             = NULL;
+  c->offline               = FALSE;
+  c->replay_paced          = FALSE;
+  c->metrics_address       = NULL;
+  c->log_level             = LOG_LEVEL_DEFAULT;
   c->enable_loopback       = FALSE;
 }
 
@@ -53,20 +86,68 @@ void usage(void) {
   printf("\t                  for -u and -U where you can specify a list of\n");
   printf("\t                  comma separated filters\n");
   printf("\t-M                Don't ignore UPnP M-SEARCH messages\n");
-  printf("\t-S                Run as a server,\n");
-  printf("\t                  listens on port 43210 and returns a\n");
-  printf("\t                  UPnP scan result (formatted list) for AXIS devices\n");
-  printf("\t                  upon receiving the string 'abused'\n");
+  printf("\t-S                Run as a server, listen for notifications and\n");
+  printf("\t                  answer HTTP requests on port %d with the devices:\n",
+      DAEMON_PORT);
+  printf("\t                  GET /devices?format=xml|json|binary&filter=<-f>&since=<ms>\n");
   printf("\t-d                Run as a UNIX daemon,\n");
   printf("\t                  only works in combination with -S or -a\n");
   printf("\t-u                Listen for local UPnP (SSDP) notifications\n");
   printf("\t-U                Perform an active search for UPnP devices\n");
+  printf("\t                  (once at the start of -u or -S, over the same table)\n");
   printf("\t-a <ip>:<port>    Forward the events to the specified ip and port,\n");
   printf("\t                  also works in combination with -u.\n");
+  printf("\t-O <seconds>      Forward only the new, changed and removed devices\n");
+  printf("\t                  (-a), and all of them this often\n");
+  printf("\t-l <seconds>      Listen and search again at least this often,\n");
+  printf("\t                  reporting the changes after every search\n");
+  printf("\t-D <file>         Save the listened device table to <file> every %d s\n",
+      SSDP_CHECKPOINT_INTERVAL / 1000);
+  printf("\t                  and restore it at startup (an absolute path with -d)\n");
+  printf("\t-J <dir>[,<MiB>]  Journal every received datagram to <dir>, keeping\n");
+  printf("\t                  it under <MiB>, default is %d\n",
+      SSDP_JOURNAL_DEFAULT_RETENTION);
+  printf("\t-Y <from>[,<to>]  Replay the journal (-J) between the times (in s since\n");
+  printf("\t                  the epoch) instead of listening\n");
+  printf("\t-P <file>         Read the SSDP traffic of a pcap or pcapng capture\n");
+  printf("\t                  instead of listening\n");
+  printf("\t-Z                Replay -Y and -P at the pace it was received,\n");
+  printf("\t                  instead of as fast as possible\n");
+  printf("\t-G [<ip>:]<port>  Serve the metrics at GET /metrics on <ip> (default is\n");
+  printf("\t                  %s), they are also dumped to stderr on SIGUSR1\n",
+      SSDP_METRICS_DEFAULT_IP);
+  printf("\t-V <level>        Log at this level (error, warn, info, debug or dev),\n");
+  printf("\t                  default is info, SIGUSR2 switches debug logging\n");
+  printf("\t                  on and off\n");
+  printf("\t-s <st>[,<st>]    Search targets to probe for, default is %s\n",
+      SSDP_PROBE_DEFAULT_TARGET);
+  printf("\t-e <count>        How many times to resend every probe, default is %d\n",
+      SSDP_PROBE_DEFAULT_RETRANSMITS);
+  printf("\t-p <pps>          Maximum probes sent per second, default is %d\n",
+      SSDP_PROBE_DEFAULT_RATE);
+  printf("\t                  (0 for no limit)\n");
+  printf("\t-w <cidr>[,...]   Probe every address of the IPv4 ranges with\n");
+  printf("\t                  unicast searches instead of multicasting\n");
+  printf("\t-W <pps>          Maximum unicast probes per second for -w,\n");
+  printf("\t                  default is %d (0 for no limit)\n",
+      SSDP_SWEEP_DEFAULT_RATE);
+  printf("\t-Q <count>        End the search as soon as this many devices answered\n");
+  printf("\t-E                End the search when the answers stop arriving\n");
+  printf("\t                  instead of waiting the whole time (-T), not\n");
+  printf("\t                  before %d%% of it has passed\n",
+      SSDP_SCAN_POLICY_MIN_WINDOW);
   printf("\t-F                Do not try to parse the \"Location\" header and fetch device info\n");
-  //printf("\t-j                Convert results to JSON\n");
+  printf("\t-j                Convert results to JSON\n");
   printf("\t-x                Convert results to XML\n");
+  printf("\t-b                Forward results in the compact binary format\n");
+  printf("\t-n                Output a stream of device add/update/remove events\n");
+  printf("\t                  as newline-delimited JSON\n");
+  printf("\t-N <ms>           How long to buffer events for -n, default is %d\n",
+      SSDP_EVENT_STREAM_FLUSH_INTERVAL);
   printf("\t-m                Monochrome mode (disable all colors)\n");
+  printf("\t-r <fps>          Maximum table redraws per second, default is %d\n",
+      DISPLAY_DEFAULT_FPS);
+  printf("\t                  (0 redraws on every change)\n");
   //printf("\t-4                Force the use of the IPv4 protocol\n");
   //printf("\t-6                Force the use of the IPv6 protocol\n");
   printf("\t-q                Be quiet!\n");
@@ -78,7 +159,7 @@ void usage(void) {
 int parse_args(const int argc, char * const *argv, configuration_s *conf) {
   int opt;
 
-  while ((opt = getopt(argc, argv, "C:i:I:t:f:MSduUma:RFc:jx64qT:LR")) > 0) {
+  while ((opt = getopt(argc, argv, "C:i:I:t:f:MSduUmr:a:RFc:jxbnN:s:e:p:w:W:Q:El:D:J:Y:P:ZG:V:O:64qT:LR")) > 0) {
     char *pend = NULL;
 
     switch (opt) {
@@ -113,6 +194,8 @@ int parse_args(const int argc, char * const *argv, configuration_s *conf) {
 
     case 'S':
       conf->run_as_server = TRUE;
+      /* The devices served are the ones the listener hears from */
+      conf->listen_for_upnp_notif = TRUE;
       break;
 
     case 'd':
@@ -131,6 +214,15 @@ int parse_args(const int argc, char * const *argv, configuration_s *conf) {
       conf->forward_address = optarg;
       break;
 
+    case 'O':
+      pend = NULL;
+      conf->resync_interval = (unsigned int)strtol(optarg, &pend, 10);
+      if (conf->resync_interval == 0) {
+        PRINT_ERROR("The resync interval (-O) has to be at least 1 second");
+        return 1;
+      }
+      break;
+
     case 'F':
       conf->fetch_info = FALSE;
       break;
@@ -143,14 +235,136 @@ int parse_args(const int argc, char * const *argv, configuration_s *conf) {
 
     case 'j':
       conf->xml_output = FALSE;
+      conf->binary_output = FALSE;
       conf->json_output = TRUE;
       break;
 
     case 'x':
       conf->json_output = FALSE;
+      conf->binary_output = FALSE;
       conf->xml_output = TRUE;
       break;
 
+    case 'b':
+      conf->json_output = FALSE;
+      conf->xml_output = FALSE;
+      conf->binary_output = TRUE;
+      break;
+
+    case 'r':
+      pend = NULL;
+      conf->display_fps = (unsigned int)strtol(optarg, &pend, 10);
+      break;
+
+    case 'n':
+      conf->event_stream_output = TRUE;
+      break;
+
+    case 'N':
+      pend = NULL;
+      conf->event_flush_interval = (unsigned int)strtol(optarg, &pend, 10);
+      break;
+
+    case 's':
+      conf->search_targets = optarg;
+      break;
+
+    case 'e':
+      pend = NULL;
+      conf->probe_retransmits = (unsigned int)strtol(optarg, &pend, 10);
+      break;
+
+    case 'p':
+      pend = NULL;
+      conf->probe_rate = (unsigned int)strtol(optarg, &pend, 10);
+      break;
+
+    case 'w':
+      conf->sweep_ranges = optarg;
+      break;
+
+    case 'W':
+      pend = NULL;
+      conf->sweep_rate = (unsigned int)strtol(optarg, &pend, 10);
+      break;
+
+    case 'Q':
+      pend = NULL;
+      conf->expected_devices = (unsigned int)strtol(optarg, &pend, 10);
+      break;
+
+    case 'E':
+      conf->adaptive_scan = TRUE;
+      break;
+
+    case 'l':
+      pend = NULL;
+      conf->scan_interval = (unsigned int)strtol(optarg, &pend, 10);
+      if (conf->scan_interval == 0) {
+        PRINT_ERROR("The search interval (-l) has to be at least 1 second");
+        return 1;
+      }
+      conf->listen_for_upnp_notif = TRUE;
+      break;
+
+    case 'D':
+      conf->checkpoint_file = optarg;
+      break;
+
+    case 'J':
+      conf->journal_directory = optarg;
+      pend = strrchr(optarg, ',');
+      if (pend) {
+        *pend = '\0';
+        conf->journal_retention = (unsigned int)strtol(pend + 1, NULL, 10);
+        if (conf->journal_retention == 0) {
+          PRINT_ERROR("The journal retention (-J) has to be at least 1 MiB");
+          return 1;
+        }
+      }
+      break;
+
+    case 'Y':
+      pend = NULL;
+      conf->journal_replay = TRUE;
+      conf->offline = TRUE;
+      conf->replay_from = strtoull(optarg, &pend, 10) * 1000000000ULL;
+      if (*pend == ',') {
+        conf->replay_to = strtoull(pend + 1, &pend, 10) * 1000000000ULL +
+            999999999ULL;
+      }
+      if (*pend != '\0' || conf->replay_to < conf->replay_from) {
+        PRINT_ERROR("Erroneous replay range (-Y): %s", optarg);
+        return 1;
+      }
+      /* Replayed traffic goes through the listener, offline */
+      conf->listen_for_upnp_notif = TRUE;
+      conf->fetch_info = FALSE;
+      break;
+
+    case 'P':
+      conf->pcap_file = optarg;
+      conf->offline = TRUE;
+      /* Captured traffic goes through the listener, offline */
+      conf->listen_for_upnp_notif = TRUE;
+      conf->fetch_info = FALSE;
+      break;
+
+    case 'Z':
+      conf->replay_paced = TRUE;
+      break;
+
+    case 'G':
+      conf->metrics_address = optarg;
+      break;
+
+    case 'V':
+      if (!log_parse_level(optarg, &conf->log_level)) {
+        PRINT_ERROR("Erroneous log level (-V): %s", optarg);
+        return 1;
+      }
+      break;
+
     case 'm':
       conf->monochrome = TRUE;
       break;
@@ -189,6 +403,41 @@ int parse_args(const int argc, char * const *argv, configuration_s *conf) {
     }
   }
 
+  /* Searching is what is done unless listening, -U searches once at the
+     start of listening as well */
+  if (!conf->listen_for_upnp_notif) {
+    conf->scan_for_upnp_devices = TRUE;
+  }
+
+  /* The changes are reported to the console, not forwarded */
+  if (conf->scan_interval && conf->forward_address) {
+    PRINT_ERROR("Continuous searching (-l) cannot be combined with -a");
+    return 1;
+  }
+
+  if (conf->resync_interval && !conf->forward_address) {
+    PRINT_ERROR("Forwarding the changes (-O) needs the forward address (-a)");
+    return 1;
+  }
+
+  if (conf->journal_replay && !conf->journal_directory) {
+    PRINT_ERROR("Replaying (-Y) needs the journal directory (-J)");
+    return 1;
+  }
+  if (conf->journal_replay && conf->pcap_file) {
+    PRINT_ERROR("Replaying (-Y) cannot be combined with reading a capture (-P)");
+    return 1;
+  }
+  if (conf->offline && (conf->scan_interval || conf->run_as_server ||
+      conf->forward_address)) {
+    PRINT_ERROR("Replaying (-Y or -P) cannot be combined with -l, -S or -a");
+    return 1;
+  }
+  if (conf->replay_paced && !conf->offline) {
+    PRINT_ERROR("Pacing (-Z) needs a replay (-Y or -P)");
+    return 1;
+  }
+
   return 0;
 }
 
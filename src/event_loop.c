@@ -0,0 +1,237 @@
+/** \file event_loop.c
+ * A small callback based event loop on top of epoll, or poll() on systems
+ * without epoll.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <errno.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> /* close() */
+
+#include "common_definitions.h"
+#include "event_loop.h"
+#include "log.h"
+
+/** The most events handled per wait. */
+#define EVENT_LOOP_MAX_EVENTS 64
+
+/**
+ * Find the handler of a file descriptor.
+ *
+ * @param loop The loop to search.
+ * @param fd The file descriptor.
+ * @param link If not NULL, set to the link pointing at the handler.
+ *
+ * @return The handler or NULL if the file descriptor is not watched.
+ */
+static event_loop_handler_s *find_handler(event_loop_s *loop, int fd,
+    event_loop_handler_s ***link) {
+  event_loop_handler_s **current = &loop->handlers;
+
+  while (*current && (*current)->fd != fd) {
+    current = &(*current)->next;
+  }
+
+  if (link) {
+    *link = current;
+  }
+
+  return *current;
+}
+
+#ifdef __linux__
+/**
+ * Convert EVENT_LOOP_* flags to epoll flags.
+ *
+ * @param events The EVENT_LOOP_* flags.
+ *
+ * @return The epoll flags.
+ */
+static unsigned int to_epoll_events(unsigned int events) {
+  return ((events & EVENT_LOOP_READ) ? EPOLLIN : 0) |
+      ((events & EVENT_LOOP_WRITE) ? EPOLLOUT : 0);
+}
+#endif
+
+BOOL event_loop_init(event_loop_s *loop) {
+  memset(loop, 0, sizeof(event_loop_s));
+  loop->epoll_fd = -1;
+
+#ifdef __linux__
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd < 0) {
+    PRINT_ERROR("epoll_create1(): %s", strerror(errno));
+    return FALSE;
+  }
+#endif
+
+  return TRUE;
+}
+
+BOOL event_loop_add(event_loop_s *loop, int fd, unsigned int events,
+    event_loop_callback callback, void *data) {
+  event_loop_handler_s *handler = NULL;
+
+  handler = (event_loop_handler_s *)malloc(sizeof(event_loop_handler_s));
+  if (!handler) {
+    PRINT_ERROR("Failed to allocate memory for the event handler");
+    return FALSE;
+  }
+  handler->fd = fd;
+  handler->events = events;
+  handler->callback = callback;
+  handler->data = data;
+
+#ifdef __linux__
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = to_epoll_events(events);
+  event.data.ptr = handler;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    PRINT_ERROR("epoll_ctl(): %s", strerror(errno));
+    free(handler);
+    return FALSE;
+  }
+#endif
+
+  handler->next = loop->handlers;
+  loop->handlers = handler;
+  loop->count++;
+
+  return TRUE;
+}
+
+BOOL event_loop_modify(event_loop_s *loop, int fd, unsigned int events) {
+  event_loop_handler_s *handler = find_handler(loop, fd, NULL);
+
+  if (!handler) {
+    PRINT_ERROR("File descriptor %d is not in the event loop", fd);
+    return FALSE;
+  }
+
+#ifdef __linux__
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = to_epoll_events(events);
+  event.data.ptr = handler;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+    PRINT_ERROR("epoll_ctl(): %s", strerror(errno));
+    return FALSE;
+  }
+#endif
+  handler->events = events;
+
+  return TRUE;
+}
+
+void event_loop_remove(event_loop_s *loop, int fd) {
+  event_loop_handler_s **link = NULL;
+  event_loop_handler_s *handler = find_handler(loop, fd, &link);
+
+  if (!handler) {
+    return;
+  }
+
+#ifdef __linux__
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+
+  /* Events for it may still be pending in the current wait */
+  *link = handler->next;
+  handler->fd = -1;
+  handler->next = loop->removed;
+  loop->removed = handler;
+  loop->count--;
+}
+
+/**
+ * Free the handlers removed during the last wait.
+ *
+ * @param loop The loop to free the handlers of.
+ */
+static void free_removed(event_loop_s *loop) {
+  while (loop->removed) {
+    event_loop_handler_s *next = loop->removed->next;
+    free(loop->removed);
+    loop->removed = next;
+  }
+}
+
+int event_loop_wait(event_loop_s *loop, int timeout) {
+  int ready = 0;
+  int i;
+
+#ifdef __linux__
+  struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+  ready = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+  if (ready < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  for (i = 0; i < ready; i++) {
+    event_loop_handler_s *handler = (event_loop_handler_s *)events[i].data.ptr;
+    unsigned int flags = 0;
+
+    if (handler->fd < 0) {
+      continue;
+    }
+    flags |= (events[i].events & EPOLLIN) ? EVENT_LOOP_READ : 0;
+    flags |= (events[i].events & EPOLLOUT) ? EVENT_LOOP_WRITE : 0;
+    flags |= (events[i].events & (EPOLLERR | EPOLLHUP)) ? EVENT_LOOP_ERROR : 0;
+    handler->callback(handler->data, flags);
+  }
+#else
+  struct pollfd pfds[EVENT_LOOP_MAX_EVENTS];
+  event_loop_handler_s *handlers[EVENT_LOOP_MAX_EVENTS];
+  event_loop_handler_s *handler = loop->handlers;
+  int count = 0;
+
+  for (; handler && count < EVENT_LOOP_MAX_EVENTS; handler = handler->next) {
+    pfds[count].fd = handler->fd;
+    pfds[count].events = ((handler->events & EVENT_LOOP_READ) ? POLLIN : 0) |
+        ((handler->events & EVENT_LOOP_WRITE) ? POLLOUT : 0);
+    pfds[count].revents = 0;
+    handlers[count++] = handler;
+  }
+
+  if (poll(pfds, count, timeout) < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    unsigned int flags = 0;
+
+    if (!pfds[i].revents || handlers[i]->fd < 0) {
+      continue;
+    }
+    flags |= (pfds[i].revents & POLLIN) ? EVENT_LOOP_READ : 0;
+    flags |= (pfds[i].revents & POLLOUT) ? EVENT_LOOP_WRITE : 0;
+    flags |= (pfds[i].revents & (POLLERR | POLLHUP)) ? EVENT_LOOP_ERROR : 0;
+    handlers[i]->callback(handlers[i]->data, flags);
+    ready++;
+  }
+#endif
+
+  free_removed(loop);
+
+  return ready;
+}
+
+void event_loop_close(event_loop_s *loop) {
+  while (loop->handlers) {
+    event_loop_remove(loop, loop->handlers->fd);
+  }
+  free_removed(loop);
+
+  if (loop->epoll_fd >= 0) {
+    close(loop->epoll_fd);
+  }
+  loop->epoll_fd = -1;
+}
@@ -1,220 +1,876 @@
 /** \file log.c
  * The logging system.
  *
+ * The messages are passed from the logging threads to the writer in a
+ * bounded ring of records, every record has a sequence number telling
+ * whether it is free (to the loggers) or written (to the writer), so
+ * logging takes no lock. A logger that finds the ring full drops its
+ * message, it never waits for the writer.
+ *
  * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "log.h"
 
-/** The printed message's buffer size */
-#define MESSAGE_MAX_SIZE 20480
+/** The longest conversion specification rebuilt when writing. */
+#define LOG_SPEC_SIZE 64
+
+/** How the argument of a conversion is passed. */
+typedef enum log_arg_enum {
+  /** No argument ("%%"). */
+  LOG_ARG_NONE,
+  /** An int (or a promoted char or short). */
+  LOG_ARG_INT,
+  /** A long. */
+  LOG_ARG_LONG,
+  /** A long long. */
+  LOG_ARG_LLONG,
+  /** An intmax_t. */
+  LOG_ARG_INTMAX,
+  /** A size_t. */
+  LOG_ARG_SIZE,
+  /** A ptrdiff_t. */
+  LOG_ARG_PTRDIFF,
+  /** A double (or a promoted float). */
+  LOG_ARG_DOUBLE,
+  /** A long double. */
+  LOG_ARG_LDOUBLE,
+  /** A string, copied since it may be gone when it is written. */
+  LOG_ARG_STRING,
+  /** A pointer. */
+  LOG_ARG_POINTER,
+  /** A pointer that is not written ("%n" and wide strings). */
+  LOG_ARG_SKIPPED
+} log_arg_e;
+
+/** A conversion of a format. */
+typedef struct log_conversion_struct {
+  /** The '%' starting it. */
+  const char *start;
+  /** The character after it. */
+  const char *end;
+  /** The number of '*' (width and precision) in it. */
+  int stars;
+  /** The argument it converts. */
+  log_arg_e arg;
+} log_conversion_s;
+
+/** A logged message, waiting in the ring to be written. */
+typedef struct log_record_struct {
+  /** The position in the ring the record is free (or written) at. */
+  unsigned long sequence;
+  /** The level of the message. */
+  log_level_e level;
+  /** The line number the message was logged at. */
+  int line;
+  /** The file the message was logged in. */
+  const char *file;
+  /** The format of the message. */
+  const char *format;
+  /** The number of conversions whose arguments were copied. */
+  unsigned short conversions;
+  /** The Bytes of args used. */
+  unsigned short args_used;
+  /** Not all arguments fit, the message is cut after the conversions. */
+  BOOL truncated;
+  /** The arguments, in the order of the conversions. */
+  char args[LOG_ARGS_SIZE];
+} __attribute__((aligned(64))) log_record_s;
+
+/** The names the levels are written with. */
+static const char *level_names[LOG_LEVELS_COUNT] = {
+  "ERR",
+  "WARN",
+  "INFO",
+  "DEBUG",
+  "DEV"
+};
+
+int log_current_level = LOG_LEVEL_DEFAULT;
+
+/** The level set, SIGUSR2 switches between it and debug. */
+static int set_level = LOG_LEVEL_DEFAULT;
+
+/** The messages on their way to the writer. */
+static log_record_s ring[LOG_RING_SIZE];
+
+/** The position the next message is logged at. */
+static unsigned long enqueue_position;
+
+/** The position the next message is written from (only the writer's). */
+static unsigned long dequeue_position;
+
+/** The messages dropped since the last were written. */
+static unsigned long long dropped;
+
+/** The writer is running, messages go through the ring. */
+static BOOL running;
+
+/** The writer is asked to write what is left and stop. */
+static BOOL stopping;
+
+/** The thread writing the messages. */
+static pthread_t writer;
+
+/** The lines being written. */
+static char batch[LOG_BATCH_SIZE];
+
+#if defined(DEBUG___) && defined(DEBUG_TO_FILE___)
+/** The debug file written to. */
+static FILE *debug_file = NULL;
+
+/** The size of the debug file. */
+static long debug_file_size = 0;
+#endif
 
-#ifdef DEBUG___
 /**
- * Counts the number of times needle occurs in haystack
+ * Parses a conversion of a format, the way printf does.
  *
- * @param haystack The string to search in
- * @param needle The character to search for
+ * @param format The conversion, starting with its '%'.
+ * @param conversion The conversion to fill.
  *
- * @return int The number of occurrences
+ * @return The character after the conversion.
  */
-static int chr_count(char *haystack, char needle) {
-  int count = 0;
-  int len = strlen(haystack);
-  int i;
-  for (i = 0; i < len; i++) {
-    if (haystack[i] == needle) {
-      count++;
+static const char *parse_conversion(const char *format,
+    log_conversion_s *conversion) {
+  const char *c = format + 1;
+  char length = '\0';
+
+  conversion->start = format;
+  conversion->stars = 0;
+  conversion->arg = LOG_ARG_NONE;
+
+  /* [flags][width][.precision][length]conversion */
+  while (*c && strchr("-+ #0'", *c)) {
+    c++;
+  }
+  if (*c == '*') {
+    conversion->stars++;
+    c++;
+  }
+  while (*c >= '0' && *c <= '9') {
+    c++;
+  }
+  if (*c == '.') {
+    c++;
+    if (*c == '*') {
+      conversion->stars++;
+      c++;
+    }
+    while (*c >= '0' && *c <= '9') {
+      c++;
     }
   }
-  return count;
+  if (*c == 'h') {
+    length = *c++;
+    if (*c == 'h') {
+      c++;
+    }
+  }
+  else if (*c == 'l') {
+    length = *c++;
+    if (*c == 'l') {
+      /* 'q' stands for "ll" */
+      length = 'q';
+      c++;
+    }
+  }
+  else if (*c && strchr("Ljzt", *c)) {
+    length = *c++;
+  }
+
+  switch (*c) {
+  case 'd':
+  case 'i':
+  case 'o':
+  case 'u':
+  case 'x':
+  case 'X':
+    switch (length) {
+    case 'l':
+      conversion->arg = LOG_ARG_LONG;
+      break;
+    case 'q':
+      conversion->arg = LOG_ARG_LLONG;
+      break;
+    case 'j':
+      conversion->arg = LOG_ARG_INTMAX;
+      break;
+    case 'z':
+      conversion->arg = LOG_ARG_SIZE;
+      break;
+    case 't':
+      conversion->arg = LOG_ARG_PTRDIFF;
+      break;
+    default:
+      conversion->arg = LOG_ARG_INT;
+      break;
+    }
+    break;
+  case 'c':
+    conversion->arg = LOG_ARG_INT;
+    break;
+  case 'e':
+  case 'E':
+  case 'f':
+  case 'F':
+  case 'g':
+  case 'G':
+  case 'a':
+  case 'A':
+    conversion->arg = length == 'L' ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+    break;
+  case 's':
+    conversion->arg = length == 'l' ? LOG_ARG_SKIPPED : LOG_ARG_STRING;
+    break;
+  case 'p':
+    conversion->arg = LOG_ARG_POINTER;
+    break;
+  case 'n':
+    conversion->arg = LOG_ARG_SKIPPED;
+    break;
+  case '\0':
+    /* The format ends in the conversion */
+    conversion->stars = 0;
+    conversion->end = c;
+    return c;
+  default:
+    break;
+  }
+
+  conversion->end = c + 1;
+  return conversion->end;
 }
 
-#ifdef DEBUG_TO_FILE___
 /**
- * Retrieves the size of a file
+ * Copies an argument to a record.
  *
- * @param file The file to stat
+ * @param record The record to copy to.
+ * @param value The argument.
+ * @param size The size of the argument.
  *
- * @return The size of the file in Bytes
+ * @return TRUE if it fit, FALSE otherwise (and the record is truncated).
  */
-static int fsize(const char *file) {
-  struct stat st;
+static BOOL store(log_record_s *record, const void *value, size_t size) {
+  if (size > LOG_ARGS_SIZE - record->args_used) {
+    record->truncated = TRUE;
+    return FALSE;
+  }
+
+  memcpy(record->args + record->args_used, value, size);
+  record->args_used += size;
+
+  return TRUE;
+}
+
+/**
+ * Copies a string argument to a record, cutting it if it does not fit.
+ *
+ * @param record The record to copy to.
+ * @param string The string, NULL is copied as "(null)".
+ *
+ * @return TRUE if any of it fit, FALSE otherwise (and the record is
+ *         truncated).
+ */
+static BOOL store_string(log_record_s *record, const char *string) {
+  size_t room = LOG_ARGS_SIZE - record->args_used;
+  size_t length;
+
+  if (!string) {
+    string = "(null)";
+  }
 
-  if(stat(file, &st) == 0) {
-    return st.st_size;
+  if (room < 1) {
+    record->truncated = TRUE;
+    return FALSE;
   }
 
-  return -1;
+  length = strnlen(string, room - 1);
+  memcpy(record->args + record->args_used, string, length);
+  record->args[record->args_used + length] = '\0';
+  record->args_used += length + 1;
+
+  if (string[length] != '\0') {
+    record->truncated = TRUE;
+  }
+
+  return TRUE;
 }
-#endif
 
-void print_debug(FILE *std, const char *color, const char* file, int line,
-    char *va_format, ...) {
-  va_list va;
-  char message[MESSAGE_MAX_SIZE];
-  int message_used = 0;
-  char *from_pointer = va_format;
-  char header[100];
-  char *to_pointer = va_format;
-  int args_count = chr_count(va_format, '%');
-  const char *no_memory =
-      "Not enought memory in buffer to build debug message";
-  char *s;
-  char c;
-  int d;
-
-  /* Remove path from file variable (borrowing 'c' for the task) */
-  s = strrchr(file, '/');
-  if (s) {
-    file = s + 1;
-    s = NULL;
-  }
-
-  /* Create a nice header for the output */
-  sprintf(header, "%s[%d][%s:%04d] ", color, (int)getpid(), file, line);
-
-  if(!va_format) {
-    fprintf(stderr, "%s[%d][%s:%d] Error, va_arg input format (va_format) "
-        "not set%s\n", ANSI_COLOR_RED, (int)getpid(), __FILE__, __LINE__,
-        ANSI_COLOR_RESET);
-    printf("some rror\n");
-    return;
+/**
+ * Copies the arguments of a message to its record, as they are passed.
+ *
+ * @param record The record, with its format set.
+ * @param va The arguments.
+ */
+static void store_args(log_record_s *record, va_list va) {
+  log_conversion_s conversion;
+  const char *c = record->format;
+  int int_value;
+  long long_value;
+  long long llong_value;
+  intmax_t intmax_value;
+  size_t size_value;
+  ptrdiff_t ptrdiff_value;
+  double double_value;
+  long double ldouble_value;
+  void *pointer_value;
+  BOOL stored;
+  int i;
+
+  record->conversions = 0;
+  record->args_used = 0;
+  record->truncated = FALSE;
+
+  while ((c = strchr(c, '%'))) {
+    c = parse_conversion(c, &conversion);
+    stored = TRUE;
+
+    for (i = 0; stored && i < conversion.stars; i++) {
+      int_value = va_arg(va, int);
+      stored = store(record, &int_value, sizeof(int_value));
+    }
+    if (!stored) {
+      return;
+    }
+
+    switch (conversion.arg) {
+    case LOG_ARG_INT:
+      int_value = va_arg(va, int);
+      stored = store(record, &int_value, sizeof(int_value));
+      break;
+    case LOG_ARG_LONG:
+      long_value = va_arg(va, long);
+      stored = store(record, &long_value, sizeof(long_value));
+      break;
+    case LOG_ARG_LLONG:
+      llong_value = va_arg(va, long long);
+      stored = store(record, &llong_value, sizeof(llong_value));
+      break;
+    case LOG_ARG_INTMAX:
+      intmax_value = va_arg(va, intmax_t);
+      stored = store(record, &intmax_value, sizeof(intmax_value));
+      break;
+    case LOG_ARG_SIZE:
+      size_value = va_arg(va, size_t);
+      stored = store(record, &size_value, sizeof(size_value));
+      break;
+    case LOG_ARG_PTRDIFF:
+      ptrdiff_value = va_arg(va, ptrdiff_t);
+      stored = store(record, &ptrdiff_value, sizeof(ptrdiff_value));
+      break;
+    case LOG_ARG_DOUBLE:
+      double_value = va_arg(va, double);
+      stored = store(record, &double_value, sizeof(double_value));
+      break;
+    case LOG_ARG_LDOUBLE:
+      ldouble_value = va_arg(va, long double);
+      stored = store(record, &ldouble_value, sizeof(ldouble_value));
+      break;
+    case LOG_ARG_STRING:
+      stored = store_string(record, va_arg(va, const char *));
+      break;
+    case LOG_ARG_POINTER:
+      pointer_value = va_arg(va, void *);
+      stored = store(record, &pointer_value, sizeof(pointer_value));
+      break;
+    case LOG_ARG_SKIPPED:
+      (void)va_arg(va, void *);
+      break;
+    case LOG_ARG_NONE:
+      break;
+    }
+
+    if (!stored) {
+      return;
+    }
+    record->conversions++;
+    if (record->truncated) {
+      return;
+    }
   }
+}
 
-  int message_length = 20480;
-  memset(message, '\0', sizeof(char) * message_length);
-  message_length -= 50; // compensate for additional chars in the message
-  va_start(va, va_format);
+/**
+ * Moves the end of a line forward after writing to it.
+ *
+ * @param used The used length of the line.
+ * @param written What snprintf() returned.
+ * @param size The size of the line.
+ */
+static void advance(size_t *used, int written, size_t size) {
+  if (written > 0) {
+    *used += written;
+  }
+  if (*used > size - 1) {
+    *used = size - 1;
+  }
+}
 
-  int copy_length = 0;
-  int args_pos;
+/**
+ * Appends text to a line.
+ *
+ * @param line The line.
+ * @param used The used length of the line.
+ * @param size The size of the line.
+ * @param text The text.
+ * @param length The length of the text.
+ */
+static void append(char *line, size_t *used, size_t size, const char *text,
+    size_t length) {
+  if (length > size - 1 - *used) {
+    length = size - 1 - *used;
+  }
+  memcpy(line + *used, text, length);
+  *used += length;
+}
 
-  for (args_pos = 1; (from_pointer && *from_pointer != '\0');
-      from_pointer = to_pointer) {
+/**
+ * Rebuilds a conversion with its '*' replaced by the values they were
+ * passed, a negative precision is left out (like printf does).
+ *
+ * @param conversion The conversion.
+ * @param stars The values of its '*'.
+ * @param spec The conversion to fill.
+ */
+static void build_spec(const log_conversion_s *conversion, const int *stars,
+    char *spec) {
+  const char *c;
+  size_t used = 0;
+  int star = 0;
 
-    to_pointer = strchr(from_pointer, '%');
+  for (c = conversion->start; c < conversion->end; c++) {
+    if (*c != '*') {
+      append(spec, &used, LOG_SPEC_SIZE, c, 1);
+    }
+    else if (c[-1] == '.' && stars[star] < 0) {
+      used--;
+      star++;
+    }
+    else {
+      advance(&used, snprintf(spec + used, LOG_SPEC_SIZE - used, "%d",
+          stars[star++]), LOG_SPEC_SIZE);
+    }
+  }
+  spec[used] = '\0';
+}
 
-    if (to_pointer && strlen(to_pointer) > 1) {
-      copy_length = to_pointer - from_pointer;
+/**
+ * Formats a message, the way printf would have when it was logged.
+ *
+ * @param record The message.
+ * @param line The line to write it to.
+ * @param size The size of the line.
+ *
+ * @return The length of the line, it always ends with a newline.
+ */
+static size_t format_record(const log_record_s *record, char *line,
+    size_t size) {
+  log_conversion_s conversion;
+  const char *file = strrchr(record->file, '/');
+  const char *literal = record->format;
+  const char *c;
+  const char *args = record->args;
+  char spec[LOG_SPEC_SIZE];
+  int stars[2];
+  unsigned int conversions = 0;
+  size_t end = size - 1; /* Room for the newline */
+  size_t used = 0;
+  int written = 0;
+  int i;
 
-      if (copy_length > message_length - message_used) {
-      fprintf(stderr, "%s[%d][%s:%d] %s%s\n", ANSI_COLOR_RED, (int)getpid(),
-          __FILE__, __LINE__, no_memory, ANSI_COLOR_RESET);
-        return;
-      }
+  file = file ? file + 1 : record->file;
+  if (record->level >= LOG_LEVEL_DEBUG) {
+    written = snprintf(line, end, "[%s][%d][%s:%04d] ",
+        level_names[record->level], (int)getpid(), file, record->line);
+  }
+  else {
+    written = snprintf(line, end, "[%s] ", level_names[record->level]);
+  }
+  advance(&used, written, end);
 
-      strncpy(message + message_used, from_pointer, copy_length);
-      message_used += copy_length;
-
-    switch(to_pointer[1]) {
-    case 's':
-      /* string */
-      s = va_arg(va, char *);
-      if(s) {
-        copy_length = strlen(s);
-        if (copy_length > message_length - message_used) {
-          fprintf(stderr, "%s[%d][%s:%d] %s%s\n", ANSI_COLOR_RED,
-              (int)getpid(), __FILE__, __LINE__, no_memory, ANSI_COLOR_RESET);
-          return;
-        }
-        strncpy(message + message_used, s, copy_length);
-        message_used += copy_length;
+  while ((c = strchr(literal, '%'))) {
+    append(line, &used, end, literal, c - literal);
+    literal = parse_conversion(c, &conversion);
+
+    if (record->truncated && conversions == record->conversions) {
+      append(line, &used, end, "...", 3);
+      literal = NULL;
+      break;
+    }
+    conversions++;
+
+    for (i = 0; i < conversion.stars; i++) {
+      memcpy(&stars[i], args, sizeof(int));
+      args += sizeof(int);
+    }
+    build_spec(&conversion, stars, spec);
+
+    written = 0;
+    switch (conversion.arg) {
+    case LOG_ARG_INT: {
+      int value;
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(value);
+      written = snprintf(line + used, end - used, spec, value);
+      break;
+    }
+    case LOG_ARG_LONG: {
+      long value;
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(value);
+      written = snprintf(line + used, end - used, spec, value);
+      break;
+    }
+    case LOG_ARG_LLONG: {
+      long long value;
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(value);
+      written = snprintf(line + used, end - used, spec, value);
+      break;
+    }
+    case LOG_ARG_INTMAX: {
+      intmax_t value;
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(value);
+      written = snprintf(line + used, end - used, spec, value);
+      break;
+    }
+    case LOG_ARG_SIZE: {
+      size_t value;
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(value);
+      written = snprintf(line + used, end - used, spec, value);
+      break;
+    }
+    case LOG_ARG_PTRDIFF: {
+      ptrdiff_t value;
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(value);
+      written = snprintf(line + used, end - used, spec, value);
+      break;
+    }
+    case LOG_ARG_DOUBLE: {
+      double value;
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(value);
+      written = snprintf(line + used, end - used, spec, value);
+      break;
+    }
+    case LOG_ARG_LDOUBLE: {
+      long double value;
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(value);
+      written = snprintf(line + used, end - used, spec, value);
+      break;
+    }
+    case LOG_ARG_STRING:
+      written = snprintf(line + used, end - used, spec, args);
+      args += strlen(args) + 1;
+      break;
+    case LOG_ARG_POINTER: {
+      void *value;
+      memcpy(&value, args, sizeof(value));
+      args += sizeof(value);
+      written = snprintf(line + used, end - used, spec, value);
+      break;
+    }
+    case LOG_ARG_SKIPPED:
+      break;
+    case LOG_ARG_NONE:
+      /* "%%", or a conversion printf would not know either */
+      if (*(conversion.end - 1) == '%' && conversion.end - conversion.start > 1) {
+        append(line, &used, end, "%", 1);
       }
       else {
-        copy_length = 6;
-        strncpy(message + message_used, "NULL", copy_length);
-        message_used += copy_length;
+        append(line, &used, end, conversion.start,
+            conversion.end - conversion.start);
       }
       break;
-    case 'c':
-      /* character */
-      c = (char)va_arg(va, int);
-      copy_length = 1;
-      if (copy_length > message_length - message_used) {
-        fprintf(stderr, "%s[%d][%s:%d] %s%s\n", ANSI_COLOR_RED, (int)getpid(),
-            __FILE__, __LINE__, no_memory, ANSI_COLOR_RESET);
-        return;
+    }
+    advance(&used, written, end);
+  }
+
+  if (literal) {
+    append(line, &used, end, literal, strlen(literal));
+  }
+
+  if (used == 0 || line[used - 1] != '\n') {
+    line[used++] = '\n';
+  }
+
+  return used;
+}
+
+/**
+ * Writes formatted lines, to stderr or the debug file.
+ *
+ * @param lines The lines.
+ * @param length The length of the lines.
+ */
+static void write_lines(const char *lines, size_t length) {
+  FILE *file = stderr;
+
+  #if defined(DEBUG___) && defined(DEBUG_TO_FILE___)
+  /* Start the file over rather than let it grow too large */
+  if (debug_file && debug_file_size + (long)length > LOG_DEBUG_FILE_MAX_SIZE) {
+    fclose(debug_file);
+    debug_file = fopen(LOG_DEBUG_FILE, "w");
+    debug_file_size = 0;
+  }
+  else if (!debug_file) {
+    debug_file = fopen(LOG_DEBUG_FILE, "a");
+    if (debug_file && fseek(debug_file, 0, SEEK_END) == 0) {
+      debug_file_size = ftell(debug_file);
+    }
+  }
+
+  if (debug_file) {
+    debug_file_size += length;
+    file = debug_file;
+  }
+  #endif
+
+  fwrite(lines, 1, length, file);
+  fflush(file);
+}
+
+/**
+ * Writes the messages waiting in the ring (and how many were dropped).
+ *
+ * @return The number of messages written.
+ */
+static unsigned int write_pending(void) {
+  log_record_s *record;
+  unsigned long long lost;
+  unsigned int count = 0;
+  size_t used = 0;
+
+  lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+  if (lost) {
+    advance(&used, snprintf(batch, LOG_LINE_SIZE, "[WARN] %llu log messages "
+        "were dropped, the log ring buffer was full\n", lost), LOG_LINE_SIZE);
+    count++;
+  }
+
+  while (TRUE) {
+    record = &ring[dequeue_position & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) !=
+        dequeue_position + 1) {
+      break;
+    }
+
+    if (LOG_BATCH_SIZE - used < LOG_LINE_SIZE) {
+      write_lines(batch, used);
+      used = 0;
+    }
+    used += format_record(record, batch + used, LOG_LINE_SIZE);
+
+    /* Free the record for the lap after this one */
+    __atomic_store_n(&record->sequence, dequeue_position + LOG_RING_SIZE,
+        __ATOMIC_RELEASE);
+    dequeue_position++;
+    count++;
+  }
+
+  if (used) {
+    write_lines(batch, used);
+  }
+
+  return count;
+}
+
+/**
+ * The writer thread, it writes the messages in batches until stopped.
+ *
+ * @param data Not used.
+ *
+ * @return NULL.
+ */
+static void *write_records(void *data) {
+  struct timespec interval = {
+    .tv_sec = 0,
+    .tv_nsec = LOG_WRITER_INTERVAL * 1000000L
+  };
+  BOOL stop;
+
+  do {
+    /* Read before writing, so all that was logged before the stop is
+       written */
+    stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+    if (!write_pending() && !stop) {
+      nanosleep(&interval, NULL);
+    }
+  } while (!stop);
+
+  return NULL;
+}
+
+/**
+ * Switches between the set level and debug, on SIGUSR2.
+ *
+ * @param param The signal handler parameter (ignored).
+ */
+static void toggle_debug(int param) {
+  int level = __atomic_load_n(&set_level, __ATOMIC_RELAXED);
+
+  if (__atomic_load_n(&log_current_level, __ATOMIC_RELAXED) <
+      LOG_LEVEL_DEBUG) {
+    level = LOG_LEVEL_DEBUG;
+  }
+  else if (level >= LOG_LEVEL_DEBUG) {
+    level = LOG_LEVEL_INFO;
+  }
+
+  __atomic_store_n(&log_current_level, level, __ATOMIC_RELAXED);
+}
+
+void log_write(log_level_e level, const char *file, int line,
+    const char *format, ...) {
+  log_record_s unqueued;
+  log_record_s *record = &unqueued;
+  char formatted[LOG_LINE_SIZE];
+  unsigned long position = 0;
+  long difference;
+  va_list va;
+
+  if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    /* Claim the next free record, unless the ring is full */
+    position = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+    while (TRUE) {
+      record = &ring[position & (LOG_RING_SIZE - 1)];
+      difference = (long)(__atomic_load_n(&record->sequence,
+          __ATOMIC_ACQUIRE) - position);
+      if (difference == 0) {
+        if (__atomic_compare_exchange_n(&enqueue_position, &position,
+            position + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+          break;
+        }
       }
-      strncpy(message + message_used, &c, copy_length);
-      message_used += copy_length;
-      break;
-    case 'd':
-      /* integer */
-      d = va_arg(va, int);
-      char *d_char = (char *)malloc(sizeof(char) * 10);
-      memset(d_char, '\0', 10);
-      sprintf(d_char, "%d", d);
-      copy_length = strlen(d_char);
-      if (copy_length > message_length - message_used) {
-        fprintf(stderr, "%s[%d][%s:%d] %s%s\n", ANSI_COLOR_RED, (int)getpid(),
-            __FILE__, __LINE__, no_memory, ANSI_COLOR_RESET);
-        free(d_char);
+      else if (difference < 0) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
         return;
       }
-      strncpy(message + message_used, d_char, copy_length);
-      message_used += copy_length;
-      free(d_char);
-      break;
-    default:
-      break;
+      else {
+        position = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+      }
     }
+  }
+
+  record->level = level;
+  record->file = file;
+  record->line = line;
+  record->format = format;
+  va_start(va, format);
+  store_args(record, va);
+  va_end(va);
 
-    to_pointer += 2;
+  if (record == &unqueued) {
+    write_lines(formatted, format_record(record, formatted, LOG_LINE_SIZE));
   }
   else {
-    strcat(message, from_pointer);
-    to_pointer = NULL;
+    /* Hand it to the writer */
+    __atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
   }
+}
 
-  if(args_pos > args_count) {
-    break;
+void log_set_level(log_level_e level) {
+  __atomic_store_n(&set_level, level, __ATOMIC_RELAXED);
+  __atomic_store_n(&log_current_level, level, __ATOMIC_RELAXED);
+}
+
+BOOL log_parse_level(const char *name, log_level_e *level) {
+  static const char *names[LOG_LEVELS_COUNT] = {
+    "error",
+    "warn",
+    "info",
+    "debug",
+    "dev"
+  };
+  int i;
+
+  for (i = 0; i < LOG_LEVELS_COUNT; i++) {
+    if (strcmp(name, names[i]) == 0) {
+      *level = (log_level_e)i;
+      return TRUE;
+    }
   }
-    args_pos++;
+
+  return FALSE;
+}
+
+BOOL log_init(void) {
+  static BOOL registered = FALSE;
+  struct sigaction action;
+  sigset_t signals;
+  sigset_t previous;
+  unsigned long i;
+  int error;
+
+  if (running) {
+    return TRUE;
   }
 
-  if (!std) {
-    std = stdout;
+  for (i = 0; i < LOG_RING_SIZE; i++) {
+    ring[i].sequence = i;
   }
+  enqueue_position = 0;
+  dequeue_position = 0;
+  stopping = FALSE;
 
-  #ifdef DEBUG_TO_FILE___
-  /* Debug file to write to */
-  const char debug_file[] = "debug.log";
-  FILE *fh = NULL;
-  int file_size = fsize(debug_file);
-  /* Max file size is 500 KB */
-  int max_size = 512000;
-  /* If file is larger than 500KB then trunkate it */
-  if (file_size > max_size) {
-    fh = fopen(debug_file, "w");
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &toggle_debug;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if (sigaction(SIGUSR2, &action, NULL) != 0) {
+    PRINT_WARN("Debug logging cannot be switched on SIGUSR2: %s",
+        strerror(errno));
   }
-  /* Else continue writing to it */
-  else {
-    fh = fopen(debug_file, "a");
+
+  /* The signals are for the threads doing the work, not the writer */
+  sigfillset(&signals);
+  pthread_sigmask(SIG_SETMASK, &signals, &previous);
+  error = pthread_create(&writer, NULL, &write_records, NULL);
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  if (error != 0) {
+    PRINT_ERROR("Could not start the log writer: %s", strerror(error));
+    return FALSE;
   }
 
-  if (NULL == fh) {
-    fprintf(stderr, "%s[%d][%s:%d] Failed to create debug file%s\n",
-        ANSI_COLOR_RED, (int)getpid(), __FILE__, __LINE__, ANSI_COLOR_RESET);
+  __atomic_store_n(&running, TRUE, __ATOMIC_RELEASE);
+
+  if (!registered) {
+    atexit(&log_stop);
+    registered = TRUE;
   }
-  else {
-    fprintf(fh, "%s%s%s\n", header, message, ANSI_COLOR_RESET);
-    fclose(fh);
+
+  return TRUE;
+}
+
+void log_stop(void) {
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    return;
   }
-  #else
-  fprintf(std, "%s%s%s\n", header, message, ANSI_COLOR_RESET);
-  #endif
 
+  __atomic_store_n(&stopping, TRUE, __ATOMIC_RELEASE);
+  pthread_join(writer, NULL);
+  __atomic_store_n(&running, FALSE, __ATOMIC_RELEASE);
+
+  /* Whatever was logged while the writer stopped */
+  write_pending();
 }
-#endif
 
 void log_start_args(int argc, char **argv) {
   char *cmdline;
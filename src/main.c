@@ -60,6 +60,7 @@
 #include "log.h"
 #include "ssdp_common.h"
 #include "ssdp_listener.h"
+#include "ssdp_metrics.h"
 #include "ssdp_prober.h"
 #include "string_utils.h"
 
@@ -72,10 +73,14 @@ static ssdp_prober_s ssdp_prober;
 /** The program configuration */
 static configuration_s conf;
 
+/** The metrics server (-G) */
+static ssdp_metrics_server_s metrics_server;
+
 /**
  * Frees all global allocations.
  */
 static void cleanup(void) {
+  ssdp_metrics_server_stop(&metrics_server);
   ssdp_listener_close(&ssdp_listener);
   ssdp_prober_close(&ssdp_prober);
   PRINT_DEBUG("Cleaning up and exiting...\n");
@@ -91,12 +96,25 @@ static void exit_sig(int param) {
 }
 
 /**
- * Decides what the program will run as and does the neccessary
- * deamonizing and forking.
+ * Decides what the program will run as, all of it in one process, and
+ * does the neccessary deamonizing.
  *
  * @param conf The global configuration to use.
  */
 static void verify_running_states(configuration_s *conf) {
+  /* Continuous searching runs inside the listener so both fill the same
+     device table, it is not forked off as a separate scan. A one-time
+     search (-U) with the listener (-u or -S) runs in it too, at the start,
+     everything else runs as tasks of the listener's event loop */
+  if (conf->scan_interval) {
+    conf->scan_for_upnp_devices = FALSE;
+  }
+
+  /* A replay runs offline, in the listener */
+  if (conf->offline) {
+    conf->scan_for_upnp_devices = FALSE;
+  }
+
   if(conf->run_as_daemon &&
      !(conf->run_as_server ||
        (conf->listen_for_upnp_notif && conf->forward_address) ||
@@ -112,41 +130,6 @@ static void verify_running_states(configuration_s *conf) {
     /* If run as a daemon */
     daemonize();
   }
-
-  /* If set to listen for UPnP notifications then
-     fork() and live a separate life */
-  if (conf->listen_for_upnp_notif &&
-     ((conf->run_as_daemon && conf->forward_address) ||
-     conf->run_as_server)) {
-    if (fork() != 0) {
-      /* listen_for_upnp_notif went to the forked process,
-         so it is set to false in parent so it doesn't run twice'*/
-      conf->listen_for_upnp_notif = FALSE;
-    }
-    else {
-      PRINT_DEBUG("Created a process for listening of UPnP notifications");
-      /* scan_for_upnp_devices is set to false
-         so it doesn't run in this child (if it will be run at all) */
-      conf->scan_for_upnp_devices = FALSE;
-    }
-  }
-
-  /* If set to scan for UPnP-enabled devices then
-     fork() and live a separate life */
-  if(conf->scan_for_upnp_devices &&
-      (conf->run_as_daemon || conf->run_as_server)) {
-    if (fork() != 0) {
-      /* scan_for_upnp_devices went to the forked process,
-         so it set to false in parent so it doesn't run twice */
-      conf->scan_for_upnp_devices = FALSE;
-    }
-    else {
-      PRINT_DEBUG("Created a process for scanning UPnP devices");
-      /* listen_for_upnp_notif is set to false
-         so it doesn't run in this child (if it will be run at all) */
-      conf->listen_for_upnp_notif = FALSE;
-    }
-  }
 }
 
 int main(int argc, char **argv) {
@@ -169,28 +152,48 @@ int main(int argc, char **argv) {
     cleanup();
     exit(EXIT_FAILURE);
   }
+  log_set_level(conf.log_level);
 
   verify_running_states(&conf);
 
+  /* After daemonizing, the threads do not survive the fork */
+  ssdp_metrics_init();
+  /* After SIGUSR1 is blocked, the writer thread inherits it */
+  log_init();
+  if (conf.metrics_address &&
+      !ssdp_metrics_server_start(&metrics_server, &conf)) {
+    cleanup();
+    exit(EXIT_FAILURE);
+  }
+
   if (conf.listen_for_upnp_notif) {
     /* If set to listen for devices notifications then
        start listening for notifications but never continue
        to do any other work the parent should be doing */
 
-    /* init socket */
-    if ((ret = ssdp_passive_listener_init(&ssdp_listener, &conf))) {
-      PRINT_ERROR("Could not create SSDP listener");
-      return ret;
-    }
+    /* init socket, a replay does not need one */
+    if (!conf.offline) {
+      if ((ret = ssdp_passive_listener_init(&ssdp_listener, &conf))) {
+        PRINT_ERROR("Could not create SSDP listener");
+        return ret;
+      }
 
-    /* Display forwarding info */
-    print_forwarder(&conf, &ssdp_listener.forwarder);
+      /* Display forwarding info */
+      print_forwarder(&conf, &ssdp_listener.forwarder);
+    }
 
     if (ssdp_listener_start(&ssdp_listener, &conf)) {
       PRINT_ERROR("%s", strerror(errno));
       return errno;
     }
 
+    /* How long the stages took, once the table is gone from the screen
+       and the log is written */
+    if (!conf.quiet_mode) {
+      log_stop();
+      ssdp_metrics_print_latencies(stderr);
+    }
+
   } else if(conf.scan_for_upnp_devices) {
     /* If set to scan for devices then
        start scanning but never continue
@@ -207,6 +210,10 @@ int main(int argc, char **argv) {
     if (ssdp_prober_start(&ssdp_prober, &conf)) {
       PRINT_ERROR("%s", strerror(errno));
     }
+    if (!conf.quiet_mode) {
+      log_stop();
+      ssdp_metrics_print_latencies(stderr);
+    }
 
   } else {
     usage();
@@ -588,14 +588,9 @@ BOOL is_address_multicast(const char *address) {
     is_ipv6 = is_address_ipv6(address);
 
     if (is_ipv6) {
-      struct in6_addr ip6_ll;
       struct in6_addr ip6_addr;
-      inet_pton(AF_INET6, "ff02::c", &ip6_ll);
       inet_pton(AF_INET6, address, &ip6_addr);
-      if (ip6_ll.s6_addr == ip6_addr.s6_addr) {
-        return TRUE;
-      }
-      return FALSE;
+      return IN6_IS_ADDR_MULTICAST(&ip6_addr) ? TRUE : FALSE;
     }
     else {
       if (strcmp(address, "0.0.0.0") == 0)
@@ -132,7 +132,8 @@ int disable_multicast_loopback(SOCKET sock, int family) {
   return 0;
 }
 
-int join_multicast_group(SOCKET sock, char *multicast_group, char *interface_ip) {
+int join_multicast_group(SOCKET sock, char *multicast_group, char *interface_ip,
+    BOOL loopback) {
   struct ifaddrs *ifa, *interfaces = NULL;
   BOOL is_bindall = FALSE;
   BOOL is_mc_ipv6 = FALSE;
@@ -251,8 +252,8 @@ int join_multicast_group(SOCKET sock, char *multicast_group, char *interface_ip)
   /* Loop throgh all the interfaces */
   for (ifa = interfaces; ifa != NULL; ifa = ifa->ifa_next) {
 
-    /* Skip loopback addresses */
-    if(ifa->ifa_flags & IFF_LOOPBACK) {
+    /* Skip loopback addresses, unless listening on loopback */
+    if(!loopback && (ifa->ifa_flags & IFF_LOOPBACK)) {
       PRINT_DEBUG("Loopback address detected, skipping");
       continue;
     }
@@ -447,7 +448,7 @@ SOCKET setup_socket(socket_conf_s *conf) {
 
   /* init socket */
   sock = socket(saddr->ss_family, conf->is_udp ? SOCK_DGRAM : SOCK_STREAM,
-      protocol);
+      conf->is_udp ? IPPROTO_UDP : IPPROTO_TCP);
 
   if (sock < 0) {
     PRINT_ERROR("Failed to create socket. (%d) %s", errno, strerror(errno));
@@ -690,7 +691,7 @@ SOCKET setup_socket(socket_conf_s *conf) {
 
   /* Join the multicast group on required interfaces */
   if (conf->is_server && conf->is_multicast && join_multicast_group(sock,
-      conf->is_ipv6 ? SSDP_ADDR6_SL : SSDP_ADDR, iface_ip)) {
+      conf->is_ipv6 ? SSDP_ADDR6_SL : SSDP_ADDR, iface_ip, conf->loopback)) {
     PRINT_ERROR("Failed to join required multicast group");
     return SOCKET_ERROR;
   }
@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common_definitions.h"
@@ -17,70 +18,89 @@
 #include "socket_helpers.h"
 #include "ssdp_message.h"
 #include "ssdp_cache.h"
+#include "ssdp_cache_binary_format.h"
 #include "ssdp_message.h"
 #include "ssdp_cache_output_format.h"
+#include "ssdp_metrics.h"
+#include "string_buffer.h"
 
 /**
- * Create a plain-text message.
+ * Append a string of a plain-text message.
  *
- * @param results The buffer to store the results in.
- * @param buffer_size The size of the buffer 'results'.
- * @param message The message to convert.
+ * @param results The buffer to append the string to.
+ * @param string The string to append, NULL is written as an empty string.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL append_plain_string(string_buffer_s *results,
+    const char *string) {
+  return string ? string_buffer_append_str(results, string) : TRUE;
+}
+
+/**
+ * Append a plain-text message.
+ *
+ * @param results The buffer to append the message to.
+ * @param ssdp_message The message to convert.
+ *
+ * @return TRUE on success, FALSE otherwise.
  */
-static BOOL create_plain_text_message(char *results, int buffer_size,
+static BOOL create_plain_text_message(string_buffer_s *results,
     ssdp_message_s *ssdp_message) {
-  int buffer_used = 0, count = 0;
   ssdp_custom_field_s *cf = NULL;
+  ssdp_header_s *ssdp_headers = ssdp_message->headers;
+  unsigned long count = 0;
+  BOOL ok = TRUE;
 
   if(ssdp_message->custom_fields) {
     cf = ssdp_message->custom_fields->first;
   }
 
-  buffer_used += snprintf(results + buffer_used,
-        buffer_size - buffer_used,
-        "Time received: %s\n",
-        ssdp_message->datetime);
-  buffer_used += snprintf(results + buffer_used,
-        buffer_size - buffer_used,
-        "Origin-MAC: %s\n",
-        (ssdp_message->mac != NULL ? ssdp_message->mac :
-        "(Could not be determined)"));
-  buffer_used += snprintf(results + buffer_used,
-        buffer_size - buffer_used,
-        "Origin-IP: %s\nMessage length: %d Bytes\n",
-        ssdp_message->ip,
-        ssdp_message->message_length);
-  buffer_used += snprintf(results + buffer_used,
-        buffer_size - buffer_used,
-        "Request: %s\nProtocol: %s\n",
-        ssdp_message->request,
-        ssdp_message->protocol);
+  ok &= string_buffer_append_str(results, "Time received: ");
+  ok &= append_plain_string(results, ssdp_message->datetime);
+  ok &= string_buffer_append_str(results, "\nOrigin-MAC: ");
+  ok &= string_buffer_append_str(results, ssdp_message->mac != NULL ?
+      ssdp_message->mac : "(Could not be determined)");
+  ok &= string_buffer_append_str(results, "\nOrigin-IP: ");
+  ok &= append_plain_string(results, ssdp_message->ip);
+  ok &= string_buffer_append_str(results, "\nMessage length: ");
+  ok &= string_buffer_append_uint(results,
+      (unsigned long)ssdp_message->message_length);
+  ok &= string_buffer_append_str(results, " Bytes\nRequest: ");
+  ok &= append_plain_string(results, ssdp_message->request);
+  ok &= string_buffer_append_str(results, "\nProtocol: ");
+  ok &= append_plain_string(results, ssdp_message->protocol);
+  ok &= string_buffer_append_char(results, '\n');
 
   while(cf) {
-    buffer_used += snprintf(results + buffer_used,
-                            buffer_size - buffer_used,
-                            "Custom field[%d][%s]: %s\n",
-                            count,
-                            cf->name,
-                            cf->contents);
+    ok &= string_buffer_append_str(results, "Custom field[");
+    ok &= string_buffer_append_uint(results, count);
+    ok &= string_buffer_append_str(results, "][");
+    ok &= append_plain_string(results, cf->name);
+    ok &= string_buffer_append_str(results, "]: ");
+    ok &= append_plain_string(results, cf->contents);
+    ok &= string_buffer_append_char(results, '\n');
     count++;
     cf = cf->next;
   }
 
   count = 0;
-  ssdp_header_s *ssdp_headers = ssdp_message->headers;
   while(ssdp_headers) {
-  buffer_used += snprintf(results + buffer_used,
-          buffer_size - buffer_used,
-          "Header[%d][type:%d;%s]: %s\n",
-          count, ssdp_headers->type,
-          get_header_string(ssdp_headers->type, ssdp_headers),
-          ssdp_headers->contents);
+    ok &= string_buffer_append_str(results, "Header[");
+    ok &= string_buffer_append_uint(results, count);
+    ok &= string_buffer_append_str(results, "][type:");
+    ok &= string_buffer_append_uint(results, ssdp_headers->type);
+    ok &= string_buffer_append_char(results, ';');
+    ok &= append_plain_string(results,
+        get_header_string(ssdp_headers->type, ssdp_headers));
+    ok &= string_buffer_append_str(results, "]: ");
+    ok &= append_plain_string(results, ssdp_headers->contents);
+    ok &= string_buffer_append_char(results, '\n');
     ssdp_headers = ssdp_headers->next;
     count++;
   }
 
-  return TRUE;
+  return ok;
 }
 
 /**
@@ -88,6 +108,8 @@ static BOOL create_plain_text_message(char *results, int buffer_size,
  *
  * @param url The URL (without the protocol and IP) to send the data to.
  * @param data The data to send.
+ * @param data_length The length of the data (it can be binary).
+ * @param content_type The MIME type of the data.
  * @param da The socket address to send to.
  * @param port The port to send to.
  * @param timeout The send-timeout to set.
@@ -95,8 +117,8 @@ static BOOL create_plain_text_message(char *results, int buffer_size,
  *
  * @return 0 on success, errno otherwise.
  */
-static int send_stuff(const char *url, const char *data,
-    const struct sockaddr_storage *da, int port, int timeout,
+static int send_stuff(const char *url, const char *data, size_t data_length,
+    const char *content_type, const struct sockaddr_storage *da, int port, int timeout,
     configuration_s *conf) {
 
   if(url == NULL || strlen(url) < 1) {
@@ -171,8 +193,10 @@ static int send_stuff(const char *url, const char *data,
       (void *)&((struct sockaddr_in *)da)->sin_addr :
       (void *)&((struct sockaddr_in6 *)da)->sin6_addr), ip, IPv6_STR_MAX_SIZE);
 
-    int request_size = strlen(data) + 150;
-    char *request = (char *)malloc(sizeof(char) * request_size);
+  /* The body and the headers, with room for the URL, IP and type */
+  int request_size = data_length + strlen(url) + IPv6_STR_MAX_SIZE +
+      strlen(content_type) + 150;
+  char *request = (char *)malloc(sizeof(char) * request_size);
   memset(request, '\0', request_size);
 
   int used_length = 0;
@@ -190,17 +214,17 @@ static int send_stuff(const char *url, const char *data,
             "User-Agent: abused-%s\r\n", ABUSED_VERSION);
   used_length += snprintf(request + used_length,
             request_size - used_length,
-            "Content-type: text/xml\r\n");
-  used_length += snprintf(request + used_length,
-            request_size - used_length,
-            "Content-length: %d\r\n\r\n", (int)strlen(data));
+            "Content-type: %s\r\n", content_type);
   used_length += snprintf(request + used_length,
             request_size - used_length,
-            "%s\r\n\r\n", data);
+            "Content-length: %d\r\n\r\n", (int)data_length);
+  /* The body is copied as-is, it can contain null bytes */
+  memcpy(request + used_length, data, data_length);
+  used_length += data_length;
   free(ip);
 
-  PRINT_DEBUG("send_stuff(): sending string:\n%s", request);
-  int bytes = send(send_sock, request, strlen(request), 0);
+  PRINT_DEBUG("send_stuff(): sending %d bytes", used_length);
+  int bytes = send(send_sock, request, used_length, 0);
   free(request);
   if(bytes < 1) {
     PRINT_ERROR("send_stuff(): Failed forwarding message (%d bytes sent)",
@@ -234,11 +258,48 @@ static int send_stuff(const char *url, const char *data,
 }
 
 /**
- * Frees all the elements in the ssdp messages list.
+ * Get the contents of the first header of a type.
  *
- * @param ssdp_cache_pointer The ssdp cache list to be cleared.
+ * @param ssdp_message The message to search in.
+ * @param header_type The header type to look for.
+ *
+ * @return The (interned) contents of the header or NULL if not found.
  */
-static void free_ssdp_cache(ssdp_cache_s **ssdp_cache_pointer) {
+static const char *get_header_contents(const ssdp_message_s *ssdp_message,
+    unsigned char header_type) {
+  ssdp_header_s *header = get_header(ssdp_message, header_type);
+
+  return header ? header->contents : NULL;
+}
+
+/**
+ * Check how a message from a cached device describes the device differently.
+ * Only the headers that describe the device itself are compared, NT, USN and
+ * CACHE-CONTROL differ between the announcements of one device.
+ *
+ * @param cached The cached message.
+ * @param ssdp_message The newly received message from the same device.
+ *
+ * @return The SSDP_CACHE_FIELD_* that changed, 0 if none did.
+ */
+static unsigned int get_changed_fields(const ssdp_message_s *cached,
+    const ssdp_message_s *ssdp_message) {
+  unsigned int fields = 0;
+
+  /* Header contents are interned, equal contents share the same pointer */
+  if (get_header_contents(cached, SSDP_HEADER_LOCATION) !=
+      get_header_contents(ssdp_message, SSDP_HEADER_LOCATION)) {
+    fields |= SSDP_CACHE_FIELD_LOCATION;
+  }
+  if (get_header_contents(cached, SSDP_HEADER_SERVER) !=
+      get_header_contents(ssdp_message, SSDP_HEADER_SERVER)) {
+    fields |= SSDP_CACHE_FIELD_SERVER;
+  }
+
+  return fields;
+}
+
+void free_ssdp_cache(ssdp_cache_s **ssdp_cache_pointer) {
   ssdp_cache_s *ssdp_cache = NULL;
   ssdp_cache_s *next_cache = NULL;
 
@@ -287,11 +348,23 @@ static void free_ssdp_cache(ssdp_cache_s **ssdp_cache_pointer) {
   #endif
 }
 
+unsigned long long ssdp_cache_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 BOOL add_ssdp_message_to_cache(ssdp_cache_s **ssdp_cache_pointer,
-    ssdp_message_s **ssdp_message_pointer) {
+    ssdp_message_s **ssdp_message_pointer, unsigned int *changes) {
   ssdp_message_s *ssdp_message = *ssdp_message_pointer;
   ssdp_cache_s *ssdp_cache = NULL;
 
+  if (changes) {
+    *changes = 0;
+  }
+
   /* Sanity check */
   if (!ssdp_cache_pointer) {
     PRINT_ERROR("No ssdp cache list given");
@@ -326,15 +399,44 @@ BOOL add_ssdp_message_to_cache(ssdp_cache_s **ssdp_cache_pointer,
 
     /* Check for duplicate and update it if found */
     while (ssdp_cache) {
-      if (0 == strcmp(ssdp_message->ip, ssdp_cache->ssdp_message->ip)) {
+      /* IPs are interned, equal IPs share the same pointer */
+      if (ssdp_message->ip == ssdp_cache->ssdp_message->ip) {
         /* Found a duplicate, update existing instead */
         PRINT_DEBUG("Found duplicate SSDP message (IP '%s'), updating",
             ssdp_cache->ssdp_message->ip);
-        strcpy(ssdp_cache->ssdp_message->datetime, ssdp_message->datetime);
-        if(strlen(ssdp_cache->ssdp_message->mac) < 1) {
+        ssdp_message_s *cached = ssdp_cache->ssdp_message;
+        unsigned int change = 0;
+        unsigned int fields = get_changed_fields(cached, ssdp_message);
+        strcpy(cached->datetime, ssdp_message->datetime);
+        ssdp_cache->seen = TRUE;
+        ssdp_cache->revision++;
+        if(strlen(cached->mac) < 1 && strlen(ssdp_message->mac) > 0) {
           PRINT_DEBUG("Field MAC was empty, updating to '%s'",
               ssdp_message->mac);
-          strcpy(ssdp_cache->ssdp_message->mac, ssdp_message->mac);
+          strcpy(cached->mac, ssdp_message->mac);
+          ssdp_cache->dirty |= SSDP_CACHE_FIELD_MAC;
+          change = SSDP_CACHE_UPDATED;
+        }
+        if (fields) {
+          /* Swap the header lists, the old ones are freed with the
+             duplicate */
+          ssdp_header_s *headers = cached->headers;
+          unsigned char header_count = cached->header_count;
+          PRINT_DEBUG("Device description changed, updating headers");
+          cached->headers = ssdp_message->headers;
+          cached->header_count = ssdp_message->header_count;
+          ssdp_message->headers = headers;
+          ssdp_message->header_count = header_count;
+          ssdp_cache->dirty |= fields;
+          change = SSDP_CACHE_UPDATED;
+        }
+        if (change) {
+          ssdp_metrics_inc(SSDP_COUNTER_DEVICES_UPDATED);
+          ssdp_cache->changes |= change;
+          ssdp_cache->changed = ssdp_cache_now();
+          if (changes) {
+            *changes = change;
+          }
         }
         // TODO: make it update all existing fields before freeing it...
         PRINT_DEBUG("Trowing away the duplicate ssdp message and using "
@@ -382,48 +484,339 @@ BOOL add_ssdp_message_to_cache(ssdp_cache_s **ssdp_cache_pointer,
   PRINT_DEBUG("SSDP cache counter increased to %d",
       *ssdp_cache->ssdp_messages_count);
   ssdp_cache->ssdp_message = ssdp_message;
+  ssdp_cache->changes = SSDP_CACHE_ADDED;
+  ssdp_metrics_inc(SSDP_COUNTER_DEVICES_ADDED);
+  ssdp_cache->changed = ssdp_cache_now();
+  ssdp_cache->revision = 1;
+  ssdp_cache->seen = TRUE;
+  ssdp_cache->missed = 0;
+  ssdp_cache->dirty = SSDP_CACHE_FIELD_ALL;
+  ssdp_cache->forwarded = FALSE;
 
   /* Set the passed ssdp_cache to point to the last element */
   *ssdp_cache_pointer = ssdp_cache;
 
+  if (changes) {
+    *changes = SSDP_CACHE_ADDED;
+  }
+
   return TRUE;
 }
 
-BOOL flush_ssdp_cache(configuration_s *conf, ssdp_cache_s **ssdp_cache_pointer,
-    const char *url, struct sockaddr_storage *sockaddr_recipient, int port,
-    int timeout) {
-  ssdp_cache_s *ssdp_cache = *ssdp_cache_pointer;
-  int ssdp_list_size = *ssdp_cache->ssdp_messages_count * XML_BUFFER_SIZE;
-  char ssdp_list[ssdp_list_size];
+ssdp_message_s *remove_ssdp_message_from_cache(
+    ssdp_cache_s **ssdp_cache_pointer, const char *ip) {
+  ssdp_cache_s *ssdp_cache = NULL;
+  ssdp_cache_s *previous = NULL;
+  ssdp_message_s *ssdp_message = NULL;
+
+  if (!ssdp_cache_pointer || !*ssdp_cache_pointer) {
+    return NULL;
+  }
+
+  /* IPs are interned, equal IPs share the same pointer */
+  ssdp_cache = (*ssdp_cache_pointer)->first;
+  while (ssdp_cache && ssdp_cache->ssdp_message->ip != ip) {
+    previous = ssdp_cache;
+    ssdp_cache = ssdp_cache->next;
+  }
+  if (!ssdp_cache) {
+    return NULL;
+  }
+
+  ssdp_message = ssdp_cache->ssdp_message;
+  ssdp_cache->ssdp_message = NULL;
+  ssdp_metrics_inc(SSDP_COUNTER_DEVICES_REMOVED);
+
+  /* The only element, free the whole list */
+  if (*ssdp_cache->ssdp_messages_count == 1) {
+    free_ssdp_cache(ssdp_cache_pointer);
+    return ssdp_message;
+  }
+
+  (*ssdp_cache->ssdp_messages_count)--;
+  if (previous) {
+    previous->next = ssdp_cache->next;
+  }
+  else {
+    /* Removing the first element, every element points to the first */
+    ssdp_cache_s *element = ssdp_cache->next;
+    while (element) {
+      element->first = ssdp_cache->next;
+      element = element->next;
+    }
+  }
+
+  /* Keep the passed pointer pointing to the last element */
+  if (*ssdp_cache_pointer == ssdp_cache) {
+    *ssdp_cache_pointer = previous ? previous : ssdp_cache->next;
+    while ((*ssdp_cache_pointer)->next) {
+      *ssdp_cache_pointer = (*ssdp_cache_pointer)->next;
+    }
+  }
+  free(ssdp_cache);
+
+  PRINT_DEBUG("SSDP cache counter decreased to %d",
+      *(*ssdp_cache_pointer)->ssdp_messages_count);
+
+  return ssdp_message;
+}
+
+BOOL mark_ssdp_cache_device_gone(ssdp_cache_s *ssdp_cache, const char *ip,
+    unsigned int max_missed) {
+  if (!ssdp_cache) {
+    return FALSE;
+  }
+
+  /* IPs are interned, equal IPs share the same pointer */
+  for (ssdp_cache = ssdp_cache->first; ssdp_cache;
+      ssdp_cache = ssdp_cache->next) {
+    if (ssdp_cache->ssdp_message->ip == ip) {
+      ssdp_cache->seen = FALSE;
+      ssdp_cache->missed = max_missed;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+BOOL set_ssdp_cache_device_fetching(ssdp_cache_s *ssdp_cache, const char *ip,
+    BOOL fetching) {
+  if (!ssdp_cache) {
+    return FALSE;
+  }
+
+  /* IPs are interned, equal IPs share the same pointer */
+  for (ssdp_cache = ssdp_cache->first; ssdp_cache;
+      ssdp_cache = ssdp_cache->next) {
+    if (ssdp_cache->ssdp_message->ip == ip) {
+      /* The description (if any) was added to the message */
+      if (ssdp_cache->fetching && !fetching) {
+        ssdp_cache->revision++;
+        ssdp_cache->changed = ssdp_cache_now();
+      }
+      ssdp_cache->fetching = fetching;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+BOOL add_ssdp_cache_goodbye(ssdp_cache_s **removed_pointer,
+    ssdp_message_s *ssdp_message) {
+  ssdp_cache_s *element = (ssdp_cache_s *)calloc(1, sizeof(ssdp_cache_s));
+
+  if (!element) {
+    PRINT_ERROR("Failed to allocate memory for the goodbye");
+    return FALSE;
+  }
+
+  /* A device is only removed once, its goodbyes are not deduplicated */
+  if (*removed_pointer) {
+    element->first = (*removed_pointer)->first;
+    element->ssdp_messages_count = (*removed_pointer)->ssdp_messages_count;
+    (*removed_pointer)->next = element;
+  }
+  else {
+    element->first = element;
+    element->ssdp_messages_count =
+        (unsigned int *)calloc(1, sizeof(unsigned int));
+    if (!element->ssdp_messages_count) {
+      PRINT_ERROR("Failed to allocate memory for the goodbye");
+      free(element);
+      return FALSE;
+    }
+  }
+  element->ssdp_message = ssdp_message;
+  (*element->ssdp_messages_count)++;
+
+  /* Keep the passed pointer pointing to the last element */
+  *removed_pointer = element;
+
+  return TRUE;
+}
+
+BOOL is_ssdp_cache_device_forwarded(const ssdp_cache_s *ssdp_cache,
+    const char *ip) {
+  if (!ssdp_cache) {
+    return FALSE;
+  }
+
+  /* IPs are interned, equal IPs share the same pointer */
+  for (ssdp_cache = ssdp_cache->first; ssdp_cache;
+      ssdp_cache = ssdp_cache->next) {
+    if (ssdp_cache->ssdp_message->ip == ip) {
+      return ssdp_cache->forwarded;
+    }
+  }
+
+  return FALSE;
+}
+
+unsigned int collect_ssdp_cache_changes(ssdp_cache_s **ssdp_cache_pointer,
+    unsigned int max_missed, ssdp_cache_change_callback callback,
+    void *data) {
+  ssdp_cache_s *ssdp_cache = NULL;
+  unsigned int count = 0;
+
+  if (!ssdp_cache_pointer || !*ssdp_cache_pointer) {
+    return 0;
+  }
+
+  ssdp_cache = (*ssdp_cache_pointer)->first;
+  while (ssdp_cache) {
+    /* Removing frees the element, and the list with the last one */
+    ssdp_cache_s *next = ssdp_cache->next;
+
+    if (!ssdp_cache->seen && ++ssdp_cache->missed >= max_missed) {
+      /* A device that came and went in between was never reported */
+      BOOL reported = !(ssdp_cache->changes & SSDP_CACHE_ADDED);
+      ssdp_message_s *removed = remove_ssdp_message_from_cache(
+          ssdp_cache_pointer, ssdp_cache->ssdp_message->ip);
+      if (reported) {
+        callback(data, SSDP_CACHE_REMOVED, removed);
+        count++;
+      }
+      else {
+        callback(data, SSDP_CACHE_DROPPED, removed);
+      }
+      free_ssdp_message(&removed);
+    }
+    else {
+      if (ssdp_cache->seen) {
+        ssdp_cache->missed = 0;
+      }
+      ssdp_cache->seen = FALSE;
+      /* A device being described is reported once it is */
+      if (ssdp_cache->changes && !ssdp_cache->fetching) {
+        /* An added device is reported as added, even if it changed */
+        callback(data, (ssdp_cache->changes & SSDP_CACHE_ADDED) ?
+            SSDP_CACHE_ADDED : SSDP_CACHE_UPDATED, ssdp_cache->ssdp_message);
+        ssdp_cache->changes = 0;
+        count++;
+      }
+    }
+    ssdp_cache = next;
+  }
+
+  return count;
+}
+
+/**
+ * Convert a SSDP cache to the forwarded format (-j, -b, -x or plain text).
+ *
+ * @param conf The configuration to use.
+ * @param ssdp_cache The SSDP cache to convert.
+ * @param ssdp_list The buffer to initialize and convert to, it is freed on
+ *        failure.
+ * @param content_type Set to the MIME type of the format.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL convert_ssdp_cache(configuration_s *conf,
+    ssdp_cache_s *ssdp_cache, string_buffer_s *ssdp_list,
+    const char **content_type) {
+  *content_type = "text/plain";
+
+  if (!string_buffer_init(ssdp_list,
+      *ssdp_cache->ssdp_messages_count * XML_BUFFER_SIZE)) {
+    return FALSE;
+  }
 
   /* If -j then convert all messages to one JSON blob */
   if (conf->json_output) {
-    if(cache_to_json(ssdp_cache, ssdp_list, ssdp_list_size) < 1) {
+    if (cache_to_json(ssdp_cache, ssdp_list) < 1) {
       PRINT_ERROR("Failed creating JSON blob from ssdp cache");
+      string_buffer_free(ssdp_list);
+      return FALSE;
+    }
+    *content_type = "application/json";
+  }
+
+  /* If -b then convert all messages to one binary batch */
+  else if (conf->binary_output) {
+    if (cache_to_binary(ssdp_cache, ssdp_list) < 1) {
+      PRINT_ERROR("Failed creating binary batch from ssdp cache");
+      string_buffer_free(ssdp_list);
       return FALSE;
     }
+    *content_type = "application/octet-stream";
   }
 
   /* If -x then convert all messages to one XML blob */
-  if (conf->xml_output) {
-    if(cache_to_xml(ssdp_cache, ssdp_list, ssdp_list_size) < 1) {
+  else if (conf->xml_output) {
+    if (cache_to_xml(ssdp_cache, ssdp_list) < 1) {
       PRINT_ERROR("Failed creating XML blob from ssdp cache");
+      string_buffer_free(ssdp_list);
       return FALSE;
     }
+    *content_type = "text/xml";
   }
 
-  // TODO: make it create a list instead of single plain message
-  else if (!create_plain_text_message(ssdp_list, XML_BUFFER_SIZE,
-      ssdp_cache->ssdp_message)) {
-    PRINT_ERROR("Failed creating plain-text message");
-    return FALSE;
+  /* Otherwise all the messages as plain text, separated by empty lines */
+  else {
+    ssdp_cache_s *element = NULL;
+    for (element = ssdp_cache->first; element; element = element->next) {
+      if ((element != ssdp_cache->first &&
+          !string_buffer_append_char(ssdp_list, '\n')) ||
+          !create_plain_text_message(ssdp_list, element->ssdp_message)) {
+        PRINT_ERROR("Failed creating plain-text message");
+        string_buffer_free(ssdp_list);
+        return FALSE;
+      }
+    }
   }
 
-  /* Send the converted cache list to the recipient (-a) */
-  if (send_stuff(url, ssdp_list, sockaddr_recipient, port, timeout, conf)) {
+  return TRUE;
+}
+
+/**
+ * Send a converted SSDP cache to the recipient (-a) and count how it went.
+ *
+ * @param conf The configuration to use.
+ * @param ssdp_list The converted SSDP cache.
+ * @param content_type The MIME type of the format.
+ * @param url The URL (without the protocol and IP) to send the data to.
+ * @param sockaddr_recipient The socket address to send to.
+ * @param port The port to send to.
+ * @param timeout The send-timeout to set.
+ *
+ * @return TRUE if it was sent, FALSE otherwise.
+ */
+static BOOL send_ssdp_list(configuration_s *conf,
+    const string_buffer_s *ssdp_list, const char *content_type,
+    const char *url, struct sockaddr_storage *sockaddr_recipient, int port,
+    int timeout) {
+  if (send_stuff(url, ssdp_list->data, ssdp_list->length, content_type,
+      sockaddr_recipient, port, timeout, conf)) {
     PRINT_WARN("Failed to send SSDP list to the specified forward address");
+    ssdp_metrics_inc(SSDP_COUNTER_FORWARD_FAILURES);
+    return FALSE;
+  }
+
+  ssdp_metrics_inc(SSDP_COUNTER_FORWARDS);
+  ssdp_metrics_add(SSDP_COUNTER_FORWARDED_BYTES, ssdp_list->length);
+
+  return TRUE;
+}
+
+BOOL flush_ssdp_cache(configuration_s *conf, ssdp_cache_s **ssdp_cache_pointer,
+    const char *url, struct sockaddr_storage *sockaddr_recipient, int port,
+    int timeout) {
+  string_buffer_s ssdp_list;
+  const char *content_type = NULL;
+
+  if (!convert_ssdp_cache(conf, *ssdp_cache_pointer, &ssdp_list,
+      &content_type)) {
+    return FALSE;
   }
 
+  /* Send the converted cache list to the recipient (-a) */
+  send_ssdp_list(conf, &ssdp_list, content_type, url, sockaddr_recipient,
+      port, timeout);
+  string_buffer_free(&ssdp_list);
+
   /* When the ssdp_cache has been sent
      then free/empty the cache list */
   free_ssdp_cache(ssdp_cache_pointer);
@@ -431,3 +824,79 @@ BOOL flush_ssdp_cache(configuration_s *conf, ssdp_cache_s **ssdp_cache_pointer,
   return TRUE;
 }
 
+BOOL forward_ssdp_cache_changes(configuration_s *conf,
+    ssdp_cache_s *ssdp_cache, ssdp_cache_s **removed_pointer,
+    BOOL everything, const char *url,
+    struct sockaddr_storage *sockaddr_recipient, int port, int timeout) {
+  ssdp_cache_s *selected = NULL;
+  ssdp_cache_s *element = NULL;
+  string_buffer_s ssdp_list;
+  const char *content_type = NULL;
+  unsigned int size = 0;
+  unsigned int count = 0;
+  BOOL sent = FALSE;
+
+  if (*removed_pointer) {
+    size += *(*removed_pointer)->ssdp_messages_count;
+  }
+  if (ssdp_cache) {
+    size += *ssdp_cache->ssdp_messages_count;
+  }
+  if (size == 0) {
+    return TRUE;
+  }
+
+  /* The elements of the sent list point to the cached messages, the
+     goodbyes go first so that a device that came back is not forgotten */
+  selected = (ssdp_cache_s *)calloc(size, sizeof(ssdp_cache_s));
+  if (!selected) {
+    PRINT_ERROR("Failed to allocate memory for the forwarded devices");
+    return FALSE;
+  }
+  for (element = *removed_pointer ? (*removed_pointer)->first : NULL;
+      element; element = element->next) {
+    PRINT_DEBUG("Forwarding the goodbye of '%s'", element->ssdp_message->ip);
+    selected[count++].ssdp_message = element->ssdp_message;
+  }
+  for (element = ssdp_cache ? ssdp_cache->first : NULL; element;
+      element = element->next) {
+    if (element->fetching || (!everything && !element->dirty)) {
+      continue;
+    }
+    PRINT_DEBUG("Forwarding '%s' (changed fields 0x%02x)",
+        element->ssdp_message->ip, element->dirty);
+    selected[count++].ssdp_message = element->ssdp_message;
+  }
+  if (count == 0) {
+    free(selected);
+    return TRUE;
+  }
+  for (size = 0; size < count; size++) {
+    selected[size].first = selected;
+    selected[size].ssdp_messages_count = &count;
+    selected[size].next = size + 1 < count ? &selected[size + 1] : NULL;
+  }
+
+  if (convert_ssdp_cache(conf, selected, &ssdp_list, &content_type)) {
+    sent = send_ssdp_list(conf, &ssdp_list, content_type, url,
+        sockaddr_recipient, port, timeout);
+    string_buffer_free(&ssdp_list);
+  }
+  free(selected);
+  if (!sent) {
+    return FALSE;
+  }
+
+  /* Only the devices in the batch have been sent */
+  for (element = ssdp_cache ? ssdp_cache->first : NULL; element;
+      element = element->next) {
+    if (element->fetching || (!everything && !element->dirty)) {
+      continue;
+    }
+    element->dirty = 0;
+    element->forwarded = TRUE;
+  }
+  free_ssdp_cache(removed_pointer);
+
+  return TRUE;
+}
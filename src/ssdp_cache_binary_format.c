@@ -0,0 +1,655 @@
+/** \file ssdp_cache_binary_format.c
+ * Functions for encoding the SSDP cache to, and decoding it from, the compact
+ * binary batch format (see ssdp_cache_binary_format.h for the layout).
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common_definitions.h"
+#include "log.h"
+#include "net_definitions.h"
+#include "ssdp_cache.h"
+#include "ssdp_cache_binary_format.h"
+#include "ssdp_message.h"
+#include "string_buffer.h"
+#include "string_intern.h"
+
+/** The maximum number of bytes in a 64-bit varint. */
+#define VARINT_MAX_SIZE 10
+
+/** The number of string table slots to start with (must be a power of 2). */
+#define STRING_TABLE_INITIAL_SLOTS 64
+
+/**
+ * The string table of a batch being encoded. All the strings in a message
+ * are interned so they are deduplicated by pointer.
+ */
+typedef struct string_table_struct {
+  /** The strings in the order they are written. */
+  const char **strings;
+  /** The number of strings in the table. */
+  unsigned int count;
+  /** The open-addressing index, holds string index + 1 (0 is empty). */
+  unsigned int *slots;
+  /** The number of slots (always a power of 2). */
+  unsigned int slots_count;
+} string_table_s;
+
+/** A cursor over a batch being decoded. */
+typedef struct binary_reader_struct {
+  /** The next byte to read. */
+  const unsigned char *pos;
+  /** One past the last byte of the batch. */
+  const unsigned char *end;
+} binary_reader_s;
+
+/** A string in the string table of a batch being decoded. */
+typedef struct binary_string_struct {
+  /** The string (not null-terminated, points into the batch). */
+  const char *data;
+  /** The length of the string. */
+  size_t length;
+} binary_string_s;
+
+/**
+ * Append an unsigned LEB128 varint to a buffer.
+ *
+ * @param buffer The buffer to append to.
+ * @param value The value to append.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL append_varint(string_buffer_s *buffer, unsigned long long value) {
+  char bytes[VARINT_MAX_SIZE];
+  int used = 0;
+
+  do {
+    bytes[used] = (char)(value & 0x7f);
+    value >>= 7;
+    if (value) {
+      bytes[used] |= 0x80;
+    }
+    used++;
+  } while (value);
+
+  return string_buffer_append(buffer, bytes, used);
+}
+
+/**
+ * Calculate the slot of a string pointer in the string table.
+ *
+ * @param string The (interned) string.
+ * @param slots_count The number of slots in the table.
+ *
+ * @return The first slot to probe.
+ */
+static unsigned int string_slot(const char *string,
+    unsigned int slots_count) {
+  return (unsigned int)(((uintptr_t)string >> 3) * 2654435761u) &
+      (slots_count - 1);
+}
+
+/**
+ * Double the number of slots in the string table and reindex the strings.
+ *
+ * @param table The table to grow.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL grow_string_table(string_table_s *table) {
+  unsigned int new_count = table->slots_count ?
+      table->slots_count * 2 : STRING_TABLE_INITIAL_SLOTS;
+  const char **new_strings = NULL;
+  unsigned int *new_slots = NULL;
+  unsigned int i;
+
+  new_slots = (unsigned int *)calloc(new_count, sizeof(unsigned int));
+  if (!new_slots) {
+    PRINT_ERROR("Failed to allocate memory for the binary string table");
+    return FALSE;
+  }
+
+  /* The table never holds more strings than half the slots */
+  new_strings = (const char **)realloc(table->strings,
+      sizeof(const char *) * (new_count / 2));
+  if (!new_strings) {
+    PRINT_ERROR("Failed to allocate memory for the binary string table");
+    free(new_slots);
+    return FALSE;
+  }
+
+  for (i = 0; i < table->count; i++) {
+    unsigned int pos = string_slot(new_strings[i], new_count);
+    while (new_slots[pos]) {
+      pos = (pos + 1) & (new_count - 1);
+    }
+    new_slots[pos] = i + 1;
+  }
+
+  free(table->slots);
+  table->strings = new_strings;
+  table->slots = new_slots;
+  table->slots_count = new_count;
+
+  return TRUE;
+}
+
+/**
+ * Append a string reference to a buffer, adding the string to the string
+ * table if it is not there already.
+ *
+ * @param table The string table of the batch.
+ * @param buffer The buffer to append the reference to.
+ * @param string The (interned) string, NULL is written as reference 0.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL append_string_ref(string_table_s *table, string_buffer_s *buffer,
+    const char *string) {
+  unsigned int pos;
+
+  if (!string) {
+    return append_varint(buffer, 0);
+  }
+
+  if ((table->count + 1) * 2 > table->slots_count &&
+      !grow_string_table(table)) {
+    return FALSE;
+  }
+
+  pos = string_slot(string, table->slots_count);
+  while (table->slots[pos]) {
+    if (table->strings[table->slots[pos] - 1] == string) {
+      return append_varint(buffer, table->slots[pos]);
+    }
+    pos = (pos + 1) & (table->slots_count - 1);
+  }
+
+  table->strings[table->count++] = string;
+  table->slots[pos] = table->count;
+
+  return append_varint(buffer, table->count);
+}
+
+/**
+ * Convert a datetime string of a message to seconds since the epoch.
+ *
+ * @param datetime The datetime ("YYYY-MM-DD HH:MM:SS", local time).
+ *
+ * @return The seconds since the epoch or 0 if the datetime is not set.
+ */
+static unsigned long long datetime_to_seconds(const char *datetime) {
+  struct tm tm;
+  time_t seconds;
+
+  memset(&tm, 0, sizeof(struct tm));
+  if (!datetime || 6 != sscanf(datetime, "%d-%d-%d %d:%d:%d", &tm.tm_year,
+      &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec)) {
+    return 0;
+  }
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  tm.tm_isdst = -1;
+
+  seconds = mktime(&tm);
+
+  return seconds < 0 ? 0 : (unsigned long long)seconds;
+}
+
+/**
+ * Encode one message of a batch.
+ *
+ * @param table The string table of the batch.
+ * @param buffer The buffer to append the message to.
+ * @param ssdp_message The message to encode.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL message_to_binary(string_table_s *table, string_buffer_s *buffer,
+    const ssdp_message_s *ssdp_message) {
+  unsigned char ip[16];
+  unsigned int mac[6];
+  unsigned char flags = 0;
+  unsigned int count, i;
+  ssdp_header_s *header = NULL;
+  ssdp_custom_field_s *cf = NULL;
+
+  if (ssdp_message->ip && 1 == inet_pton(AF_INET, ssdp_message->ip, ip)) {
+    /* No flag, 4 bytes */
+  }
+  else if (ssdp_message->ip &&
+      1 == inet_pton(AF_INET6, ssdp_message->ip, ip)) {
+    flags |= SSDP_BINARY_FLAG_IPV6;
+  }
+  else {
+    flags |= SSDP_BINARY_FLAG_IP_STRING;
+  }
+
+  if (ssdp_message->mac && 6 == sscanf(ssdp_message->mac, "%x:%x:%x:%x:%x:%x",
+      &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5])) {
+    flags |= SSDP_BINARY_FLAG_MAC;
+  }
+
+  if (!string_buffer_append_char(buffer, (char)flags)) {
+    return FALSE;
+  }
+
+  if (flags & SSDP_BINARY_FLAG_IP_STRING) {
+    if (!append_string_ref(table, buffer, ssdp_message->ip)) {
+      return FALSE;
+    }
+  }
+  else if (!string_buffer_append(buffer, (char *)ip,
+      (flags & SSDP_BINARY_FLAG_IPV6) ? 16 : 4)) {
+    return FALSE;
+  }
+
+  if (flags & SSDP_BINARY_FLAG_MAC) {
+    for (i = 0; i < 6; i++) {
+      if (!string_buffer_append_char(buffer, (char)mac[i])) {
+        return FALSE;
+      }
+    }
+  }
+
+  if (!append_varint(buffer, ssdp_message->message_length < 0 ? 0 :
+      ssdp_message->message_length) ||
+      !append_varint(buffer, datetime_to_seconds(ssdp_message->datetime)) ||
+      !append_string_ref(table, buffer, ssdp_message->request) ||
+      !append_string_ref(table, buffer, ssdp_message->protocol)) {
+    return FALSE;
+  }
+
+  /* The last header in the list can be an empty (unparsable) one */
+  count = 0;
+  for (header = ssdp_message->headers; header; header = header->next) {
+    if (header->contents) {
+      count++;
+    }
+  }
+  if (!append_varint(buffer, count)) {
+    return FALSE;
+  }
+  for (header = ssdp_message->headers; header; header = header->next) {
+    if (!header->contents) {
+      continue;
+    }
+    if (!append_varint(buffer, header->type) ||
+        (header->type == SSDP_HEADER_UNKNOWN &&
+        !append_string_ref(table, buffer, header->unknown_type)) ||
+        !append_string_ref(table, buffer, header->contents)) {
+      return FALSE;
+    }
+  }
+
+  count = 0;
+  if (ssdp_message->custom_fields) {
+    for (cf = ssdp_message->custom_fields->first; cf; cf = cf->next) {
+      count++;
+    }
+  }
+  if (!append_varint(buffer, count)) {
+    return FALSE;
+  }
+  if (ssdp_message->custom_fields) {
+    for (cf = ssdp_message->custom_fields->first; cf; cf = cf->next) {
+      if (!append_string_ref(table, buffer, cf->name) ||
+          !append_string_ref(table, buffer, cf->contents)) {
+        return FALSE;
+      }
+    }
+  }
+
+  return TRUE;
+}
+
+unsigned int cache_to_binary(ssdp_cache_s *ssdp_cache,
+    string_buffer_s *binary_buffer) {
+  string_table_s table;
+  string_buffer_s messages;
+  size_t start = binary_buffer->length;
+  unsigned int i;
+  BOOL ok = TRUE;
+
+  if (!ssdp_cache) {
+    return 0;
+  }
+
+  /* The string table is only complete once all the messages are encoded, so
+     encode them to a separate buffer first */
+  if (!string_buffer_init(&messages,
+      *ssdp_cache->ssdp_messages_count * XML_BUFFER_SIZE / 4)) {
+    return 0;
+  }
+  memset(&table, 0, sizeof(string_table_s));
+
+  ok = append_varint(&messages, *ssdp_cache->ssdp_messages_count);
+  ssdp_cache = ssdp_cache->first;
+  while (ok && ssdp_cache) {
+    ok = message_to_binary(&table, &messages, ssdp_cache->ssdp_message);
+    ssdp_cache = ssdp_cache->next;
+  }
+
+  ok = ok &&
+      string_buffer_append(binary_buffer, SSDP_BINARY_MAGIC,
+      sizeof(SSDP_BINARY_MAGIC) - 1) &&
+      string_buffer_append_char(binary_buffer, SSDP_BINARY_VERSION) &&
+      append_varint(binary_buffer, table.count);
+  for (i = 0; ok && i < table.count; i++) {
+    size_t length = string_intern_length(table.strings[i]);
+    ok = append_varint(binary_buffer, length) &&
+        string_buffer_append(binary_buffer, table.strings[i], length);
+  }
+  ok = ok && string_buffer_append(binary_buffer, messages.data,
+      messages.length);
+
+  free(table.strings);
+  free(table.slots);
+  string_buffer_free(&messages);
+
+  if (!ok) {
+    PRINT_ERROR("Failed to encode the binary batch");
+    binary_buffer->length = start;
+    binary_buffer->data[start] = '\0';
+    return 0;
+  }
+
+  return (unsigned int)(binary_buffer->length - start);
+}
+
+/**
+ * Read an unsigned LEB128 varint.
+ *
+ * @param reader The reader to read from.
+ * @param value Where to store the value.
+ *
+ * @return TRUE on success, FALSE if the varint is truncated or too long.
+ */
+static BOOL read_varint(binary_reader_s *reader, unsigned long long *value) {
+  int shift = 0;
+
+  *value = 0;
+  while (reader->pos < reader->end && shift < 7 * VARINT_MAX_SIZE) {
+    unsigned char byte = *reader->pos++;
+    *value |= (unsigned long long)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return TRUE;
+    }
+    shift += 7;
+  }
+
+  return FALSE;
+}
+
+/**
+ * Read a number of raw bytes.
+ *
+ * @param reader The reader to read from.
+ * @param bytes Where to store the bytes.
+ * @param length The number of bytes to read.
+ *
+ * @return TRUE on success, FALSE if the batch is too short.
+ */
+static BOOL read_bytes(binary_reader_s *reader, void *bytes, size_t length) {
+  if ((size_t)(reader->end - reader->pos) < length) {
+    return FALSE;
+  }
+  memcpy(bytes, reader->pos, length);
+  reader->pos += length;
+
+  return TRUE;
+}
+
+/**
+ * Read a string reference and intern the string it refers to.
+ *
+ * @param reader The reader to read from.
+ * @param strings The string table of the batch.
+ * @param strings_count The number of strings in the table.
+ * @param string Where to store the interned string (NULL for reference 0).
+ *
+ * @return TRUE on success, FALSE if the reference is invalid or on failure.
+ */
+static BOOL read_string_ref(binary_reader_s *reader,
+    const binary_string_s *strings, unsigned long long strings_count,
+    const char **string) {
+  unsigned long long index;
+
+  *string = NULL;
+  if (!read_varint(reader, &index) || index > strings_count) {
+    return FALSE;
+  }
+  if (index == 0) {
+    return TRUE;
+  }
+  *string = string_intern_n(strings[index - 1].data,
+      strings[index - 1].length);
+
+  return *string != NULL;
+}
+
+/**
+ * Decode one message of a batch.
+ *
+ * @param reader The reader to read from.
+ * @param strings The string table of the batch.
+ * @param strings_count The number of strings in the table.
+ * @param ssdp_message The (initialized) message to decode into.
+ *
+ * @return TRUE on success, FALSE if the message is malformed or on failure.
+ */
+static BOOL binary_to_message(binary_reader_s *reader,
+    const binary_string_s *strings, unsigned long long strings_count,
+    ssdp_message_s *ssdp_message) {
+  unsigned char flags;
+  unsigned char ip[16];
+  unsigned char mac[6];
+  char ip_string[IPv6_STR_MAX_SIZE];
+  unsigned long long value, count, i;
+  ssdp_header_s *header = NULL;
+  ssdp_custom_field_s *cf = NULL;
+
+  if (!read_bytes(reader, &flags, 1)) {
+    return FALSE;
+  }
+
+  if (flags & SSDP_BINARY_FLAG_IP_STRING) {
+    if (!read_string_ref(reader, strings, strings_count, &ssdp_message->ip)) {
+      return FALSE;
+    }
+  }
+  else {
+    int family = (flags & SSDP_BINARY_FLAG_IPV6) ? AF_INET6 : AF_INET;
+    if (!read_bytes(reader, ip, family == AF_INET6 ? 16 : 4) ||
+        !inet_ntop(family, ip, ip_string, IPv6_STR_MAX_SIZE)) {
+      return FALSE;
+    }
+    ssdp_message->ip = string_intern(ip_string);
+    if (!ssdp_message->ip) {
+      return FALSE;
+    }
+  }
+
+  if (flags & SSDP_BINARY_FLAG_MAC) {
+    if (!read_bytes(reader, mac, 6)) {
+      return FALSE;
+    }
+    snprintf(ssdp_message->mac, MAC_STR_MAX_SIZE, "%x:%x:%x:%x:%x:%x",
+        mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  }
+
+  if (!read_varint(reader, &value)) {
+    return FALSE;
+  }
+  ssdp_message->message_length = (int)value;
+
+  if (!read_varint(reader, &value)) {
+    return FALSE;
+  }
+  if (value) {
+    time_t t = (time_t)value;
+    strftime(ssdp_message->datetime, 20, "%Y-%m-%d %H:%M:%S", localtime(&t));
+  }
+
+  if (!read_string_ref(reader, strings, strings_count,
+      &ssdp_message->request) ||
+      !read_string_ref(reader, strings, strings_count,
+      &ssdp_message->protocol)) {
+    return FALSE;
+  }
+
+  if (!read_varint(reader, &count) || count > 0xff) {
+    return FALSE;
+  }
+  for (i = 0; i < count; i++) {
+    ssdp_header_s *new_header = (ssdp_header_s *)malloc(sizeof(ssdp_header_s));
+    if (!new_header) {
+      PRINT_ERROR("Failed to allocate memory for a SSDP header");
+      return FALSE;
+    }
+    memset(new_header, 0, sizeof(ssdp_header_s));
+
+    /* Link it in first so free_ssdp_message() cleans up on failure */
+    if (header) {
+      new_header->first = header->first;
+      header->next = new_header;
+    }
+    else {
+      new_header->first = new_header;
+      ssdp_message->headers = new_header;
+    }
+    header = new_header;
+
+    if (!read_varint(reader, &value) || value > 0xff) {
+      return FALSE;
+    }
+    header->type = (unsigned char)value;
+    if (header->type == SSDP_HEADER_UNKNOWN &&
+        !read_string_ref(reader, strings, strings_count,
+        &header->unknown_type)) {
+      return FALSE;
+    }
+    if (!read_string_ref(reader, strings, strings_count, &header->contents)) {
+      return FALSE;
+    }
+    ssdp_message->header_count++;
+  }
+
+  if (!read_varint(reader, &count) || count > 0xff) {
+    return FALSE;
+  }
+  for (i = 0; i < count; i++) {
+    ssdp_custom_field_s *new_cf =
+        (ssdp_custom_field_s *)malloc(sizeof(ssdp_custom_field_s));
+    if (!new_cf) {
+      PRINT_ERROR("Failed to allocate memory for a SSDP custom field");
+      return FALSE;
+    }
+    memset(new_cf, 0, sizeof(ssdp_custom_field_s));
+
+    if (cf) {
+      new_cf->first = cf->first;
+      cf->next = new_cf;
+    }
+    else {
+      new_cf->first = new_cf;
+      ssdp_message->custom_fields = new_cf;
+    }
+    cf = new_cf;
+
+    if (!read_string_ref(reader, strings, strings_count, &cf->name) ||
+        !read_string_ref(reader, strings, strings_count, &cf->contents)) {
+      return FALSE;
+    }
+    ssdp_message->custom_field_count++;
+  }
+
+  return TRUE;
+}
+
+BOOL binary_to_cache(const unsigned char *data, size_t length,
+    ssdp_cache_s **ssdp_cache_pointer) {
+  binary_reader_s reader = { data, data + length };
+  binary_string_s *strings = NULL;
+  unsigned long long strings_count, messages_count, i;
+  char magic[sizeof(SSDP_BINARY_MAGIC) - 1];
+  unsigned char version;
+
+  if (!read_bytes(&reader, magic, sizeof(magic)) ||
+      0 != memcmp(magic, SSDP_BINARY_MAGIC, sizeof(magic))) {
+    PRINT_ERROR("Not a binary SSDP batch");
+    return FALSE;
+  }
+  if (!read_bytes(&reader, &version, 1) || version != SSDP_BINARY_VERSION) {
+    PRINT_ERROR("Unsupported binary SSDP batch version");
+    return FALSE;
+  }
+
+  /* Every string takes at least one byte, which bounds the allocation */
+  if (!read_varint(&reader, &strings_count) ||
+      strings_count > (unsigned long long)(reader.end - reader.pos)) {
+    PRINT_ERROR("Malformed binary SSDP batch string table");
+    return FALSE;
+  }
+  if (strings_count) {
+    strings = (binary_string_s *)malloc(sizeof(binary_string_s) *
+        strings_count);
+    if (!strings) {
+      PRINT_ERROR("Failed to allocate memory for the binary string table");
+      return FALSE;
+    }
+  }
+  for (i = 0; i < strings_count; i++) {
+    unsigned long long string_length;
+    if (!read_varint(&reader, &string_length) ||
+        string_length > (unsigned long long)(reader.end - reader.pos)) {
+      PRINT_ERROR("Malformed binary SSDP batch string table");
+      free(strings);
+      return FALSE;
+    }
+    strings[i].data = (const char *)reader.pos;
+    strings[i].length = (size_t)string_length;
+    reader.pos += string_length;
+  }
+
+  if (!read_varint(&reader, &messages_count)) {
+    PRINT_ERROR("Malformed binary SSDP batch");
+    free(strings);
+    return FALSE;
+  }
+
+  for (i = 0; i < messages_count; i++) {
+    ssdp_message_s *ssdp_message = NULL;
+
+    if (!init_ssdp_message(&ssdp_message)) {
+      PRINT_ERROR("Failed to initialize a SSDP message");
+      free(strings);
+      return FALSE;
+    }
+
+    if (!binary_to_message(&reader, strings, strings_count, ssdp_message)) {
+      PRINT_ERROR("Malformed message %d in binary SSDP batch", (int)i);
+      free_ssdp_message(&ssdp_message);
+      free(strings);
+      return FALSE;
+    }
+
+    if (!add_ssdp_message_to_cache(ssdp_cache_pointer, &ssdp_message,
+        NULL)) {
+      free_ssdp_message(&ssdp_message);
+      free(strings);
+      return FALSE;
+    }
+  }
+
+  free(strings);
+
+  return TRUE;
+}
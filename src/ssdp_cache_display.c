@@ -1,17 +1,135 @@
 /** \file ssdp_cache_display.c
  * Functions for displaying the SSDP cache.
  *
+ * The table is composed into a frame of terminal cells which is compared to
+ * a shadow copy of what is on the screen, only the changed cells are sent to
+ * the terminal (in one write()). Only the rows that fit in the terminal are
+ * composed, the rest are reached by scrolling.
+ *
  * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
  */
 
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common_definitions.h"
 #include "log.h"
 #include "ssdp_cache.h"
+#include "ssdp_cache_display.h"
 #include "ssdp_cache_output_format.h"
+#include "string_buffer.h"
+
+/** The number of table columns. */
+#define DISPLAY_COLUMNS 5
+/** The number of terminal rows that are not device rows. */
+#define DISPLAY_CHROME_ROWS 5
+/** The size used when the terminal size cannot be read. */
+#define DISPLAY_FALLBACK_WIDTH 100
+/** The size used when the terminal size cannot be read. */
+#define DISPLAY_FALLBACK_HEIGHT 30
+/** Switch to the alternate screen and hide the cursor. */
+#define DISPLAY_ENTER "\x1b[?1049h\x1b[?25l"
+/** Reset the attributes, show the cursor and leave the alternate screen. */
+#define DISPLAY_LEAVE "\x1b[0m\x1b[?25h\x1b[?1049l"
+
+/** The table columns. */
+enum display_column_enum {
+  COLUMN_ID,
+  COLUMN_IP,
+  COLUMN_MAC,
+  COLUMN_MODEL,
+  COLUMN_VERSION
+};
+
+/** A terminal cell. */
+typedef struct display_cell_struct {
+  /** The UTF-8 encoded character. */
+  char glyph[4];
+  /** The length of the glyph, 0 marks an unknown cell. */
+  unsigned char length;
+  /** Draw the character in bold. */
+  unsigned char bold;
+} display_cell_s;
+
+/** A device row of the table. */
+typedef struct display_row_struct {
+  /** The message of the device. */
+  const ssdp_message_s *ssdp_message;
+  /** The cells of the row (NULL if not available). */
+  const char *cells[DISPLAY_COLUMNS];
+  /** The position of the device in the cache (keeps sorting stable). */
+  unsigned int position;
+} display_row_s;
+
+/** The column titles. */
+static const char *column_titles[DISPLAY_COLUMNS] = {
+  "ID", "IPv4", "MAC", "Model", "Version"
+};
+
+/** The column widths (excluding the leading space and the border). */
+static const int column_widths[DISPLAY_COLUMNS] = { 20, 16, 18, 16, 16 };
+
+/** The table elements (corners, junctions and lines). */
+enum table_element_enum {
+  TBL_RIGHT_T, TBL_VERTICAL, TBL_TOP_RIGHT, TBL_BOTTOM_RIGHT, TBL_BOTTOM_LEFT,
+  TBL_TOP_LEFT, TBL_BOTTOM_T, TBL_TOP_T, TBL_LEFT_T, TBL_HORIZONTAL, TBL_CROSS
+};
+
+/** The UTF-8 table elements (in table_element_enum order). */
+static const char *single_line_table_elements[] = {
+  "┤", "│", "┐", "┘", "└", "┌", "┴", "┬", "├", "─", "┼"
+};
+
+/** The ASCII table elements (in table_element_enum order). */
+static const char *asci_table_elements[] = {
+  "+", "|", "+", "+", "+", "+", "+", "+", "+", "-", "+"
+};
+
+/** The state of the display. */
+static struct {
+  /** Draw with ASCII characters only. */
+  BOOL draw_asci;
+  /** A frame is waiting to be drawn. */
+  BOOL dirty;
+  /** The maximum number of frames per second (0 for no limit). */
+  unsigned int max_fps;
+  /** When the last frame was drawn. */
+  struct timespec last_frame;
+  /** What is on the screen. */
+  display_cell_s *shadow;
+  /** The frame being composed. */
+  display_cell_s *frame;
+  /** The size of the frames. */
+  int width;
+  /** The size of the frames. */
+  int height;
+  /** The first device row shown. */
+  int scroll;
+  /** The column to sort by, -1 to keep the cache order. */
+  int sort_column;
+  /** Sort in descending order. */
+  BOOL sort_descending;
+  /** The device rows. */
+  display_row_s *rows;
+  /** The allocated number of device rows. */
+  unsigned int rows_size;
+  /** The terminal output of a frame. */
+  string_buffer_s output;
+  /** Keys are read from stdin. */
+  BOOL key_input;
+  /** The terminal settings to restore. */
+  struct termios saved_termios;
+  /** The terminal has been set up. */
+  BOOL initialized;
+} display = { FALSE, FALSE, DISPLAY_DEFAULT_FPS, { 0, 0 }, NULL, NULL, 0, 0,
+    0, -1, FALSE, NULL, 0, { NULL, 0, 0 }, FALSE };
 
 /**
  * Read the terminal width and height.
@@ -21,141 +139,635 @@
  */
 static void get_window_size(int *width, int *height) {
   struct winsize w;
-  ioctl(0, TIOCGWINSZ, &w);
+
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) < 0 || w.ws_col == 0 ||
+      w.ws_row == 0) {
+    *width = DISPLAY_FALLBACK_WIDTH;
+    *height = DISPLAY_FALLBACK_HEIGHT;
+    return;
+  }
 
   *width = w.ws_col;
   *height = w.ws_row;
 }
 
 /**
- * Moves the terminal cursor to the given coords.
+ * Get the number of milliseconds since a point in time.
  *
- * @param row The row to move the cursor to.
- * @param col The column to move the cursor to.
+ * @param since The point in time.
+ *
+ * @return The elapsed milliseconds.
  */
-static void move_cursor(int row, int col) {
-  printf("\033[%d;%dH", row, col);
+static long elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000 +
+      (now.tv_nsec - since->tv_nsec) / 1000000;
 }
 
-void display_ssdp_cache(ssdp_cache_s *ssdp_cache, BOOL draw_asci) {
-  int horizontal_lines_printed = 4;
-  const char **tbl_ele = NULL;
-
-  const char *single_line_table_elements[] = {
-    "┤", // 185 "\e(0\x75\e(B"
-    "│", // 186 "\e(0\x78\e(B"
-    "┐", // 187 "\e(0\x6b\e(B"
-    "┘", // 188 "\e(0\x6a\e(B"
-    "└", // 200 "\e(0\x6d\e(B"
-    "┌", // 201 "\e(0\x6c\e(B"
-    "┴", // 202 "\e(0\x76\e(B"
-    "┬", // 203 "\e(0\x77\e(B"
-    "├", // 204 "\e(0\x74\e(B"
-    "─", // 205 "\e(0\x71\e(B"
-    "┼"  // 206 "\e(0\x6e\e(B"
-  };
-
-  const char *asci_table_elements[] = {
-    "+",
-    "|",
-    "+",
-    "+",
-    "+",
-    "+",
-    "+",
-    "+",
-    "+",
-    "-",
-    "+",
-  };
-
-  const char *columns[] = {
-    " ID                  ",
-    " IPv4            ",
-    " MAC               ",
-    " Model           ",
-    " Version         "
-  };
-
-  if (draw_asci) {
-    tbl_ele = asci_table_elements;
-  } else {
-    tbl_ele = single_line_table_elements;
-  }
-
-  move_cursor(0, 0);
-
-  /* Draw the topmost line */
-  int i;
-  for (i = 0; i < sizeof(columns) / sizeof(char *); i++) {
-    printf("%s",
-           (i == 0 ? tbl_ele[5] : tbl_ele[7]));
-    int j;
-    for (j = 0; j < strlen(columns[i]); j++) {
-      printf("%s", tbl_ele[9]);
+/**
+ * Write a buffer to stdout.
+ *
+ * @param data The data to write.
+ * @param length The length of the data.
+ */
+static void write_all(const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t bytes = write(STDOUT_FILENO, data, length);
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
     }
+    data += bytes;
+    length -= bytes;
   }
-  printf("%s\n", tbl_ele[2]);
+}
+
+/**
+ * Put a string into the frame, clipped (and padded with spaces) to a number
+ * of cells. Control characters are replaced so device supplied strings
+ * cannot inject terminal sequences.
+ *
+ * @param row The row to put the string at.
+ * @param col The column to put the string at.
+ * @param string The UTF-8 string to put, NULL puts nothing but padding.
+ * @param cells The number of cells to fill, -1 to fill only the string.
+ * @param bold Draw the string in bold.
+ *
+ * @return The column after the string.
+ */
+static int put_string(int row, int col, const char *string, int cells,
+    BOOL bold) {
+  const unsigned char *s = (const unsigned char *)string;
+  int end = cells < 0 ? display.width : col + cells;
 
-  /* Draw first row with column titles */
-  for (i = 0; i < sizeof(columns) / sizeof(char *); i++) {
-    printf("%s\x1b[1m%s\x1b[0m", tbl_ele[1], columns[i]);
+  if (end > display.width) {
+    end = display.width;
+  }
+  if (row < 0 || row >= display.height) {
+    return col;
   }
-  printf("%s\n", tbl_ele[1]);
 
-  if (ssdp_cache) {
+  while (col < end && s && *s) {
+    display_cell_s *cell = &display.frame[row * display.width + col];
+    int length = 1;
+    int i;
 
-    /* Draw a row-dividing line */
-    for (i = 0; i < sizeof(columns) / sizeof(char *); i++) {
-      printf("%s", (i == 0 ? tbl_ele[8] : tbl_ele[10]));
-      int j;
-      for (j = 0; j < strlen(columns[i]); j++) {
-        printf("%s", tbl_ele[9]);
+    if (*s >= 0xf0) {
+      length = 4;
+    }
+    else if (*s >= 0xe0) {
+      length = 3;
+    }
+    else if (*s >= 0xc0) {
+      length = 2;
+    }
+    for (i = 1; i < length; i++) {
+      if ((s[i] & 0xc0) != 0x80) {
+        length = 1;
+        break;
       }
     }
-    printf("%s\n", tbl_ele[0]);
 
-    ssdp_custom_field_s *cf = NULL;
-    ssdp_cache = ssdp_cache->first;
-    const char no_info[] = "-";
+    if (*s < 0x20 || *s == 0x7f || (length == 1 && *s >= 0x80)) {
+      cell->glyph[0] = '?';
+      cell->length = 1;
+    }
+    else {
+      memcpy(cell->glyph, s, length);
+      cell->length = length;
+    }
+    cell->bold = bold;
+    s += length;
+    col++;
+  }
+
+  if (cells < 0) {
+    return col;
+  }
+
+  while (col < end) {
+    display_cell_s *cell = &display.frame[row * display.width + col];
+    cell->glyph[0] = ' ';
+    cell->length = 1;
+    cell->bold = bold;
+    col++;
+  }
 
-    while (ssdp_cache) {
-        cf = get_custom_field(ssdp_cache->ssdp_message, "serialNumber");
-        printf("%s %-20s", tbl_ele[1],
-            (cf && cf->contents ? cf->contents : no_info));
-        printf("%s %-16s", tbl_ele[1], ssdp_cache->ssdp_message->ip);
-        printf("%s %-18s", tbl_ele[1], (ssdp_cache->ssdp_message->mac &&
-            0 != strcmp(ssdp_cache->ssdp_message->mac, "") ?
-            ssdp_cache->ssdp_message->mac : no_info));
-        cf = get_custom_field(ssdp_cache->ssdp_message, "modelName");
-        printf("%s %-*s", tbl_ele[1], 16,
-            (cf && cf->contents ? cf->contents : no_info));
-        cf = get_custom_field(ssdp_cache->ssdp_message, "modelNumber");
-        printf("%s %-16s", tbl_ele[1],
-            (cf && cf->contents ? cf->contents : no_info));
-        printf("%s\n", tbl_ele[1]);
+  return col;
+}
 
-        horizontal_lines_printed++;
+/**
+ * Put a horizontal table line into the frame.
+ *
+ * @param row The row to put the line at.
+ * @param tbl_ele The table elements to use.
+ * @param left The left corner/junction.
+ * @param middle The junction between columns.
+ * @param right The right corner/junction.
+ */
+static void put_line(int row, const char **tbl_ele, int left, int middle,
+    int right) {
+  int col = 0;
+  int i, j;
 
-        ssdp_cache = ssdp_cache->next;
+  for (i = 0; i < DISPLAY_COLUMNS; i++) {
+    col = put_string(row, col, tbl_ele[i == 0 ? left : middle], -1, FALSE);
+    for (j = 0; j <= column_widths[i]; j++) {
+      col = put_string(row, col, tbl_ele[TBL_HORIZONTAL], -1, FALSE);
     }
   }
+  put_string(row, col, tbl_ele[right], -1, FALSE);
+}
 
-  /* Draw the bottom line */
-  for (i = 0; i < sizeof(columns) / sizeof(char *); i++) {
-    printf("%s",
-           (i == 0 ? tbl_ele[4] : tbl_ele[6]));
-    int j;
-    for (j = 0; j < strlen(columns[i]); j++) {
-      printf("%s", tbl_ele[9]);
+/**
+ * Compare two IP address strings, numerically if both are IPv4.
+ *
+ * @param a The first IP.
+ * @param b The second IP.
+ *
+ * @return Less than, equal to or greater than 0 like strcmp().
+ */
+static int compare_ips(const char *a, const char *b) {
+  struct in_addr addr_a, addr_b;
+
+  if (1 == inet_pton(AF_INET, a, &addr_a) &&
+      1 == inet_pton(AF_INET, b, &addr_b)) {
+    return memcmp(&addr_a, &addr_b, sizeof(struct in_addr));
+  }
+
+  return strcmp(a, b);
+}
+
+/**
+ * Compare two device rows by the sort column (qsort() callback).
+ *
+ * @param a The first row.
+ * @param b The second row.
+ *
+ * @return Less than, equal to or greater than 0 like strcmp().
+ */
+static int compare_rows(const void *a, const void *b) {
+  const display_row_s *row_a = (const display_row_s *)a;
+  const display_row_s *row_b = (const display_row_s *)b;
+  const char *cell_a = row_a->cells[display.sort_column];
+  const char *cell_b = row_b->cells[display.sort_column];
+  int result;
+
+  /* Rows without a value always go last */
+  if (!cell_a || !cell_b) {
+    result = cell_a ? -1 : (cell_b ? 1 : 0);
+  }
+  else {
+    result = display.sort_column == COLUMN_IP ? compare_ips(cell_a, cell_b) :
+        strcmp(cell_a, cell_b);
+    if (display.sort_descending) {
+      result = -result;
+    }
+  }
+
+  if (result == 0) {
+    result = row_a->position < row_b->position ? -1 : 1;
+  }
+
+  return result;
+}
+
+/**
+ * Collect the device rows from the cache and sort them.
+ *
+ * @param ssdp_cache The cache to display.
+ *
+ * @return The number of device rows.
+ */
+static unsigned int collect_rows(ssdp_cache_s *ssdp_cache) {
+  unsigned int count = 0;
+
+  if (!ssdp_cache) {
+    return 0;
+  }
+
+  if (*ssdp_cache->ssdp_messages_count > display.rows_size) {
+    unsigned int new_size = *ssdp_cache->ssdp_messages_count * 2;
+    display_row_s *rows = (display_row_s *)realloc(display.rows,
+        sizeof(display_row_s) * new_size);
+    if (!rows) {
+      PRINT_ERROR("Failed to allocate memory for the display rows");
+      return 0;
+    }
+    display.rows = rows;
+    display.rows_size = new_size;
+  }
+
+  ssdp_cache = ssdp_cache->first;
+  while (ssdp_cache && count < display.rows_size) {
+    const ssdp_message_s *ssdp_message = ssdp_cache->ssdp_message;
+    display_row_s *row = &display.rows[count];
+    ssdp_custom_field_s *cf = NULL;
+
+    memset(row, 0, sizeof(display_row_s));
+    row->ssdp_message = ssdp_message;
+    row->position = count;
+    row->cells[COLUMN_IP] = ssdp_message->ip;
+    row->cells[COLUMN_MAC] = ssdp_message->mac && ssdp_message->mac[0] ?
+        ssdp_message->mac : NULL;
+
+    /* One pass over the custom fields instead of a lookup per column */
+    if (ssdp_message->custom_fields) {
+      cf = ssdp_message->custom_fields->first;
     }
+    while (cf) {
+      if (!cf->name || !cf->contents) {
+        /* Nothing to show */
+      }
+      else if (0 == strcmp(cf->name, "serialNumber")) {
+        row->cells[COLUMN_ID] = cf->contents;
+      }
+      else if (0 == strcmp(cf->name, "modelName")) {
+        row->cells[COLUMN_MODEL] = cf->contents;
+      }
+      else if (0 == strcmp(cf->name, "modelNumber")) {
+        row->cells[COLUMN_VERSION] = cf->contents;
+      }
+      cf = cf->next;
+    }
+
+    count++;
+    ssdp_cache = ssdp_cache->next;
+  }
+
+  if (display.sort_column >= 0 && count > 1) {
+    qsort(display.rows, count, sizeof(display_row_s), compare_rows);
   }
-  printf("%s\n", tbl_ele[3]);
+
+  return count;
+}
+
+/**
+ * Resize the frames to the terminal size if it changed.
+ *
+ * @return TRUE if the screen has to be cleared, FALSE otherwise.
+ */
+static BOOL resize_frames(void) {
   int width, height;
+  size_t cells;
+  int i;
 
   get_window_size(&width, &height);
-  for (i = 1; i < height - horizontal_lines_printed; i++) {
-    printf("%*s\n", width, " ");
+  if (display.shadow && width == display.width &&
+      height == display.height) {
+    return FALSE;
   }
+
+  cells = (size_t)width * height;
+  free(display.shadow);
+  free(display.frame);
+  display.shadow = (display_cell_s *)malloc(sizeof(display_cell_s) * cells);
+  display.frame = (display_cell_s *)malloc(sizeof(display_cell_s) * cells);
+  if (!display.shadow || !display.frame) {
+    PRINT_ERROR("Failed to allocate memory for the display frames");
+    free(display.shadow);
+    free(display.frame);
+    display.shadow = NULL;
+    display.frame = NULL;
+    return FALSE;
+  }
+  display.width = width;
+  display.height = height;
+
+  /* The screen is cleared, so the shadow is all spaces */
+  for (i = 0; i < width * height; i++) {
+    display.shadow[i].glyph[0] = ' ';
+    display.shadow[i].length = 1;
+    display.shadow[i].bold = FALSE;
+  }
+
+  return TRUE;
 }
 
+/**
+ * Compose the table into the frame.
+ *
+ * @param ssdp_cache The cache to display.
+ */
+static void compose_frame(ssdp_cache_s *ssdp_cache) {
+  const char **tbl_ele = display.draw_asci ? asci_table_elements :
+      single_line_table_elements;
+  int visible_rows = display.height - DISPLAY_CHROME_ROWS;
+  unsigned int count = collect_rows(ssdp_cache);
+  char title[32];
+  char status[128];
+  int row, col, i;
+
+  if (visible_rows < 1) {
+    visible_rows = 1;
+  }
+
+  /* Keep the scroll position inside the table */
+  if (display.scroll > (int)count - visible_rows) {
+    display.scroll = (int)count - visible_rows;
+  }
+  if (display.scroll < 0) {
+    display.scroll = 0;
+  }
+
+  for (i = 0; i < display.width * display.height; i++) {
+    display.frame[i].glyph[0] = ' ';
+    display.frame[i].length = 1;
+    display.frame[i].bold = FALSE;
+  }
+
+  /* Draw the topmost line and the column titles */
+  put_line(0, tbl_ele, TBL_TOP_LEFT, TBL_TOP_T, TBL_TOP_RIGHT);
+  col = 0;
+  for (i = 0; i < DISPLAY_COLUMNS; i++) {
+    snprintf(title, sizeof(title), " %s%s", column_titles[i],
+        display.sort_column != i ? "" :
+        (display.sort_descending ? (display.draw_asci ? " v" : " ▼") :
+        (display.draw_asci ? " ^" : " ▲")));
+    col = put_string(1, col, tbl_ele[TBL_VERTICAL], -1, FALSE);
+    col = put_string(1, col, title, column_widths[i] + 1, TRUE);
+  }
+  put_string(1, col, tbl_ele[TBL_VERTICAL], -1, FALSE);
+  row = 2;
+
+  if (count > 0) {
+
+    /* Draw a row-dividing line */
+    put_line(row++, tbl_ele, TBL_LEFT_T, TBL_CROSS, TBL_RIGHT_T);
+
+    /* Only the visible rows are composed */
+    for (i = display.scroll; i < (int)count &&
+        i < display.scroll + visible_rows; i++) {
+      int j;
+      col = 0;
+      for (j = 0; j < DISPLAY_COLUMNS; j++) {
+        col = put_string(row, col, tbl_ele[TBL_VERTICAL], -1, FALSE);
+        col = put_string(row, col, " ", -1, FALSE);
+        col = put_string(row, col, display.rows[i].cells[j] ?
+            display.rows[i].cells[j] : "-", column_widths[j], FALSE);
+      }
+      put_string(row, col, tbl_ele[TBL_VERTICAL], -1, FALSE);
+      row++;
+    }
+  }
+
+  /* Draw the bottom line */
+  put_line(row, tbl_ele, TBL_BOTTOM_LEFT, TBL_BOTTOM_T, TBL_BOTTOM_RIGHT);
+
+  /* The status line */
+  snprintf(status, sizeof(status), " %u devices, showing %d-%d  "
+      "[up/down/pgup/pgdn] scroll  [s] sort  [r] reverse", count,
+      count > 0 ? display.scroll + 1 : 0,
+      display.scroll + visible_rows < (int)count ?
+      display.scroll + visible_rows : (int)count);
+  put_string(display.height - 1, 0, status, display.width - 1, FALSE);
+}
+
+/**
+ * Send the cells that differ from the shadow to the terminal.
+ *
+ * @param clear Clear the screen first.
+ */
+static void flush_frame(BOOL clear) {
+  string_buffer_s *output = &display.output;
+  int cursor_row = -1, cursor_col = -1;
+  BOOL bold = FALSE;
+  int row, col;
+
+  string_buffer_reset(output);
+  if (clear) {
+    string_buffer_append_str(output, "\x1b[0m\x1b[2J");
+  }
+
+  for (row = 0; row < display.height; row++) {
+    for (col = 0; col < display.width; col++) {
+      int pos = row * display.width + col;
+      display_cell_s *cell = &display.frame[pos];
+      display_cell_s *old = &display.shadow[pos];
+
+      if (cell->length == old->length && cell->bold == old->bold &&
+          0 == memcmp(cell->glyph, old->glyph, cell->length)) {
+        continue;
+      }
+
+      if (row != cursor_row || col != cursor_col) {
+        char move[32];
+        snprintf(move, sizeof(move), "\x1b[%d;%dH", row + 1, col + 1);
+        string_buffer_append_str(output, move);
+      }
+      if (cell->bold != bold) {
+        string_buffer_append_str(output, cell->bold ? "\x1b[1m" : "\x1b[0m");
+        bold = cell->bold;
+      }
+      string_buffer_append(output, cell->glyph, cell->length);
+      *old = *cell;
+      cursor_row = row;
+      cursor_col = col + 1;
+    }
+  }
+
+  if (bold) {
+    string_buffer_append_str(output, "\x1b[0m");
+  }
+
+  if (output->length > 0) {
+    write_all(output->data, output->length);
+  }
+}
+
+/**
+ * Draw a frame if one is waiting and the frame rate allows it.
+ *
+ * @param ssdp_cache The cache to display.
+ */
+static void draw_if_due(ssdp_cache_s *ssdp_cache) {
+  BOOL clear;
+
+  if (!display.dirty || display_ssdp_cache_timeout() != 0) {
+    return;
+  }
+
+  if (!display.output.data &&
+      !string_buffer_init(&display.output, XML_BUFFER_SIZE)) {
+    return;
+  }
+
+  clear = resize_frames();
+  if (!display.frame) {
+    return;
+  }
+
+  compose_frame(ssdp_cache);
+  flush_frame(clear);
+
+  display.dirty = FALSE;
+  clock_gettime(CLOCK_MONOTONIC, &display.last_frame);
+}
+
+/**
+ * Read and handle the pending key presses.
+ */
+static void handle_keys(void) {
+  unsigned char keys[64];
+  int page = display.height - DISPLAY_CHROME_ROWS;
+  ssize_t count, i;
+
+  if (!display.key_input) {
+    return;
+  }
+  if (page < 1) {
+    page = 1;
+  }
+
+  count = read(STDIN_FILENO, keys, sizeof(keys));
+  for (i = 0; i < count; i++) {
+    int old_scroll = display.scroll;
+
+    /* Arrow, page and home/end keys are escape sequences */
+    if (keys[i] == 0x1b && i + 2 < count && keys[i + 1] == '[') {
+      i += 2;
+      switch (keys[i]) {
+      case 'A':
+        display.scroll--;
+        break;
+      case 'B':
+        display.scroll++;
+        break;
+      case 'H':
+        display.scroll = 0;
+        break;
+      case 'F':
+        display.scroll = (int)(~0u >> 1);
+        break;
+      case '5':
+      case '6':
+        display.scroll += keys[i] == '5' ? -page : page;
+        if (i + 1 < count && keys[i + 1] == '~') {
+          i++;
+        }
+        break;
+      }
+    }
+    else {
+      switch (keys[i]) {
+      case 'k':
+        display.scroll--;
+        break;
+      case 'j':
+        display.scroll++;
+        break;
+      case 'g':
+        display.scroll = 0;
+        break;
+      case 'G':
+        display.scroll = (int)(~0u >> 1);
+        break;
+      case 's':
+        /* Cycle through the columns and back to the cache order */
+        display.sort_column++;
+        if (display.sort_column >= DISPLAY_COLUMNS) {
+          display.sort_column = -1;
+        }
+        display.dirty = TRUE;
+        break;
+      case 'r':
+        display.sort_descending = !display.sort_descending;
+        display.dirty = TRUE;
+        break;
+      }
+    }
+
+    if (display.scroll != old_scroll) {
+      display.dirty = TRUE;
+    }
+  }
+}
+
+/**
+ * Restore the terminal (also registered with atexit()).
+ */
+static void restore_terminal(void) {
+  if (!display.initialized) {
+    return;
+  }
+
+  if (display.key_input) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &display.saved_termios);
+  }
+  write_all(DISPLAY_LEAVE, sizeof(DISPLAY_LEAVE) - 1);
+  display.initialized = FALSE;
+}
+
+void display_ssdp_cache_init(unsigned int max_fps) {
+  struct termios raw;
+
+  display.max_fps = max_fps;
+  if (display.initialized || !isatty(STDOUT_FILENO)) {
+    return;
+  }
+
+  /* Read single key presses without echoing them */
+  if (isatty(STDIN_FILENO) &&
+      0 == tcgetattr(STDIN_FILENO, &display.saved_termios)) {
+    raw = display.saved_termios;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    display.key_input = 0 == tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+  }
+
+  /* Use the alternate screen and hide the cursor */
+  write_all(DISPLAY_ENTER, sizeof(DISPLAY_ENTER) - 1);
+  display.initialized = TRUE;
+  atexit(restore_terminal);
+}
+
+void display_ssdp_cache(ssdp_cache_s *ssdp_cache, BOOL draw_asci) {
+  display.draw_asci = draw_asci;
+  display.dirty = TRUE;
+
+  draw_if_due(ssdp_cache);
+}
+
+int display_ssdp_cache_timeout(void) {
+  long left;
+
+  if (!display.dirty) {
+    return -1;
+  }
+  if (display.max_fps == 0) {
+    return 0;
+  }
+
+  left = 1000 / display.max_fps - elapsed_ms(&display.last_frame);
+
+  return left > 0 ? (int)left : 0;
+}
+
+int display_ssdp_cache_input_fd(void) {
+  return display.key_input ? STDIN_FILENO : -1;
+}
+
+void display_ssdp_cache_tick(ssdp_cache_s *ssdp_cache) {
+  handle_keys();
+  draw_if_due(ssdp_cache);
+}
+
+void display_ssdp_cache_close(void) {
+  restore_terminal();
+
+  free(display.shadow);
+  free(display.frame);
+  free(display.rows);
+  string_buffer_free(&display.output);
+  display.shadow = NULL;
+  display.frame = NULL;
+  display.rows = NULL;
+  display.rows_size = 0;
+  display.dirty = FALSE;
+}
@@ -11,6 +11,7 @@
 #include "log.h"
 #include "ssdp_cache_output_format.h"
 #include "ssdp_message.h"
+#include "string_buffer.h"
 
 #define SSDP_CUSTOM_FIELD_SERIALNUMBER "serialNumber"
 #define SSDP_CUSTOM_FIELD_FRIENDLYNAME "friendlyName"
@@ -19,30 +20,228 @@
 #define ONELINE_ANSI_COLOR_RESET   "\x1b[0m"
 #define ONELINE_ANSI_COLOR_RESET_SIZE 7
 
-unsigned int cache_to_json(ssdp_cache_s *ssdp_cache, char *json_buffer,
-    unsigned int json_buffer_size) {
-  unsigned int used_buffer = 0;
+/** Append a string literal (with a compile-time length) to a buffer. */
+#define APPEND_LITERAL(buffer, literal) \
+  string_buffer_append((buffer), (literal), sizeof(literal) - 1)
+
+/**
+ * Append a string to a buffer escaping the XML special characters. The
+ * characters to escape are located with strcspn(), which the C library
+ * implements with vector instructions, and everything in between is copied
+ * in one go.
+ *
+ * @param buffer The buffer to append to.
+ * @param string The string to append, NULL is written as an empty string.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL append_xml_string(string_buffer_s *buffer, const char *string) {
+  if (!string) {
+    return TRUE;
+  }
+
+  while (*string) {
+    size_t run = strcspn(string, "<>&\"'");
+
+    if (run > 0 && !string_buffer_append(buffer, string, run)) {
+      return FALSE;
+    }
+    string += run;
+
+    switch (*string) {
+    case '<':
+      if (!APPEND_LITERAL(buffer, "&lt;")) return FALSE;
+      break;
+    case '>':
+      if (!APPEND_LITERAL(buffer, "&gt;")) return FALSE;
+      break;
+    case '&':
+      if (!APPEND_LITERAL(buffer, "&amp;")) return FALSE;
+      break;
+    case '"':
+      if (!APPEND_LITERAL(buffer, "&quot;")) return FALSE;
+      break;
+    case '\'':
+      if (!APPEND_LITERAL(buffer, "&apos;")) return FALSE;
+      break;
+    default:
+      /* End of the string */
+      return TRUE;
+    }
+    string++;
+  }
+
+  return TRUE;
+}
+
+/**
+ * JSON escape table. 0 means the character can be copied as is, 'u' means it
+ * has to be written as a \u00XX sequence and anything else is the character
+ * to write after the backslash.
+ */
+static const char json_escapes[256] = {
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  ['"'] = '"',
+  ['\\'] = '\\'
+};
+
+/**
+ * Get the length of the UTF-8 sequence a string starts with (RFC 3629, no
+ * overlong forms or surrogates).
+ *
+ * @param pos The start of the sequence, its first byte is at least 0x80.
+ *
+ * @return The length of the sequence, 0 if it is not valid UTF-8.
+ */
+static size_t utf8_sequence_length(const unsigned char *pos) {
+  unsigned char min = 0x80, max = 0xbf;
+  size_t length, i;
+
+  if (pos[0] >= 0xc2 && pos[0] <= 0xdf) {
+    length = 2;
+  }
+  else if (pos[0] >= 0xe0 && pos[0] <= 0xef) {
+    length = 3;
+    if (pos[0] == 0xe0) {
+      min = 0xa0;
+    }
+    else if (pos[0] == 0xed) {
+      max = 0x9f;
+    }
+  }
+  else if (pos[0] >= 0xf0 && pos[0] <= 0xf4) {
+    length = 4;
+    if (pos[0] == 0xf0) {
+      min = 0x90;
+    }
+    else if (pos[0] == 0xf4) {
+      max = 0x8f;
+    }
+  }
+  else {
+    return 0;
+  }
+
+  /* The string terminator is never a continuation byte */
+  if (pos[1] < min || pos[1] > max) {
+    return 0;
+  }
+  for (i = 2; i < length; i++) {
+    if (pos[i] < 0x80 || pos[i] > 0xbf) {
+      return 0;
+    }
+  }
+
+  return length;
+}
+
+/**
+ * Append a string to a buffer as a quoted and escaped JSON string. Runs of
+ * characters that need no escaping are copied in one go, bytes that are not
+ * valid UTF-8 are replaced with U+FFFD.
+ *
+ * @param buffer The buffer to append to.
+ * @param string The string to append, NULL is written as null.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL append_json_string(string_buffer_s *buffer, const char *string) {
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char *run = (const unsigned char *)string;
+  const unsigned char *pos = run;
+
+  if (!string) {
+    return APPEND_LITERAL(buffer, "null");
+  }
+
+  if (!string_buffer_append_char(buffer, '"')) {
+    return FALSE;
+  }
+
+  while (*pos) {
+    char escape = json_escapes[*pos];
+    size_t length = *pos < 0x80 ? 1 : utf8_sequence_length(pos);
+
+    if (!escape && length > 0) {
+      pos += length;
+      continue;
+    }
+
+    /* Flush the run of plain characters before the escaped one */
+    if (pos > run && !string_buffer_append(buffer, (const char *)run,
+        pos - run)) {
+      return FALSE;
+    }
+
+    if (length == 0) {
+      if (!APPEND_LITERAL(buffer, "\\ufffd")) {
+        return FALSE;
+      }
+    }
+    else if (escape == 'u') {
+      char unicode[6] = { '\\', 'u', '0', '0', hex[*pos >> 4],
+          hex[*pos & 0x0f] };
+      if (!string_buffer_append(buffer, unicode, sizeof(unicode))) {
+        return FALSE;
+      }
+    }
+    else {
+      char escaped[2] = { '\\', escape };
+      if (!string_buffer_append(buffer, escaped, sizeof(escaped))) {
+        return FALSE;
+      }
+    }
+    run = ++pos;
+  }
+
+  if (pos > run && !string_buffer_append(buffer, (const char *)run,
+      pos - run)) {
+    return FALSE;
+  }
+
+  return string_buffer_append_char(buffer, '"');
+}
+
+unsigned int cache_to_json(ssdp_cache_s *ssdp_cache,
+    string_buffer_s *json_buffer) {
+  size_t start_length = json_buffer->length;
+  BOOL ok = TRUE;
+
+  if(NULL == ssdp_cache) {
+    PRINT_ERROR("No valid SSDP cache given (NULL)");
+    return 0;
+  }
 
   /* Point at the beginning */
   ssdp_cache = ssdp_cache->first;
 
   /* For every element in the ssdp cache */
-  used_buffer = snprintf(json_buffer, json_buffer_size, "root {\n");
+  ok &= APPEND_LITERAL(json_buffer, "{\"root\":[");
 
-  while(ssdp_cache) {
-    used_buffer += to_json(ssdp_cache->ssdp_message, FALSE,
-        (json_buffer + used_buffer), (json_buffer_size - used_buffer));
+  while(ssdp_cache && ok) {
+    ok &= (to_json(ssdp_cache->ssdp_message, FALSE, json_buffer) > 0);
     ssdp_cache = ssdp_cache->next;
+    if (ssdp_cache) {
+      ok &= string_buffer_append_char(json_buffer, ',');
+    }
   }
-  used_buffer += snprintf((json_buffer + used_buffer),
-      (json_buffer_size - used_buffer), "}\n");
+  ok &= APPEND_LITERAL(json_buffer, "]}\n");
 
-  return used_buffer;
+  if (!ok) {
+    PRINT_ERROR("cache_to_json(): Failed to build the JSON document");
+    return 0;
+  }
+
+  return json_buffer->length - start_length;
 }
 
-unsigned int cache_to_xml(ssdp_cache_s *ssdp_cache, char *xml_buffer,
-    unsigned int xml_buffer_size) {
-  unsigned int used_buffer = 0;
+unsigned int cache_to_xml(ssdp_cache_s *ssdp_cache,
+    string_buffer_s *xml_buffer) {
+  size_t start_length = xml_buffer->length;
+  BOOL ok = TRUE;
 
   if(NULL == ssdp_cache) {
     PRINT_ERROR("No valid SSDP cache given (NULL)");
@@ -53,199 +252,183 @@ unsigned int cache_to_xml(ssdp_cache_s *ssdp_cache, char *xml_buffer,
   ssdp_cache = ssdp_cache->first;
 
   /* For every element in the ssdp cache */
-  used_buffer = snprintf(xml_buffer, xml_buffer_size,
+  ok &= APPEND_LITERAL(xml_buffer,
       "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<root>\n");
 
-  while(ssdp_cache) {
-    PRINT_DEBUG("cache_to_xml(): buffer used: %d; left: %d", used_buffer,
-        xml_buffer_size - used_buffer);
-    PRINT_DEBUG("start with with '%s'", ssdp_cache->ssdp_message->ip);
-    used_buffer += to_xml(ssdp_cache->ssdp_message, FALSE,
-        (xml_buffer + used_buffer), (xml_buffer_size - used_buffer));
-    PRINT_DEBUG("done with '%s'", ssdp_cache->ssdp_message->ip);
+  while(ssdp_cache && ok) {
+    PRINT_DEBUG("cache_to_xml(): buffer used: %d", (int)xml_buffer->length);
+    ok &= (to_xml(ssdp_cache->ssdp_message, FALSE, xml_buffer) > 0);
     ssdp_cache = ssdp_cache->next;
   }
-  used_buffer += snprintf((xml_buffer + used_buffer),
-      (xml_buffer_size - used_buffer), "</root>\n");
+  ok &= APPEND_LITERAL(xml_buffer, "</root>\n");
 
-  return used_buffer;
+  if (!ok) {
+    PRINT_ERROR("cache_to_xml(): Failed to build the XML document");
+    return 0;
+  }
+
+  return xml_buffer->length - start_length;
 }
 
 unsigned int to_json(const ssdp_message_s *ssdp_message, BOOL full_json,
-    char *json_buffer, int json_buffer_size) {
-  int used_length = 0;
+    string_buffer_s *json_buffer) {
+  size_t start_length = json_buffer->length;
+  BOOL ok = TRUE;
+
+  if (ssdp_message == NULL) {
+    PRINT_ERROR("to_json(): No SSDP message specified");
+    return 0;
+  }
+
+  ok &= APPEND_LITERAL(json_buffer, "{\"length\":");
+  ok &= string_buffer_append_uint(json_buffer,
+      (unsigned long)ssdp_message->message_length);
+  ok &= APPEND_LITERAL(json_buffer, ",\"mac\":");
+  ok &= append_json_string(json_buffer, ssdp_message->mac);
+  ok &= APPEND_LITERAL(json_buffer, ",\"ip\":");
+  ok &= append_json_string(json_buffer, ssdp_message->ip);
+  ok &= APPEND_LITERAL(json_buffer, ",\"request\":");
+  ok &= append_json_string(json_buffer, ssdp_message->request);
+  ok &= APPEND_LITERAL(json_buffer, ",\"protocol\":");
+  ok &= append_json_string(json_buffer, ssdp_message->protocol);
+  ok &= APPEND_LITERAL(json_buffer, ",\"datetime\":");
+  ok &= append_json_string(json_buffer, ssdp_message->datetime);
+
+  /* The custom fields as an object ("name": "contents") */
+  ok &= APPEND_LITERAL(json_buffer, ",\"custom_fields\":{");
+  if (ssdp_message->custom_fields) {
+    ssdp_custom_field_s *cf = ssdp_message->custom_fields->first;
+
+    while (cf) {
+      ok &= append_json_string(json_buffer, cf->name);
+      ok &= string_buffer_append_char(json_buffer, ':');
+      ok &= append_json_string(json_buffer, cf->contents);
+      cf = cf->next;
+      if (cf) {
+        ok &= string_buffer_append_char(json_buffer, ',');
+      }
+    }
+  }
+
+  /* The headers as an array, names can repeat */
+  ok &= APPEND_LITERAL(json_buffer, "},\"headers\":[");
+  if (ssdp_message->headers) {
+    ssdp_header_s *h = ssdp_message->headers->first;
+
+    while (h) {
+      ok &= APPEND_LITERAL(json_buffer, "{\"typeInt\":");
+      ok &= string_buffer_append_uint(json_buffer, h->type);
+      ok &= APPEND_LITERAL(json_buffer, ",\"typeStr\":");
+      ok &= append_json_string(json_buffer, get_header_string(h->type, h));
+      ok &= APPEND_LITERAL(json_buffer, ",\"contents\":");
+      ok &= append_json_string(json_buffer, h->contents);
+      ok &= string_buffer_append_char(json_buffer, '}');
+      h = h->next;
+      if (h) {
+        ok &= string_buffer_append_char(json_buffer, ',');
+      }
+    }
+  }
+  ok &= APPEND_LITERAL(json_buffer, "]}");
 
-  // TODO: write it!
+  if (full_json) {
+    ok &= string_buffer_append_char(json_buffer, '\n');
+  }
 
-  return used_length;
+  if (!ok) {
+    PRINT_ERROR("to_json(): Failed to build the JSON document");
+    return 0;
+  }
+
+  return json_buffer->length - start_length;
 }
 
 unsigned int to_xml(const ssdp_message_s *ssdp_message, BOOL full_xml,
-    char *xml_buffer, int xml_buffer_size) {
-  int used_length = 0;
+    string_buffer_s *xml_buffer) {
+  size_t start_length = xml_buffer->length;
+  BOOL ok = TRUE;
 
-  if (!xml_buffer) {
-    PRINT_ERROR("to_xml(): No XML message buffer specified");
-    return -1;
-  } else if (ssdp_message == NULL) {
+  if (ssdp_message == NULL) {
     PRINT_ERROR("to_xml(): No SSDP message specified");
-    return -1;
+    return 0;
   }
 
-  memset(xml_buffer, '\0', sizeof(char) * xml_buffer_size);
   if (full_xml) {
-    used_length = snprintf(xml_buffer, xml_buffer_size,
-    "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<root>\n");
+    ok &= APPEND_LITERAL(xml_buffer,
+        "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<root>\n");
   }
 
   PRINT_DEBUG("Setting upnp xml-fields");
-  used_length += snprintf(xml_buffer + used_length,
-      xml_buffer_size - used_length, "\t<message length=\"%d\">\n",
-      ssdp_message->message_length);
-  used_length += snprintf(xml_buffer + used_length,
-      xml_buffer_size - used_length, "\t\t<mac>\n\t\t\t%s\n\t\t</mac>\n",
-      ssdp_message->mac);
-  used_length += snprintf(xml_buffer + used_length,
-      xml_buffer_size - used_length, "\t\t<ip>\n\t\t\t%s\n\t\t</ip>\n",
-      ssdp_message->ip);
-  used_length += snprintf(xml_buffer + used_length, xml_buffer_size - used_length,
-      "\t\t<request protocol=\"%s\">\n\t\t\t%s\n\t\t</request>\n",
-      ssdp_message->protocol, ssdp_message->request);
-  used_length += snprintf(xml_buffer + used_length,
-      xml_buffer_size - used_length,
-      "\t\t<datetime>\n\t\t\t%s\n\t\t</datetime>\n", ssdp_message->datetime);
+  ok &= APPEND_LITERAL(xml_buffer, "\t<message length=\"");
+  ok &= string_buffer_append_uint(xml_buffer,
+      (unsigned long)ssdp_message->message_length);
+  ok &= APPEND_LITERAL(xml_buffer, "\">\n\t\t<mac>\n\t\t\t");
+  ok &= append_xml_string(xml_buffer, ssdp_message->mac);
+  ok &= APPEND_LITERAL(xml_buffer, "\n\t\t</mac>\n\t\t<ip>\n\t\t\t");
+  ok &= append_xml_string(xml_buffer, ssdp_message->ip);
+  ok &= APPEND_LITERAL(xml_buffer, "\n\t\t</ip>\n\t\t<request protocol=\"");
+  ok &= append_xml_string(xml_buffer, ssdp_message->protocol);
+  ok &= APPEND_LITERAL(xml_buffer, "\">\n\t\t\t");
+  ok &= append_xml_string(xml_buffer, ssdp_message->request);
+  ok &= APPEND_LITERAL(xml_buffer,
+      "\n\t\t</request>\n\t\t<datetime>\n\t\t\t");
+  ok &= append_xml_string(xml_buffer, ssdp_message->datetime);
+  ok &= APPEND_LITERAL(xml_buffer, "\n\t\t</datetime>\n");
 
   if (ssdp_message->custom_fields) {
-
     ssdp_custom_field_s *cf = ssdp_message->custom_fields->first;
 
-    /*
-     * The whole needed size is calculated as:
-     * leading headers string: +29
-     * each header constant string +50
-     * each header name string +X
-     * each header contents string +Y
-     * tailing header tailing string +19
-     */
-
-    /* Leading (29) and tailing (13) string sizes combined */
-    int needed_size = 48;
-
     PRINT_DEBUG("Setting custom xml-fields");
-    /* Calculate needed buffer size */
-    while (cf) {
+    ok &= APPEND_LITERAL(xml_buffer, "\t\t<custom_fields count=\"");
+    ok &= string_buffer_append_uint(xml_buffer,
+        ssdp_message->custom_field_count);
+    ok &= APPEND_LITERAL(xml_buffer, "\">\n");
 
-      /* Each header combined (46 + X + Y + 18) string size */
-      needed_size += strlen(cf->name) + strlen(cf->contents) + 50;
+    while (cf) {
+      ok &= APPEND_LITERAL(xml_buffer, "\t\t\t<custom_field name=\"");
+      ok &= append_xml_string(xml_buffer, cf->name);
+      ok &= APPEND_LITERAL(xml_buffer, "\">\n\t\t\t\t");
+      ok &= append_xml_string(xml_buffer, cf->contents);
+      ok &= APPEND_LITERAL(xml_buffer, "\n\t\t\t</custom_field>\n");
       cf = cf->next;
-      PRINT_DEBUG("Done calculating buffer");
-
-    }
-    cf = ssdp_message->custom_fields->first;
-
-    /* Check if buffer has enought room */
-    PRINT_DEBUG("to_xml(): XML custom fields buffer left: %d, buffer_needed: "
-        "%d", (xml_buffer_size - used_length), needed_size);
-    if ((xml_buffer_size - used_length) < needed_size) {
-      PRINT_ERROR("to_xml(): Not enought buffer space left to convert the "
-          "SSDP message custom fields to XML, skipping\n");
-    } else {
-
-      /* Convert to XML format */
-      used_length += snprintf(xml_buffer + used_length, xml_buffer_size - used_length,
-      "\t\t<custom_fields count=\"%d\">\n", ssdp_message->custom_field_count);
-
-      while (cf) {
-        PRINT_DEBUG("Setting:");
-        PRINT_DEBUG("'%s'", cf->name);
-        used_length += snprintf(xml_buffer + used_length,
-                                xml_buffer_size - used_length,
-                                "\t\t\t<custom_field name=\"%s\">\n\t\t\t\t%s\n\t\t\t</custom_field>\n",
-                                cf->name,
-                                cf->contents);
-        cf = cf->next;
-        PRINT_DEBUG("Done with this one");
-      }
-
-      cf = NULL;
-      used_length += snprintf(xml_buffer + used_length,
-                              xml_buffer_size - used_length,
-                              "\t\t</custom_fields>\n");
-      PRINT_DEBUG("to_xml(): XML custom-fields bytes used: %d",
-          (int)strlen(xml_buffer));
     }
 
+    ok &= APPEND_LITERAL(xml_buffer, "\t\t</custom_fields>\n");
   }
 
   if (ssdp_message->headers) {
-
     ssdp_header_s *h = ssdp_message->headers->first;
 
-    /*
-     * The whole needed size is calculated as:
-     * leading headers string: +23
-     * each header leading string +46
-     * each header type as two digits
-     * each header type as string +X
-     * each header contents string +Y
-     * each header tailing string +18
-     * tailing header tailing string +13
-     */
-
-    /* Leading (23) and tailing (13) string sizes combined */
-    int needed_size = 36;
-
-    /* Calculate needed buffer size */
-    while (h) {
+    ok &= APPEND_LITERAL(xml_buffer, "\t\t<headers count=\"");
+    ok &= string_buffer_append_uint(xml_buffer, ssdp_message->header_count);
+    ok &= APPEND_LITERAL(xml_buffer, "\">\n");
 
-      /* Each header combined (46 + X + Y + 18) string size */
-      needed_size += (h->unknown_type ?
-                        strlen(h->unknown_type) :
-                        strlen(get_header_string(h->type, h))) + strlen(h->contents) + 64;
+    while (h) {
+      ok &= APPEND_LITERAL(xml_buffer, "\t\t\t<header typeInt=\"");
+      ok &= string_buffer_append_uint(xml_buffer, h->type);
+      ok &= APPEND_LITERAL(xml_buffer, "\" typeStr=\"");
+      ok &= append_xml_string(xml_buffer, get_header_string(h->type, h));
+      ok &= APPEND_LITERAL(xml_buffer, "\">\n\t\t\t\t");
+      ok &= append_xml_string(xml_buffer, h->contents);
+      ok &= APPEND_LITERAL(xml_buffer, "\n\t\t\t</header>\n");
       h = h->next;
-
-    }
-    h = ssdp_message->headers->first;
-
-    /* Check if buffer has enought space */
-    PRINT_DEBUG("buffer left: %d, buffer needed: %d",
-        (xml_buffer_size - used_length), needed_size);
-    if ((xml_buffer_size - used_length) < needed_size) {
-      PRINT_ERROR("to_xml(): Not enought buffer space left to convert the "
-          "SSDP message headers to XML, skipping\n");
-    } else {
-
-      used_length += snprintf(xml_buffer + used_length,
-          xml_buffer_size - used_length, "\t\t<headers count=\"%d\">\n",
-          (unsigned int)ssdp_message->header_count);
-
-      while (h) {
-        used_length += snprintf(xml_buffer + used_length,
-            xml_buffer_size - used_length,
-            "\t\t\t<header typeInt=\"%d\" typeStr=\"%s\">\n", h->type,
-            get_header_string(h->type, h));
-        used_length += snprintf(xml_buffer + used_length,
-            xml_buffer_size - used_length, "\t\t\t\t%s\n\t\t\t</header>\n",
-            h->contents);
-        h = h->next;
-      }
-      h = NULL;
-
-      used_length += snprintf(xml_buffer + used_length,
-          xml_buffer_size - used_length, "\t\t</headers>\n");
     }
 
+    ok &= APPEND_LITERAL(xml_buffer, "\t\t</headers>\n");
   }
 
-  used_length += snprintf(xml_buffer + used_length,
-      xml_buffer_size - used_length, "\t</message>\n");
+  ok &= APPEND_LITERAL(xml_buffer, "\t</message>\n");
 
   if (full_xml) {
-    used_length += snprintf(xml_buffer + used_length,
-        xml_buffer_size - used_length, "</root>\n");
+    ok &= APPEND_LITERAL(xml_buffer, "</root>\n");
+  }
+
+  if (!ok) {
+    PRINT_ERROR("to_xml(): Failed to build the XML document");
+    return 0;
   }
 
-  return used_length;
+  return xml_buffer->length - start_length;
 }
 
 char *to_oneline(const ssdp_message_s *message, BOOL monochrome) {
@@ -0,0 +1,214 @@
+/** \file ssdp_checkpoint.c
+ * Save the device table to a file and restore it at startup (-D).
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common_definitions.h"
+#include "log.h"
+#include "ssdp_cache.h"
+#include "ssdp_cache_binary_format.h"
+#include "ssdp_checkpoint.h"
+#include "ssdp_message.h"
+#include "string_buffer.h"
+
+/**
+ * Get the number of milliseconds since a point in time.
+ *
+ * @param since The point in time.
+ *
+ * @return The elapsed milliseconds.
+ */
+static long elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000 +
+      (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * Write a whole buffer to a file.
+ *
+ * @param fd The file to write to.
+ * @param data The data to write.
+ * @param length The length of the data.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL write_all(int fd, const char *data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return FALSE;
+    }
+    data += written;
+    length -= written;
+  }
+
+  return TRUE;
+}
+
+void ssdp_checkpoint_init(ssdp_checkpoint_s *checkpoint, const char *path) {
+  memset(checkpoint, 0, sizeof(ssdp_checkpoint_s));
+  checkpoint->path = path;
+  clock_gettime(CLOCK_MONOTONIC, &checkpoint->saved);
+}
+
+BOOL ssdp_checkpoint_load(ssdp_checkpoint_s *checkpoint,
+    ssdp_cache_s **ssdp_cache_pointer) {
+  struct stat file_stat;
+  void *data = NULL;
+  BOOL ok;
+  int fd;
+
+  fd = open(checkpoint->path, O_RDONLY);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      PRINT_DEBUG("No checkpoint to restore the devices from yet");
+      return TRUE;
+    }
+    PRINT_ERROR("Could not open the checkpoint '%s': %s", checkpoint->path,
+        strerror(errno));
+    return FALSE;
+  }
+  if (fstat(fd, &file_stat) < 0) {
+    PRINT_ERROR("fstat(): %s", strerror(errno));
+    close(fd);
+    return FALSE;
+  }
+  if (file_stat.st_size == 0) {
+    close(fd);
+    return TRUE;
+  }
+
+  data = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd,
+      0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    PRINT_ERROR("mmap(): %s", strerror(errno));
+    return FALSE;
+  }
+
+  ok = binary_to_cache((const unsigned char *)data, (size_t)file_stat.st_size,
+      ssdp_cache_pointer);
+  munmap(data, (size_t)file_stat.st_size);
+  if (!ok) {
+    PRINT_WARN("The checkpoint '%s' is damaged, some devices were not "
+        "restored", checkpoint->path);
+    return FALSE;
+  }
+
+  PRINT_DEBUG("Restored %d devices from the checkpoint",
+      *ssdp_cache_pointer ? (int)*(*ssdp_cache_pointer)->ssdp_messages_count :
+      0);
+
+  return TRUE;
+}
+
+void ssdp_checkpoint_changed(ssdp_checkpoint_s *checkpoint) {
+  checkpoint->dirty = TRUE;
+}
+
+int ssdp_checkpoint_timeout(ssdp_checkpoint_s *checkpoint) {
+  long left;
+
+  if (!checkpoint->dirty) {
+    return -1;
+  }
+
+  left = SSDP_CHECKPOINT_INTERVAL - elapsed_ms(&checkpoint->saved);
+
+  return left > 0 ? (int)left : 0;
+}
+
+BOOL ssdp_checkpoint_save(ssdp_checkpoint_s *checkpoint,
+    ssdp_cache_s *ssdp_cache) {
+  char temp_path[PATH_MAX];
+  string_buffer_s buffer;
+  BOOL ok;
+  int fd;
+
+  /* Retried on the next interval if it fails */
+  checkpoint->dirty = FALSE;
+  clock_gettime(CLOCK_MONOTONIC, &checkpoint->saved);
+
+  if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", checkpoint->path) >=
+      (int)sizeof(temp_path)) {
+    PRINT_ERROR("The checkpoint path is too long");
+    return FALSE;
+  }
+
+  if (!string_buffer_init(&buffer, XML_BUFFER_SIZE)) {
+    checkpoint->dirty = TRUE;
+    return FALSE;
+  }
+  if (ssdp_cache && *ssdp_cache->ssdp_messages_count > 0) {
+    ok = cache_to_binary(ssdp_cache, &buffer) > 0;
+  }
+  else {
+    /* No strings and no messages */
+    ok = string_buffer_append_str(&buffer, SSDP_BINARY_MAGIC) &&
+        string_buffer_append_char(&buffer, SSDP_BINARY_VERSION) &&
+        string_buffer_append_char(&buffer, 0) &&
+        string_buffer_append_char(&buffer, 0);
+  }
+  if (!ok) {
+    string_buffer_free(&buffer);
+    checkpoint->dirty = TRUE;
+    return FALSE;
+  }
+
+  /* Replace the old checkpoint only once the new one is on disk */
+  fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    PRINT_ERROR("Could not create the checkpoint '%s': %s", temp_path,
+        strerror(errno));
+    string_buffer_free(&buffer);
+    checkpoint->dirty = TRUE;
+    return FALSE;
+  }
+  ok = write_all(fd, buffer.data, buffer.length) && fsync(fd) == 0;
+  if (!ok) {
+    PRINT_ERROR("Could not write the checkpoint '%s': %s", temp_path,
+        strerror(errno));
+  }
+  close(fd);
+  string_buffer_free(&buffer);
+
+  if (ok && rename(temp_path, checkpoint->path) < 0) {
+    PRINT_ERROR("Could not replace the checkpoint '%s': %s",
+        checkpoint->path, strerror(errno));
+    ok = FALSE;
+  }
+  if (!ok) {
+    unlink(temp_path);
+    checkpoint->dirty = TRUE;
+    return FALSE;
+  }
+
+  PRINT_DEBUG("Saved the devices to the checkpoint");
+
+  return TRUE;
+}
+
+void ssdp_checkpoint_update(ssdp_checkpoint_s *checkpoint,
+    ssdp_cache_s *ssdp_cache) {
+  if (ssdp_checkpoint_timeout(checkpoint) == 0) {
+    ssdp_checkpoint_save(checkpoint, ssdp_cache);
+  }
+}
@@ -8,8 +8,23 @@
 #include <string.h> /* memset() */
 #include <sys/socket.h> /* struct sockaddr_storage */
 
+#include "common_definitions.h"
 #include "configuration.h"
 #include "net_utils.h"
+#include "ssdp_common.h"
+
+void ssdp_recv_node_read(SOCKET sock, ssdp_recv_node_s *recv_node) {
+  struct sockaddr_storage recv_addr;
+  socklen_t addr_size = sizeof recv_addr;
+
+  recv_node->recv_bytes = recvfrom(sock, recv_node->recv_data,
+      SSDP_RECV_DATA_LEN, 0, (struct sockaddr *)&recv_addr, &addr_size);
+
+  if (recv_node->recv_bytes > 0) {
+    get_ip_from_sock_address(&recv_addr, recv_node->from_ip);
+    get_mac_address_from_socket(sock, &recv_addr, NULL, recv_node->from_mac);
+  }
+}
 
 void print_forwarder(configuration_s *conf,
     struct sockaddr_storage *forwarder) {
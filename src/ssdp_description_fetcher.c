@@ -0,0 +1,438 @@
+/** \file ssdp_description_fetcher.c
+ * Non-blocking HTTP fetches of device description documents.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h> /* close() */
+
+#include "common_definitions.h"
+#include "event_loop.h"
+#include "log.h"
+#include "net_definitions.h"
+#include "net_utils.h"
+#include "ssdp_description_fetcher.h"
+#include "ssdp_message.h"
+#include "ssdp_metrics.h"
+#include "string_buffer.h"
+
+/** The size of the URL path buffer used by parse_url(). */
+#define FETCH_PATH_SIZE 256
+
+/**
+ * Get the number of milliseconds since a point in time.
+ *
+ * @param since The point in time.
+ *
+ * @return The elapsed milliseconds.
+ */
+static long elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000 +
+      (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * Get the number of nanoseconds since a point in time.
+ *
+ * @param since The point in time.
+ *
+ * @return The elapsed nanoseconds.
+ */
+static unsigned long long elapsed_ns(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000000000ULL +
+      (now.tv_nsec - since->tv_nsec);
+}
+
+/**
+ * Free a fetch and close its connection.
+ *
+ * @param fetch The fetch to free.
+ */
+static void free_fetch(ssdp_fetch_s *fetch) {
+  if (fetch->sock != SOCKET_ERROR) {
+    event_loop_remove(fetch->fetcher->loop, fetch->sock);
+    close(fetch->sock);
+  }
+  string_buffer_free(&fetch->request);
+  free(fetch->response);
+  free(fetch);
+}
+
+static void start_fetch(ssdp_fetch_s *fetch);
+
+/**
+ * End a fetch in progress, parse what was received and start the next
+ * queued fetch.
+ *
+ * @param fetch The fetch to end.
+ * @param completed TRUE if the whole description was received.
+ */
+static void finish_fetch(ssdp_fetch_s *fetch, BOOL completed) {
+  ssdp_fetcher_s *fetcher = fetch->fetcher;
+  ssdp_message_s *ssdp_message = fetch->ssdp_message;
+  ssdp_fetch_s **link = &fetcher->active;
+
+  while (*link && *link != fetch) {
+    link = &(*link)->next;
+  }
+  if (*link) {
+    *link = fetch->next;
+    fetcher->active_count--;
+  }
+
+  if (completed && fetch->response) {
+    parse_custom_fields(ssdp_message, fetch->response);
+    ssdp_metrics_inc(SSDP_COUNTER_FETCHES);
+  }
+  else {
+    PRINT_DEBUG("Fetching the description of %s failed", ssdp_message->ip);
+    ssdp_metrics_inc(SSDP_COUNTER_FETCH_FAILURES);
+  }
+  ssdp_metrics_record(SSDP_HISTOGRAM_FETCH, elapsed_ns(&fetch->started));
+  free_fetch(fetch);
+
+  /* Fill the freed slot before the callback can queue more */
+  while (fetcher->queued && fetcher->active_count < fetcher->max_active) {
+    ssdp_fetch_s *next = fetcher->queued;
+    fetcher->queued = next->next;
+    if (!fetcher->queued) {
+      fetcher->queued_last = NULL;
+    }
+    fetcher->queued_count--;
+    start_fetch(next);
+  }
+  ssdp_metrics_set(SSDP_GAUGE_FETCHES_PENDING,
+      fetcher->active_count + fetcher->queued_count);
+
+  fetcher->callback(fetcher->data, ssdp_message);
+}
+
+/**
+ * Handle the connection of a fetch becoming ready.
+ *
+ * @param data The fetch.
+ * @param events The EVENT_LOOP_* flags that are set.
+ */
+static void on_fetch_ready(void *data, unsigned int events) {
+  ssdp_fetch_s *fetch = (ssdp_fetch_s *)data;
+
+  if (fetch->state == SSDP_FETCH_CONNECTING) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (getsockopt(fetch->sock, SOL_SOCKET, SO_ERROR, &error, &length) < 0 ||
+        error != 0) {
+      PRINT_DEBUG("connect(): %s", strerror(error ? error : errno));
+      finish_fetch(fetch, FALSE);
+      return;
+    }
+    fetch->state = SSDP_FETCH_SENDING;
+  }
+
+  if (fetch->state == SSDP_FETCH_SENDING) {
+    while (fetch->request_sent < fetch->request.length) {
+      ssize_t bytes = send(fetch->sock,
+          fetch->request.data + fetch->request_sent,
+          fetch->request.length - fetch->request_sent, MSG_NOSIGNAL);
+      if (bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+          return;
+        }
+        PRINT_DEBUG("send(): %s", strerror(errno));
+        finish_fetch(fetch, FALSE);
+        return;
+      }
+      fetch->request_sent += bytes;
+    }
+
+    fetch->response = (char *)malloc(DEVICE_INFO_SIZE);
+    if (!fetch->response ||
+        !event_loop_modify(fetch->fetcher->loop, fetch->sock,
+        EVENT_LOOP_READ)) {
+      finish_fetch(fetch, FALSE);
+      return;
+    }
+    fetch->response[0] = '\0';
+    fetch->state = SSDP_FETCH_RECEIVING;
+    return;
+  }
+
+  if (!(events & (EVENT_LOOP_READ | EVENT_LOOP_ERROR))) {
+    return;
+  }
+
+  /* HTTP/1.0, the device closes the connection when it is done */
+  while (TRUE) {
+    ssize_t bytes = recv(fetch->sock, fetch->response + fetch->response_length,
+        DEVICE_INFO_SIZE - 1 - fetch->response_length, 0);
+    if (bytes < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return;
+      }
+      PRINT_DEBUG("recv(): %s", strerror(errno));
+      finish_fetch(fetch, fetch->response_length > 0);
+      return;
+    }
+    fetch->response_length += bytes;
+    fetch->response[fetch->response_length] = '\0';
+    if (bytes == 0 || fetch->response_length == DEVICE_INFO_SIZE - 1) {
+      finish_fetch(fetch, TRUE);
+      return;
+    }
+  }
+}
+
+/**
+ * Open the connection of a fetch.
+ *
+ * @param fetch The fetch to start.
+ */
+static void start_fetch(ssdp_fetch_s *fetch) {
+  ssdp_fetcher_s *fetcher = fetch->fetcher;
+  socklen_t addr_length = fetch->addr.ss_family == AF_INET6 ?
+      sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+  fetch->next = fetcher->active;
+  fetcher->active = fetch;
+  fetcher->active_count++;
+  clock_gettime(CLOCK_MONOTONIC, &fetch->started);
+
+  fetch->sock = socket(fetch->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+  if (fetch->sock == SOCKET_ERROR) {
+    PRINT_ERROR("Failed to create the fetch socket: %s", strerror(errno));
+    finish_fetch(fetch, FALSE);
+    return;
+  }
+  fcntl(fetch->sock, F_SETFL, fcntl(fetch->sock, F_GETFL, 0) | O_NONBLOCK);
+
+  fetch->state = SSDP_FETCH_CONNECTING;
+  if (connect(fetch->sock, (struct sockaddr *)&fetch->addr, addr_length) < 0 &&
+      errno != EINPROGRESS) {
+    PRINT_DEBUG("connect(): %s", strerror(errno));
+    close(fetch->sock);
+    fetch->sock = SOCKET_ERROR;
+    finish_fetch(fetch, FALSE);
+    return;
+  }
+
+  if (!event_loop_add(fetcher->loop, fetch->sock, EVENT_LOOP_WRITE,
+      on_fetch_ready, fetch)) {
+    close(fetch->sock);
+    fetch->sock = SOCKET_ERROR;
+    finish_fetch(fetch, FALSE);
+  }
+}
+
+void ssdp_fetcher_init(ssdp_fetcher_s *fetcher, event_loop_s *loop,
+    unsigned int max_active, unsigned int timeout,
+    ssdp_fetcher_callback callback, void *data) {
+  memset(fetcher, 0, sizeof(ssdp_fetcher_s));
+  fetcher->loop = loop;
+  fetcher->max_active = max_active ? max_active : 1;
+  fetcher->timeout = timeout;
+  fetcher->callback = callback;
+  fetcher->data = data;
+}
+
+BOOL ssdp_fetcher_fetch(ssdp_fetcher_s *fetcher,
+    ssdp_message_s *ssdp_message) {
+  ssdp_header_s *location = get_header(ssdp_message, SSDP_HEADER_LOCATION);
+  char ip[IPv6_STR_MAX_SIZE];
+  char path[FETCH_PATH_SIZE];
+  int port = 0;
+  ssdp_fetch_s *fetch = NULL;
+
+  if (ssdp_message->custom_fields ||
+      ssdp_fetcher_is_fetching(fetcher, ssdp_message)) {
+    return FALSE;
+  }
+
+  /* parse_url() only handles plain http URLs that fit its buffers */
+  if (!location || strncmp(location->contents, "http://", 7) != 0 ||
+      strlen(location->contents) >= FETCH_PATH_SIZE) {
+    PRINT_DEBUG("No usable location header to fetch the description from");
+    return FALSE;
+  }
+
+  memset(ip, '\0', sizeof(ip));
+  memset(path, '\0', sizeof(path));
+  if (!parse_url(location->contents, ip, IPv6_STR_MAX_SIZE, &port, path,
+      FETCH_PATH_SIZE)) {
+    return FALSE;
+  }
+
+  fetch = (ssdp_fetch_s *)calloc(1, sizeof(ssdp_fetch_s));
+  if (!fetch) {
+    PRINT_ERROR("Failed to allocate memory for the description fetch");
+    return FALSE;
+  }
+  fetch->fetcher = fetcher;
+  fetch->ssdp_message = ssdp_message;
+  fetch->sock = SOCKET_ERROR;
+  fetch->state = SSDP_FETCH_QUEUED;
+
+  if (!set_ip_and_port_in_sock_address(ip, port, &fetch->addr) ||
+      !string_buffer_init(&fetch->request, 256) ||
+      !string_buffer_append_str(&fetch->request, "GET ") ||
+      !string_buffer_append_str(&fetch->request, path) ||
+      !string_buffer_append_str(&fetch->request, " HTTP/1.0\r\nHost: ") ||
+      !string_buffer_append_str(&fetch->request, ip) ||
+      !string_buffer_append_str(&fetch->request, "\r\nUser-Agent: abused-") ||
+      !string_buffer_append_str(&fetch->request, ABUSED_VERSION) ||
+      !string_buffer_append_str(&fetch->request, "\r\n\r\n")) {
+    free_fetch(fetch);
+    return FALSE;
+  }
+
+  if (fetcher->active_count < fetcher->max_active) {
+    start_fetch(fetch);
+  }
+  else {
+    if (fetcher->queued_last) {
+      fetcher->queued_last->next = fetch;
+    }
+    else {
+      fetcher->queued = fetch;
+    }
+    fetcher->queued_last = fetch;
+    fetcher->queued_count++;
+  }
+  ssdp_metrics_set(SSDP_GAUGE_FETCHES_PENDING,
+      fetcher->active_count + fetcher->queued_count);
+
+  return TRUE;
+}
+
+BOOL ssdp_fetcher_is_fetching(ssdp_fetcher_s *fetcher,
+    const ssdp_message_s *ssdp_message) {
+  ssdp_fetch_s *fetch = NULL;
+
+  for (fetch = fetcher->active; fetch; fetch = fetch->next) {
+    if (fetch->ssdp_message == ssdp_message) {
+      return TRUE;
+    }
+  }
+  for (fetch = fetcher->queued; fetch; fetch = fetch->next) {
+    if (fetch->ssdp_message == ssdp_message) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+void ssdp_fetcher_cancel(ssdp_fetcher_s *fetcher,
+    const ssdp_message_s *ssdp_message) {
+  ssdp_fetch_s **link = &fetcher->active;
+  ssdp_fetch_s *previous = NULL;
+  ssdp_fetch_s *fetch = NULL;
+
+  while (*link && (*link)->ssdp_message != ssdp_message) {
+    link = &(*link)->next;
+  }
+  if (*link) {
+    fetch = *link;
+    *link = fetch->next;
+    fetcher->active_count--;
+    free_fetch(fetch);
+
+    /* Fill the freed slot */
+    if (fetcher->queued) {
+      fetch = fetcher->queued;
+      fetcher->queued = fetch->next;
+      if (!fetcher->queued) {
+        fetcher->queued_last = NULL;
+      }
+      fetcher->queued_count--;
+      start_fetch(fetch);
+    }
+  }
+  else {
+    for (link = &fetcher->queued; *link &&
+        (*link)->ssdp_message != ssdp_message; link = &(*link)->next) {
+      previous = *link;
+    }
+    if (!*link) {
+      return;
+    }
+    fetch = *link;
+    *link = fetch->next;
+    if (fetcher->queued_last == fetch) {
+      fetcher->queued_last = previous;
+    }
+    fetcher->queued_count--;
+    free_fetch(fetch);
+  }
+
+  ssdp_metrics_set(SSDP_GAUGE_FETCHES_PENDING,
+      fetcher->active_count + fetcher->queued_count);
+}
+
+unsigned int ssdp_fetcher_pending(ssdp_fetcher_s *fetcher) {
+  return fetcher->active_count + fetcher->queued_count;
+}
+
+int ssdp_fetcher_timeout(ssdp_fetcher_s *fetcher) {
+  ssdp_fetch_s *fetch = NULL;
+  long timeout = -1;
+
+  for (fetch = fetcher->active; fetch; fetch = fetch->next) {
+    long left = (long)fetcher->timeout - elapsed_ms(&fetch->started);
+    if (left < 0) {
+      left = 0;
+    }
+    if (timeout < 0 || left < timeout) {
+      timeout = left;
+    }
+  }
+
+  return (int)timeout;
+}
+
+void ssdp_fetcher_expire(ssdp_fetcher_s *fetcher) {
+  ssdp_fetch_s *fetch = fetcher->active;
+
+  while (fetch) {
+    ssdp_fetch_s *next = fetch->next;
+    if (elapsed_ms(&fetch->started) >= (long)fetcher->timeout) {
+      PRINT_DEBUG("Fetching the description of %s timed out",
+          fetch->ssdp_message->ip);
+      finish_fetch(fetch, fetch->response_length > 0);
+      /* Finishing may start queued fetches, rescan from the beginning */
+      next = fetcher->active;
+    }
+    fetch = next;
+  }
+}
+
+void ssdp_fetcher_close(ssdp_fetcher_s *fetcher) {
+  /* Nothing more may start while closing */
+  while (fetcher->queued) {
+    ssdp_fetch_s *fetch = fetcher->queued;
+    ssdp_message_s *ssdp_message = fetch->ssdp_message;
+    fetcher->queued = fetch->next;
+    fetcher->queued_count--;
+    free_fetch(fetch);
+    fetcher->callback(fetcher->data, ssdp_message);
+  }
+  fetcher->queued_last = NULL;
+
+  while (fetcher->active) {
+    finish_fetch(fetcher->active, FALSE);
+  }
+}
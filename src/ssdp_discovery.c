@@ -0,0 +1,321 @@
+/** \file ssdp_discovery.c
+ * Discovery contexts, the API for embedding libssdp.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> /* strcasecmp() */
+
+#include "common_definitions.h"
+#include "configuration.h"
+#include "event_loop.h"
+#include "log.h"
+#include "ssdp_cache.h"
+#include "ssdp_common.h"
+#include "ssdp_description_fetcher.h"
+#include "ssdp_discovery.h"
+#include "ssdp_filter.h"
+#include "ssdp_listener.h"
+#include "ssdp_message.h"
+#include "ssdp_metrics.h"
+
+/**
+ * Call the callback of an event, if one is registered.
+ *
+ * @param discovery The context.
+ * @param event The event.
+ * @param device The device.
+ */
+static void report(ssdp_discovery_s *discovery, ssdp_discovery_event_e event,
+    const ssdp_message_s *device) {
+  ssdp_discovery_handler_s *handler = &discovery->handlers[event];
+
+  if (handler->callback && !discovery->closing) {
+    handler->callback(handler->data, event, device);
+  }
+}
+
+/**
+ * Report a new device once its description has been fetched (or failed
+ * to).
+ *
+ * @param data The context.
+ * @param ssdp_message The cached message of the device.
+ */
+static void on_description_fetched(void *data, ssdp_message_s *ssdp_message) {
+  /* Only new devices are fetched for */
+  report((ssdp_discovery_s *)data, SSDP_DISCOVERY_ADDED, ssdp_message);
+}
+
+/**
+ * Filter, cache and report a notification or a search response.
+ *
+ * @param discovery The context.
+ * @param ssdp_message The message, it is freed or owned by the cache when
+ *        the function returns.
+ */
+static void handle_message(ssdp_discovery_s *discovery,
+    ssdp_message_s *ssdp_message) {
+  configuration_s *conf = discovery->conf;
+  ssdp_header_s *nts = NULL;
+  ssdp_message_s *removed = NULL;
+  unsigned int changes = 0;
+
+  if (conf->ignore_search_msgs &&
+      strstr(ssdp_message->request, "M-SEARCH") != NULL) {
+    ssdp_metrics_inc(SSDP_COUNTER_SEARCHES_IGNORED);
+    free_ssdp_message(&ssdp_message);
+    return;
+  }
+
+  if (discovery->filters_factory &&
+      filter(ssdp_message, discovery->filters_factory)) {
+    ssdp_metrics_inc(SSDP_COUNTER_FILTER_DROPS);
+    free_ssdp_message(&ssdp_message);
+    return;
+  }
+
+  /* If a device leaves the network (ssdp:byebye) then forget it */
+  nts = get_header(ssdp_message, SSDP_HEADER_NTS);
+  if (nts && strstr(nts->contents, "ssdp:byebye")) {
+    removed = remove_ssdp_message_from_cache(&discovery->ssdp_cache,
+        ssdp_message->ip);
+    if (removed) {
+      /* A device whose description is still being fetched was never
+         reported */
+      if (conf->fetch_info &&
+          ssdp_fetcher_is_fetching(&discovery->fetcher, removed)) {
+        ssdp_fetcher_cancel(&discovery->fetcher, removed);
+      }
+      else {
+        report(discovery, SSDP_DISCOVERY_REMOVED, removed);
+      }
+      free_ssdp_message(&removed);
+    }
+    free_ssdp_message(&ssdp_message);
+    return;
+  }
+
+  if (!add_ssdp_message_to_cache(&discovery->ssdp_cache, &ssdp_message,
+      &changes)) {
+    PRINT_ERROR("Failed adding SSDP message to SSDP cache, skipping");
+    free_ssdp_message(&ssdp_message);
+    return;
+  }
+
+  /* The message is owned by the cache now, a device whose description is
+     still being fetched is reported with its latest state when done */
+  if (!changes || (conf->fetch_info &&
+      ssdp_fetcher_is_fetching(&discovery->fetcher, ssdp_message))) {
+    return;
+  }
+
+  if ((changes & SSDP_CACHE_ADDED) && conf->fetch_info &&
+      ssdp_fetcher_fetch(&discovery->fetcher, ssdp_message)) {
+    return;
+  }
+
+  report(discovery, (changes & SSDP_CACHE_ADDED) ? SSDP_DISCOVERY_ADDED :
+      SSDP_DISCOVERY_UPDATED, ssdp_message);
+}
+
+/**
+ * Read and handle the datagrams queued on the listener, at most
+ * SSDP_DISCOVERY_MAX_READS so that the application is not held up, the
+ * rest are left for the next ssdp_discovery_process().
+ *
+ * @param data The context.
+ * @param events The EVENT_LOOP_* flags that are set.
+ */
+static void on_listener_readable(void *data, unsigned int events) {
+  ssdp_discovery_s *discovery = (ssdp_discovery_s *)data;
+  ssdp_recv_node_s *recv_node = &discovery->recv_node;
+  ssdp_message_s *ssdp_message = NULL;
+  int reads;
+
+  if (!(events & EVENT_LOOP_READ)) {
+    return;
+  }
+
+  for (reads = 0; reads < SSDP_DISCOVERY_MAX_READS; reads++) {
+    ssdp_listener_read(&discovery->listener, recv_node);
+    if (recv_node->recv_bytes <= 0) {
+      break;
+    }
+    ssdp_metrics_inc(SSDP_COUNTER_DATAGRAMS);
+    ssdp_metrics_add(SSDP_COUNTER_BYTES, recv_node->recv_bytes);
+
+    ssdp_message = NULL;
+    if (!init_ssdp_message(&ssdp_message)) {
+      PRINT_ERROR("Failed to initialize the SSDP message buffer");
+      continue;
+    }
+
+    if (!build_ssdp_message(ssdp_message, recv_node->from_ip,
+        recv_node->from_mac, recv_node->recv_bytes, recv_node->recv_data)) {
+      ssdp_metrics_inc(SSDP_COUNTER_PARSE_FAILURES);
+      free_ssdp_message(&ssdp_message);
+      continue;
+    }
+
+    handle_message(discovery, ssdp_message);
+  }
+}
+
+ssdp_discovery_s *ssdp_discovery_create(configuration_s *conf) {
+  ssdp_discovery_s *discovery = NULL;
+  SOCKET sock;
+
+  discovery = (ssdp_discovery_s *)calloc(1, sizeof(ssdp_discovery_s));
+  if (!discovery) {
+    PRINT_ERROR("Failed to allocate memory for the discovery context");
+    return NULL;
+  }
+  discovery->conf = conf;
+  discovery->listener.sock = SOCKET_ERROR;
+
+  if (!event_loop_init(&discovery->loop)) {
+    free(discovery);
+    return NULL;
+  }
+  ssdp_fetcher_init(&discovery->fetcher, &discovery->loop,
+      SSDP_FETCHER_MAX_ACTIVE, SSDP_FETCHER_TIMEOUT, on_description_fetched,
+      discovery);
+
+  if (ssdp_passive_listener_init(&discovery->listener, conf)) {
+    PRINT_ERROR("Could not create SSDP listener");
+    discovery->listener.sock = SOCKET_ERROR;
+    ssdp_discovery_close(discovery);
+    return NULL;
+  }
+
+  sock = ssdp_listener_get_sock(&discovery->listener);
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+  if (!event_loop_add(&discovery->loop, sock, EVENT_LOOP_READ,
+      on_listener_readable, discovery)) {
+    ssdp_discovery_close(discovery);
+    return NULL;
+  }
+
+  parse_filters(conf->filter, &discovery->filters_factory, FALSE);
+
+  return discovery;
+}
+
+void ssdp_discovery_on(ssdp_discovery_s *discovery,
+    ssdp_discovery_event_e event, ssdp_discovery_callback callback,
+    void *data) {
+  if (event >= SSDP_DISCOVERY_EVENTS_COUNT) {
+    PRINT_ERROR("Unknown discovery event %d", (int)event);
+    return;
+  }
+
+  discovery->handlers[event].callback = callback;
+  discovery->handlers[event].data = data;
+}
+
+int ssdp_discovery_get_fd(ssdp_discovery_s *discovery) {
+  /* The epoll instance is readable when any of its descriptors is */
+  if (discovery->loop.epoll_fd >= 0) {
+    return discovery->loop.epoll_fd;
+  }
+
+  return ssdp_listener_get_sock(&discovery->listener);
+}
+
+int ssdp_discovery_timeout(ssdp_discovery_s *discovery) {
+  if (!discovery->conf->fetch_info ||
+      ssdp_fetcher_pending(&discovery->fetcher) == 0) {
+    return -1;
+  }
+
+  /* Without epoll the fetches are not behind the file descriptor */
+  if (discovery->loop.epoll_fd < 0) {
+    return SSDP_DISCOVERY_POLL_INTERVAL;
+  }
+
+  return ssdp_fetcher_timeout(&discovery->fetcher);
+}
+
+BOOL ssdp_discovery_process(ssdp_discovery_s *discovery) {
+  BOOL success = TRUE;
+
+  if (event_loop_wait(&discovery->loop, 0) < 0 && errno != EINTR) {
+    PRINT_ERROR("Waiting for the discovery sockets failed: %s",
+        strerror(errno));
+    success = FALSE;
+  }
+
+  if (discovery->conf->fetch_info) {
+    ssdp_fetcher_expire(&discovery->fetcher);
+  }
+
+  return success;
+}
+
+const char *ssdp_discovery_get_field(const ssdp_message_s *device,
+    const char *name) {
+  ssdp_header_s *header = NULL;
+  ssdp_custom_field_s *custom_field = NULL;
+  unsigned char header_type;
+
+  if (strcmp(name, "ip") == 0) {
+    return device->ip;
+  }
+  if (strcmp(name, "mac") == 0) {
+    return device->mac;
+  }
+  if (strcmp(name, "request") == 0) {
+    return device->request;
+  }
+  if (strcmp(name, "protocol") == 0) {
+    return device->protocol;
+  }
+  if (strcmp(name, "datetime") == 0) {
+    return device->datetime;
+  }
+
+  header_type = get_header_type(name);
+  if (header_type != SSDP_HEADER_UNKNOWN) {
+    header = get_header(device, header_type);
+    return header ? header->contents : NULL;
+  }
+
+  for (header = device->headers; header; header = header->next) {
+    if (header->type == SSDP_HEADER_UNKNOWN && header->unknown_type &&
+        strcasecmp(header->unknown_type, name) == 0) {
+      return header->contents;
+    }
+  }
+
+  custom_field = get_custom_field(device, name);
+
+  return custom_field ? custom_field->contents : NULL;
+}
+
+void ssdp_discovery_close(ssdp_discovery_s *discovery) {
+  SOCKET sock;
+
+  if (!discovery) {
+    return;
+  }
+
+  /* The fetcher calls back for every fetch it aborts */
+  discovery->closing = TRUE;
+  ssdp_fetcher_close(&discovery->fetcher);
+
+  sock = ssdp_listener_get_sock(&discovery->listener);
+  if (sock != SOCKET_ERROR) {
+    event_loop_remove(&discovery->loop, sock);
+    ssdp_listener_close(&discovery->listener);
+  }
+  event_loop_close(&discovery->loop);
+
+  free_ssdp_filters_factory(discovery->filters_factory);
+  free_ssdp_cache(&discovery->ssdp_cache);
+  free(discovery);
+}
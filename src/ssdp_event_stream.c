@@ -0,0 +1,117 @@
+/** \file ssdp_event_stream.c
+ * A newline-delimited JSON stream of device add/update/remove events, meant
+ * for piping the results into other tools.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common_definitions.h"
+#include "log.h"
+#include "ssdp_cache_output_format.h"
+#include "ssdp_event_stream.h"
+#include "ssdp_message.h"
+#include "string_buffer.h"
+
+/** Write the buffer regardless of the interval once it grows this big. */
+#define SSDP_EVENT_STREAM_MAX_BUFFERED 65536
+
+/**
+ * Get the number of milliseconds since a point in time.
+ *
+ * @param since The point in time.
+ *
+ * @return The elapsed milliseconds.
+ */
+static long elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000 +
+      (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+BOOL ssdp_event_stream_init(ssdp_event_stream_s *stream, int fd,
+    unsigned int flush_interval) {
+  memset(stream, 0, sizeof(ssdp_event_stream_s));
+  stream->fd = fd;
+  stream->flush_interval = flush_interval;
+  clock_gettime(CLOCK_MONOTONIC, &stream->last_flush);
+
+  return string_buffer_init(&stream->buffer, XML_BUFFER_SIZE);
+}
+
+BOOL ssdp_event_stream_emit(ssdp_event_stream_s *stream,
+    ssdp_event_type_e type, const ssdp_message_s *ssdp_message) {
+  static const char *event_names[] = { "add", "update", "remove" };
+  size_t start = stream->buffer.length;
+
+  /* Start the interval from the first buffered event */
+  if (start == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &stream->last_flush);
+  }
+
+  if (!string_buffer_append_str(&stream->buffer, "{\"event\":\"") ||
+      !string_buffer_append_str(&stream->buffer, event_names[type]) ||
+      !string_buffer_append_str(&stream->buffer, "\",\"device\":") ||
+      to_json(ssdp_message, FALSE, &stream->buffer) < 1 ||
+      !string_buffer_append(&stream->buffer, "}\n", 2)) {
+    PRINT_ERROR("Failed to create the device event");
+    /* Drop the partial line */
+    stream->buffer.length = start;
+    stream->buffer.data[start] = '\0';
+    return FALSE;
+  }
+
+  if (stream->buffer.length >= SSDP_EVENT_STREAM_MAX_BUFFERED ||
+      ssdp_event_stream_timeout(stream) == 0) {
+    return ssdp_event_stream_flush(stream);
+  }
+
+  return TRUE;
+}
+
+int ssdp_event_stream_timeout(ssdp_event_stream_s *stream) {
+  long left;
+
+  if (stream->buffer.length == 0) {
+    return -1;
+  }
+
+  left = (long)stream->flush_interval - elapsed_ms(&stream->last_flush);
+
+  return left > 0 ? (int)left : 0;
+}
+
+BOOL ssdp_event_stream_flush(ssdp_event_stream_s *stream) {
+  size_t written = 0;
+
+  while (written < stream->buffer.length) {
+    ssize_t bytes = write(stream->fd, stream->buffer.data + written,
+        stream->buffer.length - written);
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PRINT_ERROR("Failed writing device events: %s", strerror(errno));
+      string_buffer_reset(&stream->buffer);
+      return FALSE;
+    }
+    written += bytes;
+  }
+
+  string_buffer_reset(&stream->buffer);
+  clock_gettime(CLOCK_MONOTONIC, &stream->last_flush);
+
+  return TRUE;
+}
+
+void ssdp_event_stream_close(ssdp_event_stream_s *stream) {
+  ssdp_event_stream_flush(stream);
+  string_buffer_free(&stream->buffer);
+}
@@ -11,8 +11,30 @@
 #include "log.h"
 #include "ssdp_filter.h"
 #include "ssdp_message.h"
+#include "string_intern.h"
 #include "string_utils.h"
 
+/** The size of a filter header name buffer. */
+#define FILTER_HEADER_SIZE 64
+/** The size of a filter value buffer. */
+#define FILTER_VALUE_SIZE 2048
+
+/**
+ * Copy a part of a string, cutting it to fit the destination.
+ *
+ * @param dest The (zeroed) buffer to copy to.
+ * @param size The size of the buffer.
+ * @param src The string to copy from.
+ * @param length The number of characters to copy.
+ */
+static void copy_cut(char *dest, size_t size, const char *src,
+    size_t length) {
+  if (length > size - 1) {
+    length = size - 1;
+  }
+  memcpy(dest, src, length);
+}
+
 void free_ssdp_filters_factory(filters_factory_s *factory) {
   if (factory) {
     if (factory->filters) {
@@ -26,6 +48,8 @@ void free_ssdp_filters_factory(filters_factory_s *factory) {
           free(factory->filters[fc].value);
           factory->filters[fc].value = NULL;
         }
+        string_intern_release(factory->filters[fc].interned_value);
+        factory->filters[fc].interned_value = NULL;
       }
       free(factory->filters);
       factory->filters = NULL;
@@ -53,6 +77,13 @@ void parse_filters(char *raw_filter, filters_factory_s **filters_factory,
     last_pos++;
   }
 
+  if(*last_pos == '\0') {
+    if(print_filters) {
+      printf("No filters applied.\n");
+    }
+    return;
+  }
+
   while(*(last_pos + strlen(last_pos) - 1) == ',' || *(last_pos + strlen(last_pos) - 1) == '=') {
     memcpy((last_pos + strlen(last_pos) - 1), "\0", 1);
   }
@@ -76,12 +107,14 @@ void parse_filters(char *raw_filter, filters_factory_s **filters_factory,
   for(fc = 0; fc < filters_count; fc++) {
 
     /* Header name which value to apply filter on */
-    ff->filters[fc].header = (char *)malloc(sizeof(char) * 64);
-    memset((ff->filters[fc]).header, '\0', sizeof(char) * 64);
+    ff->filters[fc].header = (char *)malloc(sizeof(char) *
+        FILTER_HEADER_SIZE);
+    memset((ff->filters[fc]).header, '\0', sizeof(char) *
+        FILTER_HEADER_SIZE);
 
     /* Header value to filter on */
-    ff->filters[fc].value = (char *)malloc(sizeof(char) * 2048);
-    memset(ff->filters[fc].value, '\0', sizeof(char) * 2048);
+    ff->filters[fc].value = (char *)malloc(sizeof(char) * FILTER_VALUE_SIZE);
+    memset(ff->filters[fc].value, '\0', sizeof(char) * FILTER_VALUE_SIZE);
 
     /* Find filter splitter (',') */
     pos = strstr(last_pos, ",");
@@ -89,16 +122,21 @@ void parse_filters(char *raw_filter, filters_factory_s **filters_factory,
       pos = last_pos + strlen(last_pos);
     }
 
-    /* Find name and value splitter ('=') */
-    splitter = strstr(last_pos, "=");
-    if(splitter > 0) {
-      strncpy(ff->filters[fc].header, last_pos, splitter - last_pos);
+    /* Find name and value splitter ('=') within this filter, too long
+       names and values are cut */
+    splitter = memchr(last_pos, '=', pos - last_pos);
+    if(splitter != NULL) {
+      copy_cut(ff->filters[fc].header, FILTER_HEADER_SIZE, last_pos,
+          splitter - last_pos);
       splitter++;
-      strncpy(ff->filters[fc].value, splitter, pos - splitter);
+      copy_cut(ff->filters[fc].value, FILTER_VALUE_SIZE, splitter,
+          pos - splitter);
     }
     else {
-      strncpy(ff->filters[fc].header, last_pos, pos - last_pos);
+      copy_cut(ff->filters[fc].header, FILTER_HEADER_SIZE, last_pos,
+          pos - last_pos);
     }
+    ff->filters[fc].interned_value = string_intern(ff->filters[fc].value);
     last_pos = pos + 1;
 
   }
@@ -122,6 +160,7 @@ BOOL filter(ssdp_message_s *ssdp_message, filters_factory_s *filters_factory) {
     BOOL filter_found = FALSE;
     char *filter_value = filters_factory->filters[fc].value;
     char *filter_header = filters_factory->filters[fc].header;
+    const char *interned_value = filters_factory->filters[fc].interned_value;
 
     /* If IP filtering has been set, check values */
     if(strcmp(filter_header, "ip") == 0) {
@@ -175,8 +214,10 @@ BOOL filter(ssdp_message_s *ssdp_message, filters_factory_s *filters_factory) {
       if(strcmp(ssdp_header_string, filter_header) == 0) {
         filter_found = TRUE;
 
-        /* Then see if the values match */
-        if(strstr(ssdp_headers->contents, filter_value) == NULL) {
+        /* Then see if the values match (identical values are interned
+           to the same pointer and need no substring search) */
+        if(ssdp_headers->contents != interned_value &&
+           strstr(ssdp_headers->contents, filter_value) == NULL) {
           PRINT_DEBUG("Header (%s) filter mismatch, marked for dropping", filter_header);
           drop_message = TRUE;
           break;
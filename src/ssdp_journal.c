@@ -0,0 +1,503 @@
+/** \file ssdp_journal.c
+ * An append-only journal of the received datagrams (-J) and its replay
+ * (-Y).
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common_definitions.h"
+#include "log.h"
+#include "ssdp_journal.h"
+
+/** The length of a segment name without the extension. */
+#define SEGMENT_NAME_LENGTH 20
+
+/**
+ * Get the size of a record with its datagram and padding.
+ *
+ * @param length The length of the datagram.
+ *
+ * @return The size in bytes.
+ */
+static size_t record_size(size_t length) {
+  return sizeof(ssdp_journal_record_s) + ((length + 7) & ~(size_t)7);
+}
+
+/**
+ * Copy a string to a fixed size field, cutting it if needed.
+ *
+ * @param dest The field.
+ * @param size The size of the field.
+ * @param src The string, NULL for an empty one.
+ */
+static void copy_field(char *dest, size_t size, const char *src) {
+  memset(dest, 0, size);
+  if (src) {
+    strncpy(dest, src, size - 1);
+  }
+}
+
+/**
+ * Make the path of a segment file.
+ *
+ * @param path Where to put the path (PATH_MAX bytes).
+ * @param directory The journal directory.
+ * @param start The time in the segment name.
+ * @param extension The extension ("ssj" or "ssx").
+ *
+ * @return TRUE on success, FALSE if the path is too long.
+ */
+static BOOL segment_path(char *path, const char *directory,
+    unsigned long long start, const char *extension) {
+  if (snprintf(path, PATH_MAX, "%s/%020llu.%s", directory, start,
+      extension) >= PATH_MAX) {
+    PRINT_ERROR("The journal path is too long");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * Compare two segment times, for qsort().
+ *
+ * @param a The first time.
+ * @param b The second time.
+ *
+ * @return <0, 0 or >0 like strcmp().
+ */
+static int compare_starts(const void *a, const void *b) {
+  unsigned long long first = *(const unsigned long long *)a;
+  unsigned long long second = *(const unsigned long long *)b;
+
+  return first < second ? -1 : first > second;
+}
+
+/**
+ * List the segments of a journal, oldest first.
+ *
+ * @param directory The journal directory.
+ * @param starts Where to put the (allocated) list of segment times, which
+ *        the caller has to free.
+ * @param count Where to put the number of segments.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL list_segments(const char *directory, unsigned long long **starts,
+    size_t *count) {
+  DIR *dir = opendir(directory);
+  struct dirent *entry = NULL;
+  size_t size = 0;
+
+  *starts = NULL;
+  *count = 0;
+  if (!dir) {
+    PRINT_ERROR("Could not open the journal '%s': %s", directory,
+        strerror(errno));
+    return FALSE;
+  }
+
+  while ((entry = readdir(dir))) {
+    char *end = NULL;
+    unsigned long long start;
+
+    if (strlen(entry->d_name) != SEGMENT_NAME_LENGTH + 4 ||
+        strcmp(entry->d_name + SEGMENT_NAME_LENGTH, ".ssj") != 0) {
+      continue;
+    }
+    start = strtoull(entry->d_name, &end, 10);
+    if (end != entry->d_name + SEGMENT_NAME_LENGTH) {
+      continue;
+    }
+
+    if (*count == size) {
+      unsigned long long *grown = NULL;
+      size = size ? size * 2 : 64;
+      grown = (unsigned long long *)realloc(*starts,
+          size * sizeof(unsigned long long));
+      if (!grown) {
+        PRINT_ERROR("Failed to allocate memory for the journal segments");
+        free(*starts);
+        *starts = NULL;
+        *count = 0;
+        closedir(dir);
+        return FALSE;
+      }
+      *starts = grown;
+    }
+    (*starts)[(*count)++] = start;
+  }
+  closedir(dir);
+
+  if (*count > 1) {
+    qsort(*starts, *count, sizeof(unsigned long long), compare_starts);
+  }
+
+  return TRUE;
+}
+
+/**
+ * Delete the oldest segments until the journal is within its retention.
+ * The segment being written is never deleted.
+ *
+ * @param journal The journal.
+ */
+static void enforce_retention(ssdp_journal_s *journal) {
+  unsigned long long *starts = NULL;
+  unsigned long long *sizes = NULL;
+  unsigned long long total = 0;
+  char path[PATH_MAX];
+  size_t count, i;
+
+  if (!list_segments(journal->directory, &starts, &count) || count == 0) {
+    free(starts);
+    return;
+  }
+  sizes = (unsigned long long *)calloc(count, sizeof(unsigned long long));
+  if (!sizes) {
+    free(starts);
+    return;
+  }
+
+  for (i = 0; i < count; i++) {
+    struct stat file_stat;
+    if (segment_path(path, journal->directory, starts[i], "ssj") &&
+        stat(path, &file_stat) == 0) {
+      sizes[i] += file_stat.st_size;
+    }
+    if (segment_path(path, journal->directory, starts[i], "ssx") &&
+        stat(path, &file_stat) == 0) {
+      sizes[i] += file_stat.st_size;
+    }
+    total += sizes[i];
+  }
+
+  for (i = 0; i < count && total > journal->retention &&
+      starts[i] != journal->segment_start; i++) {
+    PRINT_DEBUG("Deleting the oldest journal segment");
+    if (segment_path(path, journal->directory, starts[i], "ssj")) {
+      unlink(path);
+    }
+    if (segment_path(path, journal->directory, starts[i], "ssx")) {
+      unlink(path);
+    }
+    total -= sizes[i];
+  }
+
+  free(sizes);
+  free(starts);
+}
+
+/**
+ * Close the segment being written.
+ *
+ * @param journal The journal.
+ */
+static void close_segment(ssdp_journal_s *journal) {
+  if (journal->segment_fd >= 0) {
+    close(journal->segment_fd);
+    journal->segment_fd = -1;
+  }
+  if (journal->index_fd >= 0) {
+    close(journal->index_fd);
+    journal->index_fd = -1;
+  }
+}
+
+/**
+ * Start a new segment.
+ *
+ * @param journal The journal.
+ * @param start The time of its first record.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL open_segment(ssdp_journal_s *journal, unsigned long long start) {
+  ssdp_journal_header_s header;
+  char path[PATH_MAX];
+
+  close_segment(journal);
+
+  if (!segment_path(path, journal->directory, start, "ssj")) {
+    return FALSE;
+  }
+  journal->segment_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC,
+      0644);
+  if (journal->segment_fd < 0) {
+    PRINT_ERROR("Could not create the journal segment '%s': %s", path,
+        strerror(errno));
+    return FALSE;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SSDP_JOURNAL_MAGIC, sizeof(header.magic));
+  header.version = SSDP_JOURNAL_VERSION;
+  if (write(journal->segment_fd, &header, sizeof(header)) !=
+      (ssize_t)sizeof(header)) {
+    PRINT_ERROR("Could not write the journal segment '%s': %s", path,
+        strerror(errno));
+    close_segment(journal);
+    unlink(path);
+    return FALSE;
+  }
+
+  if (!segment_path(path, journal->directory, start, "ssx")) {
+    close_segment(journal);
+    return FALSE;
+  }
+  journal->index_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC,
+      0644);
+  if (journal->index_fd < 0) {
+    PRINT_WARN("Could not create the journal index '%s': %s", path,
+        strerror(errno));
+  }
+
+  journal->segment_start = start;
+  journal->segment_size = sizeof(header);
+  journal->last_indexed = 0;
+  enforce_retention(journal);
+
+  return TRUE;
+}
+
+unsigned long long ssdp_journal_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+BOOL ssdp_journal_open(ssdp_journal_s *journal, const char *directory,
+    unsigned int retention) {
+  memset(journal, 0, sizeof(ssdp_journal_s));
+  journal->segment_fd = -1;
+  journal->index_fd = -1;
+  journal->retention = (unsigned long long)retention * 1024 * 1024;
+  journal->segment_limit = journal->retention / 4;
+  if (journal->segment_limit > SSDP_JOURNAL_SEGMENT_SIZE) {
+    journal->segment_limit = SSDP_JOURNAL_SEGMENT_SIZE;
+  }
+  if (journal->segment_limit < SSDP_JOURNAL_MIN_SEGMENT_SIZE) {
+    journal->segment_limit = SSDP_JOURNAL_MIN_SEGMENT_SIZE;
+  }
+
+  if (strlen(directory) >= sizeof(journal->directory)) {
+    PRINT_ERROR("The journal path is too long");
+    return FALSE;
+  }
+  strcpy(journal->directory, directory);
+
+  if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+    PRINT_ERROR("Could not create the journal '%s': %s", directory,
+        strerror(errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+BOOL ssdp_journal_append(ssdp_journal_s *journal, unsigned long long time,
+    const char *ip, const char *mac, const char *interface,
+    const char *datagram, size_t length) {
+  static const char padding[8] = { 0 };
+  ssdp_journal_record_s record;
+  struct iovec iov[3];
+  size_t size = record_size(length);
+
+  if (journal->segment_fd < 0 ||
+      journal->segment_size + size > journal->segment_limit) {
+    if (!open_segment(journal, time)) {
+      return FALSE;
+    }
+  }
+
+  memset(&record, 0, sizeof(record));
+  record.time = time;
+  record.length = (uint32_t)length;
+  copy_field(record.ip, sizeof(record.ip), ip);
+  copy_field(record.mac, sizeof(record.mac), mac);
+  copy_field(record.interface, sizeof(record.interface), interface);
+
+  iov[0].iov_base = &record;
+  iov[0].iov_len = sizeof(record);
+  iov[1].iov_base = (void *)datagram;
+  iov[1].iov_len = length;
+  iov[2].iov_base = (void *)padding;
+  iov[2].iov_len = size - sizeof(record) - length;
+  if (writev(journal->segment_fd, iov, 3) != (ssize_t)size) {
+    PRINT_ERROR("Could not write to the journal: %s", strerror(errno));
+    /* Start over in a new segment, a partial record ends this one */
+    close_segment(journal);
+    return FALSE;
+  }
+
+  if (journal->index_fd >= 0 && (journal->last_indexed == 0 ||
+      time >= journal->last_indexed + SSDP_JOURNAL_INDEX_INTERVAL)) {
+    ssdp_journal_index_entry_s entry;
+    entry.time = time;
+    entry.offset = journal->segment_size;
+    if (write(journal->index_fd, &entry, sizeof(entry)) !=
+        (ssize_t)sizeof(entry)) {
+      PRINT_WARN("Could not write to the journal index: %s",
+          strerror(errno));
+    }
+    journal->last_indexed = time;
+  }
+  journal->segment_size += size;
+
+  return TRUE;
+}
+
+void ssdp_journal_close(ssdp_journal_s *journal) {
+  close_segment(journal);
+}
+
+/**
+ * Find where to start replaying a segment from its index.
+ *
+ * @param directory The journal directory.
+ * @param start The time in the segment name.
+ * @param from The start of the replayed range.
+ *
+ * @return The offset of the last indexed record before the range, 0 if
+ *         there is none.
+ */
+static unsigned long long find_offset(const char *directory,
+    unsigned long long start, unsigned long long from) {
+  ssdp_journal_index_entry_s entry;
+  unsigned long long offset = 0;
+  char path[PATH_MAX];
+  int fd;
+
+  if (!segment_path(path, directory, start, "ssx") ||
+      (fd = open(path, O_RDONLY)) < 0) {
+    return 0;
+  }
+  while (read(fd, &entry, sizeof(entry)) == (ssize_t)sizeof(entry) &&
+      entry.time <= from) {
+    offset = entry.offset;
+  }
+  close(fd);
+
+  return offset;
+}
+
+/**
+ * Replay the datagrams of a segment received in a time range.
+ *
+ * @param directory The journal directory.
+ * @param start The time in the segment name.
+ * @param from The start of the range.
+ * @param to The end of the range.
+ * @param callback The function to call for every datagram.
+ * @param data Passed to the callback.
+ *
+ * @return TRUE to go on with the next segment, FALSE if the replay is over.
+ */
+static BOOL replay_segment(const char *directory, unsigned long long start,
+    unsigned long long from, unsigned long long to,
+    ssdp_journal_replay_cb callback, void *data) {
+  const ssdp_journal_header_s *header = NULL;
+  struct stat file_stat;
+  char path[PATH_MAX];
+  const char *map = NULL;
+  size_t size, offset;
+  BOOL more = TRUE;
+  int fd;
+
+  if (!segment_path(path, directory, start, "ssj") ||
+      (fd = open(path, O_RDONLY)) < 0) {
+    PRINT_WARN("Could not open the journal segment '%s'", path);
+    return TRUE;
+  }
+  if (fstat(fd, &file_stat) < 0 ||
+      (size_t)file_stat.st_size < sizeof(ssdp_journal_header_s)) {
+    close(fd);
+    return TRUE;
+  }
+  size = (size_t)file_stat.st_size;
+  map = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    PRINT_WARN("mmap(): %s", strerror(errno));
+    return TRUE;
+  }
+
+  header = (const ssdp_journal_header_s *)map;
+  if (memcmp(header->magic, SSDP_JOURNAL_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SSDP_JOURNAL_VERSION) {
+    PRINT_WARN("'%s' is not a journal segment", path);
+    munmap((void *)map, size);
+    return TRUE;
+  }
+
+  offset = from > start ? (size_t)find_offset(directory, start, from) : 0;
+  if (offset < sizeof(ssdp_journal_header_s) || offset >= size ||
+      offset % 8 != 0) {
+    offset = sizeof(ssdp_journal_header_s);
+  }
+
+  while (more && offset + sizeof(ssdp_journal_record_s) <= size) {
+    const ssdp_journal_record_s *record =
+        (const ssdp_journal_record_s *)(map + offset);
+
+    /* A record cut short (still being written or damaged) ends it */
+    if (record->length > size - offset - sizeof(ssdp_journal_record_s) ||
+        !memchr(record->ip, '\0', sizeof(record->ip)) ||
+        !memchr(record->mac, '\0', sizeof(record->mac)) ||
+        !memchr(record->interface, '\0', sizeof(record->interface))) {
+      break;
+    }
+    if (record->time > to) {
+      more = FALSE;
+      break;
+    }
+    if (record->time >= from) {
+      more = callback(data, record, map + offset +
+          sizeof(ssdp_journal_record_s));
+    }
+    offset += record_size(record->length);
+  }
+
+  munmap((void *)map, size);
+
+  return more;
+}
+
+BOOL ssdp_journal_replay(const char *directory, unsigned long long from,
+    unsigned long long to, ssdp_journal_replay_cb callback, void *data) {
+  unsigned long long *starts = NULL;
+  size_t count, i;
+
+  if (!list_segments(directory, &starts, &count)) {
+    return FALSE;
+  }
+
+  for (i = 0; i < count; i++) {
+    /* The segment ends where the next one starts */
+    if (i + 1 < count && starts[i + 1] <= from) {
+      continue;
+    }
+    if (starts[i] > to ||
+        !replay_segment(directory, starts[i], from, to, callback, data)) {
+      break;
+    }
+  }
+  free(starts);
+
+  return TRUE;
+}
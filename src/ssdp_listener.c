@@ -5,13 +5,17 @@
  */
 
 #include <errno.h>
+#include <poll.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h> /* struct sockaddr_storage */
+#include <time.h>
 #include <unistd.h> /* close() */
 
 #include "common_definitions.h"
 #include "configuration.h"
+#include "event_loop.h"
 #include "log.h"
 #include "net_definitions.h"
 #include "net_utils.h"
@@ -20,9 +24,18 @@
 #include "ssdp_cache.h"
 #include "ssdp_cache_display.h"
 #include "ssdp_cache_output_format.h"
+#include "ssdp_checkpoint.h"
 #include "ssdp_common.h"
+#include "ssdp_description_fetcher.h"
+#include "ssdp_event_stream.h"
+#include "ssdp_journal.h"
 #include "ssdp_listener.h"
 #include "ssdp_message.h"
+#include "ssdp_metrics.h"
+#include "ssdp_monitor.h"
+#include "ssdp_pcap.h"
+#include "ssdp_server.h"
+#include "ssdp_snapshot.h"
 #include "ssdp_static_defs.h"
 
 /** The queue length for the listener (how many queued connections) */
@@ -38,6 +51,22 @@
  * nodes to answer a SEARCH probe/message.
  */
 #define SSDP_ACTIVE_LISTENER_TIMEOUT 5
+/**
+ * The most messages waiting to be output whose latencies are recorded, the
+ * rest are not.
+ */
+#define SSDP_LISTENER_MAX_AWAITING 4096
+/**
+ * The longest time (in ms) a change waits to be forwarded with -O, and the
+ * time before a failed forward is retried.
+ */
+#define SSDP_LISTENER_FORWARD_DELAY 10000
+/**
+ * The time (in ms) between two checks of the description fetches while
+ * fetching, on systems without epoll (where they are not polled with the
+ * rest).
+ */
+#define SSDP_LISTENER_FETCH_POLL_INTERVAL 50
 
 /**
  * Initialize a SSDP listener. This parses and sets the forwarder address,
@@ -131,159 +160,1212 @@ void ssdp_listener_close(ssdp_listener_s *listener) {
 void ssdp_listener_read(ssdp_listener_s *listener,
     ssdp_recv_node_s *recv_node) {
   PRINT_DEBUG("ssdp_listener_read()");
-  struct sockaddr_storage recv_addr;
-  size_t addr_size = sizeof recv_addr;
+  ssdp_recv_node_read(listener->sock, recv_node);
+}
+
+SOCKET ssdp_listener_get_sock(ssdp_listener_s *listener) {
+  return listener->sock;
+}
+
+/** A message waiting to be output, for the latency histograms. */
+typedef struct ssdp_listener_output_struct {
+  /** When it was received, 0 if not known. */
+  unsigned long long received;
+  /** When it was enriched. */
+  unsigned long long enriched;
+} ssdp_listener_output_s;
+
+/** The state of a running listener, shared with the continuous scans. */
+typedef struct ssdp_listener_state_struct {
+  /** The listener. */
+  ssdp_listener_s *listener;
+  /** The global configuration. */
+  configuration_s *conf;
+  /** The filters to apply. */
+  filters_factory_s *filters_factory;
+  /** The devices heard from. */
+  ssdp_cache_s *ssdp_cache;
+  /** The device event stream, when streaming. */
+  ssdp_event_stream_s event_stream;
+  /** Device events are streamed to stdout. */
+  BOOL stream_events;
+  /** The cached devices are displayed in a table. */
+  BOOL display_table;
+  /** Changes are only reported after every continuous scan. */
+  BOOL monitoring;
+  /** Searches run in between, once (-U) or continuously (-l). */
+  BOOL scanning;
+  /** The server answering queries for the devices (-S), when serving. */
+  ssdp_server_s *server;
+  /** The snapshots of the table the server reads, when serving. */
+  ssdp_snapshots_s *snapshots;
+  /** The checkpoint of the table (-D), when saving it. */
+  ssdp_checkpoint_s *checkpoint;
+  /** The journal of the received datagrams (-J), when recording. */
+  ssdp_journal_s *journal;
+  /** The recorded traffic is replayed at the pace it was received (-Z). */
+  BOOL replay_paced;
+  /** When the first replayed datagram was received, 0 before it. */
+  unsigned long long replay_first;
+  /** When the first replayed datagram was replayed. */
+  struct timespec replay_start;
+  /** When the message being handled was received, 0 if not known. */
+  unsigned long long received_time;
+  /** When the message being handled passed its last stage, 0 if not known. */
+  unsigned long long stage_time;
+  /** The messages waiting to be output. */
+  ssdp_listener_output_s *awaiting;
+  /** The number of messages waiting to be output. */
+  unsigned int awaiting_count;
+  /** The allocated size of awaiting. */
+  unsigned int awaiting_size;
+  /** Only the changes are forwarded, and everything now and then (-O). */
+  BOOL forward_delta;
+  /** The goodbyes of the forwarded devices that left, to forward. */
+  ssdp_cache_s *forward_removed;
+  /** The number of changes to the table not forwarded yet. */
+  unsigned int forward_changes;
+  /** When the oldest change not forwarded yet was made. */
+  unsigned long long forward_since;
+  /** When all the devices are forwarded next. */
+  unsigned long long forward_resync;
+  /** Forwarding failed, it is not tried again before this. */
+  unsigned long long forward_retry;
+  /**
+   * When a datagram was last received, or the cache last forwarded for
+   * want of one (-a without -O).
+   */
+  unsigned long long idle_since;
+  /** The cache is forwarded (-a) once the descriptions are fetched. */
+  BOOL flush_waiting;
+  /** The description fetcher, NULL unless descriptions are fetched live. */
+  ssdp_fetcher_s *fetcher;
+} ssdp_listener_state_s;
+
+/**
+ * Start timing the stages of a message.
+ *
+ * @param state The listener state.
+ * @param received TRUE if it was just received, FALSE if it was received
+ *        and parsed elsewhere.
+ */
+static void message_received(ssdp_listener_state_s *state, BOOL received) {
+  state->stage_time = ssdp_metrics_now();
+  state->received_time = received ? state->stage_time : 0;
+}
+
+/**
+ * Record the time the message being handled spent in a stage.
+ *
+ * @param state The listener state.
+ * @param histogram The histogram of the stage.
+ */
+static void stage_done(ssdp_listener_state_s *state,
+    ssdp_histogram_e histogram) {
+  unsigned long long now = ssdp_metrics_now();
+
+  if (state->stage_time) {
+    ssdp_metrics_record(histogram, now - state->stage_time);
+  }
+  state->stage_time = now;
+}
+
+/**
+ * Remember that the message being handled is waiting to be output.
+ *
+ * @param state The listener state.
+ */
+static void await_output(ssdp_listener_state_s *state) {
+  if (state->awaiting_count == state->awaiting_size) {
+    unsigned int size = state->awaiting_size ? state->awaiting_size * 2 : 64;
+    ssdp_listener_output_s *awaiting;
+
+    if (size > SSDP_LISTENER_MAX_AWAITING) {
+      return;
+    }
+    awaiting = (ssdp_listener_output_s *)realloc(state->awaiting,
+        size * sizeof(ssdp_listener_output_s));
+    if (!awaiting) {
+      return;
+    }
+    state->awaiting = awaiting;
+    state->awaiting_size = size;
+  }
+
+  state->awaiting[state->awaiting_count].received = state->received_time;
+  state->awaiting[state->awaiting_count++].enriched = state->stage_time;
+}
+
+/**
+ * Record the latencies of the messages waiting to be output, they just
+ * were.
+ *
+ * @param state The listener state.
+ */
+static void output_done(ssdp_listener_state_s *state) {
+  unsigned long long now = ssdp_metrics_now();
+  unsigned int i;
+
+  for (i = 0; i < state->awaiting_count; i++) {
+    ssdp_metrics_record(SSDP_HISTOGRAM_EMIT, now - state->awaiting[i].enriched);
+    if (state->awaiting[i].received) {
+      ssdp_metrics_record(SSDP_HISTOGRAM_TOTAL,
+          now - state->awaiting[i].received);
+    }
+  }
+  state->awaiting_count = 0;
+}
+
+/**
+ * Record the latencies of the messages waiting to be output if the event
+ * stream or the table has nothing left to write. Forwarded messages are
+ * output when the cache is flushed and printed ones at the end.
+ *
+ * @param state The listener state.
+ */
+static void output_if_idle(ssdp_listener_state_s *state) {
+  if (state->awaiting_count == 0) {
+    return;
+  }
+  if (state->stream_events ? state->event_stream.buffer.length == 0 :
+      state->display_table && display_ssdp_cache_timeout() < 0) {
+    output_done(state);
+  }
+}
+
+/**
+ * Tell the readers and the checkpoint of the table (if any) that it has
+ * changed.
+ *
+ * @param state The listener state.
+ */
+static void table_changed(ssdp_listener_state_s *state) {
+  ssdp_metrics_set(SSDP_GAUGE_DEVICES, state->ssdp_cache ?
+      *state->ssdp_cache->ssdp_messages_count : 0);
+  if (state->snapshots) {
+    ssdp_snapshots_changed(state->snapshots);
+  }
+  if (state->checkpoint) {
+    ssdp_checkpoint_changed(state->checkpoint);
+  }
+}
+
+/**
+ * Remember that the table has changed in a way that is forwarded (-O).
+ *
+ * @param state The listener state.
+ */
+static void forward_later(ssdp_listener_state_s *state) {
+  if (state->forward_changes++ == 0) {
+    state->forward_since = ssdp_cache_now();
+  }
+}
+
+/**
+ * Forward the changes to the table (-O) once there are as many as the
+ * cache size (-c) or the oldest has waited SSDP_LISTENER_FORWARD_DELAY, and
+ * all the devices when it is time to resync.
+ *
+ * @param state The listener state.
+ */
+static void forward_changes(ssdp_listener_state_s *state) {
+  configuration_s *conf = state->conf;
+  unsigned long long now = ssdp_cache_now();
+  BOOL resync = now >= state->forward_resync;
+
+  if (now < state->forward_retry || (!resync &&
+      (state->forward_changes == 0 ||
+      (state->forward_changes < (unsigned int)conf->ssdp_cache_size &&
+      now < state->forward_since + SSDP_LISTENER_FORWARD_DELAY)))) {
+    return;
+  }
+
+  PRINT_DEBUG("Forwarding %s", resync ? "all the cached devices" :
+      "the changed devices");
+  if (!forward_ssdp_cache_changes(conf, state->ssdp_cache,
+      &state->forward_removed, resync, "/abused/post.php",
+      &state->listener->forwarder, 80, 1)) {
+    state->forward_retry = now + SSDP_LISTENER_FORWARD_DELAY;
+    return;
+  }
+  state->forward_changes = 0;
+  if (resync) {
+    state->forward_resync = now + (unsigned long long)conf->resync_interval *
+        1000;
+  }
+  output_done(state);
+}
+
+/**
+ * Get the time until the changes to the table are forwarded (-O).
+ *
+ * @param state The listener state.
+ *
+ * @return The time in ms, 0 if it is due now.
+ */
+static int forward_timeout(ssdp_listener_state_s *state) {
+  unsigned long long now = ssdp_cache_now();
+  unsigned long long next = state->forward_resync;
+
+  if (state->forward_changes > 0 &&
+      state->forward_since + SSDP_LISTENER_FORWARD_DELAY < next) {
+    next = state->forward_since + SSDP_LISTENER_FORWARD_DELAY;
+  }
+  if (next < state->forward_retry) {
+    next = state->forward_retry;
+  }
+
+  return next > now ? (int)(next - now) : 0;
+}
+
+/**
+ * Forward the cached devices (-a without -O) and empty the cache, unless
+ * the descriptions of some are still being fetched, then it is done once
+ * they are.
+ *
+ * @param state The listener state.
+ */
+static void flush_forwarded(ssdp_listener_state_s *state) {
+  configuration_s *conf = state->conf;
+
+  if (state->fetcher && ssdp_fetcher_pending(state->fetcher) > 0) {
+    PRINT_DEBUG("Descriptions are being fetched, not sending yet");
+    state->flush_waiting = TRUE;
+    return;
+  }
+  state->flush_waiting = FALSE;
+
+  if (!state->ssdp_cache) {
+    return;
+  }
+  if (!flush_ssdp_cache(conf, &state->ssdp_cache, "/abused/post.php",
+      &state->listener->forwarder, 80, 1)) {
+    PRINT_DEBUG("Failed flushing SSDP cache");
+    return;
+  }
+  output_done(state);
+  table_changed(state);
+}
+
+/**
+ * Get the time until the listener is idle, when the cached devices are
+ * forwarded (-a without -O) if no datagram has been received in
+ * SSDP_PASSIVE_LISTENER_TIMEOUT.
+ *
+ * @param state The listener state.
+ *
+ * @return The time in ms, 0 if it is idle now.
+ */
+static int idle_timeout(ssdp_listener_state_s *state) {
+  unsigned long long now = ssdp_cache_now();
+  unsigned long long next = state->idle_since +
+      SSDP_PASSIVE_LISTENER_TIMEOUT * 1000ULL;
+
+  return next > now ? (int)(next - now) : 0;
+}
+
+/**
+ * Forward or display the cached devices, no datagram has been received in
+ * SSDP_PASSIVE_LISTENER_TIMEOUT.
+ *
+ * @param state The listener state.
+ */
+static void on_idle(ssdp_listener_state_s *state) {
+  configuration_s *conf = state->conf;
+
+  PRINT_DEBUG("Timed-out waiting for a SSDP message");
+  state->idle_since = ssdp_cache_now();
+  if (state->forward_delta) {
+    forward_changes(state);
+  }
+  else if (!state->ssdp_cache ||
+      *state->ssdp_cache->ssdp_messages_count == 0) {
+    PRINT_DEBUG("No messages in the SSDP cache, continuing to listen");
+  }
+  /* If forwarding has been enabled, send the cached SSDP messages and empty
+     the list */
+  else if (conf->forward_address) {
+    PRINT_DEBUG("Forwarding cached SSDP messages");
+    flush_forwarded(state);
+  }
+  /* Else just display the cached messages in a table */
+  else if (state->display_table) {
+    PRINT_DEBUG("Displaying cached SSDP messages");
+    display_ssdp_cache(state->ssdp_cache, FALSE);
+  }
+}
+
+/**
+ * Stop fetching the description of a device that is being removed.
+ *
+ * @param state The listener state.
+ * @param ssdp_message The cached message of the device.
+ *
+ * @return TRUE if it was being fetched, then the device was never output,
+ *         FALSE otherwise.
+ */
+static BOOL cancel_fetch(ssdp_listener_state_s *state,
+    ssdp_message_s *ssdp_message) {
+  if (!state->fetcher ||
+      !ssdp_fetcher_is_fetching(state->fetcher, ssdp_message)) {
+    return FALSE;
+  }
+
+  PRINT_DEBUG("Device '%s' left before it was described", ssdp_message->ip);
+  ssdp_fetcher_cancel(state->fetcher, ssdp_message);
+
+  return TRUE;
+}
+
+/**
+ * Fetch the description of a device right away, if not fetched already,
+ * and count how it went. Only for the replays (-Y and -P), live devices are
+ * fetched for by the fetcher of the loop.
+ *
+ * @param conf The global configuration.
+ * @param ssdp_message The cached message of the device.
+ */
+static void fetch_description(configuration_s *conf,
+    ssdp_message_s *ssdp_message) {
+  unsigned long long start;
+
+  if (ssdp_message->custom_fields) {
+    return;
+  }
+
+  start = ssdp_metrics_now();
+  if (fetch_custom_fields(conf, ssdp_message)) {
+    ssdp_metrics_inc(SSDP_COUNTER_FETCHES);
+  }
+  else {
+    PRINT_DEBUG("Could not fetch custom fields");
+    ssdp_metrics_inc(SSDP_COUNTER_FETCH_FAILURES);
+  }
+  ssdp_metrics_record(SSDP_HISTOGRAM_FETCH, ssdp_metrics_now() - start);
+}
+
+/**
+ * Make the goodbye of a device describe it the way it was cached, with its
+ * MAC and description, so that the recipient of a forward (-a) recognizes
+ * the device.
+ *
+ * @param goodbye The goodbye (ssdp:byebye) of the device.
+ * @param removed The removed cached message of the device, its description
+ *        is moved to the goodbye.
+ */
+static void describe_goodbye(ssdp_message_s *goodbye,
+    ssdp_message_s *removed) {
+  if (strlen(goodbye->mac) < 1) {
+    strcpy(goodbye->mac, removed->mac);
+  }
+  if (!goodbye->custom_fields) {
+    goodbye->custom_fields = removed->custom_fields;
+    removed->custom_fields = NULL;
+  }
+}
+
+/**
+ * Output a cached (and described) device the way the listener is
+ * configured to.
+ *
+ * @param state The listener state.
+ * @param ssdp_message The cached message of the device.
+ * @param changes The SSDP_CACHE_* changes the message made to the cache.
+ */
+static void output_message(ssdp_listener_state_s *state,
+    ssdp_message_s *ssdp_message, unsigned int changes) {
+  configuration_s *conf = state->conf;
+
+  /* Forwarded devices are output with the next batch, even unchanged
+     unless only the changes are forwarded (-O) */
+  if (changes || (conf->forward_address && !state->forward_delta)) {
+    await_output(state);
+  }
+
+  /* Stream the device event, if anything changed */
+  if (state->stream_events && !state->monitoring) {
+    if (changes & SSDP_CACHE_ADDED) {
+      ssdp_event_stream_emit(&state->event_stream, SSDP_EVENT_ADD,
+          ssdp_message);
+    }
+    else if (changes & SSDP_CACHE_UPDATED) {
+      ssdp_event_stream_emit(&state->event_stream, SSDP_EVENT_UPDATE,
+          ssdp_message);
+    }
+  }
+
+  /* Only forward the changes, in batches (-O) */
+  if (state->forward_delta) {
+    if (changes) {
+      forward_later(state);
+    }
+    forward_changes(state);
+  }
+
+  /* Check if forwarding ('-a') is enabled */
+  else if (conf->forward_address) {
+
+    /* If max ssdp cache size reached then it is time to flush */
+    if (*state->ssdp_cache->ssdp_messages_count >= conf->ssdp_cache_size) {
+      PRINT_DEBUG("Cache max size reached, sending and emptying");
+      flush_forwarded(state);
+    }
+    else {
+      PRINT_DEBUG("Cache max size not reached, not sending yet");
+    }
+  }
+  else if (state->display_table) {
+    /* Display results on console */
+    PRINT_DEBUG("Displaying cached SSDP messages");
+    display_ssdp_cache(state->ssdp_cache, FALSE);
+  }
+  output_if_idle(state);
+}
+
+/**
+ * Filter, cache and output a notification or a search response.
+ *
+ * @param state The listener state.
+ * @param ssdp_message The message, it is freed or owned by the cache when
+ *        the function returns.
+ */
+static void handle_message(ssdp_listener_state_s *state,
+    ssdp_message_s *ssdp_message) {
+  configuration_s *conf = state->conf;
+  unsigned int changes = 0;
+  BOOL goodbye = FALSE;
+
+  // TODO: Make it recognize both AND and OR (search for ; inside a ,)!!!
+
+  /* If -M is not set check if it is a M-SEARCH message
+     and drop it */
+  if (conf->ignore_search_msgs && (strstr(ssdp_message->request,
+      "M-SEARCH") != NULL)) {
+      PRINT_DEBUG("Message contains a M-SEARCH request, dropping "
+          "message");
+      ssdp_metrics_inc(SSDP_COUNTER_SEARCHES_IGNORED);
+      free_ssdp_message(&ssdp_message);
+      return;
+  }
+
+  /* Check if notification should be used (if any filters have been set) */
+  if (state->filters_factory != NULL &&
+      filter(ssdp_message, state->filters_factory)) {
+    ssdp_metrics_inc(SSDP_COUNTER_FILTER_DROPS);
+    free_ssdp_message(&ssdp_message);
+    return;
+  }
+  stage_done(state, SSDP_HISTOGRAM_FILTER);
+
+  /* If a device leaves the network (ssdp:byebye) then forget it, unless
+     every message is forwarded (-a without -O), then the goodbye takes its
+     place in the next batch */
+  ssdp_header_s *nts = get_header(ssdp_message, SSDP_HEADER_NTS);
+  goodbye = nts && strstr(nts->contents, "ssdp:byebye");
+  if (goodbye && conf->forward_address && !state->forward_delta) {
+    PRINT_DEBUG("Device '%s' said goodbye, forwarding it", ssdp_message->ip);
+    ssdp_message_s *removed = remove_ssdp_message_from_cache(
+        &state->ssdp_cache, ssdp_message->ip);
+    if (removed) {
+      cancel_fetch(state, removed);
+      describe_goodbye(ssdp_message, removed);
+      free_ssdp_message(&removed);
+    }
+  }
+  else if (goodbye) {
+    PRINT_DEBUG("Device '%s' said goodbye", ssdp_message->ip);
+    /* The recipient is only told about the devices it knows (-O) */
+    BOOL forwarded = state->forward_delta && is_ssdp_cache_device_forwarded(
+        state->ssdp_cache, ssdp_message->ip);
+    /* Continuous scans report it with the other changes */
+    if (state->monitoring) {
+      if (mark_ssdp_cache_device_gone(state->ssdp_cache, ssdp_message->ip,
+          SSDP_MONITOR_MAX_MISSED)) {
+        stage_done(state, SSDP_HISTOGRAM_CACHE);
+        await_output(state);
+      }
+      free_ssdp_message(&ssdp_message);
+      return;
+    }
+    ssdp_message_s *removed = remove_ssdp_message_from_cache(
+        &state->ssdp_cache, ssdp_message->ip);
+    if (removed) {
+      /* A device whose description was still being fetched was never
+         output */
+      BOOL output = !cancel_fetch(state, removed);
+      stage_done(state, SSDP_HISTOGRAM_CACHE);
+      await_output(state);
+      table_changed(state);
+      if (state->stream_events && output) {
+        ssdp_event_stream_emit(&state->event_stream, SSDP_EVENT_REMOVE,
+            removed);
+      }
+      else if (state->display_table) {
+        display_ssdp_cache(state->ssdp_cache, FALSE);
+      }
+      if (forwarded) {
+        /* The goodbye is forwarded with the next changes */
+        describe_goodbye(ssdp_message, removed);
+        if (add_ssdp_cache_goodbye(&state->forward_removed, ssdp_message)) {
+          ssdp_message = NULL;
+          forward_later(state);
+          forward_changes(state);
+        }
+      }
+      free_ssdp_message(&removed);
+      output_if_idle(state);
+    }
+    if (ssdp_message) {
+      free_ssdp_message(&ssdp_message);
+    }
+    return;
+  }
+
+  /* Add ssdp_message to ssdp_cache
+     (this internally checks for duplicates) */
+  if (!add_ssdp_message_to_cache(&state->ssdp_cache, &ssdp_message,
+      &changes)) {
+    PRINT_ERROR("Failed adding SSDP message to SSDP cache, skipping");
+    return;
+  }
+  stage_done(state, SSDP_HISTOGRAM_CACHE);
+  table_changed(state);
+
+  /* A device whose description is still being fetched is output with its
+     latest state when done */
+  if (state->fetcher &&
+      ssdp_fetcher_is_fetching(state->fetcher, ssdp_message)) {
+    return;
+  }
+
+  /* The description of a new device is fetched on the loop and the device
+     output when done, replays fetch it right away. A goodbye has no
+     description to fetch */
+  if (state->fetcher) {
+    if ((changes & SSDP_CACHE_ADDED) && !goodbye &&
+        ssdp_fetcher_fetch(state->fetcher, ssdp_message)) {
+      set_ssdp_cache_device_fetching(state->ssdp_cache, ssdp_message->ip,
+          TRUE);
+      return;
+    }
+  }
+  else if (conf->fetch_info && !goodbye) {
+    fetch_description(conf, ssdp_message);
+    stage_done(state, SSDP_HISTOGRAM_ENRICH);
+  }
+
+  output_message(state, ssdp_message, changes);
+}
 
-  recv_node->recv_bytes = recvfrom(listener->sock, recv_node->recv_data,
-      SSDP_RECV_DATA_LEN, 0, (struct sockaddr *)&recv_addr,
-      (socklen_t *)&addr_size);
+/**
+ * Output a new device once its description has been fetched (or failed
+ * to), continuous scans report it with the next changes.
+ *
+ * @param data The listener state.
+ * @param ssdp_message The cached message of the device.
+ */
+static void on_description_fetched(void *data, ssdp_message_s *ssdp_message) {
+  ssdp_listener_state_s *state = (ssdp_listener_state_s *)data;
+
+  /* The fetches aborted when the listener stops are not output */
+  if (!state->fetcher) {
+    return;
+  }
+
+  set_ssdp_cache_device_fetching(state->ssdp_cache, ssdp_message->ip, FALSE);
+  table_changed(state);
+
+  /* Only new devices are fetched for */
+  message_received(state, FALSE);
+  output_message(state, ssdp_message, SSDP_CACHE_ADDED);
+
+  /* The cache waited for the last description to be forwarded (-a) */
+  if (state->flush_waiting) {
+    flush_forwarded(state);
+  }
+}
+
+/**
+ * Take care of a response to a continuous scan.
+ *
+ * @param data The listener state.
+ * @param ssdp_message The response.
+ */
+static void on_monitor_response(void *data, ssdp_message_s *ssdp_message) {
+  ssdp_listener_state_s *state = (ssdp_listener_state_s *)data;
+
+  /* Read and parsed by the monitor */
+  message_received(state, FALSE);
+  handle_message(state, ssdp_message);
+}
+
+/**
+ * Output a device change found by a continuous scan.
+ *
+ * @param data The listener state.
+ * @param change The SSDP_CACHE_* change.
+ * @param ssdp_message The device.
+ */
+static void on_device_change(void *data, unsigned int change,
+    ssdp_message_s *ssdp_message) {
+  ssdp_listener_state_s *state = (ssdp_listener_state_s *)data;
+
+  /* A device that left before it was described was never reported */
+  if (change == SSDP_CACHE_DROPPED) {
+    cancel_fetch(state, ssdp_message);
+    return;
+  }
+
+  table_changed(state);
+  if (state->stream_events) {
+    ssdp_event_stream_emit(&state->event_stream,
+        change == SSDP_CACHE_ADDED ? SSDP_EVENT_ADD :
+        change == SSDP_CACHE_UPDATED ? SSDP_EVENT_UPDATE : SSDP_EVENT_REMOVE,
+        ssdp_message);
+  }
+}
 
-  if (recv_node->recv_bytes > 0) {
-    get_ip_from_sock_address(&recv_addr, recv_node->from_ip);
-    get_mac_address_from_socket(listener->sock, &recv_addr, NULL,
-        recv_node->from_mac);
+/**
+ * Report what appeared, changed and disappeared since the last continuous
+ * scan and schedule the next one, or end a one-time scan.
+ *
+ * @param state The listener state.
+ * @param monitor The monitor running the scans.
+ */
+static void report_changes(ssdp_listener_state_s *state,
+    ssdp_monitor_s *monitor) {
+  unsigned int changes = 0;
+  unsigned int devices = state->ssdp_cache ?
+      *state->ssdp_cache->ssdp_messages_count : 0;
+  BOOL removed = FALSE;
+
+  /* The responses to a one-time scan (-U) were output as they came, like
+     the notifications */
+  if (!state->monitoring) {
+    ssdp_monitor_cycle_done(monitor, 0, devices);
+    return;
+  }
+
+  changes = collect_ssdp_cache_changes(&state->ssdp_cache,
+      SSDP_MONITOR_MAX_MISSED, on_device_change, state);
+
+  /* A device that came and went within the cycle is removed unreported */
+  removed = devices != (state->ssdp_cache ?
+      *state->ssdp_cache->ssdp_messages_count : 0);
+  if (removed) {
+    table_changed(state);
+  }
+
+  if (state->stream_events) {
+    ssdp_event_stream_flush(&state->event_stream);
+  }
+  else if (state->display_table && (changes > 0 || removed)) {
+    display_ssdp_cache(state->ssdp_cache, FALSE);
   }
+  output_if_idle(state);
+  ssdp_monitor_cycle_done(monitor, changes, devices);
+}
+
+/**
+ * Parse, filter, cache and output a replayed datagram.
+ *
+ * @param state The listener state.
+ * @param time When it was received (in ns since the epoch).
+ * @param ip The IP of the sender.
+ * @param mac The MAC of the sender, empty if unknown.
+ * @param datagram The datagram (not null-terminated).
+ * @param length The length of the datagram.
+ */
+static void replay_datagram(ssdp_listener_state_s *state,
+    unsigned long long time, const char *ip, const char *mac,
+    const char *datagram, size_t length) {
+  ssdp_message_s *ssdp_message = NULL;
+  char from_ip[IPv6_STR_MAX_SIZE];
+  char from_mac[MAC_STR_MAX_SIZE];
+  char data[SSDP_RECV_DATA_LEN];
+  time_t seconds = (time_t)(time / 1000000000ULL);
+
+  /* Only what the listener could have received */
+  if (length >= sizeof(data)) {
+    PRINT_DEBUG("Skipping a replayed datagram too big to be received");
+    return;
+  }
+  message_received(state, TRUE);
+  memcpy(data, datagram, length);
+  data[length] = '\0';
+  ssdp_metrics_inc(SSDP_COUNTER_DATAGRAMS);
+  ssdp_metrics_add(SSDP_COUNTER_BYTES, length);
+  strncpy(from_ip, ip, sizeof(from_ip) - 1);
+  from_ip[sizeof(from_ip) - 1] = '\0';
+  strncpy(from_mac, mac, sizeof(from_mac) - 1);
+  from_mac[sizeof(from_mac) - 1] = '\0';
+
+  if (!init_ssdp_message(&ssdp_message)) {
+    PRINT_ERROR("Failed to initialize the SSDP message buffer");
+    return;
+  }
+  if (!build_ssdp_message(ssdp_message, from_ip, from_mac, (int)length,
+      data)) {
+    PRINT_DEBUG("Failed to build a replayed SSDP message");
+    ssdp_metrics_inc(SSDP_COUNTER_PARSE_FAILURES);
+    free_ssdp_message(&ssdp_message);
+    return;
+  }
+  stage_done(state, SSDP_HISTOGRAM_PARSE);
+  /* It was received then, not now */
+  strftime(ssdp_message->datetime, 20, "%Y-%m-%d %H:%M:%S",
+      localtime(&seconds));
+
+  handle_message(state, ssdp_message);
+}
+
+/**
+ * Wait until a replayed datagram is due, as long after the first one as
+ * it was received after it.
+ *
+ * @param state The listener state.
+ * @param time When it was received (in ns since the epoch).
+ */
+static void pace_replay(ssdp_listener_state_s *state,
+    unsigned long long time) {
+  unsigned long long offset;
+  struct timespec due;
+
+  if (state->replay_first == 0 || time < state->replay_first) {
+    state->replay_first = time;
+    clock_gettime(CLOCK_MONOTONIC, &state->replay_start);
+    return;
+  }
+
+  offset = time - state->replay_first;
+  due.tv_sec = state->replay_start.tv_sec + (time_t)(offset / 1000000000ULL);
+  due.tv_nsec = state->replay_start.tv_nsec + (long)(offset % 1000000000ULL);
+  if (due.tv_nsec >= 1000000000L) {
+    due.tv_sec++;
+    due.tv_nsec -= 1000000000L;
+  }
+
+  /* The events so far are out before the wait */
+  if (state->stream_events) {
+    ssdp_event_stream_flush(&state->event_stream);
+    output_if_idle(state);
+  }
+  while (!state->listener->stop && clock_nanosleep(CLOCK_MONOTONIC,
+      TIMER_ABSTIME, &due, NULL) == EINTR);
+}
+
+/**
+ * Take care of a datagram replayed from the journal (-Y) or a capture (-P).
+ *
+ * @param data The listener state.
+ * @param record The record of the datagram.
+ * @param datagram The datagram.
+ *
+ * @return TRUE to go on, FALSE if the listener was stopped.
+ */
+static BOOL on_replayed_datagram(void *data,
+    const ssdp_journal_record_s *record, const char *datagram) {
+  ssdp_listener_state_s *state = (ssdp_listener_state_s *)data;
+
+  if (state->replay_paced) {
+    pace_replay(state, record->time);
+    if (state->listener->stop) {
+      return FALSE;
+    }
+  }
+  replay_datagram(state, record->time, record->ip, record->mac, datagram,
+      record->length);
+
+  return !state->listener->stop;
+}
+
+/**
+ * Print the cached devices in the configured output format.
+ *
+ * @param conf The global configuration.
+ * @param ssdp_cache The SSDP cache list.
+ */
+static void print_ssdp_cache(configuration_s *conf,
+    ssdp_cache_s *ssdp_cache) {
+  string_buffer_s buffer;
+
+  if (!ssdp_cache || *ssdp_cache->ssdp_messages_count == 0) {
+    return;
+  }
+
+  if (conf->json_output || conf->xml_output) {
+    if (string_buffer_init(&buffer, XML_BUFFER_SIZE) &&
+        (conf->json_output ? cache_to_json(ssdp_cache, &buffer) :
+        cache_to_xml(ssdp_cache, &buffer)) > 0) {
+      fwrite(buffer.data, 1, buffer.length, stdout);
+    }
+    string_buffer_free(&buffer);
+    return;
+  }
+
+  for (ssdp_cache = ssdp_cache->first; ssdp_cache;
+      ssdp_cache = ssdp_cache->next) {
+    char *oneline_string = to_oneline(ssdp_cache->ssdp_message,
+        conf->monochrome);
+    if (oneline_string) {
+      printf("%s\n", oneline_string);
+      free(oneline_string);
+    }
+  }
+}
+
+/**
+ * Get the shorter of two poll() timeouts.
+ *
+ * @param a A timeout in ms, -1 for no limit.
+ * @param b A timeout in ms, -1 for no limit.
+ *
+ * @return The shorter timeout.
+ */
+static int shorter_timeout(int a, int b) {
+  if (a < 0) {
+    return b;
+  }
+  return (b < 0 || a < b) ? a : b;
 }
 
 int ssdp_listener_start(ssdp_listener_s *listener, configuration_s *conf) {
   PRINT_DEBUG("ssdp_listener_start()");
 
-  /* The structure contining all the filters information */
-  filters_factory_s *filters_factory = NULL;
+  ssdp_listener_state_s state;
+  memset(&state, 0, sizeof(state));
+  state.listener = listener;
+  state.conf = conf;
 
   /* Parse the filters */
   PRINT_DEBUG("parse_filters()");
-  parse_filters(conf->filter, &filters_factory, TRUE & (~conf->quiet_mode));
+  parse_filters(conf->filter, &state.filters_factory,
+      TRUE & (~conf->quiet_mode));
 
   /* Child process server loop */
   PRINT_DEBUG("Strating infinite loop");
   ssdp_message_s *ssdp_message;
-  BOOL drop_message;
 
-  /* Create a list for keeping/caching SSDP messages */
-  ssdp_cache_s *ssdp_cache = NULL;
+  /* The table of the last run is restored (-D) */
+  ssdp_checkpoint_s checkpoint;
+  if (conf->checkpoint_file) {
+    ssdp_checkpoint_init(&checkpoint, conf->checkpoint_file);
+    ssdp_checkpoint_load(&checkpoint, &state.ssdp_cache);
+    state.checkpoint = &checkpoint;
+  }
 
-  while (!listener->stop) {
-    ssdp_recv_node_s recv_node;
-    drop_message = FALSE;
-    ssdp_message = NULL;
+  /* The received datagrams are journaled (-J), unless replaying them */
+  ssdp_journal_s journal;
+  if (conf->journal_directory && !conf->offline) {
+    if (!ssdp_journal_open(&journal, conf->journal_directory,
+        conf->journal_retention)) {
+      free_ssdp_cache(&state.ssdp_cache);
+      free_ssdp_filters_factory(state.filters_factory);
+      return 1;
+    }
+    state.journal = &journal;
+  }
 
-    PRINT_DEBUG("loop: ready to receive");
-    ssdp_listener_read(listener, &recv_node);
+  /* The table is kept and only its changes are forwarded (-O), the
+     first time all of it */
+  state.forward_delta = conf->forward_address && conf->resync_interval;
+  state.forward_resync = ssdp_cache_now() +
+      (unsigned long long)conf->resync_interval * 1000;
 
-    #ifdef __DEBUG
-    if (recv_node.recv_bytes > 0) {
-      PRINT_DEBUG("**** RECEIVED %d bytes ****\n%s", recv_node.recv_bytes,
-          notif_string);
-      PRINT_DEBUG("************************");
+  /* Device events are streamed to stdout unless forwarding (-a) */
+  state.stream_events = conf->event_stream_output && !conf->forward_address;
+  if (state.stream_events && !ssdp_event_stream_init(&state.event_stream,
+      STDOUT_FILENO, conf->event_flush_interval)) {
+    free_ssdp_cache(&state.ssdp_cache);
+    free_ssdp_filters_factory(state.filters_factory);
+    return 1;
+  }
+
+  /* Searches run in between and fill the same table, once at the start
+     (-U) or continuously (-l) */
+  ssdp_monitor_s monitor;
+  state.monitoring = conf->scan_interval > 0;
+  state.scanning = state.monitoring || conf->scan_for_upnp_devices;
+  if (state.scanning && !ssdp_monitor_init(&monitor, conf,
+      on_monitor_response, &state)) {
+    if (state.stream_events) {
+      ssdp_event_stream_close(&state.event_stream);
     }
-    #endif
+    free_ssdp_cache(&state.ssdp_cache);
+    free_ssdp_filters_factory(state.filters_factory);
+    return 1;
+  }
 
-    /* If timeout reached then go through the
-      ssdp_cache list and see if anything needs
-      to be sent */
-    if (recv_node.recv_bytes < 1) {
-      PRINT_DEBUG("Timed-out waiting for a SSDP message");
-      if(!ssdp_cache || *ssdp_cache->ssdp_messages_count == 0) {
-        PRINT_DEBUG("No messages in the SSDP cache, continuing to listen");
+  /* The devices are served to anyone asking (-S), from snapshots of the
+     table */
+  ssdp_server_s server;
+  ssdp_snapshots_s snapshots;
+  if (conf->run_as_server) {
+    if (!ssdp_snapshots_init(&snapshots)) {
+      if (state.scanning) {
+        ssdp_monitor_close(&monitor);
       }
-      else {
-        /* If forwarding has been enabled, send the cached
-           SSDP messages and empty the list*/
-        if(conf->forward_address) {
-          PRINT_DEBUG("Forwarding cached SSDP messages");
-          if(!flush_ssdp_cache(conf, &ssdp_cache, "/abused/post.php",
-              &listener->forwarder, 80, 1)) {
-            PRINT_DEBUG("Failed flushing SSDP cache");
-            continue;
-          }
-        }
-        /* Else just display the cached messages in a table */
-        else {
-          PRINT_DEBUG("Displaying cached SSDP messages");
-          display_ssdp_cache(ssdp_cache, FALSE);
-        }
+      if (state.stream_events) {
+        ssdp_event_stream_close(&state.event_stream);
       }
-      continue;
+      free_ssdp_cache(&state.ssdp_cache);
+      free_ssdp_filters_factory(state.filters_factory);
+      return 1;
     }
-    /* Else a new ssdp message has been received */
-    else {
+    state.snapshots = &snapshots;
+    table_changed(&state);
+    if (!ssdp_server_init(&server, conf, &snapshots)) {
+      ssdp_snapshots_close(&snapshots);
+      if (state.scanning) {
+        ssdp_monitor_close(&monitor);
+      }
+      if (state.stream_events) {
+        ssdp_event_stream_close(&state.event_stream);
+      }
+      free_ssdp_cache(&state.ssdp_cache);
+      free_ssdp_filters_factory(state.filters_factory);
+      return 1;
+    }
+    state.server = &server;
+  }
 
-      /* init ssdp_message */
-      if (!init_ssdp_message(&ssdp_message)) {
-        PRINT_ERROR("Failed to initialize the SSDP message buffer");
-        continue;
+  /* The descriptions are fetched on a loop polled with the rest, so that a
+     slow device holds up nothing else, replays fetch them as they go */
+  event_loop_s fetch_loop;
+  ssdp_fetcher_s fetcher;
+  if (conf->fetch_info && !conf->offline) {
+    if (!event_loop_init(&fetch_loop)) {
+      if (state.server) {
+        ssdp_server_close(state.server);
+        ssdp_snapshots_close(state.snapshots);
       }
+      if (state.scanning) {
+        ssdp_monitor_close(&monitor);
+      }
+      if (state.stream_events) {
+        ssdp_event_stream_close(&state.event_stream);
+      }
+      free_ssdp_cache(&state.ssdp_cache);
+      free_ssdp_filters_factory(state.filters_factory);
+      return 1;
+    }
+    ssdp_fetcher_init(&fetcher, &fetch_loop, SSDP_FETCHER_MAX_ACTIVE,
+        SSDP_FETCHER_TIMEOUT, on_description_fetched, &state);
+    state.fetcher = &fetcher;
+  }
+  state.idle_since = ssdp_cache_now();
 
-      /* Build the ssdp message struct */
-      if (!build_ssdp_message(ssdp_message, recv_node.from_ip,
-          recv_node.from_mac, recv_node.recv_bytes, recv_node.recv_data)) {
-        PRINT_ERROR("Failed to build the SSDP message");
-        free_ssdp_message(&ssdp_message);
-        continue;
+  /* Else the cached devices are displayed in a table, or printed at the
+     end of a replay */
+  state.display_table = !conf->forward_address && !state.stream_events &&
+      !conf->offline;
+  if (state.display_table) {
+    display_ssdp_cache_init(conf->display_fps);
+    display_ssdp_cache(state.ssdp_cache, FALSE);
+  }
+
+  /* Replay the journal (-Y) or a capture (-P) instead of listening, as
+     fast as it is parsed or at its own pace (-Z) */
+  if (conf->offline) {
+    state.replay_paced = conf->replay_paced;
+    if (conf->pcap_file) {
+      ssdp_pcap_read(conf->pcap_file, on_replayed_datagram, &state);
+    }
+    else {
+      ssdp_journal_replay(conf->journal_directory, conf->replay_from,
+          conf->replay_to, on_replayed_datagram, &state);
+    }
+    if (!state.stream_events) {
+      print_ssdp_cache(conf, state.ssdp_cache);
+      output_done(&state);
+    }
+  }
+
+  while (!conf->offline && !listener->stop) {
+    ssdp_recv_node_s recv_node;
+    ssdp_message = NULL;
+
+    /* Wait for messages, key presses, search responses and deferred
+       (frame-rate capped) redraws and event flushes */
+    if (state.stream_events || state.display_table || state.scanning ||
+        state.server || state.checkpoint || state.fetcher) {
+      struct pollfd pfds[4 + SSDP_MONITOR_MAX_FDS];
+      nfds_t pfds_count = 1;
+      nfds_t monitor_pfds = 0;
+      int timeout = -1;
+      int ready;
+
+      pfds[0].fd = listener->sock;
+      pfds[0].events = POLLIN;
+      pfds[0].revents = 0;
+      if (state.display_table) {
+        pfds[pfds_count].fd = display_ssdp_cache_input_fd();
+        pfds[pfds_count].events = POLLIN;
+        pfds[pfds_count++].revents = 0;
+        timeout = display_ssdp_cache_timeout();
+      }
+      if (state.stream_events) {
+        timeout = shorter_timeout(timeout,
+            ssdp_event_stream_timeout(&state.event_stream));
+      }
+      if (state.server) {
+        ssdp_snapshots_update(state.snapshots, state.ssdp_cache);
+        pfds[pfds_count].fd = ssdp_server_fd(state.server);
+        pfds[pfds_count].events = POLLIN;
+        pfds[pfds_count++].revents = 0;
+        timeout = shorter_timeout(timeout, ssdp_server_timeout(state.server));
+        timeout = shorter_timeout(timeout,
+            ssdp_snapshots_timeout(state.snapshots));
+      }
+      if (state.checkpoint) {
+        ssdp_checkpoint_update(state.checkpoint, state.ssdp_cache);
+        timeout = shorter_timeout(timeout,
+            ssdp_checkpoint_timeout(state.checkpoint));
+      }
+      if (state.scanning) {
+        monitor_pfds = pfds_count;
+        pfds_count += ssdp_monitor_fill_pollfds(&monitor, &pfds[pfds_count]);
+        timeout = shorter_timeout(timeout, ssdp_monitor_timeout(&monitor));
+      }
+      if (state.forward_delta) {
+        timeout = shorter_timeout(timeout, forward_timeout(&state));
+      }
+      else if (conf->forward_address) {
+        timeout = shorter_timeout(timeout, idle_timeout(&state));
+      }
+      /* The epoll instance is readable when any of the fetches is, without
+         epoll the fetches are checked now and then */
+      if (state.fetcher && fetch_loop.epoll_fd >= 0) {
+        pfds[pfds_count].fd = fetch_loop.epoll_fd;
+        pfds[pfds_count].events = POLLIN;
+        pfds[pfds_count++].revents = 0;
+        timeout = shorter_timeout(timeout, ssdp_fetcher_timeout(&fetcher));
+      }
+      else if (state.fetcher && ssdp_fetcher_pending(&fetcher) > 0) {
+        timeout = shorter_timeout(timeout, SSDP_LISTENER_FETCH_POLL_INTERVAL);
       }
 
-      // TODO: Make it recognize both AND and OR (search for ; inside a ,)!!!
+      ready = poll(pfds, pfds_count, timeout);
 
-      /* If -M is not set check if it is a M-SEARCH message
-         and drop it */
-      if (conf->ignore_search_msgs && (strstr(ssdp_message->request,
-          "M-SEARCH") != NULL)) {
-          PRINT_DEBUG("Message contains a M-SEARCH request, dropping "
-              "message");
-          free_ssdp_message(&ssdp_message);
-          continue;
+      if (state.fetcher) {
+        if (event_loop_wait(&fetch_loop, 0) < 0 && errno != EINTR) {
+          PRINT_ERROR("Waiting for the description fetches failed: %s",
+              strerror(errno));
+        }
+        ssdp_fetcher_expire(&fetcher);
       }
 
-      /* Check if notification should be used (if any filters have been set) */
-      if (filters_factory != NULL) {
-        drop_message = filter(ssdp_message, filters_factory);
+      if (state.server) {
+        ssdp_server_process(state.server);
       }
 
-      /* If message is not filtered then use it */
-      if (filters_factory == NULL || !drop_message) {
+      if (state.forward_delta) {
+        forward_changes(&state);
+      }
 
-        /* Add ssdp_message to ssdp_cache
-           (this internally checks for duplicates) */
-        if (!add_ssdp_message_to_cache(&ssdp_cache, &ssdp_message)) {
-          PRINT_ERROR("Failed adding SSDP message to SSDP cache, skipping");
-          continue;
-        }
+      if (state.scanning && ssdp_monitor_process(&monitor,
+          &pfds[monitor_pfds], (unsigned int)(pfds_count - monitor_pfds))) {
+        report_changes(&state, &monitor);
+      }
 
-        /* Fetch custom fields */
-        if (conf->fetch_info && !fetch_custom_fields(conf, ssdp_message)) {
-          PRINT_DEBUG("Could not fetch custom fields");
+      if (ready < 1 || !(pfds[0].revents & POLLIN)) {
+        if (state.stream_events &&
+            ssdp_event_stream_timeout(&state.event_stream) == 0) {
+          ssdp_event_stream_flush(&state.event_stream);
         }
-        ssdp_message = NULL;
-
-        /* Check if forwarding ('-a') is enabled */
-        if (conf->forward_address) {
-
-          /* If max ssdp cache size reached then it is time to flush */
-          if (*ssdp_cache->ssdp_messages_count >= conf->ssdp_cache_size) {
-            PRINT_DEBUG("Cache max size reached, sending and emptying");
-            if(!flush_ssdp_cache(conf, &ssdp_cache, "/abused/post.php",
-                &listener->forwarder, 80, 1)) {
-              PRINT_DEBUG("Failed flushing SSDP cache");
-              continue;
-            }
-          }
-          else {
-            PRINT_DEBUG("Cache max size not reached, not sending yet");
-          }
+        if (state.display_table) {
+          display_ssdp_cache_tick(state.ssdp_cache);
         }
-        else {
-          /* Display results on console */
-          PRINT_DEBUG("Displaying cached SSDP messages");
-          display_ssdp_cache(ssdp_cache, FALSE);
+        if (conf->forward_address && !state.forward_delta &&
+            idle_timeout(&state) == 0) {
+          on_idle(&state);
         }
+        output_if_idle(&state);
+        continue;
       }
     }
 
+    PRINT_DEBUG("loop: ready to receive");
+    ssdp_listener_read(listener, &recv_node);
+    if (recv_node.recv_bytes > 0) {
+      message_received(&state, TRUE);
+      ssdp_metrics_inc(SSDP_COUNTER_DATAGRAMS);
+      ssdp_metrics_add(SSDP_COUNTER_BYTES, recv_node.recv_bytes);
+    }
+    if (state.journal && recv_node.recv_bytes > 0) {
+      ssdp_journal_append(state.journal, ssdp_journal_now(),
+          recv_node.from_ip, recv_node.from_mac,
+          strlen(conf->interface) > 0 ? conf->interface : NULL,
+          recv_node.recv_data, recv_node.recv_bytes);
+    }
+
+    #ifdef __DEBUG
+    if (recv_node.recv_bytes > 0) {
+      PRINT_DEBUG("**** RECEIVED %d bytes ****\n%s", recv_node.recv_bytes,
+          notif_string);
+      PRINT_DEBUG("************************");
+    }
+    #endif
+
+    /* If timeout reached then go through the
+      ssdp_cache list and see if anything needs
+      to be sent */
+    if (recv_node.recv_bytes < 1) {
+      on_idle(&state);
+      continue;
+    }
+    state.idle_since = ssdp_cache_now();
+
+    /* init ssdp_message */
+    if (!init_ssdp_message(&ssdp_message)) {
+      PRINT_ERROR("Failed to initialize the SSDP message buffer");
+      continue;
+    }
+
+    /* Build the ssdp message struct */
+    if (!build_ssdp_message(ssdp_message, recv_node.from_ip,
+        recv_node.from_mac, recv_node.recv_bytes, recv_node.recv_data)) {
+      PRINT_ERROR("Failed to build the SSDP message");
+      ssdp_metrics_inc(SSDP_COUNTER_PARSE_FAILURES);
+      free_ssdp_message(&ssdp_message);
+      continue;
+    }
+    stage_done(&state, SSDP_HISTOGRAM_PARSE);
+
+    handle_message(&state, ssdp_message);
+
     PRINT_DEBUG("scan loop: done");
   }
-  free_ssdp_filters_factory(filters_factory);
-
+  if (state.fetcher) {
+    /* The aborted fetches are not output */
+    state.fetcher = NULL;
+    ssdp_fetcher_close(&fetcher);
+    event_loop_close(&fetch_loop);
+  }
+  if (state.server) {
+    ssdp_server_close(state.server);
+    ssdp_snapshots_close(state.snapshots);
+  }
+  if (state.scanning) {
+    ssdp_monitor_close(&monitor);
+  }
+  if (state.stream_events) {
+    ssdp_event_stream_close(&state.event_stream);
+    output_done(&state);
+  }
+  if (state.display_table) {
+    display_ssdp_cache_close();
+  }
+  if (state.journal) {
+    ssdp_journal_close(state.journal);
+  }
+  if (state.checkpoint && state.checkpoint->dirty) {
+    ssdp_checkpoint_save(state.checkpoint, state.ssdp_cache);
+  }
+  free_ssdp_cache(&state.ssdp_cache);
+  free_ssdp_cache(&state.forward_removed);
+  free_ssdp_filters_factory(state.filters_factory);
+  free(state.awaiting);
 
   return 0;
 }
@@ -19,18 +19,11 @@
 #include "socket_helpers.h"
 #include "ssdp_message.h"
 #include "ssdp_static_defs.h"
+#include "string_intern.h"
 #include "string_utils.h"
 #include "log.h"
 
-/**
- * Returns the appropriate unsigned char (number) representation of the header
- * string.
- *
- * @param header_string The header string to be looked up.
- *
- * @return A unsigned char representing the header type.
- */
-static unsigned char get_header_type(const char *header_string) {
+unsigned char get_header_type(const char *header_string) {
   int headers_size;
   int header_string_length = 0;
   char *header_lower = NULL;
@@ -42,7 +35,6 @@ static unsigned char get_header_type(const char *header_string) {
     SSDP_HEADER_MX_STR,
     SSDP_HEADER_CACHE_STR,
     SSDP_HEADER_LOCATION_STR,
-    SSDP_HEADER_HOST_STR,
     SSDP_HEADER_OPT_STR,
     SSDP_HEADER_01NLS_STR,
     SSDP_HEADER_NT_STR,
@@ -99,7 +91,7 @@ static void build_ssdp_header(ssdp_header_s *header, const char *raw_header) {
 
   "
   */
-  int header_name_length = -1, header_contents_length = -1;
+  int header_name_length = -1, header_contents_offset = -1;
   int raw_header_length = 0;
   char *header_name;
 
@@ -113,21 +105,22 @@ static void build_ssdp_header(ssdp_header_s *header, const char *raw_header) {
 
   header->type = (unsigned char)get_header_type(header_name);
   if(header->type == SSDP_HEADER_UNKNOWN) {
-    header->unknown_type = malloc(header_name_length + 1);
-    memset(header->unknown_type, '\0', header_name_length + 1);
-    strcpy(header->unknown_type, header_name);
+    header->unknown_type = string_intern(header_name);
   }
   else {
     header->unknown_type = NULL;
   }
 
+  /* Header values repeat a lot between devices so they are interned */
   raw_header_length = strlen(raw_header);
-  header_contents_length = raw_header_length - header_name_length + 2;
-  header->contents = (char *)malloc(header_contents_length);
-  memset(header->contents, '\0', header_contents_length);
-  // avoid ": " in header contents
-  strcpy(header->contents, &raw_header[header_name_length + 1 +
-      (raw_header[header_name_length + 2] == ' ' ? 1 : 0)]);
+  // avoid ": " in header contents (also keeps the interned value canonical)
+  header_contents_offset = header_name_length + 1;
+  while(raw_header[header_contents_offset] == ' ' ||
+        raw_header[header_contents_offset] == '\t') {
+    header_contents_offset++;
+  }
+  header->contents = string_intern_n(&raw_header[header_contents_offset],
+      raw_header_length - header_contents_offset);
   free(header_name);
 }
 
@@ -154,9 +147,111 @@ ssdp_custom_field_s *get_custom_field(const ssdp_message_s *ssdp_message,
   return NULL;
 }
 
+ssdp_header_s *get_header(const ssdp_message_s *ssdp_message,
+    unsigned char header_type) {
+  ssdp_header_s *header = NULL;
+
+  if(ssdp_message) {
+    header = ssdp_message->headers;
+
+    while(header) {
+      if(header->type == header_type && header->contents) {
+        return header;
+      }
+      header = header->next;
+    }
+
+  }
+
+  return NULL;
+}
+
+int parse_custom_fields(ssdp_message_s *ssdp_message, const char *response) {
+  int i;
+  const char *tmp_pointer = NULL;
+  const char *end_pointer = NULL;
+
+  const char *field[] = {
+    "serialNumber",
+    "friendlyName",
+    "manufacturer",
+    "manufacturerURL",
+    "modelName",
+    "modelNumber",
+    "modelURL"
+  };
+  int fields_size = sizeof(field) / sizeof(char *);
+  PRINT_DEBUG("fields_size: %d", fields_size);
+
+  for(i = 0; i < fields_size; i++) {
+    ssdp_custom_field_s *cf = NULL;
+
+    int field_length = strlen(field[i]);
+
+    char needle[field_length + 4];
+    sprintf(needle, "<%s>", field[i]);
+    end_pointer = NULL;
+    tmp_pointer = strstr(response, needle);
+    if (tmp_pointer) {
+      sprintf(needle, "</%s>", field[i]);
+      end_pointer = strstr(tmp_pointer, needle);
+    }
+
+    if(tmp_pointer && end_pointer) {
+
+      /* Create a new ssdp_custom_field_s */
+      cf = (ssdp_custom_field_s *)malloc(sizeof(ssdp_custom_field_s));
+      memset(cf, 0, sizeof(ssdp_custom_field_s));
+
+      /* Set 'name' */
+      cf->name = string_intern(field[i]);
+
+      /* Parse 'contents' */
+      cf->contents = string_intern_n(tmp_pointer + field_length + 2,
+          (size_t)(end_pointer - (tmp_pointer + field_length + 2)));
+
+      PRINT_DEBUG("Found expected custom field (%d) '%s' with value '%s'",
+                  ssdp_message->custom_field_count,
+                  cf->name,
+                  cf->contents);
+    }
+    else {
+      PRINT_DEBUG("Expected custom field '%s' is missing", field[i]);
+      continue;
+    }
+
+    /* If it is the first one then set this as the
+       start and set 'first' to it */
+    if(!ssdp_message->custom_fields) {
+      cf->first = cf;
+    }
+    /* Else set 'first' to previous 'first' 
+       and this one as 'next' */
+    else {
+      cf->first = ssdp_message->custom_fields->first;
+      ssdp_message->custom_fields->next = cf;
+    }
+
+    /* Add the custom field array to the ssdp_message */
+    ssdp_message->custom_fields = cf;
+
+    /* Tell ssdp_message that we added one ssdp_custom_field_s */
+    ssdp_message->custom_field_count++;
+
+  }
+
+  if(ssdp_message->custom_fields) {
+    /* End the linked list and reset the pointer to the beginning */
+    ssdp_message->custom_fields->next = NULL;
+    ssdp_message->custom_fields = ssdp_message->custom_fields->first;
+  }
+
+  return ssdp_message->custom_field_count;
+}
+
 int fetch_custom_fields(configuration_s *conf, ssdp_message_s *ssdp_message) {
   int bytes_received = 0;
-  char *location_header = NULL;
+  const char *location_header = NULL;
   ssdp_header_s *ssdp_headers = ssdp_message->headers;
 
   if(ssdp_message->custom_fields) {
@@ -312,84 +407,7 @@ int fetch_custom_fields(configuration_s *conf, ssdp_message_s *ssdp_message) {
       free(rest);
       free(request);
 
-      /* Init the ssdp_custom_field struct */
-      int i;
-      char *tmp_pointer = NULL;
-      int buffer_size = 0;
-
-      const char *field[] = {
-        "serialNumber",
-        "friendlyName",
-        "manufacturer",
-        "manufacturerURL",
-        "modelName",
-        "modelNumber",
-        "modelURL"
-      };
-      int fields_size = sizeof(field) / sizeof(char *);
-      PRINT_DEBUG("fields_size: %d", fields_size);
-
-      for(i = 0; i < fields_size; i++) {
-        ssdp_custom_field_s *cf = NULL;
-
-        int field_length = strlen(field[i]);
-
-        char needle[field_length + 4];
-        sprintf(needle, "<%s>", field[i]);
-        tmp_pointer = strstr(response, needle);
-
-        if(tmp_pointer) {
-
-          /* Create a new ssdp_custom_field_s */
-          cf = (ssdp_custom_field_s *)malloc(sizeof(ssdp_custom_field_s));
-          memset(cf, 0, sizeof(ssdp_custom_field_s));
-
-          /* Set 'name' */
-          cf->name = (char *)malloc(sizeof(char) * field_length + 1);
-          strcpy(cf->name, field[i]);
-
-          /* Parse 'contents' */
-          sprintf(needle, "</%s>", field[i]);
-          buffer_size = (int)(strstr(response, needle) - (tmp_pointer + field_length + 2) + 1);
-          cf->contents = (char *)malloc(sizeof(char) * buffer_size);
-          memset(cf->contents, '\0', buffer_size);
-          strncpy(cf->contents, (tmp_pointer + field_length + 2), buffer_size - 1);
-
-          PRINT_DEBUG("Found expected custom field (%d) '%s' with value '%s'",
-                      ssdp_message->custom_field_count,
-                      cf->name,
-                      cf->contents);
-        }
-        else {
-          PRINT_DEBUG("Expected custom field '%s' is missing", field[i]);
-          continue;
-        }
-
-        /* If it is the first one then set this as the
-           start and set 'first' to it */
-        if(!ssdp_message->custom_fields) {
-          cf->first = cf;
-        }
-        /* Else set 'first' to previous 'first' 
-           and this one as 'next' */
-        else {
-          cf->first = ssdp_message->custom_fields->first;
-          ssdp_message->custom_fields->next = cf;
-        }
-
-        /* Add the custom field array to the ssdp_message */
-        ssdp_message->custom_fields = cf;
-
-        /* Tell ssdp_message that we added one ssdp_custom_field_s */
-        ssdp_message->custom_field_count++;
-
-      }
-
-      if(ssdp_message->custom_fields) {
-        /* End the linked list and reset the pointer to the beginning */
-        ssdp_message->custom_fields->next = NULL;
-        ssdp_message->custom_fields = ssdp_message->custom_fields->first;
-      }
+      parse_custom_fields(ssdp_message, response);
 
     }
 
@@ -409,7 +427,6 @@ const char *get_header_string(const unsigned int header_type,
     SSDP_HEADER_MX_STR,
     SSDP_HEADER_CACHE_STR,
     SSDP_HEADER_LOCATION_STR,
-    SSDP_HEADER_HOST_STR,
     SSDP_HEADER_OPT_STR,
     SSDP_HEADER_01NLS_STR,
     SSDP_HEADER_NT_STR,
@@ -443,47 +460,21 @@ BOOL init_ssdp_message(ssdp_message_s **message_pointer) {
     return FALSE;
   }
   memset(message->mac, '\0', MAC_STR_MAX_SIZE);
-  message->ip = (char *)malloc(sizeof(char) * IPv6_STR_MAX_SIZE);
-  if(NULL == message->ip) {
-    free(message->mac);
-    free(message);
-    return TRUE;
-  }
-  memset(message->ip, '\0', IPv6_STR_MAX_SIZE);
   message->datetime = (char *)malloc(sizeof(char) * 20);
   if(NULL == message->datetime) {
     free(message->mac);
-    free(message->ip);
     free(message);
     return TRUE;
   }
   memset(message->datetime, '\0', 20);
-  message->request = (char *)malloc(sizeof(char) * 1024);
-  if(NULL == message->request) {
-    free(message->mac);
-    free(message->ip);
-    free(message->datetime);
-    free(message);
-    return FALSE;
-  }
-  memset(message->request, '\0', 1024);
-  message->protocol = (char *)malloc(sizeof(char) * 48);
-  if(NULL == message->protocol) {
-    free(message->mac);
-    free(message->ip);
-    free(message->datetime);
-    free(message->request);
-    free(message);
-    return FALSE;
-  }
-  memset(message->protocol, '\0', sizeof(char) * 48);
+  /* The IP, request and protocol are interned when the message is built */
+  message->ip = NULL;
+  message->request = NULL;
+  message->protocol = NULL;
   message->answer = (char *)malloc(sizeof(char) * 1024);
   if(NULL == message->answer) {
     free(message->mac);
-    free(message->ip);
     free(message->datetime);
-    free(message->request);
-    free(message->protocol);
     free(message);
     return FALSE;
   }
@@ -509,9 +500,8 @@ BOOL build_ssdp_message(ssdp_message_s *message, char *ip, char *mac,
     strncpy(message->mac, mac, MAC_STR_MAX_SIZE);
   }
 
-  if(ip) {
-    strncpy(message->ip, ip, IPv6_STR_MAX_SIZE);
-  }
+  /* The IP is interned so the cache can compare it by pointer */
+  message->ip = string_intern(ip ? ip : "");
   message->message_length = message_length;
 
   /* find end of request string */
@@ -533,15 +523,17 @@ BOOL build_ssdp_message(ssdp_message_s *message, char *ip, char *mac,
   */
   newline = strpos(raw_message, "HTTP");
   if(newline < 0) {
-    free(message->datetime);
     PRINT_DEBUG("build_ssdp_message() failed: newline < 0");
     return FALSE;
   }
-  strncpy(message->request, raw_message, (!newline? newline : newline - 1));
-  strncpy(message->protocol, &raw_message[newline], last_newline - 2 - newline);
+  message->request = string_intern_n(raw_message,
+      (!newline? newline : newline - 1));
+  message->protocol = string_intern_n(&raw_message[newline],
+      last_newline - 2 - newline);
 
   /* allocate starting header heap */
   message->headers = (ssdp_header_s *)malloc(sizeof(ssdp_header_s));
+  memset(message->headers, '\0', sizeof(ssdp_header_s));
   message->headers->first = message->headers;
 
   BOOL has_next_header = TRUE;
@@ -552,8 +544,9 @@ BOOL build_ssdp_message(ssdp_message_s *message, char *ip, char *mac,
     /* find where new header ends in raw message */
     pos = strpos(&raw_message[last_newline], "\r\n");
     if(pos < 0) {
-      free(message->datetime);
       PRINT_DEBUG("build_ssdp_message() failed: pos < 0");
+      /* reset chain so that all of it is freed */
+      message->headers = message->headers->first;
       return FALSE;
     }
     newline = last_newline + pos;
@@ -622,25 +615,19 @@ void free_ssdp_message(ssdp_message_s **message_pointer) {
     message->mac = NULL;
   }
 
-  if(message->ip != NULL) {
-    free(message->ip);
-    message->ip = NULL;
-  }
+  string_intern_release(message->ip);
+  message->ip = NULL;
 
   if(message->datetime != NULL) {
     free(message->datetime);
     message->datetime = NULL;
   }
 
-  if(message->request != NULL) {
-    free(message->request);
-    message->request = NULL;
-  }
+  string_intern_release(message->request);
+  message->request = NULL;
 
-  if(message->protocol != NULL) {
-    free(message->protocol);
-    message->protocol = NULL;
-  }
+  string_intern_release(message->protocol);
+  message->protocol = NULL;
 
   if(message->answer != NULL) {
     free(message->answer);
@@ -652,36 +639,28 @@ void free_ssdp_message(ssdp_message_s **message_pointer) {
     message->info = NULL;
   }
 
-  do {
+  while (message->headers) {
 
-    if(message->headers->contents != NULL) {
-      free(message->headers->contents);
-      message->headers->contents = NULL;
-    }
+    string_intern_release(message->headers->contents);
+    message->headers->contents = NULL;
 
-    if(message->headers->unknown_type != NULL) {
-      free(message->headers->unknown_type);
-      message->headers->unknown_type = NULL;
-    }
+    string_intern_release(message->headers->unknown_type);
+    message->headers->unknown_type = NULL;
 
     next_header = message->headers->next;
     free(message->headers);
     message->headers = next_header;
     next_header = NULL;
 
-  } while (message->headers);
+  }
 
   while (message->custom_fields) {
 
-    if (message->custom_fields->name != NULL) {
-      free(message->custom_fields->name);
-      message->custom_fields->name = NULL;
-    }
+    string_intern_release(message->custom_fields->name);
+    message->custom_fields->name = NULL;
 
-    if (message->custom_fields->contents != NULL) {
-      free(message->custom_fields->contents);
-      message->custom_fields->contents = NULL;
-    }
+    string_intern_release(message->custom_fields->contents);
+    message->custom_fields->contents = NULL;
 
     next_custom_field = message->custom_fields->next;
     free(message->custom_fields);
@@ -693,3 +672,75 @@ void free_ssdp_message(ssdp_message_s **message_pointer) {
   free(message);
 }
 
+ssdp_message_s *copy_ssdp_message(const ssdp_message_s *message) {
+  ssdp_message_s *copy = NULL;
+  ssdp_header_s *header = NULL;
+  ssdp_header_s *last_header = NULL;
+  ssdp_custom_field_s *cf = NULL;
+  ssdp_custom_field_s *last_cf = NULL;
+
+  if (!init_ssdp_message(&copy)) {
+    PRINT_ERROR("Failed to allocate memory for a SSDP message copy");
+    return NULL;
+  }
+
+  strcpy(copy->mac, message->mac);
+  strcpy(copy->datetime, message->datetime);
+  memcpy(copy->answer, message->answer, 1024);
+  copy->ip = string_intern_ref(message->ip);
+  copy->request = string_intern_ref(message->request);
+  copy->protocol = string_intern_ref(message->protocol);
+  copy->message_length = message->message_length;
+  if (message->info) {
+    copy->info = strdup(message->info);
+    if (!copy->info) {
+      free_ssdp_message(&copy);
+      return NULL;
+    }
+  }
+
+  for (header = message->headers; header; header = header->next) {
+    ssdp_header_s *header_copy = (ssdp_header_s *)calloc(1,
+        sizeof(ssdp_header_s));
+    if (!header_copy) {
+      free_ssdp_message(&copy);
+      return NULL;
+    }
+    header_copy->type = header->type;
+    header_copy->unknown_type = string_intern_ref(header->unknown_type);
+    header_copy->contents = string_intern_ref(header->contents);
+    if (last_header) {
+      header_copy->first = copy->headers;
+      last_header->next = header_copy;
+    }
+    else {
+      header_copy->first = header_copy;
+      copy->headers = header_copy;
+    }
+    last_header = header_copy;
+    copy->header_count++;
+  }
+
+  for (cf = message->custom_fields; cf; cf = cf->next) {
+    ssdp_custom_field_s *cf_copy = (ssdp_custom_field_s *)calloc(1,
+        sizeof(ssdp_custom_field_s));
+    if (!cf_copy) {
+      free_ssdp_message(&copy);
+      return NULL;
+    }
+    cf_copy->name = string_intern_ref(cf->name);
+    cf_copy->contents = string_intern_ref(cf->contents);
+    if (last_cf) {
+      cf_copy->first = copy->custom_fields;
+      last_cf->next = cf_copy;
+    }
+    else {
+      cf_copy->first = cf_copy;
+      copy->custom_fields = cf_copy;
+    }
+    last_cf = cf_copy;
+    copy->custom_field_count++;
+  }
+
+  return copy;
+}
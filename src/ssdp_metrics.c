@@ -0,0 +1,698 @@
+/** \file ssdp_metrics.c
+ * The per-stage counters, served in the Prometheus text format.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h> /* close() */
+
+#include "common_definitions.h"
+#include "configuration.h"
+#include "log.h"
+#include "net_definitions.h"
+#include "socket_helpers.h"
+#include "ssdp_metrics.h"
+#include "string_buffer.h"
+
+/** The description of a metric. */
+typedef struct ssdp_metric_info_struct {
+  /** The Prometheus name. */
+  const char *name;
+  /** The Prometheus help text. */
+  const char *help;
+  /** The unit the value is divided by, 1 for none. */
+  unsigned int divisor;
+} ssdp_metric_info_s;
+
+/** The counters, in ssdp_counter_e order. */
+static const ssdp_metric_info_s counter_infos[SSDP_COUNTERS_COUNT] = {
+  { "ssdp_datagrams_received_total",
+    "SSDP datagrams received or replayed.", 1 },
+  { "ssdp_received_bytes_total",
+    "Bytes of the SSDP datagrams received or replayed.", 1 },
+  { "ssdp_parse_failures_total",
+    "SSDP datagrams that could not be parsed.", 1 },
+  { "ssdp_searches_ignored_total",
+    "M-SEARCH messages ignored.", 1 },
+  { "ssdp_filter_drops_total",
+    "SSDP messages dropped by the filters.", 1 },
+  { "ssdp_devices_added_total",
+    "Devices added to the table.", 1 },
+  { "ssdp_devices_updated_total",
+    "Devices whose cached message changed.", 1 },
+  { "ssdp_devices_removed_total",
+    "Devices removed from the table.", 1 },
+  { "ssdp_fetches_total",
+    "Device descriptions fetched.", 1 },
+  { "ssdp_fetch_failures_total",
+    "Device descriptions that could not be fetched.", 1 },
+  { "ssdp_forwards_total",
+    "Batches of devices forwarded.", 1 },
+  { "ssdp_forward_failures_total",
+    "Batches of devices that could not be forwarded.", 1 },
+  { "ssdp_forwarded_bytes_total",
+    "Bytes of the batches of devices forwarded.", 1 }
+};
+
+/** The gauges, in ssdp_gauge_e order. */
+static const ssdp_metric_info_s gauge_infos[SSDP_GAUGES_COUNT] = {
+  { "ssdp_devices", "Devices in the table.", 1 },
+  { "ssdp_fetches_pending", "Device descriptions queued or being fetched.",
+    1 }
+};
+
+/** The histograms, in ssdp_histogram_e order (the help is per name). */
+static const ssdp_metric_info_s histogram_infos[SSDP_HISTOGRAMS_COUNT] = {
+  { "ssdp_stage_latency_seconds{stage=\"parse\"",
+    "Time between the stages of a message.", 1000000000 },
+  { "ssdp_stage_latency_seconds{stage=\"filter\"", NULL, 1000000000 },
+  { "ssdp_stage_latency_seconds{stage=\"cache\"", NULL, 1000000000 },
+  { "ssdp_stage_latency_seconds{stage=\"enrich\"", NULL, 1000000000 },
+  { "ssdp_stage_latency_seconds{stage=\"emit\"", NULL, 1000000000 },
+  { "ssdp_output_latency_seconds{",
+    "Time from receiving a message until it was output.", 1000000000 },
+  { "ssdp_fetch_duration_seconds{",
+    "Time it took to fetch the description of a device.", 1000000000 }
+};
+
+/** The names the latencies are printed with, in ssdp_histogram_e order. */
+static const char *histogram_names[SSDP_HISTOGRAMS_COUNT] = {
+  "parse", "filter", "cache", "enrich", "emit", "total", "fetch"
+};
+
+/** The slots of the threads, the last one is shared by the rest. */
+static ssdp_metrics_slot_s slots[SSDP_METRICS_MAX_THREADS];
+/** The number of slots handed out. */
+static unsigned int slots_used;
+/** The slot of the calling thread, NULL until it counts. */
+static __thread ssdp_metrics_slot_s *thread_slot;
+/** The slot of the calling thread is shared with other threads. */
+static __thread BOOL thread_slot_shared;
+/** The gauges. */
+static long long gauges[SSDP_GAUGES_COUNT];
+
+/**
+ * Get the slot of the calling thread, handing one out on the first call.
+ *
+ * @return The slot.
+ */
+static ssdp_metrics_slot_s *get_thread_slot(void) {
+  unsigned int slot;
+
+  if (thread_slot) {
+    return thread_slot;
+  }
+
+  slot = __atomic_fetch_add(&slots_used, 1, __ATOMIC_RELAXED);
+  if (slot >= SSDP_METRICS_MAX_THREADS - 1) {
+    slot = SSDP_METRICS_MAX_THREADS - 1;
+    thread_slot_shared = TRUE;
+  }
+  thread_slot = &slots[slot];
+
+  return thread_slot;
+}
+
+static void slot_add(unsigned long long *count, unsigned long long value);
+
+void ssdp_metrics_add(ssdp_counter_e counter, unsigned long long value) {
+  slot_add(&get_thread_slot()->counters[counter], value);
+}
+
+void ssdp_metrics_inc(ssdp_counter_e counter) {
+  ssdp_metrics_add(counter, 1);
+}
+
+void ssdp_metrics_set(ssdp_gauge_e gauge, long long value) {
+  __atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+unsigned long long ssdp_metrics_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Get the bucket of a value.
+ *
+ * @param value The value, below 2^SSDP_HISTOGRAM_MAX_BITS.
+ *
+ * @return The bucket.
+ */
+static unsigned int bucket_of(unsigned long long value) {
+  unsigned int shift;
+
+  if (value < (1ULL << SSDP_HISTOGRAM_SUB_BITS)) {
+    return (unsigned int)value;
+  }
+
+  /* The top SSDP_HISTOGRAM_SUB_BITS + 1 bits pick the bucket */
+  shift = 63 - __builtin_clzll(value) - SSDP_HISTOGRAM_SUB_BITS;
+
+  return ((shift + 1) << SSDP_HISTOGRAM_SUB_BITS) +
+      (unsigned int)(value >> shift) - (1U << SSDP_HISTOGRAM_SUB_BITS);
+}
+
+/**
+ * Get the largest value of a bucket.
+ *
+ * @param bucket The bucket.
+ *
+ * @return The value.
+ */
+static unsigned long long bucket_max(unsigned int bucket) {
+  unsigned int shift;
+  unsigned long long sub;
+
+  if (bucket < (1U << SSDP_HISTOGRAM_SUB_BITS)) {
+    return bucket;
+  }
+
+  shift = (bucket >> SSDP_HISTOGRAM_SUB_BITS) - 1;
+  sub = (bucket & ((1U << SSDP_HISTOGRAM_SUB_BITS) - 1)) +
+      (1U << SSDP_HISTOGRAM_SUB_BITS);
+
+  return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * Add to a value of the calling thread's slot.
+ *
+ * @param count The value.
+ * @param value What to add.
+ */
+static void slot_add(unsigned long long *count, unsigned long long value) {
+  /* Only the owner writes to its slot, no locked instruction is needed */
+  if (thread_slot_shared) {
+    __atomic_fetch_add(count, value, __ATOMIC_RELAXED);
+  }
+  else {
+    __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + value,
+        __ATOMIC_RELAXED);
+  }
+}
+
+void ssdp_metrics_record(ssdp_histogram_e histogram,
+    unsigned long long value) {
+  ssdp_histogram_s *values = &get_thread_slot()->histograms[histogram];
+  unsigned long long max;
+
+  if (value >= (1ULL << SSDP_HISTOGRAM_MAX_BITS)) {
+    value = (1ULL << SSDP_HISTOGRAM_MAX_BITS) - 1;
+  }
+
+  slot_add(&values->buckets[bucket_of(value)], 1);
+  slot_add(&values->count, 1);
+  slot_add(&values->sum, value);
+  max = __atomic_load_n(&values->max, __ATOMIC_RELAXED);
+  while (value > max && !__atomic_compare_exchange_n(&values->max, &max,
+      value, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void ssdp_metrics_read_histogram(ssdp_histogram_e histogram,
+    ssdp_histogram_s *values) {
+  unsigned int used = __atomic_load_n(&slots_used, __ATOMIC_RELAXED);
+  unsigned int slot, i;
+
+  if (used > SSDP_METRICS_MAX_THREADS) {
+    used = SSDP_METRICS_MAX_THREADS;
+  }
+
+  memset(values, 0, sizeof(ssdp_histogram_s));
+  for (slot = 0; slot < used; slot++) {
+    ssdp_histogram_s *slot_values = &slots[slot].histograms[histogram];
+    unsigned long long max;
+
+    for (i = 0; i < SSDP_HISTOGRAM_BUCKETS; i++) {
+      values->buckets[i] += __atomic_load_n(&slot_values->buckets[i],
+          __ATOMIC_RELAXED);
+    }
+    values->count += __atomic_load_n(&slot_values->count, __ATOMIC_RELAXED);
+    values->sum += __atomic_load_n(&slot_values->sum, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&slot_values->max, __ATOMIC_RELAXED);
+    if (max > values->max) {
+      values->max = max;
+    }
+  }
+}
+
+unsigned long long ssdp_histogram_percentile(const ssdp_histogram_s *histogram,
+    double percentile) {
+  unsigned long long total = 0;
+  unsigned long long rank;
+  unsigned long long seen = 0;
+  unsigned int i;
+
+  /* The buckets are summed up, count may be read at another instant */
+  for (i = 0; i < SSDP_HISTOGRAM_BUCKETS; i++) {
+    total += histogram->buckets[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  rank = (unsigned long long)(percentile / 100.0 * total + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  }
+  for (i = 0; i < SSDP_HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) {
+      break;
+    }
+  }
+  if (i == SSDP_HISTOGRAM_BUCKETS) {
+    i--;
+  }
+
+  /* Never above the largest value recorded */
+  return bucket_max(i) < histogram->max || histogram->max == 0 ?
+      bucket_max(i) : histogram->max;
+}
+
+/**
+ * Print a latency in a readable unit.
+ *
+ * @param file Where to print it.
+ * @param value The latency (in ns).
+ */
+static void print_latency(FILE *file, unsigned long long value) {
+  if (value < 10000ULL) {
+    fprintf(file, " %8llu ns", value);
+  }
+  else if (value < 10000000ULL) {
+    fprintf(file, " %8.1f us", value / 1000.0);
+  }
+  else if (value < 10000000000ULL) {
+    fprintf(file, " %8.1f ms", value / 1000000.0);
+  }
+  else {
+    fprintf(file, " %8.1f s ", value / 1000000000.0);
+  }
+}
+
+void ssdp_metrics_print_latencies(FILE *file) {
+  static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+  ssdp_histogram_s histogram;
+  BOOL header = FALSE;
+  unsigned int i, p;
+
+  for (i = 0; i < SSDP_HISTOGRAMS_COUNT; i++) {
+    ssdp_metrics_read_histogram(i, &histogram);
+    if (histogram.count == 0) {
+      continue;
+    }
+    if (!header) {
+      fprintf(file, "%-8s %10s %11s %11s %11s %11s %11s\n", "latency",
+          "count", "p50", "p90", "p99", "p99.9", "max");
+      header = TRUE;
+    }
+    fprintf(file, "%-8s %10llu", histogram_names[i], histogram.count);
+    for (p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++) {
+      print_latency(file, ssdp_histogram_percentile(&histogram,
+          percentiles[p]));
+    }
+    print_latency(file, histogram.max);
+    fprintf(file, "\n");
+  }
+}
+
+void ssdp_metrics_read(ssdp_metrics_values_s *values) {
+  unsigned int used = __atomic_load_n(&slots_used, __ATOMIC_RELAXED);
+  unsigned int slot, i;
+
+  if (used > SSDP_METRICS_MAX_THREADS) {
+    used = SSDP_METRICS_MAX_THREADS;
+  }
+
+  memset(values, 0, sizeof(ssdp_metrics_values_s));
+  for (slot = 0; slot < used; slot++) {
+    for (i = 0; i < SSDP_COUNTERS_COUNT; i++) {
+      values->counters[i] += __atomic_load_n(&slots[slot].counters[i],
+          __ATOMIC_RELAXED);
+    }
+  }
+  for (i = 0; i < SSDP_GAUGES_COUNT; i++) {
+    values->gauges[i] = __atomic_load_n(&gauges[i], __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Write a metric in the Prometheus text format.
+ *
+ * @param buffer The buffer to append to.
+ * @param info The description of the metric.
+ * @param type The Prometheus type.
+ * @param value The value.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL append_metric(string_buffer_s *buffer,
+    const ssdp_metric_info_s *info, const char *type, long long value) {
+  char line[256];
+
+  if (info->divisor > 1) {
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %.6f\n",
+        info->name, info->help, info->name, type, info->name,
+        (double)value / info->divisor);
+  }
+  else {
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %lld\n",
+        info->name, info->help, info->name, type, info->name, value);
+  }
+
+  return string_buffer_append_str(buffer, line);
+}
+
+/**
+ * Write a histogram as a Prometheus summary.
+ *
+ * @param buffer The buffer to append to.
+ * @param index The histogram.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL append_summary(string_buffer_s *buffer, ssdp_histogram_e index) {
+  static const double quantiles[] = SSDP_METRICS_QUANTILES;
+  const ssdp_metric_info_s *info = &histogram_infos[index];
+  /* The name up to the labels, and the labels to add the quantile to */
+  size_t name_length = strchr(info->name, '{') - info->name;
+  const char *labels = info->name + name_length + 1;
+  const char *separator = *labels ? "," : "";
+  ssdp_histogram_s histogram;
+  char line[256];
+  unsigned int q;
+
+  ssdp_metrics_read_histogram(index, &histogram);
+
+  if (info->help) {
+    snprintf(line, sizeof(line), "# HELP %.*s %s\n# TYPE %.*s summary\n",
+        (int)name_length, info->name, info->help, (int)name_length,
+        info->name);
+    if (!string_buffer_append_str(buffer, line)) {
+      return FALSE;
+    }
+  }
+
+  for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+    snprintf(line, sizeof(line), "%s%squantile=\"%g\"} %.9f\n", info->name,
+        separator, quantiles[q], (double)ssdp_histogram_percentile(
+        &histogram, quantiles[q] * 100.0) / info->divisor);
+    if (!string_buffer_append_str(buffer, line)) {
+      return FALSE;
+    }
+  }
+
+  snprintf(line, sizeof(line), "%.*s_sum%s%s%s %.9f\n"
+      "%.*s_count%s%s%s %llu\n",
+      (int)name_length, info->name, *labels ? "{" : "", labels,
+      *labels ? "}" : "", (double)histogram.sum / info->divisor,
+      (int)name_length, info->name, *labels ? "{" : "", labels,
+      *labels ? "}" : "", histogram.count);
+
+  return string_buffer_append_str(buffer, line);
+}
+
+BOOL ssdp_metrics_to_prometheus(string_buffer_s *buffer) {
+  ssdp_metrics_values_s values;
+  unsigned int i;
+
+  ssdp_metrics_read(&values);
+
+  for (i = 0; i < SSDP_COUNTERS_COUNT; i++) {
+    if (!append_metric(buffer, &counter_infos[i], "counter",
+        (long long)values.counters[i])) {
+      return FALSE;
+    }
+  }
+  for (i = 0; i < SSDP_GAUGES_COUNT; i++) {
+    if (!append_metric(buffer, &gauge_infos[i], "gauge", values.gauges[i])) {
+      return FALSE;
+    }
+  }
+  for (i = 0; i < SSDP_HISTOGRAMS_COUNT; i++) {
+    if (!append_summary(buffer, i)) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/**
+ * Dump the metrics to stderr on every SIGUSR1.
+ *
+ * @param data The signals waited for.
+ *
+ * @return Nothing, it never returns.
+ */
+static void *dump_on_signal(void *data) {
+  sigset_t *signals = (sigset_t *)data;
+  string_buffer_s buffer;
+  int signal;
+
+  while (TRUE) {
+    if (sigwait(signals, &signal) != 0) {
+      continue;
+    }
+    if (!string_buffer_init(&buffer, SSDP_METRICS_BUFFER_SIZE)) {
+      continue;
+    }
+    if (ssdp_metrics_to_prometheus(&buffer)) {
+      fwrite(buffer.data, 1, buffer.length, stderr);
+      fflush(stderr);
+    }
+    string_buffer_free(&buffer);
+  }
+
+  return NULL;
+}
+
+BOOL ssdp_metrics_init(void) {
+  static sigset_t signals;
+  pthread_attr_t attributes;
+  pthread_t thread;
+  BOOL started;
+
+  /* Blocked here and so in every thread started after, only the dumping
+     thread takes it */
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+    PRINT_ERROR("Could not block SIGUSR1");
+    return FALSE;
+  }
+
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  started = pthread_create(&thread, &attributes, dump_on_signal,
+      &signals) == 0;
+  pthread_attr_destroy(&attributes);
+  if (!started) {
+    PRINT_ERROR("Could not start the metrics dump thread");
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * Answer a metrics client, the connection is closed after the answer.
+ *
+ * @param sock The client connection.
+ */
+static void serve_client(SOCKET sock) {
+  char request[SSDP_METRICS_MAX_REQUEST];
+  const char *status = "404 Not Found";
+  string_buffer_s body;
+  char header[128];
+  size_t length = 0;
+  ssize_t bytes;
+
+  /* Only the request line matters, the rest is read to not reset the
+     connection */
+  set_receive_timeout(sock, SSDP_METRICS_CLIENT_TIMEOUT);
+  set_send_timeout(sock, SSDP_METRICS_CLIENT_TIMEOUT);
+  while (length < sizeof(request) - 1) {
+    bytes = recv(sock, request + length, sizeof(request) - 1 - length, 0);
+    if (bytes <= 0) {
+      return;
+    }
+    length += (size_t)bytes;
+    request[length] = '\0';
+    if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+      break;
+    }
+  }
+
+  if (!string_buffer_init(&body, SSDP_METRICS_BUFFER_SIZE)) {
+    return;
+  }
+  if (strncmp(request, "GET /metrics ", 13) == 0 ||
+      strncmp(request, "GET /metrics\r", 13) == 0) {
+    status = ssdp_metrics_to_prometheus(&body) ? "200 OK" :
+        "500 Internal Server Error";
+  }
+
+  snprintf(header, sizeof(header), "HTTP/1.0 %s\r\n"
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Content-Length: %zu\r\n\r\n", status, body.length);
+  if (send(sock, header, strlen(header), MSG_NOSIGNAL) > 0 &&
+      body.length > 0) {
+    send(sock, body.data, body.length, MSG_NOSIGNAL);
+  }
+  string_buffer_free(&body);
+}
+
+/**
+ * Serve the metrics clients, one at a time, until woken up.
+ *
+ * @param data The server.
+ *
+ * @return NULL.
+ */
+static void *serve_metrics(void *data) {
+  ssdp_metrics_server_s *server = (ssdp_metrics_server_s *)data;
+  struct pollfd pfds[2];
+
+  pfds[0].fd = server->sock;
+  pfds[0].events = POLLIN;
+  pfds[1].fd = server->wake[0];
+  pfds[1].events = POLLIN;
+
+  while (TRUE) {
+    SOCKET client;
+
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      PRINT_ERROR("Metrics server poll(): %s", strerror(errno));
+      break;
+    }
+    if (pfds[1].revents) {
+      break;
+    }
+    if (!(pfds[0].revents & POLLIN)) {
+      continue;
+    }
+
+    client = accept(server->sock, NULL, NULL);
+    if (client == SOCKET_ERROR) {
+      continue;
+    }
+    serve_client(client);
+    close(client);
+  }
+
+  return NULL;
+}
+
+/**
+ * Parse the metrics address, [<ip>:]<port>.
+ *
+ * @param raw_address The address.
+ * @param address The address to fill.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL parse_metrics_address(const char *raw_address,
+    struct sockaddr_in *address) {
+  const char *colon = strrchr(raw_address, ':');
+  char ip[IPv4_STR_MAX_SIZE] = SSDP_METRICS_DEFAULT_IP;
+  char *pend = NULL;
+  long port;
+
+  if (colon) {
+    if ((size_t)(colon - raw_address) >= sizeof(ip)) {
+      return FALSE;
+    }
+    memcpy(ip, raw_address, colon - raw_address);
+    ip[colon - raw_address] = '\0';
+    raw_address = colon + 1;
+  }
+  port = strtol(raw_address, &pend, 10);
+  if (*raw_address == '\0' || *pend != '\0' || port < 1 || port > 65535) {
+    return FALSE;
+  }
+
+  memset(address, 0, sizeof(struct sockaddr_in));
+  address->sin_family = AF_INET;
+  address->sin_port = htons((unsigned short)port);
+
+  return inet_pton(AF_INET, ip, &address->sin_addr) == 1;
+}
+
+BOOL ssdp_metrics_server_start(ssdp_metrics_server_s *server,
+    configuration_s *conf) {
+  struct sockaddr_in address;
+
+  memset(server, 0, sizeof(ssdp_metrics_server_s));
+
+  if (!parse_metrics_address(conf->metrics_address, &address)) {
+    PRINT_ERROR("Erroneous metrics address (-G): %s", conf->metrics_address);
+    return FALSE;
+  }
+
+  server->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (server->sock == SOCKET_ERROR) {
+    PRINT_ERROR("socket(): %s", strerror(errno));
+    return FALSE;
+  }
+  if (set_reuseaddr(server->sock) ||
+      bind(server->sock, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(server->sock, SSDP_METRICS_LISTEN_QUEUE) < 0) {
+    PRINT_ERROR("Could not serve the metrics on %s: %s",
+        conf->metrics_address, strerror(errno));
+    close(server->sock);
+    return FALSE;
+  }
+
+  if (pipe(server->wake) < 0) {
+    PRINT_ERROR("pipe(): %s", strerror(errno));
+    close(server->sock);
+    return FALSE;
+  }
+  if (pthread_create(&server->thread, NULL, serve_metrics, server) != 0) {
+    PRINT_ERROR("Could not start the metrics server thread");
+    close(server->wake[0]);
+    close(server->wake[1]);
+    close(server->sock);
+    return FALSE;
+  }
+  server->running = TRUE;
+
+  PRINT_DEBUG("Serving the metrics on %s", conf->metrics_address);
+
+  return TRUE;
+}
+
+void ssdp_metrics_server_stop(ssdp_metrics_server_s *server) {
+  if (!server->running) {
+    return;
+  }
+
+  if (write(server->wake[1], "", 1) < 0) {
+    PRINT_WARN("Could not wake the metrics server up");
+  }
+  pthread_join(server->thread, NULL);
+  close(server->wake[0]);
+  close(server->wake[1]);
+  close(server->sock);
+  server->running = FALSE;
+}
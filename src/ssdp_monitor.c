@@ -0,0 +1,305 @@
+/** \file ssdp_monitor.c
+ * Continuous, scheduled probing for devices.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common_definitions.h"
+#include "configuration.h"
+#include "log.h"
+#include "ssdp_common.h"
+#include "ssdp_message.h"
+#include "ssdp_metrics.h"
+#include "ssdp_monitor.h"
+#include "ssdp_probe_scheduler.h"
+#include "ssdp_prober.h"
+#include "ssdp_scan_policy.h"
+#include "ssdp_static_defs.h"
+
+/**
+ * Get the number of milliseconds until a point in time.
+ *
+ * @param until The point in time.
+ *
+ * @return The milliseconds left, negative if it has passed.
+ */
+static long ms_until(const struct timespec *until) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (until->tv_sec - now.tv_sec) * 1000 +
+      (until->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+BOOL ssdp_monitor_init(ssdp_monitor_s *monitor, configuration_s *conf,
+    ssdp_monitor_callback callback, void *data) {
+  memset(monitor, 0, sizeof(ssdp_monitor_s));
+  monitor->conf = conf;
+  monitor->callback = callback;
+  monitor->data = data;
+  monitor->base_interval = (unsigned long)conf->scan_interval * 1000;
+  monitor->interval = monitor->base_interval;
+
+  if (ssdp_prober_init(&monitor->prober, conf)) {
+    PRINT_ERROR("Could not create the sockets for continuous scanning");
+    return FALSE;
+  }
+  if (monitor->prober.sock != SOCKET_ERROR) {
+    fcntl(monitor->prober.sock, F_SETFL,
+        fcntl(monitor->prober.sock, F_GETFL, 0) | O_NONBLOCK);
+  }
+  if (monitor->prober.sock6 != SOCKET_ERROR) {
+    fcntl(monitor->prober.sock6, F_SETFL,
+        fcntl(monitor->prober.sock6, F_GETFL, 0) | O_NONBLOCK);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &monitor->next_cycle);
+
+  return TRUE;
+}
+
+unsigned int ssdp_monitor_fill_pollfds(ssdp_monitor_s *monitor,
+    struct pollfd *pfds) {
+  unsigned int count = 0;
+
+  if (monitor->prober.sock != SOCKET_ERROR) {
+    pfds[count].fd = monitor->prober.sock;
+    pfds[count].events = POLLIN;
+    pfds[count++].revents = 0;
+  }
+  if (monitor->prober.sock6 != SOCKET_ERROR) {
+    pfds[count].fd = monitor->prober.sock6;
+    pfds[count].events = POLLIN;
+    pfds[count++].revents = 0;
+  }
+
+  return count;
+}
+
+int ssdp_monitor_timeout(ssdp_monitor_s *monitor) {
+  long left;
+  int send_timeout;
+
+  if (!monitor->probing) {
+    if (monitor->base_interval == 0 && monitor->cycles > 0) {
+      return -1;
+    }
+    left = ms_until(&monitor->next_cycle);
+    return left > 0 ? (int)left : 0;
+  }
+
+  send_timeout = ssdp_probe_scheduler_timeout(&monitor->scheduler);
+  if (send_timeout >= 0) {
+    return send_timeout;
+  }
+
+  left = ms_until(&monitor->deadline);
+
+  return left > 0 ? (int)left : 0;
+}
+
+/**
+ * Set the next cycle to start one interval from now.
+ *
+ * @param monitor The monitor.
+ */
+static void schedule_next_cycle(ssdp_monitor_s *monitor) {
+  clock_gettime(CLOCK_MONOTONIC, &monitor->next_cycle);
+  monitor->next_cycle.tv_sec += monitor->interval / 1000;
+  monitor->next_cycle.tv_nsec += (monitor->interval % 1000) * 1000000;
+  if (monitor->next_cycle.tv_nsec >= 1000000000) {
+    monitor->next_cycle.tv_sec++;
+    monitor->next_cycle.tv_nsec -= 1000000000;
+  }
+}
+
+/**
+ * Start a probe cycle.
+ *
+ * @param monitor The monitor.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL start_cycle(ssdp_monitor_s *monitor) {
+  configuration_s *conf = monitor->conf;
+
+  if (!ssdp_probe_scheduler_init(&monitor->scheduler, conf->search_targets,
+      conf->probe_retransmits, conf->probe_rate, conf->upnp_timeout)) {
+    return FALSE;
+  }
+  if (monitor->prober.sock != SOCKET_ERROR) {
+    ssdp_probe_scheduler_add_destination(&monitor->scheduler,
+        monitor->prober.sock, SSDP_ADDR);
+  }
+  if (monitor->prober.sock6 != SOCKET_ERROR) {
+    ssdp_probe_scheduler_add_destination(&monitor->scheduler,
+        monitor->prober.sock6, SSDP_ADDR6_LL);
+    ssdp_probe_scheduler_add_destination(&monitor->scheduler,
+        monitor->prober.sock6, SSDP_ADDR6_SL);
+  }
+  if (!ssdp_probe_scheduler_start(&monitor->scheduler)) {
+    ssdp_probe_scheduler_close(&monitor->scheduler);
+    return FALSE;
+  }
+
+  /* A cycle cut short drops the late answers and the devices that gave
+     them would count as missed, so only -Q ends it before the deadline */
+  ssdp_probe_scheduler_deadline(&monitor->scheduler, &monitor->deadline);
+  ssdp_scan_policy_init(&monitor->policy, FALSE, conf->expected_devices,
+      ms_until(&monitor->deadline));
+  monitor->probing = TRUE;
+  PRINT_DEBUG("Started probe cycle %d", (int)monitor->cycles + 1);
+
+  return TRUE;
+}
+
+/**
+ * Read all the responses queued on a probe socket.
+ *
+ * @param monitor The monitor.
+ * @param sock The socket to read from.
+ */
+static void read_responses(ssdp_monitor_s *monitor, SOCKET sock) {
+  ssdp_recv_node_s *recv_node = &monitor->recv_node;
+  ssdp_message_s *ssdp_message = NULL;
+  unsigned int devices;
+  BOOL first;
+
+  while (TRUE) {
+    ssdp_recv_node_read(sock, recv_node);
+    if (recv_node->recv_bytes <= 0) {
+      break;
+    }
+
+    ssdp_metrics_inc(SSDP_COUNTER_DATAGRAMS);
+    ssdp_metrics_add(SSDP_COUNTER_BYTES, recv_node->recv_bytes);
+
+    /* Answers to an ended cycle are dropped, the next one gets them */
+    if (!monitor->probing) {
+      continue;
+    }
+
+    ssdp_message = NULL;
+    if (!init_ssdp_message(&ssdp_message)) {
+      PRINT_ERROR("Failed to initialize SSDP message holder structure");
+      continue;
+    }
+    if (!build_ssdp_message(ssdp_message, recv_node->from_ip,
+        recv_node->from_mac, recv_node->recv_bytes, recv_node->recv_data)) {
+      ssdp_metrics_inc(SSDP_COUNTER_PARSE_FAILURES);
+      free_ssdp_message(&ssdp_message);
+      continue;
+    }
+
+    /* Devices answer every copy of a probe, only use the first answer */
+    devices = monitor->scheduler.seen_hosts.count;
+    first = ssdp_probe_scheduler_account(&monitor->scheduler, ssdp_message);
+    ssdp_scan_policy_response(&monitor->policy,
+        monitor->scheduler.seen_hosts.count > devices);
+    if (!first) {
+      free_ssdp_message(&ssdp_message);
+      continue;
+    }
+
+    monitor->callback(monitor->data, ssdp_message);
+  }
+}
+
+BOOL ssdp_monitor_process(ssdp_monitor_s *monitor, const struct pollfd *pfds,
+    unsigned int pfds_count) {
+  ssdp_scan_end_e reason = SSDP_SCAN_END_NONE;
+  long left;
+  unsigned int i;
+
+  for (i = 0; i < pfds_count; i++) {
+    if (pfds[i].revents & POLLIN) {
+      read_responses(monitor, pfds[i].fd);
+    }
+  }
+
+  if (!monitor->probing) {
+    /* Without an interval there is only one cycle */
+    if ((monitor->base_interval == 0 && monitor->cycles > 0) ||
+        ms_until(&monitor->next_cycle) > 0) {
+      return FALSE;
+    }
+    if (!start_cycle(monitor)) {
+      schedule_next_cycle(monitor);
+      return FALSE;
+    }
+  }
+
+  ssdp_probe_scheduler_send(&monitor->scheduler);
+  if (ssdp_probe_scheduler_timeout(&monitor->scheduler) >= 0) {
+    return FALSE;
+  }
+
+  left = ms_until(&monitor->deadline);
+  if (ssdp_scan_policy_has_expected(&monitor->policy,
+      monitor->scheduler.seen_hosts.count)) {
+    reason = SSDP_SCAN_END_EXPECTED;
+  }
+  else if (left <= 0) {
+    reason = SSDP_SCAN_END_DEADLINE;
+  }
+  else {
+    return FALSE;
+  }
+
+  ssdp_scan_policy_end(&monitor->policy, reason, left);
+  ssdp_probe_scheduler_close(&monitor->scheduler);
+  monitor->probing = FALSE;
+  monitor->cycles++;
+  PRINT_DEBUG("Probe cycle %d ended (%d)", (int)monitor->cycles, reason);
+
+  return TRUE;
+}
+
+void ssdp_monitor_cycle_done(ssdp_monitor_s *monitor, unsigned int changes,
+    unsigned int devices) {
+  unsigned long max_interval = monitor->base_interval *
+      SSDP_MONITOR_MAX_BACKOFF;
+
+  if (monitor->base_interval == 0) {
+    PRINT_DEBUG("Found %d devices, no more probe cycles", (int)devices);
+    return;
+  }
+
+  /* Probe often while the network is changing, back off while it is
+     not */
+  if (changes > 0 && (double)changes >=
+      SSDP_MONITOR_HIGH_CHURN * (devices > 0 ? devices : 1)) {
+    monitor->interval = monitor->base_interval;
+  }
+  else if (changes > 0) {
+    monitor->interval /= 2;
+    if (monitor->interval < monitor->base_interval) {
+      monitor->interval = monitor->base_interval;
+    }
+  }
+  else {
+    monitor->interval *= 2;
+    if (monitor->interval > max_interval) {
+      monitor->interval = max_interval;
+    }
+  }
+
+  schedule_next_cycle(monitor);
+  PRINT_DEBUG("%d changes in %d devices, next probe cycle in %d ms",
+      (int)changes, (int)devices, (int)monitor->interval);
+}
+
+void ssdp_monitor_close(ssdp_monitor_s *monitor) {
+  if (monitor->probing) {
+    ssdp_probe_scheduler_close(&monitor->scheduler);
+    monitor->probing = FALSE;
+  }
+  ssdp_prober_close(&monitor->prober);
+}
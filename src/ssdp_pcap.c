@@ -0,0 +1,559 @@
+/** \file ssdp_pcap.c
+ * Read the SSDP datagrams of pcap and pcapng capture files (-P).
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common_definitions.h"
+#include "log.h"
+#include "net_definitions.h"
+#include "ssdp_journal.h"
+#include "ssdp_pcap.h"
+
+/** The link types of the captured frames (see the tcpdump.org list). */
+#define LINKTYPE_NULL         0
+#define LINKTYPE_ETHERNET     1
+#define LINKTYPE_RAW          101
+#define LINKTYPE_LINUX_SLL    113
+#define LINKTYPE_IPV4         228
+#define LINKTYPE_IPV6         229
+#define LINKTYPE_LINUX_SLL2   276
+
+/** The pcapng blocks that are read, the others are skipped. */
+#define PCAPNG_SECTION_HEADER     0x0a0d0d0a
+#define PCAPNG_INTERFACE          0x00000001
+#define PCAPNG_PACKET             0x00000002
+#define PCAPNG_SIMPLE_PACKET      0x00000003
+#define PCAPNG_ENHANCED_PACKET    0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC   0x1a2b3c4d
+
+/** The pcapng interface options that are read. */
+#define PCAPNG_OPTION_END         0
+#define PCAPNG_OPTION_IF_NAME     2
+#define PCAPNG_OPTION_IF_TSRESOL  9
+
+/** A capture interface (pcapng). */
+typedef struct pcap_interface_struct {
+  /** The link type of its frames. */
+  unsigned int linktype;
+  /** The timestamp units per second. */
+  unsigned long long units;
+  /** The name of the interface, empty if unknown. */
+  char name[IFNAMSIZ];
+} pcap_interface_s;
+
+/** Where the datagrams go. */
+typedef struct pcap_sink_struct {
+  /** The function to call for every datagram. */
+  ssdp_journal_replay_cb callback;
+  /** Passed to the callback. */
+  void *data;
+} pcap_sink_s;
+
+/**
+ * Read a 16-bit integer.
+ *
+ * @param p The bytes.
+ * @param big_endian The bytes are in big endian order.
+ *
+ * @return The integer.
+ */
+static unsigned int get16(const unsigned char *p, BOOL big_endian) {
+  return big_endian ? (unsigned int)(p[0] << 8 | p[1]) :
+      (unsigned int)(p[1] << 8 | p[0]);
+}
+
+/**
+ * Read a 32-bit integer.
+ *
+ * @param p The bytes.
+ * @param big_endian The bytes are in big endian order.
+ *
+ * @return The integer.
+ */
+static uint32_t get32(const unsigned char *p, BOOL big_endian) {
+  return big_endian ?
+      (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3] :
+      (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+/**
+ * Convert a timestamp to ns.
+ *
+ * @param timestamp The timestamp.
+ * @param units The timestamp units per second.
+ *
+ * @return The time in ns since the epoch.
+ */
+static unsigned long long to_ns(unsigned long long timestamp,
+    unsigned long long units) {
+  if (units == 1000000000ULL) {
+    return timestamp;
+  }
+
+  return timestamp / units * 1000000000ULL + (unsigned long long)(
+      (long double)(timestamp % units) * 1000000000.0L / units);
+}
+
+/**
+ * Pass the datagram in a UDP packet on, if it is SSDP.
+ *
+ * @param sink Where the datagram goes.
+ * @param record The record to fill in and pass (time, ip and mac are set).
+ * @param udp The UDP header and payload.
+ * @param length The captured length of the UDP packet.
+ *
+ * @return TRUE to go on, FALSE if the callback stopped the reading.
+ */
+static BOOL handle_udp(pcap_sink_s *sink, ssdp_journal_record_s *record,
+    const unsigned char *udp, size_t length) {
+  unsigned int udp_length;
+
+  if (length < 8 || (get16(udp, TRUE) != SSDP_PCAP_PORT &&
+      get16(udp + 2, TRUE) != SSDP_PCAP_PORT)) {
+    return TRUE;
+  }
+  udp_length = get16(udp + 4, TRUE);
+  if (udp_length < 8) {
+    return TRUE;
+  }
+  /* Only the captured part of a truncated packet */
+  if (udp_length > length) {
+    udp_length = (unsigned int)length;
+  }
+  record->length = udp_length - 8;
+
+  return sink->callback(sink->data, record, (const char *)udp + 8);
+}
+
+/**
+ * Pass the SSDP datagram in an IPv4 packet on.
+ *
+ * @param sink Where the datagram goes.
+ * @param record The record to fill in and pass (time and mac are set).
+ * @param ip The IPv4 packet.
+ * @param length The captured length of the packet.
+ *
+ * @return TRUE to go on, FALSE if the callback stopped the reading.
+ */
+static BOOL handle_ipv4(pcap_sink_s *sink, ssdp_journal_record_s *record,
+    const unsigned char *ip, size_t length) {
+  size_t header_length;
+  size_t total_length;
+
+  if (length < 20 || (ip[0] >> 4) != 4 || ip[9] != IPPROTO_UDP) {
+    return TRUE;
+  }
+  header_length = (size_t)(ip[0] & 0x0f) * 4;
+  total_length = get16(ip + 2, TRUE);
+  /* Fragments can not be parsed on their own */
+  if (header_length < 20 || (get16(ip + 6, TRUE) & 0x3fff) != 0) {
+    return TRUE;
+  }
+  if (total_length < length) {
+    length = total_length;
+  }
+  if (header_length > length) {
+    return TRUE;
+  }
+  inet_ntop(AF_INET, ip + 12, record->ip, sizeof(record->ip));
+
+  return handle_udp(sink, record, ip + header_length, length - header_length);
+}
+
+/**
+ * Pass the SSDP datagram in an IPv6 packet on.
+ *
+ * @param sink Where the datagram goes.
+ * @param record The record to fill in and pass (time and mac are set).
+ * @param ip The IPv6 packet.
+ * @param length The captured length of the packet.
+ *
+ * @return TRUE to go on, FALSE if the callback stopped the reading.
+ */
+static BOOL handle_ipv6(pcap_sink_s *sink, ssdp_journal_record_s *record,
+    const unsigned char *ip, size_t length) {
+  unsigned int next_header;
+  size_t offset = 40;
+
+  if (length < 40 || (ip[0] >> 4) != 6) {
+    return TRUE;
+  }
+  if (40 + (size_t)get16(ip + 4, TRUE) < length) {
+    length = 40 + get16(ip + 4, TRUE);
+  }
+  next_header = ip[6];
+
+  /* Skip the extension headers, fragments can not be parsed on their own */
+  while (next_header != IPPROTO_UDP) {
+    size_t extension_length;
+    if (offset + 8 > length) {
+      return TRUE;
+    }
+    switch (next_header) {
+    case 0:   /* Hop-by-hop options */
+    case 43:  /* Routing */
+    case 60:  /* Destination options */
+      extension_length = ((size_t)ip[offset + 1] + 1) * 8;
+      break;
+    case 51:  /* Authentication */
+      extension_length = ((size_t)ip[offset + 1] + 2) * 4;
+      break;
+    default:
+      return TRUE;
+    }
+    next_header = ip[offset];
+    offset += extension_length;
+  }
+  if (offset > length) {
+    return TRUE;
+  }
+  inet_ntop(AF_INET6, ip + 8, record->ip, sizeof(record->ip));
+
+  return handle_udp(sink, record, ip + offset, length - offset);
+}
+
+/**
+ * Pass the SSDP datagram in a captured frame on.
+ *
+ * @param sink Where the datagram goes.
+ * @param linktype The link type of the frame.
+ * @param time When the frame was captured (in ns since the epoch).
+ * @param interface The capture interface, empty if unknown.
+ * @param frame The frame.
+ * @param length The captured length of the frame.
+ *
+ * @return TRUE to go on, FALSE if the callback stopped the reading.
+ */
+static BOOL handle_frame(pcap_sink_s *sink, unsigned int linktype,
+    unsigned long long time, const char *interface,
+    const unsigned char *frame, size_t length) {
+  ssdp_journal_record_s record;
+  const unsigned char *mac = NULL;
+  unsigned int ethertype = 0;
+  size_t offset = 0;
+
+  switch (linktype) {
+  case LINKTYPE_ETHERNET:
+    if (length < 14) {
+      return TRUE;
+    }
+    mac = frame + 6;
+    ethertype = get16(frame + 12, TRUE);
+    offset = 14;
+    break;
+  case LINKTYPE_LINUX_SLL:
+    if (length < 16) {
+      return TRUE;
+    }
+    if (get16(frame + 4, TRUE) == 6) {
+      mac = frame + 6;
+    }
+    ethertype = get16(frame + 14, TRUE);
+    offset = 16;
+    break;
+  case LINKTYPE_LINUX_SLL2:
+    if (length < 20) {
+      return TRUE;
+    }
+    if (frame[11] == 6) {
+      mac = frame + 12;
+    }
+    ethertype = get16(frame, TRUE);
+    offset = 20;
+    break;
+  case LINKTYPE_NULL:
+    if (length < 4) {
+      return TRUE;
+    }
+    /* The address family, in the byte order of the capturing machine */
+    switch (frame[0] ? frame[0] : frame[3]) {
+    case 2:
+      ethertype = 0x0800;
+      break;
+    case 24:
+    case 28:
+    case 30:
+      ethertype = 0x86dd;
+      break;
+    }
+    offset = 4;
+    break;
+  case LINKTYPE_RAW:
+  case LINKTYPE_IPV4:
+  case LINKTYPE_IPV6:
+    if (length < 1) {
+      return TRUE;
+    }
+    ethertype = (frame[0] >> 4) == 6 ? 0x86dd : 0x0800;
+    break;
+  default:
+    return TRUE;
+  }
+
+  /* Any number of VLAN tags */
+  while ((ethertype == 0x8100 || ethertype == 0x88a8 ||
+      ethertype == 0x9100) && offset + 4 <= length) {
+    ethertype = get16(frame + offset + 2, TRUE);
+    offset += 4;
+  }
+
+  memset(&record, 0, sizeof(record));
+  record.time = time;
+  strncpy(record.interface, interface, sizeof(record.interface) - 1);
+  if (mac) {
+    snprintf(record.mac, sizeof(record.mac), "%x:%x:%x:%x:%x:%x", mac[0],
+        mac[1], mac[2], mac[3], mac[4], mac[5]);
+  }
+
+  if (ethertype == 0x0800) {
+    return handle_ipv4(sink, &record, frame + offset, length - offset);
+  }
+  if (ethertype == 0x86dd) {
+    return handle_ipv6(sink, &record, frame + offset, length - offset);
+  }
+
+  return TRUE;
+}
+
+/**
+ * Read the frames of a pcap file.
+ *
+ * @param sink Where the datagrams go.
+ * @param data The file.
+ * @param size The size of the file.
+ * @param big_endian The file is in big endian order.
+ * @param units The timestamp units per second (1000000 or 1000000000).
+ *
+ * @return TRUE on success, FALSE if the file is malformed.
+ */
+static BOOL read_pcap(pcap_sink_s *sink, const unsigned char *data,
+    size_t size, BOOL big_endian, unsigned long long units) {
+  unsigned int linktype;
+  size_t offset = 24;
+
+  if (size < 24) {
+    return FALSE;
+  }
+  linktype = get32(data + 20, big_endian) & 0xffff;
+
+  while (offset + 16 <= size) {
+    const unsigned char *header = data + offset;
+    uint32_t captured = get32(header + 8, big_endian);
+    if (captured > size - offset - 16) {
+      PRINT_WARN("The capture ends with a cut packet");
+      return FALSE;
+    }
+    if (!handle_frame(sink, linktype,
+        to_ns((unsigned long long)get32(header, big_endian) * units +
+        get32(header + 4, big_endian), units), "", header + 16, captured)) {
+      return TRUE;
+    }
+    offset += 16 + captured;
+  }
+
+  return TRUE;
+}
+
+/**
+ * Read the options of a pcapng interface block.
+ *
+ * @param interface The interface to fill.
+ * @param options The options.
+ * @param length The length of the options.
+ * @param big_endian The section is in big endian order.
+ */
+static void read_interface_options(pcap_interface_s *interface,
+    const unsigned char *options, size_t length, BOOL big_endian) {
+  size_t offset = 0;
+
+  while (offset + 4 <= length) {
+    unsigned int code = get16(options + offset, big_endian);
+    size_t option_length = get16(options + offset + 2, big_endian);
+    const unsigned char *value = options + offset + 4;
+
+    if (code == PCAPNG_OPTION_END || option_length > length - offset - 4) {
+      break;
+    }
+    if (code == PCAPNG_OPTION_IF_TSRESOL && option_length >= 1) {
+      unsigned int exponent = value[0] & 0x7f;
+      unsigned long long units = 1;
+      if (exponent <= ((value[0] & 0x80) ? 63 : 19)) {
+        while (exponent-- > 0) {
+          units *= (value[0] & 0x80) ? 2 : 10;
+        }
+        interface->units = units;
+      }
+    }
+    else if (code == PCAPNG_OPTION_IF_NAME) {
+      size_t name_length = option_length < sizeof(interface->name) ?
+          option_length : sizeof(interface->name) - 1;
+      memcpy(interface->name, value, name_length);
+      interface->name[name_length] = '\0';
+    }
+    offset += 4 + ((option_length + 3) & ~(size_t)3);
+  }
+}
+
+/**
+ * Read the packets of a pcapng file.
+ *
+ * @param sink Where the datagrams go.
+ * @param data The file.
+ * @param size The size of the file.
+ *
+ * @return TRUE on success, FALSE if the file is malformed.
+ */
+static BOOL read_pcapng(pcap_sink_s *sink, const unsigned char *data,
+    size_t size) {
+  pcap_interface_s *interfaces = NULL;
+  size_t interfaces_count = 0;
+  unsigned long long last_time = 0;
+  BOOL big_endian = FALSE;
+  BOOL ok = TRUE;
+  size_t offset = 0;
+
+  while (offset + 12 <= size) {
+    const unsigned char *block = data + offset;
+    uint32_t type;
+    uint32_t total;
+
+    /* A new section sets the byte order and its own interfaces */
+    if (get32(block, FALSE) == PCAPNG_SECTION_HEADER) {
+      if (get32(block + 8, FALSE) == PCAPNG_BYTE_ORDER_MAGIC) {
+        big_endian = FALSE;
+      }
+      else if (get32(block + 8, TRUE) == PCAPNG_BYTE_ORDER_MAGIC) {
+        big_endian = TRUE;
+      }
+      else {
+        ok = FALSE;
+        break;
+      }
+      interfaces_count = 0;
+    }
+    type = get32(block, big_endian);
+    total = get32(block + 4, big_endian);
+    if (total < 12 || total % 4 != 0 || total > size - offset) {
+      PRINT_WARN("The capture ends with a cut block");
+      ok = FALSE;
+      break;
+    }
+
+    if (type == PCAPNG_INTERFACE && total >= 20) {
+      pcap_interface_s *grown = (pcap_interface_s *)realloc(interfaces,
+          (interfaces_count + 1) * sizeof(pcap_interface_s));
+      if (!grown) {
+        PRINT_ERROR("Failed to allocate memory for a capture interface");
+        ok = FALSE;
+        break;
+      }
+      interfaces = grown;
+      memset(&interfaces[interfaces_count], 0, sizeof(pcap_interface_s));
+      interfaces[interfaces_count].linktype = get16(block + 8, big_endian);
+      interfaces[interfaces_count].units = 1000000;
+      read_interface_options(&interfaces[interfaces_count], block + 16,
+          total - 20, big_endian);
+      interfaces_count++;
+    }
+    else if ((type == PCAPNG_ENHANCED_PACKET || type == PCAPNG_PACKET) &&
+        total >= 32) {
+      uint32_t id = type == PCAPNG_PACKET ? get16(block + 8, big_endian) :
+          get32(block + 8, big_endian);
+      unsigned long long timestamp =
+          (unsigned long long)get32(block + 12, big_endian) << 32 |
+          get32(block + 16, big_endian);
+      uint32_t captured = get32(block + 20, big_endian);
+      if (id < interfaces_count && captured <= total - 32) {
+        last_time = to_ns(timestamp, interfaces[id].units);
+        if (!handle_frame(sink, interfaces[id].linktype, last_time,
+            interfaces[id].name, block + 28, captured)) {
+          break;
+        }
+      }
+    }
+    else if (type == PCAPNG_SIMPLE_PACKET && total >= 16 &&
+        interfaces_count > 0) {
+      /* No timestamp, it is taken to be as old as the last one */
+      uint32_t captured = get32(block + 8, big_endian);
+      if (captured > total - 16) {
+        captured = total - 16;
+      }
+      if (!handle_frame(sink, interfaces[0].linktype, last_time,
+          interfaces[0].name, block + 12, captured)) {
+        break;
+      }
+    }
+
+    offset += total;
+  }
+
+  free(interfaces);
+
+  return ok;
+}
+
+BOOL ssdp_pcap_read(const char *path, ssdp_journal_replay_cb callback,
+    void *data) {
+  pcap_sink_s sink = { callback, data };
+  const unsigned char *map = NULL;
+  struct stat file_stat;
+  uint32_t magic;
+  size_t size;
+  BOOL ok;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    PRINT_ERROR("Could not open the capture '%s': %s", path,
+        strerror(errno));
+    return FALSE;
+  }
+  if (fstat(fd, &file_stat) < 0 || file_stat.st_size < 24) {
+    PRINT_ERROR("'%s' is not a capture file", path);
+    close(fd);
+    return FALSE;
+  }
+  size = (size_t)file_stat.st_size;
+  map = (const unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd,
+      0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    PRINT_ERROR("mmap(): %s", strerror(errno));
+    return FALSE;
+  }
+
+  magic = get32(map, FALSE);
+  switch (magic) {
+  case 0xa1b2c3d4:
+  case 0xd4c3b2a1:
+    ok = read_pcap(&sink, map, size, magic == 0xd4c3b2a1, 1000000);
+    break;
+  case 0xa1b23c4d:
+  case 0x4d3cb2a1:
+    ok = read_pcap(&sink, map, size, magic == 0x4d3cb2a1, 1000000000);
+    break;
+  case PCAPNG_SECTION_HEADER:
+    ok = read_pcapng(&sink, map, size);
+    break;
+  default:
+    PRINT_ERROR("'%s' is not a pcap or pcapng file", path);
+    ok = FALSE;
+  }
+
+  munmap((void *)map, size);
+
+  return ok;
+}
@@ -0,0 +1,447 @@
+/** \file ssdp_probe_scheduler.c
+ * Schedules paced and retransmitted M-SEARCH packets for a set of search
+ * targets and keeps per search target response statistics.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <errno.h>
+#include <stdint.h> /* uintptr_t */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h> /* getpid() */
+
+#include "common_definitions.h"
+#include "log.h"
+#include "net_definitions.h"
+#include "net_utils.h"
+#include "ssdp_message.h"
+#include "ssdp_probe_scheduler.h"
+#include "ssdp_static_defs.h"
+#include "string_buffer.h"
+#include "string_intern.h"
+
+/** The initial number of tuple slots in a seen set (a power of 2). */
+#define SEEN_INITIAL_CAPACITY 64
+
+/** The largest MX value allowed by the UPnP Device Architecture. */
+#define SSDP_PROBE_MAX_MX 5
+
+/**
+ * Get the number of microseconds since a point in time.
+ *
+ * @param since The point in time.
+ *
+ * @return The elapsed microseconds.
+ */
+static long elapsed_us(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000000 +
+      (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/**
+ * Calculate the slot of a tuple in a seen set.
+ *
+ * @param first The first (interned) string of the tuple.
+ * @param second The second (interned) string of the tuple.
+ * @param capacity The number of slots in the set.
+ *
+ * @return The first slot to probe.
+ */
+static unsigned int seen_slot(const char *first, const char *second,
+    unsigned int capacity) {
+  uintptr_t key = ((uintptr_t)first >> 3) ^ ((uintptr_t)second >> 1);
+
+  return (unsigned int)(key * 2654435761u) & (capacity - 1);
+}
+
+/**
+ * Double the number of slots in a seen set and reinsert the tuples.
+ *
+ * @param seen The set to grow.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL grow_seen(ssdp_probe_seen_s *seen) {
+  unsigned int new_capacity = seen->capacity ?
+      seen->capacity * 2 : SEEN_INITIAL_CAPACITY;
+  const char **new_entries = NULL;
+  unsigned int i;
+
+  new_entries = (const char **)calloc(new_capacity * 2, sizeof(const char *));
+  if (!new_entries) {
+    PRINT_ERROR("Failed to allocate memory for the probe responses");
+    return FALSE;
+  }
+
+  for (i = 0; i < seen->capacity; i++) {
+    const char **entry = &seen->entries[i * 2];
+    unsigned int pos;
+
+    if (!entry[0]) {
+      continue;
+    }
+
+    pos = seen_slot(entry[0], entry[1], new_capacity);
+    while (new_entries[pos * 2]) {
+      pos = (pos + 1) & (new_capacity - 1);
+    }
+    new_entries[pos * 2] = entry[0];
+    new_entries[pos * 2 + 1] = entry[1];
+  }
+
+  free(seen->entries);
+  seen->entries = new_entries;
+  seen->capacity = new_capacity;
+
+  return TRUE;
+}
+
+/**
+ * Add a tuple to a seen set unless it is there already. The strings are
+ * referenced for as long as they are in the set.
+ *
+ * @param seen The set to add to.
+ * @param first The first (interned) string of the tuple, not NULL.
+ * @param second The second (interned) string of the tuple.
+ *
+ * @return TRUE if the tuple was added, FALSE if it was there already or on
+ *         failure.
+ */
+static BOOL add_seen(ssdp_probe_seen_s *seen, const char *first,
+    const char *second) {
+  unsigned int pos;
+
+  if ((seen->count + 1) * 2 > seen->capacity && !grow_seen(seen)) {
+    return FALSE;
+  }
+
+  pos = seen_slot(first, second, seen->capacity);
+  while (seen->entries[pos * 2]) {
+    if (seen->entries[pos * 2] == first &&
+        seen->entries[pos * 2 + 1] == second) {
+      return FALSE;
+    }
+    pos = (pos + 1) & (seen->capacity - 1);
+  }
+
+  seen->entries[pos * 2] = string_intern_ref(first);
+  seen->entries[pos * 2 + 1] = string_intern_ref(second);
+  seen->count++;
+
+  return TRUE;
+}
+
+/**
+ * Release the strings of a seen set and free it.
+ *
+ * @param seen The set to free.
+ */
+static void free_seen(ssdp_probe_seen_s *seen) {
+  unsigned int i;
+
+  for (i = 0; i < seen->capacity * 2; i++) {
+    string_intern_release(seen->entries[i]);
+  }
+  free(seen->entries);
+  memset(seen, 0, sizeof(ssdp_probe_seen_s));
+}
+
+BOOL ssdp_probe_scheduler_init(ssdp_probe_scheduler_s *scheduler,
+    const char *targets, unsigned int retransmits, unsigned int rate,
+    unsigned int mx) {
+  const char *target = targets ? targets : SSDP_PROBE_DEFAULT_TARGET;
+
+  memset(scheduler, 0, sizeof(ssdp_probe_scheduler_s));
+  scheduler->retransmits = retransmits;
+  scheduler->rate = rate;
+  scheduler->mx = mx < 1 ? 1 : (mx > SSDP_PROBE_MAX_MX ? SSDP_PROBE_MAX_MX :
+      mx);
+
+  /* Split the comma separated search targets */
+  while (*target) {
+    size_t length = strcspn(target, ",");
+    const char *st = NULL;
+    unsigned int i;
+
+    if (length == 0) {
+      target++;
+      continue;
+    }
+
+    if (scheduler->target_count == SSDP_PROBE_MAX_TARGETS) {
+      PRINT_WARN("Too many search targets, only probing for the first %d",
+          SSDP_PROBE_MAX_TARGETS);
+      break;
+    }
+
+    st = string_intern_n(target, length);
+    if (!st) {
+      ssdp_probe_scheduler_close(scheduler);
+      return FALSE;
+    }
+
+    /* Interned strings are equal only if the pointers are */
+    for (i = 0; i < scheduler->target_count; i++) {
+      if (scheduler->targets[i].st == st) {
+        break;
+      }
+    }
+
+    if (i < scheduler->target_count) {
+      string_intern_release(st);
+    }
+    else {
+      scheduler->targets[i].st = st;
+      scheduler->targets[i].first_response = -1;
+      scheduler->target_count++;
+    }
+
+    target += length;
+  }
+
+  if (scheduler->target_count == 0) {
+    PRINT_ERROR("No search target to probe for");
+    return FALSE;
+  }
+
+  return string_buffer_init(&scheduler->message, 256);
+}
+
+BOOL ssdp_probe_scheduler_add_destination(ssdp_probe_scheduler_s *scheduler,
+    SOCKET sock, const char *group) {
+  ssdp_probe_destination_s *destination = NULL;
+
+  if (scheduler->destination_count == SSDP_PROBE_MAX_DESTINATIONS) {
+    PRINT_ERROR("Too many multicast groups to probe");
+    return FALSE;
+  }
+
+  destination = &scheduler->destinations[scheduler->destination_count];
+  memset(destination, 0, sizeof(ssdp_probe_destination_s));
+
+  if (!set_ip_and_port_in_sock_address(group, SSDP_PORT,
+      &destination->addr)) {
+    PRINT_ERROR("Erroneous multicast group '%s'", group);
+    return FALSE;
+  }
+
+  destination->sock = sock;
+  if (destination->addr.ss_family == AF_INET6) {
+    destination->addr_length = sizeof(struct sockaddr_in6);
+    snprintf(destination->host, sizeof(destination->host), "[%s]:%d", group,
+        SSDP_PORT);
+  }
+  else {
+    destination->addr_length = sizeof(struct sockaddr_in);
+    snprintf(destination->host, sizeof(destination->host), "%s:%d", group,
+        SSDP_PORT);
+  }
+  scheduler->destination_count++;
+
+  return TRUE;
+}
+
+BOOL ssdp_probe_scheduler_start(ssdp_probe_scheduler_s *scheduler) {
+  unsigned int rounds = scheduler->retransmits + 1;
+  long gap = scheduler->rate ? 1000000 / scheduler->rate : 0;
+  long due = 0;
+  unsigned int round;
+
+  free(scheduler->sends);
+  scheduler->next_send = 0;
+  scheduler->send_count = rounds * scheduler->target_count *
+      scheduler->destination_count;
+  scheduler->sends = (ssdp_probe_send_s *)malloc(sizeof(ssdp_probe_send_s) *
+      (scheduler->send_count ? scheduler->send_count : 1));
+  if (!scheduler->sends) {
+    PRINT_ERROR("Failed to allocate memory for the probe schedule");
+    scheduler->send_count = 0;
+    return FALSE;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &scheduler->start);
+  srandom((unsigned int)(scheduler->start.tv_nsec ^ getpid()));
+
+  /* A round sends every target to every group, the rounds are spread out
+     and jittered so losses are independent and devices that answer several
+     control points do not see synchronized bursts. The rate limit only ever
+     pushes sends later. */
+  for (round = 0; round < rounds; round++) {
+    long round_start = 0;
+    unsigned int t, d;
+
+    if (round > 0) {
+      round_start = (long)round * SSDP_PROBE_RETRANSMIT_INTERVAL * 1000 +
+          random() % (SSDP_PROBE_MAX_JITTER * 1000);
+    }
+
+    for (t = 0; t < scheduler->target_count; t++) {
+      for (d = 0; d < scheduler->destination_count; d++) {
+        ssdp_probe_send_s *send = &scheduler->sends[(round *
+            scheduler->target_count + t) * scheduler->destination_count + d];
+
+        if (round > 0 || t > 0 || d > 0) {
+          due += gap;
+        }
+        if (due < round_start) {
+          due = round_start;
+        }
+
+        send->target = (unsigned char)t;
+        send->destination = (unsigned char)d;
+        send->due = due;
+      }
+    }
+  }
+
+  return TRUE;
+}
+
+int ssdp_probe_scheduler_timeout(ssdp_probe_scheduler_s *scheduler) {
+  long left;
+
+  if (scheduler->next_send >= scheduler->send_count) {
+    return -1;
+  }
+
+  left = scheduler->sends[scheduler->next_send].due -
+      elapsed_us(&scheduler->start);
+
+  /* Round up, waking up early only means another poll */
+  return left > 0 ? (int)((left + 999) / 1000) : 0;
+}
+
+void ssdp_probe_scheduler_deadline(ssdp_probe_scheduler_s *scheduler,
+    struct timespec *deadline) {
+  long last_due = scheduler->send_count ?
+      scheduler->sends[scheduler->send_count - 1].due : 0;
+  long offset = last_due + ((long)scheduler->mx * 1000 +
+      SSDP_PROBE_DEADLINE_GRACE) * 1000;
+
+  /* Devices wait up to MX seconds before answering the last send */
+  deadline->tv_sec = scheduler->start.tv_sec + offset / 1000000;
+  deadline->tv_nsec = scheduler->start.tv_nsec + (offset % 1000000) * 1000;
+  if (deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+unsigned int ssdp_probe_scheduler_send(ssdp_probe_scheduler_s *scheduler) {
+  long now = elapsed_us(&scheduler->start);
+  unsigned int sent = 0;
+
+  while (scheduler->next_send < scheduler->send_count &&
+      scheduler->sends[scheduler->next_send].due <= now) {
+    ssdp_probe_send_s *send = &scheduler->sends[scheduler->next_send++];
+    ssdp_probe_target_s *target = &scheduler->targets[send->target];
+    ssdp_probe_destination_s *destination =
+        &scheduler->destinations[send->destination];
+    string_buffer_s *message = &scheduler->message;
+
+    string_buffer_reset(message);
+    if (!string_buffer_append_str(message, "M-SEARCH * HTTP/1.1\r\nHost:") ||
+        !string_buffer_append_str(message, destination->host) ||
+        !string_buffer_append_str(message, "\r\nST:") ||
+        !string_buffer_append_str(message, target->st) ||
+        !string_buffer_append_str(message,
+        "\r\nMan:\"ssdp:discover\"\r\nMX:") ||
+        !string_buffer_append_uint(message, scheduler->mx) ||
+        !string_buffer_append_str(message, "\r\n\r\n")) {
+      PRINT_ERROR("Failed to create the M-SEARCH message");
+      continue;
+    }
+
+    PRINT_DEBUG("sending M-SEARCH for '%s' to %s", target->st,
+        destination->host);
+    if (sendto(destination->sock, message->data, message->length, 0,
+        (struct sockaddr *)&destination->addr, destination->addr_length) < 0) {
+      PRINT_DEBUG("sendto(): Failed sending to %s: %s", destination->host,
+          strerror(errno));
+      continue;
+    }
+
+    target->sent++;
+    sent++;
+  }
+
+  return sent;
+}
+
+BOOL ssdp_probe_scheduler_account(ssdp_probe_scheduler_s *scheduler,
+    const ssdp_message_s *ssdp_message) {
+  ssdp_header_s *st_header = get_header(ssdp_message, SSDP_HEADER_ST);
+  ssdp_header_s *usn_header = get_header(ssdp_message, SSDP_HEADER_USN);
+  ssdp_probe_target_s *target = NULL;
+  const char *st = st_header ? st_header->contents : NULL;
+  unsigned int i;
+
+  /* Responses repeat the ST they answer, except for ssdp:all which is
+     answered with every type the device has */
+  for (i = 0; i < scheduler->target_count; i++) {
+    if (scheduler->targets[i].st == st) {
+      target = &scheduler->targets[i];
+      break;
+    }
+    if (!target && strcmp(scheduler->targets[i].st,
+        SSDP_PROBE_DEFAULT_TARGET) == 0) {
+      target = &scheduler->targets[i];
+    }
+  }
+
+  if (target) {
+    target->responses++;
+    if (target->first_response < 0) {
+      target->first_response = elapsed_us(&scheduler->start) / 1000;
+    }
+    if (add_seen(&scheduler->seen_devices, ssdp_message->ip, target->st)) {
+      target->devices++;
+    }
+  }
+  add_seen(&scheduler->seen_hosts, ssdp_message->ip, NULL);
+
+  return add_seen(&scheduler->seen_responses, ssdp_message->ip,
+      usn_header ? usn_header->contents : st);
+}
+
+void ssdp_probe_scheduler_print_stats(ssdp_probe_scheduler_s *scheduler,
+    FILE *stream) {
+  unsigned int i;
+
+  fprintf(stream, "%-48s %6s %10s %8s %10s\n", "Search target", "Sent",
+      "Responses", "Devices", "First (ms)");
+  for (i = 0; i < scheduler->target_count; i++) {
+    ssdp_probe_target_s *target = &scheduler->targets[i];
+
+    if (target->first_response < 0) {
+      fprintf(stream, "%-48s %6u %10u %8u %10s\n", target->st, target->sent,
+          target->responses, target->devices, "-");
+    }
+    else {
+      fprintf(stream, "%-48s %6u %10u %8u %10ld\n", target->st, target->sent,
+          target->responses, target->devices, target->first_response);
+    }
+  }
+}
+
+void ssdp_probe_scheduler_close(ssdp_probe_scheduler_s *scheduler) {
+  unsigned int i;
+
+  for (i = 0; i < scheduler->target_count; i++) {
+    string_intern_release(scheduler->targets[i].st);
+  }
+  free(scheduler->sends);
+  string_buffer_free(&scheduler->message);
+  free_seen(&scheduler->seen_responses);
+  free_seen(&scheduler->seen_devices);
+  free_seen(&scheduler->seen_hosts);
+  memset(scheduler, 0, sizeof(ssdp_probe_scheduler_s));
+}
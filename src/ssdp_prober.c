@@ -6,26 +6,37 @@
 
 #include <arpa/inet.h> /* inet_pton() */
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h> /* struct addrinfo */
 #include <netinet/in.h>
+#include <stdio.h> /* snprintf() */
 #include <stdlib.h>
 #include <string.h> /* memset() */
 #include <sys/socket.h> /* struct sockaddr_storage */
+#include <time.h>
 #include <unistd.h> /* close() */
 
 #include "common_definitions.h"
 #include "configuration.h"
+#include "event_loop.h"
 #include "log.h"
 #include "net_definitions.h"
 #include "net_utils.h"
 #include "socket_helpers.h"
+#include "ssdp_cache.h"
 #include "ssdp_cache_output_format.h"
 #include "ssdp_common.h"
+#include "ssdp_description_fetcher.h"
+#include "ssdp_event_stream.h"
 #include "ssdp_filter.h"
-#include "ssdp_listener.h"
 #include "ssdp_message.h"
+#include "ssdp_metrics.h"
+#include "ssdp_probe_scheduler.h"
 #include "ssdp_prober.h"
+#include "ssdp_scan_policy.h"
 #include "ssdp_static_defs.h"
+#include "ssdp_sweep.h"
+#include "string_buffer.h"
 
 /** A default SSDP probe (SEARCH) message. */
 #define PROBE_MSG \
@@ -36,34 +47,70 @@
   "MX:5\r\n\r\n"
 // For axis devices: "ST:urn:axis-com:service:BasicService:1\r\n"
 
+/** A probe socket watched by the event loop. */
+typedef struct ssdp_prober_socket_struct {
+  /** The scan the socket belongs to. */
+  struct ssdp_prober_scan_struct *scan;
+  /** The socket, the probes are sent and answered on it. */
+  SOCKET sock;
+} ssdp_prober_socket_s;
+
+/** The state shared by the event loop callbacks of a scan. */
+typedef struct ssdp_prober_scan_struct {
+  /** The global configuration. */
+  configuration_s *conf;
+  /** The filters to apply. */
+  filters_factory_s *filters_factory;
+  /** The scheduler the responses are accounted with. */
+  ssdp_probe_scheduler_s *scheduler;
+  /** The cache to deduplicate devices with, NULL to output everything. */
+  ssdp_cache_s **ssdp_cache;
+  /** The stream to emit device events to, NULL to print the responses. */
+  ssdp_event_stream_s *event_stream;
+  /** Decides when the scan has ended. */
+  ssdp_scan_policy_s *policy;
+  /** The description fetcher, NULL unless descriptions are fetched. */
+  ssdp_fetcher_s *fetcher;
+  /** The IPv4 and IPv6 probe sockets. */
+  ssdp_prober_socket_s sockets[2];
+  /** The number of probe sockets. */
+  unsigned int socket_count;
+  /** Reused for every received packet. */
+  ssdp_recv_node_s recv_node;
+} ssdp_prober_scan_s;
+
 const char *ssdp_probe_message_create(void) {
   return PROBE_MSG;
 }
 
-int ssdp_prober_init(ssdp_prober_s *prober, configuration_s *conf) {
-  PRINT_DEBUG("ssdp_prober_init()");
-  if (!prober) {
-    PRINT_ERROR("Prober is empty");
-  }
-
-  memset(prober, 0, sizeof *prober);
-
-  if (conf->forward_address) {
-    if (parse_address(conf->forward_address, &prober->forwarder)) {
-      PRINT_WARN("Errnoeous forward address");
-      return 1;
-    }
+/**
+ * Create a socket for sending probes to the multicast groups of one IP
+ * version, the responses are received on the same socket.
+ *
+ * @param conf The global configuration.
+ * @param is_ipv6 Create an IPv6 socket instead of an IPv4 one.
+ *
+ * @return The socket or SOCKET_ERROR on failure.
+ */
+static SOCKET create_probe_socket(configuration_s *conf, BOOL is_ipv6) {
+  char if_ip[IPv6_STR_MAX_SIZE];
+  struct in6_addr ip6;
+  BOOL if_ip_is_ipv6 = inet_pton(AF_INET6, conf->ip, &ip6) > 0;
+
+  /* An interface IP only applies to the socket of its own family */
+  memset(if_ip, '\0', IPv6_STR_MAX_SIZE);
+  if (if_ip_is_ipv6 == is_ipv6) {
+    snprintf(if_ip, sizeof(if_ip), "%s", conf->ip);
   }
 
-  /* init sending socket */
   socket_conf_s sock_conf = {
-    conf->use_ipv6,  // BOOL is_ipv6
+    is_ipv6,        // BOOL is_ipv6
     TRUE,           // BOOL is_udp
     TRUE,           // BOOL is_multicast
     conf->interface, // char *interface
-    conf->ip,        // char *IP
+    if_ip,          // char *IP
     NULL,           // struct sockaddr_storage *sa
-    (conf->use_ipv6 ? SSDP_ADDR6_LL : SSDP_ADDR),  // const char *ip
+    (is_ipv6 ? SSDP_ADDR6_LL : SSDP_ADDR),  // const char *ip
     SSDP_PORT,      // int port
     FALSE,          // BOOL is_server
     1,              // int queue_len
@@ -74,10 +121,42 @@ int ssdp_prober_init(ssdp_prober_s *prober, configuration_s *conf) {
     0               // Send timeout
   };
 
-  if ((prober->sock = setup_socket(&sock_conf)) == SOCKET_ERROR) {
+  return setup_socket(&sock_conf);
+}
+
+int ssdp_prober_init(ssdp_prober_s *prober, configuration_s *conf) {
+  PRINT_DEBUG("ssdp_prober_init()");
+  if (!prober) {
+    PRINT_ERROR("Prober is empty");
+  }
+
+  memset(prober, 0, sizeof *prober);
+  prober->sock = SOCKET_ERROR;
+  prober->sock6 = SOCKET_ERROR;
+
+  if (conf->forward_address) {
+    if (parse_address(conf->forward_address, &prober->forwarder)) {
+      PRINT_WARN("Errnoeous forward address");
+      return 1;
+    }
+  }
+
+  /* init the sending sockets, IPv6 probes the IPv4 group as well */
+  prober->sock = create_probe_socket(conf, FALSE);
+  if (conf->use_ipv6) {
+    prober->sock6 = create_probe_socket(conf, TRUE);
+  }
+
+  if (prober->sock == SOCKET_ERROR && prober->sock6 == SOCKET_ERROR) {
     PRINT_DEBUG("Could not create socket");
     return errno;
   }
+  if (prober->sock == SOCKET_ERROR || (conf->use_ipv6 &&
+      prober->sock6 == SOCKET_ERROR)) {
+    PRINT_WARN("Could not create an IPv%d socket, probing over IPv%d only\n",
+        prober->sock == SOCKET_ERROR ? 4 : 6,
+        prober->sock == SOCKET_ERROR ? 6 : 4);
+  }
   PRINT_DEBUG("ssdp_prober has been initialized");
 
   return 0;
@@ -90,212 +169,493 @@ void ssdp_prober_close(ssdp_prober_s *prober) {
 
   if (prober->sock > 0)
     close(prober->sock);
+  if (prober->sock6 > 0)
+    close(prober->sock6);
+  prober->sock = SOCKET_ERROR;
+  prober->sock6 = SOCKET_ERROR;
 }
 
-int ssdp_prober_start(ssdp_prober_s *prober, configuration_s *conf) {
-  PRINT_DEBUG("ssdp_prober_start()");
+/**
+ * Check if a response passes the filters.
+ *
+ * @param filters_factory The filters, NULL lets everything pass.
+ * @param ssdp_message The response to check.
+ *
+ * @return TRUE if the response should be used, FALSE otherwise.
+ */
+static BOOL filter_response(filters_factory_s *filters_factory,
+    ssdp_message_s *ssdp_message) {
+  ssdp_header_s *ssdp_headers = NULL;
+  int fc;
 
-  /* The structure contining all the filters information */
-  filters_factory_s *filters_factory = NULL;
+  if (filters_factory == NULL) {
+    return TRUE;
+  }
 
-  /* Parse the filters */
-  PRINT_DEBUG("parse_filters()");
-  parse_filters(conf->filter, &filters_factory, TRUE & (~conf->quiet_mode));
+  // TODO: Make it recognize both AND and OR (search for ; inside a ,)!!!
+  // TODO: add "request" string filtering
+  for (fc = 0; fc < filters_factory->filters_count; fc++) {
+    if ((strcmp(filters_factory->filters[fc].header, "ip") == 0) &&
+        strstr(ssdp_message->ip, filters_factory->filters[fc].value) == NULL) {
+      return FALSE;
+    }
 
-  /* Create a SSDP probe message */
-  const char *request = ssdp_probe_message_create();
-
-  BOOL drop_message;
-
-  /* Client (mcast group) address */
-  PRINT_DEBUG("creating multicast address");
-  //struct addrinfo *addri;
-  //struct addrinfo hint;
-  //memset(&hint, 0, sizeof(hint));
-  //hint.ai_family = (conf->use_ipv6 ? AF_INET6 : AF_INET);
-  //hint.ai_socktype = SOCK_DGRAM;
-  //hint.ai_protocol = IPPROTO_UDP;
-  //hint.ai_canonname = NULL;
-  //hint.ai_addr = NULL;
-  //hint.ai_next = NULL;
-  //char *port_str = (char *)malloc(sizeof(char) * 6);
-  //memset(port_str, '\0', 6);
-  //sprintf(port_str, "%d", SSDP_PORT);
-
-  //int err = 0;
-
-  //if ((err = getaddrinfo((conf->use_ipv6 ? SSDP_ADDR6_LL : SSDP_ADDR),
-  //    port_str, &hint, &addri)) != 0) {
-  //  PRINT_ERROR("getaddrinfo(): %s\n", gai_strerror(err));
-  //  free(port_str);
-  //  return err;
-  //}
-  //free(port_str);
-
-  /*****************
-   This is the temp solution until the
-   commented-out sendto() code below (and above) is fixed */
-  struct sockaddr_in sa;
-  sa.sin_family = AF_INET;
-  sa.sin_port = htons(SSDP_PORT);
-  inet_pton(AF_INET, SSDP_ADDR, &sa.sin_addr);
-  /*****************/
-
-  /* Send the UPnP request */
-  PRINT_DEBUG("sending request");
-  int sent_bytes;
-  //sent_bytes = sendto(prober->sock, request, strlen(request), 0,
-  //    (struct sockaddr *)&addri->ai_addr, addri->ai_addrlen);
-  sent_bytes = sendto(prober->sock, request, strlen(request), 0,
-      (struct sockaddr *)&sa, sizeof(sa));
-
-  if (sent_bytes < 0) {
-    PRINT_DEBUG("sendto(): Failed sending any data");
-    return errno;
+    for (ssdp_headers = ssdp_message->headers; ssdp_headers;
+        ssdp_headers = ssdp_headers->next) {
+      if ((strcmp(get_header_string(ssdp_headers->type, ssdp_headers),
+          filters_factory->filters[fc].header) == 0) &&
+          strstr(ssdp_headers->contents,
+          filters_factory->filters[fc].value) == NULL) {
+        return FALSE;
+      }
+    }
+  }
+
+  return TRUE;
+}
+
+/**
+ * Print a response in the configured output format.
+ *
+ * @param conf The global configuration.
+ * @param ssdp_message The response to print.
+ */
+static void print_response(configuration_s *conf,
+    ssdp_message_s *ssdp_message) {
+  if (conf->json_output) {
+    string_buffer_s json_string;
+    if (string_buffer_init(&json_string, XML_BUFFER_SIZE) &&
+        to_json(ssdp_message, TRUE, &json_string) > 0) {
+      fwrite(json_string.data, 1, json_string.length, stdout);
+    }
+    string_buffer_free(&json_string);
+  } else if (conf->xml_output) {
+    string_buffer_s xml_string;
+    if (string_buffer_init(&xml_string, XML_BUFFER_SIZE) &&
+        to_xml(ssdp_message, TRUE, &xml_string) > 0) {
+      printf("%s\n", xml_string.data);
+    }
+    string_buffer_free(&xml_string);
+  } else if (conf->oneline_output) {
+    char *oneline_string = to_oneline(ssdp_message, conf->monochrome);
+    if (oneline_string) {
+      printf("%s\n", oneline_string);
+      free(oneline_string);
+    }
+  } else {
+    ssdp_header_s *ssdp_headers = ssdp_message->headers;
+    int hc = 0;
+
+    printf("\n\n\n----------BEGIN NOTIFICATION------------\n");
+    printf("Time received: %s\n", ssdp_message->datetime);
+    printf("Origin-MAC: %s\n", (ssdp_message->mac != NULL ?
+        ssdp_message->mac : "(Could not be determined)"));
+    printf("Origin-IP: %s\nMessage length: %d Bytes\n", ssdp_message->ip,
+        ssdp_message->message_length);
+    printf("Request: %s\nProtocol: %s\n", ssdp_message->request,
+        ssdp_message->protocol);
+
+    while (ssdp_headers) {
+      printf("Header[%d][type:%d;%s]: %s\n", hc, ssdp_headers->type,
+          get_header_string(ssdp_headers->type, ssdp_headers),
+          ssdp_headers->contents);
+      ssdp_headers = ssdp_headers->next;
+      hc++;
+    }
+    printf("-----------END NOTIFICATION-------------\n");
   }
+  /* TODO: Send the message back to -a (or not support that for probing?)*/
+}
+
+/**
+ * Get the number of milliseconds until a point in time.
+ *
+ * @param until The point in time.
+ *
+ * @return The milliseconds left, negative if it has passed.
+ */
+static long ms_until(const struct timespec *until) {
+  struct timespec now;
 
+  clock_gettime(CLOCK_MONOTONIC, &now);
 
-  size_t sento_addr_len = sizeof(struct sockaddr_storage);
-  struct sockaddr_storage *sendto_addr = malloc(sento_addr_len);
-  memset(sendto_addr, 0, sento_addr_len);
-  int response_port = 0;
+  return (until->tv_sec - now.tv_sec) * 1000 +
+      (until->tv_nsec - now.tv_nsec) / 1000000;
+}
 
-  if (getsockname(prober->sock, (struct sockaddr *)sendto_addr,
-      (socklen_t *)&sento_addr_len) < 0) {
-    PRINT_ERROR("Could not get sendto() port, going to miss the replies");
+/**
+ * Output a device, as an added device event or printed.
+ *
+ * @param scan The scan the device was found by.
+ * @param ssdp_message The response of the device.
+ * @param changes The SSDP_CACHE_* flags of what changed.
+ */
+static void output_response(ssdp_prober_scan_s *scan,
+    ssdp_message_s *ssdp_message, unsigned int changes) {
+  if (scan->event_stream) {
+    ssdp_event_stream_emit(scan->event_stream, (changes & SSDP_CACHE_ADDED) ?
+        SSDP_EVENT_ADD : SSDP_EVENT_UPDATE, ssdp_message);
+  } else if (changes & SSDP_CACHE_ADDED) {
+    print_response(scan->conf, ssdp_message);
   }
-  else {
-    response_port = get_port_from_sock_address(sendto_addr);
-    PRINT_DEBUG("sendto() port is %d", response_port);
+
+  if (!scan->ssdp_cache) {
+    free_ssdp_message(&ssdp_message);
   }
-  free(sendto_addr);
-  close(prober->sock);
-  PRINT_DEBUG("sent %d bytes", sent_bytes);
-  //freeaddrinfo(addri);
-  drop_message = FALSE;
+}
 
-  /* init listening socket */
-  PRINT_DEBUG("setup_socket() listening");
+/**
+ * Output a device once its description has been fetched (or failed to).
+ *
+ * @param data The scan.
+ * @param ssdp_message The response of the device.
+ */
+static void on_description_fetched(void *data, ssdp_message_s *ssdp_message) {
+  /* Only new devices are fetched for */
+  output_response((ssdp_prober_scan_s *)data, ssdp_message, SSDP_CACHE_ADDED);
+}
 
-  // TODO: fix this listener, its acting weird
-  ssdp_listener_s response_listener;
-  ssdp_active_listener_init(&response_listener, conf, response_port);
+/**
+ * Filter, deduplicate and output a response. The output of new devices is
+ * deferred until their description is fetched when that is enabled.
+ *
+ * @param scan The scan the response belongs to.
+ * @param ssdp_message The response, it is freed or owned by the cache or
+ *        the fetcher when the function returns.
+ */
+static void process_response(ssdp_prober_scan_s *scan,
+    ssdp_message_s *ssdp_message) {
+  unsigned int changes = SSDP_CACHE_ADDED;
 
-  ssdp_message_s *ssdp_message;
-  ssdp_recv_node_s recv_node;
+  if (!filter_response(scan->filters_factory, ssdp_message)) {
+    ssdp_metrics_inc(SSDP_COUNTER_FILTER_DROPS);
+    free_ssdp_message(&ssdp_message);
+    return;
+  }
 
-  do {
-    memset(&recv_node, 0, sizeof recv_node);
+  /* Devices answer once per service, only use the first answer */
+  if (scan->ssdp_cache) {
+    if (!add_ssdp_message_to_cache(scan->ssdp_cache, &ssdp_message,
+        &changes)) {
+      PRINT_ERROR("Failed adding SSDP message to SSDP cache, skipping");
+      free_ssdp_message(&ssdp_message);
+      return;
+    }
+    /* The message is owned by the cache now, a device whose description
+       is still being fetched is output with its latest state when done */
+    if (!changes || (scan->fetcher &&
+        ssdp_fetcher_is_fetching(scan->fetcher, ssdp_message))) {
+      return;
+    }
+  }
 
-    /* Wait for an answer */
-    PRINT_DEBUG("Waiting for a response");
-    ssdp_listener_read(&response_listener, &recv_node);
-    PRINT_DEBUG("Recived %d bytes%s",
-        (recv_node.recv_bytes < 0 ? 0 : recv_node.recv_bytes),
-        (recv_node.recv_bytes < 0 ? " (wait time limit reached)" : ""));
+  if ((changes & SSDP_CACHE_ADDED) && scan->fetcher &&
+      ssdp_fetcher_fetch(scan->fetcher, ssdp_message)) {
+    return;
+  }
 
-    if(recv_node.recv_bytes < 0) {
-      continue;
-    }
+  output_response(scan, ssdp_message, changes);
+}
 
-    ssdp_message = NULL;
+/**
+ * Read and process all the responses queued on a probe socket.
+ *
+ * @param data The probe socket.
+ * @param events The EVENT_LOOP_* flags that are set.
+ */
+static void on_probe_readable(void *data, unsigned int events) {
+  ssdp_prober_socket_s *probe_socket = (ssdp_prober_socket_s *)data;
+  ssdp_prober_scan_s *scan = probe_socket->scan;
+  ssdp_recv_node_s *recv_node = &scan->recv_node;
+  ssdp_message_s *ssdp_message = NULL;
+  unsigned int devices;
+  BOOL first;
+
+  if (!(events & EVENT_LOOP_READ)) {
+    return;
+  }
+
+  /* Read everything that is queued before waiting again */
+  while (TRUE) {
+    ssdp_recv_node_read(probe_socket->sock, recv_node);
+    PRINT_DEBUG("Recived %d bytes",
+        (recv_node->recv_bytes < 0 ? 0 : recv_node->recv_bytes));
+    if (recv_node->recv_bytes <= 0) {
+      break;
+    }
+    ssdp_metrics_inc(SSDP_COUNTER_DATAGRAMS);
+    ssdp_metrics_add(SSDP_COUNTER_BYTES, recv_node->recv_bytes);
 
     /* Initialize and build ssdp_message */
-    if(!init_ssdp_message(&ssdp_message)) {
+    ssdp_message = NULL;
+    if (!init_ssdp_message(&ssdp_message)) {
       PRINT_ERROR("Failed to initialize SSDP message holder structure");
       continue;
     }
 
-    if (!build_ssdp_message(ssdp_message, recv_node.from_ip,
-        recv_node.from_mac, recv_node.recv_bytes, recv_node.recv_data)) {
+    if (!build_ssdp_message(ssdp_message, recv_node->from_ip,
+        recv_node->from_mac, recv_node->recv_bytes, recv_node->recv_data)) {
+      ssdp_metrics_inc(SSDP_COUNTER_PARSE_FAILURES);
+      free_ssdp_message(&ssdp_message);
       continue;
     }
 
-    // TODO: Make it recognize both AND and OR (search for ; inside a ,)!!!
-    // TODO: add "request" string filtering
-    /* Check if notification should be used (to print and possibly send to the given destination) */
-    ssdp_header_s *ssdp_headers = ssdp_message->headers;
-    if (filters_factory != NULL) {
-      int fc;
-      for (fc = 0; fc < filters_factory->filters_count; fc++) {
-        if ((strcmp(filters_factory->filters[fc].header, "ip") == 0) &&
-            strstr(ssdp_message->ip,
-            filters_factory->filters[fc].value) == NULL) {
-          drop_message = TRUE;
-          break;
+    /* The results are final once the scan has ended */
+    if (scan->policy->reason != SSDP_SCAN_END_NONE) {
+      ssdp_scan_policy_response(scan->policy, FALSE);
+      free_ssdp_message(&ssdp_message);
+      continue;
+    }
+
+    /* Devices answer every copy of a probe, only use the first answer */
+    devices = scan->scheduler->seen_hosts.count;
+    first = ssdp_probe_scheduler_account(scan->scheduler, ssdp_message);
+    ssdp_scan_policy_response(scan->policy,
+        scan->scheduler->seen_hosts.count > devices);
+    if (!first) {
+      free_ssdp_message(&ssdp_message);
+      continue;
+    }
+
+    process_response(scan, ssdp_message);
+  }
+}
+
+int ssdp_prober_start(ssdp_prober_s *prober, configuration_s *conf) {
+  PRINT_DEBUG("ssdp_prober_start()");
+
+  /* The structure contining all the filters information */
+  filters_factory_s *filters_factory = NULL;
+
+  /* Parse the filters */
+  PRINT_DEBUG("parse_filters()");
+  parse_filters(conf->filter, &filters_factory, TRUE & (~conf->quiet_mode));
+
+  /* Schedule the probes for all the search targets and groups */
+  ssdp_probe_scheduler_s scheduler;
+  if (!ssdp_probe_scheduler_init(&scheduler, conf->search_targets,
+      conf->probe_retransmits, conf->probe_rate, conf->upnp_timeout)) {
+    free_ssdp_filters_factory(filters_factory);
+    return 1;
+  }
+
+  /* A sweep replaces the multicast probes with unicast ones */
+  ssdp_sweep_s sweep;
+  BOOL sweeping = conf->sweep_ranges != NULL;
+  if (sweeping) {
+    if (prober->sock == SOCKET_ERROR ||
+        !ssdp_sweep_init(&sweep, conf->sweep_ranges, conf->sweep_rate)) {
+      PRINT_ERROR("Could not start the sweep");
+      ssdp_probe_scheduler_close(&scheduler);
+      free_ssdp_filters_factory(filters_factory);
+      return 1;
+    }
+  }
+  else {
+    if (prober->sock != SOCKET_ERROR) {
+      ssdp_probe_scheduler_add_destination(&scheduler, prober->sock,
+          SSDP_ADDR);
+    }
+    if (prober->sock6 != SOCKET_ERROR) {
+      ssdp_probe_scheduler_add_destination(&scheduler, prober->sock6,
+          SSDP_ADDR6_LL);
+      ssdp_probe_scheduler_add_destination(&scheduler, prober->sock6,
+          SSDP_ADDR6_SL);
+    }
+  }
+
+  /* Device events and sweep results are deduplicated through a cache of
+     the responders */
+  ssdp_cache_s *ssdp_cache = NULL;
+  ssdp_event_stream_s event_stream;
+  BOOL stream_events = conf->event_stream_output;
+  BOOL started = TRUE;
+
+  ssdp_scan_policy_s policy;
+  ssdp_prober_scan_s scan;
+  memset(&scan, 0, sizeof(scan));
+  scan.conf = conf;
+  scan.policy = &policy;
+  scan.filters_factory = filters_factory;
+  scan.scheduler = &scheduler;
+  scan.ssdp_cache = stream_events || sweeping ? &ssdp_cache : NULL;
+
+  /* Descriptions are fetched while more responses are received */
+  event_loop_s loop;
+  ssdp_fetcher_s fetcher;
+  if (!event_loop_init(&loop)) {
+    started = FALSE;
+  }
+  ssdp_fetcher_init(&fetcher, &loop, SSDP_FETCHER_MAX_ACTIVE,
+      SSDP_FETCHER_TIMEOUT, on_description_fetched, &scan);
+  if (conf->fetch_info) {
+    scan.fetcher = &fetcher;
+  }
+
+  /* Responses are unicast to the port the probes were sent from, the
+     sockets never block so a full buffer cannot stall the sends */
+  if (prober->sock != SOCKET_ERROR) {
+    scan.sockets[scan.socket_count++].sock = prober->sock;
+  }
+  if (prober->sock6 != SOCKET_ERROR) {
+    scan.sockets[scan.socket_count++].sock = prober->sock6;
+  }
+  unsigned int i;
+  for (i = 0; started && i < scan.socket_count; i++) {
+    SOCKET sock = scan.sockets[i].sock;
+    scan.sockets[i].scan = &scan;
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    if (!event_loop_add(&loop, sock, EVENT_LOOP_READ, on_probe_readable,
+        &scan.sockets[i])) {
+      started = FALSE;
+    }
+  }
+
+  if (started && stream_events && !ssdp_event_stream_init(&event_stream,
+      STDOUT_FILENO, conf->event_flush_interval)) {
+    stream_events = FALSE;
+    started = FALSE;
+  }
+  else if (started && !ssdp_probe_scheduler_start(&scheduler)) {
+    started = FALSE;
+  }
+  if (stream_events) {
+    scan.event_stream = &event_stream;
+  }
+
+  /* The responses are received until the MX delay after the last probe
+     has passed, a sweep waits a moment after its last send */
+  struct timespec deadline;
+  BOOL receiving = started;
+  if (started) {
+    ssdp_probe_scheduler_deadline(&scheduler, &deadline);
+  }
+  ssdp_scan_policy_init(&policy, conf->adaptive_scan, conf->expected_devices,
+      started ? ms_until(&deadline) : 0);
+
+  while (started) {
+    int timeout = ssdp_probe_scheduler_timeout(&scheduler);
+    BOOL sending = timeout >= 0;
+
+    if (sweeping) {
+      int sweep_timeout = ssdp_sweep_timeout(&sweep);
+      if (sweep_timeout >= 0) {
+        sending = TRUE;
+        if (timeout < 0 || sweep_timeout < timeout) {
+          timeout = sweep_timeout;
         }
+      }
+    }
 
-        while (ssdp_headers) {
-          if ((strcmp(get_header_string(ssdp_headers->type, ssdp_headers),
-              filters_factory->filters[fc].header) == 0) &&
-              strstr(ssdp_headers->contents,
-              filters_factory->filters[fc].value) == NULL) {
-            drop_message = TRUE;
-            break;
-          }
-          ssdp_headers = ssdp_headers->next;
+    /* Stop as soon as the expected devices have answered, or when the
+       answers stop arriving after the last probe */
+    if (receiving) {
+      long left = ms_until(&deadline);
+      ssdp_scan_end_e reason = SSDP_SCAN_END_NONE;
+
+      if (sweeping && !sending) {
+        /* The unicast answers come right away, there is no MX delay */
+        long sweep_left = SSDP_SWEEP_ANSWER_WAIT + ms_until(&sweep.end);
+        if (sweep_left > left) {
+          left = sweep_left;
         }
-        ssdp_headers = ssdp_message->headers;
+      }
 
-        if (drop_message) {
-          break;;
+      if (ssdp_scan_policy_has_expected(&policy,
+          scheduler.seen_hosts.count)) {
+        reason = SSDP_SCAN_END_EXPECTED;
+      }
+      else if (!sending) {
+        int quiet_timeout = ssdp_scan_policy_timeout(&policy);
+        if (left <= 0) {
+          reason = SSDP_SCAN_END_DEADLINE;
+        }
+        else if (quiet_timeout == 0) {
+          reason = SSDP_SCAN_END_QUIET;
+        }
+        else {
+          timeout = quiet_timeout > 0 && quiet_timeout < left ?
+              quiet_timeout : (int)left;
         }
       }
+
+      if (reason != SSDP_SCAN_END_NONE) {
+        PRINT_DEBUG("The scan has ended (%d)", reason);
+        ssdp_scan_policy_end(&policy, reason, left);
+        receiving = FALSE;
+      }
     }
 
-    if (filters_factory == NULL || !drop_message) {
+    /* Let the descriptions that are still being fetched finish */
+    if (!receiving) {
+      if (ssdp_fetcher_pending(&fetcher) == 0) {
+        break;
+      }
+      timeout = ssdp_fetcher_timeout(&fetcher);
+    }
+    else {
+      int fetch_timeout = ssdp_fetcher_timeout(&fetcher);
+      if (fetch_timeout >= 0 && fetch_timeout < timeout) {
+        timeout = fetch_timeout;
+      }
+    }
 
-      /* Fetch custom fields */
-      if (conf->fetch_info && !fetch_custom_fields(conf, ssdp_message)) {
-        PRINT_DEBUG("Could not fetch custom fields");
+    if (stream_events) {
+      int flush_timeout = ssdp_event_stream_timeout(&event_stream);
+      if (flush_timeout >= 0 && (timeout < 0 || flush_timeout < timeout)) {
+        timeout = flush_timeout;
       }
+    }
 
-      /* Print the message */
-      if (conf->xml_output) {
-        char *xml_string = malloc(sizeof(char) * XML_BUFFER_SIZE);
-        to_xml(ssdp_message, TRUE, xml_string, XML_BUFFER_SIZE);
-        printf("%s\n", xml_string);
-        free(xml_string);
-      } else if (conf->oneline_output) {
-        char *oneline_string = to_oneline(ssdp_message, conf->monochrome);
-        if (oneline_string) {
-          printf("%s\n", oneline_string);
-          free(oneline_string);
-        }
-      } else {
-        printf("\n\n\n----------BEGIN NOTIFICATION------------\n");
-        printf("Time received: %s\n", ssdp_message->datetime);
-        printf("Origin-MAC: %s\n", (ssdp_message->mac != NULL ?
-            ssdp_message->mac : "(Could not be determined)"));
-        printf("Origin-IP: %s\nMessage length: %d Bytes\n", ssdp_message->ip,
-            ssdp_message->message_length);
-        printf("Request: %s\nProtocol: %s\n", ssdp_message->request,
-            ssdp_message->protocol);
-
-        int hc = 0;
-        while (ssdp_headers) {
-          printf("Header[%d][type:%d;%s]: %s\n", hc, ssdp_headers->type,
-              get_header_string(ssdp_headers->type, ssdp_headers),
-              ssdp_headers->contents);
-          ssdp_headers = ssdp_headers->next;
-          hc++;
-        }
-        ssdp_headers = NULL;
-        printf("-----------END NOTIFICATION-------------\n");
+    /* Wait for an answer, a fetch or the next probe */
+    PRINT_DEBUG("Waiting for a response");
+    if (event_loop_wait(&loop, timeout) < 0) {
+      PRINT_ERROR("epoll_wait(): %s", strerror(errno));
+      break;
+    }
+
+    if (receiving) {
+      ssdp_probe_scheduler_send(&scheduler);
+      if (sweeping) {
+        ssdp_sweep_send(&sweep, prober->sock, scheduler.targets,
+            scheduler.target_count);
       }
-      /* TODO: Send the message back to -a (or not support that for probing?)*/
+    }
 
+    ssdp_fetcher_expire(&fetcher);
+
+    if (stream_events && ssdp_event_stream_timeout(&event_stream) == 0) {
+      ssdp_event_stream_flush(&event_stream);
     }
+  }
 
-    if (ssdp_message)
-      free_ssdp_message(&ssdp_message);
-  } while(recv_node.recv_bytes > 0);
+  /* Count the responses that are still queued as late */
+  for (i = 0; started && i < scan.socket_count; i++) {
+    on_probe_readable(&scan.sockets[i], EVENT_LOOP_READ);
+  }
+
+  /* Output the devices whose fetches were cut short */
+  ssdp_fetcher_close(&fetcher);
+  event_loop_close(&loop);
 
-  //TODO: ssdp_listener_close(&response_listener) ?
+  if (stream_events) {
+    ssdp_event_stream_close(&event_stream);
+  }
+  if (started && !conf->quiet_mode) {
+    ssdp_probe_scheduler_print_stats(&scheduler, stderr);
+    if (sweeping) {
+      ssdp_sweep_print_stats(&sweep, stderr);
+    }
+    ssdp_scan_policy_print_stats(&policy, stderr);
+  }
+  if (sweeping) {
+    ssdp_sweep_close(&sweep);
+  }
+  ssdp_probe_scheduler_close(&scheduler);
+  free_ssdp_cache(&ssdp_cache);
   free_ssdp_filters_factory(filters_factory);
 
   PRINT_DEBUG("scan_for_upnp_devices end");
 
-  return 0;
+  return started ? 0 : 1;
 }
-
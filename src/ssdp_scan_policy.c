@@ -0,0 +1,139 @@
+/** \file ssdp_scan_policy.c
+ * Decides when an active scan has seen all the responses it will get.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "common_definitions.h"
+#include "ssdp_scan_policy.h"
+
+/** The weight of a new gap in the running mean. */
+#define SSDP_SCAN_POLICY_MEAN_WEIGHT 0.125
+/** The weight of a new gap in the running deviation. */
+#define SSDP_SCAN_POLICY_DEVIATION_WEIGHT 0.25
+
+/**
+ * Get the number of milliseconds since a point in time.
+ *
+ * @param since The point in time.
+ *
+ * @return The elapsed milliseconds.
+ */
+static double elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (double)(now.tv_sec - since->tv_sec) * 1000.0 +
+      (double)(now.tv_nsec - since->tv_nsec) / 1000000.0;
+}
+
+void ssdp_scan_policy_init(ssdp_scan_policy_s *policy, BOOL adaptive,
+    unsigned int expected, long window) {
+  memset(policy, 0, sizeof(ssdp_scan_policy_s));
+  policy->adaptive = adaptive;
+  policy->expected = expected;
+  policy->window = window;
+  clock_gettime(CLOCK_MONOTONIC, &policy->start);
+  policy->last_response = policy->start;
+}
+
+void ssdp_scan_policy_response(ssdp_scan_policy_s *policy,
+    BOOL new_device) {
+  double gap;
+
+  if (policy->reason != SSDP_SCAN_END_NONE) {
+    policy->late++;
+    return;
+  }
+  policy->responses++;
+  if (!new_device) {
+    return;
+  }
+
+  /* The gap before the first device is the network and device delay,
+     not the spacing of the answers. The estimate is the one TCP uses for
+     its retransmission timeout (RFC 6298). */
+  if (policy->devices++ > 0) {
+    gap = elapsed_ms(&policy->last_response);
+    if (policy->gaps++ == 0) {
+      policy->gap_mean = gap;
+      policy->gap_deviation = gap / 2;
+    }
+    else {
+      policy->gap_deviation += SSDP_SCAN_POLICY_DEVIATION_WEIGHT *
+          ((gap > policy->gap_mean ? gap - policy->gap_mean :
+          policy->gap_mean - gap) - policy->gap_deviation);
+      policy->gap_mean += SSDP_SCAN_POLICY_MEAN_WEIGHT *
+          (gap - policy->gap_mean);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &policy->last_response);
+}
+
+int ssdp_scan_policy_timeout(ssdp_scan_policy_s *policy) {
+  double quiet;
+  double left;
+  double earliest;
+
+  if (!policy->adaptive || policy->gaps < SSDP_SCAN_POLICY_MIN_GAPS) {
+    return -1;
+  }
+
+  quiet = policy->gap_mean + SSDP_SCAN_POLICY_QUIET_DEVIATIONS *
+      policy->gap_deviation;
+  if (quiet < SSDP_SCAN_POLICY_MIN_QUIET) {
+    quiet = SSDP_SCAN_POLICY_MIN_QUIET;
+  }
+  left = quiet - elapsed_ms(&policy->last_response);
+
+  /* A silence early in the window says little, the rest of the devices
+     may simply have picked later answer times */
+  earliest = (double)policy->window * SSDP_SCAN_POLICY_MIN_WINDOW / 100 -
+      elapsed_ms(&policy->start);
+  if (earliest > left) {
+    left = earliest;
+  }
+
+  return left > 0 ? (int)left + 1 : 0;
+}
+
+BOOL ssdp_scan_policy_has_expected(ssdp_scan_policy_s *policy,
+    unsigned int devices) {
+  return policy->expected > 0 && devices >= policy->expected;
+}
+
+void ssdp_scan_policy_end(ssdp_scan_policy_s *policy, ssdp_scan_end_e reason,
+    long deadline) {
+  if (policy->reason != SSDP_SCAN_END_NONE) {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &policy->end);
+  policy->reason = reason;
+  policy->deadline = (long)elapsed_ms(&policy->start) + deadline;
+}
+
+void ssdp_scan_policy_print_stats(ssdp_scan_policy_s *policy, FILE *stream) {
+  long took = (long)(elapsed_ms(&policy->start) - elapsed_ms(&policy->end));
+
+  switch (policy->reason) {
+  case SSDP_SCAN_END_QUIET:
+    fprintf(stream, "Scan took %ld ms, the responses stopped (the MX "
+        "deadline was at %ld ms)\n", took, policy->deadline);
+    break;
+  case SSDP_SCAN_END_EXPECTED:
+    fprintf(stream, "Scan took %ld ms, all %u expected devices answered "
+        "(the MX deadline was at %ld ms)\n", took, policy->expected,
+        policy->deadline);
+    break;
+  default:
+    fprintf(stream, "Scan took %ld ms, until the MX deadline\n", took);
+    break;
+  }
+  fprintf(stream, "%lu responses from %lu devices, %lu after the scan "
+      "ended\n", policy->responses, policy->devices, policy->late);
+}
@@ -0,0 +1,813 @@
+/** \file ssdp_server.c
+ * Serve the device table to clients over HTTP (-S).
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h> /* close() */
+
+#include "common_definitions.h"
+#include "configuration.h"
+#include "event_loop.h"
+#include "log.h"
+#include "socket_helpers.h"
+#include "ssdp_cache.h"
+#include "ssdp_cache_binary_format.h"
+#include "ssdp_cache_output_format.h"
+#include "ssdp_filter.h"
+#include "ssdp_message.h"
+#include "ssdp_server.h"
+#include "ssdp_snapshot.h"
+#include "string_buffer.h"
+
+/** The formats a response body can be in. */
+typedef enum ssdp_server_format_enum {
+  SSDP_SERVER_FORMAT_XML,
+  SSDP_SERVER_FORMAT_JSON,
+  SSDP_SERVER_FORMAT_BINARY
+} ssdp_server_format_e;
+
+/** A parsed request. */
+typedef struct ssdp_server_request_struct {
+  /** The format of the response body. */
+  ssdp_server_format_e format;
+  /** The filters to apply, NULL for all the devices. */
+  filters_factory_s *filters;
+  /** Only the devices changed since then, if since_set. */
+  unsigned long long since;
+  /** A since parameter was given. */
+  BOOL since_set;
+} ssdp_server_request_s;
+
+/**
+ * Get the number of milliseconds since a point in time.
+ *
+ * @param since The point in time.
+ *
+ * @return The elapsed milliseconds.
+ */
+static long elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000 +
+      (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * Disconnect a client and free it.
+ *
+ * @param client The client to free.
+ */
+static void free_client(ssdp_server_client_s *client) {
+  ssdp_server_s *server = client->server;
+  ssdp_server_client_s **link = &server->clients;
+
+  while (*link && *link != client) {
+    link = &(*link)->next;
+  }
+  if (*link) {
+    *link = client->next;
+    server->clients_count--;
+  }
+
+  event_loop_remove(&server->loop, client->sock);
+  close(client->sock);
+  string_buffer_free(&client->request);
+  string_buffer_free(&client->response);
+  free(client);
+}
+
+/**
+ * Get the value of a hexadecimal digit.
+ *
+ * @param c The digit.
+ *
+ * @return The value, -1 if it is not a hexadecimal digit.
+ */
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/**
+ * Decode a URL-encoded parameter value.
+ *
+ * @param value The encoded value (not null-terminated).
+ * @param length The length of the encoded value.
+ *
+ * @return The decoded value, which the caller has to free, or NULL on
+ *         failure.
+ */
+static char *url_decode(const char *value, size_t length) {
+  char *decoded = (char *)malloc(length + 1);
+  size_t used = 0;
+  size_t i;
+
+  if (!decoded) {
+    PRINT_ERROR("Failed to allocate memory for a request parameter");
+    return NULL;
+  }
+
+  for (i = 0; i < length; i++) {
+    if (value[i] == '+') {
+      decoded[used++] = ' ';
+    }
+    else if (value[i] == '%' && i + 2 < length &&
+        hex_value(value[i + 1]) >= 0 && hex_value(value[i + 2]) >= 0) {
+      decoded[used++] = (char)(hex_value(value[i + 1]) * 16 +
+          hex_value(value[i + 2]));
+      i += 2;
+    }
+    else {
+      decoded[used++] = value[i];
+    }
+  }
+  decoded[used] = '\0';
+
+  return decoded;
+}
+
+/**
+ * Parse the query parameters of a request.
+ *
+ * @param query The parameters (not null-terminated).
+ * @param length The length of the parameters.
+ * @param request The request to fill.
+ *
+ * @return TRUE on success, FALSE if a parameter is erroneous.
+ */
+static BOOL parse_query(const char *query, size_t length,
+    ssdp_server_request_s *request) {
+  const char *end = query + length;
+
+  while (query < end) {
+    const char *next = memchr(query, '&', end - query);
+    const char *equals = NULL;
+    char *value = NULL;
+    size_t name_length;
+    BOOL ok = TRUE;
+
+    if (!next) {
+      next = end;
+    }
+    equals = memchr(query, '=', next - query);
+    if (!equals) {
+      query = next + 1;
+      continue;
+    }
+    name_length = equals - query;
+    value = url_decode(equals + 1, next - equals - 1);
+    if (!value) {
+      return FALSE;
+    }
+
+    if (name_length == 6 && strncmp(query, "format", 6) == 0) {
+      if (strcmp(value, "xml") == 0) {
+        request->format = SSDP_SERVER_FORMAT_XML;
+      }
+      else if (strcmp(value, "json") == 0) {
+        request->format = SSDP_SERVER_FORMAT_JSON;
+      }
+      else if (strcmp(value, "binary") == 0) {
+        request->format = SSDP_SERVER_FORMAT_BINARY;
+      }
+      else {
+        ok = FALSE;
+      }
+    }
+    else if (name_length == 6 && strncmp(query, "filter", 6) == 0) {
+      if (request->filters) {
+        free_ssdp_filters_factory(request->filters);
+        request->filters = NULL;
+      }
+      parse_filters(value, &request->filters, FALSE);
+    }
+    else if (name_length == 5 && strncmp(query, "since", 5) == 0) {
+      char *pend = NULL;
+      request->since = strtoull(value, &pend, 10);
+      request->since_set = TRUE;
+      ok = *value != '\0' && *pend == '\0';
+    }
+    /* Unknown parameters are ignored */
+
+    free(value);
+    if (!ok) {
+      return FALSE;
+    }
+    query = next + 1;
+  }
+
+  return TRUE;
+}
+
+/**
+ * Make a list of the devices in a snapshot a request asks for. The list
+ * elements point to the snapshot's messages, only the elements have to be
+ * freed.
+ *
+ * @param snapshot The snapshot.
+ * @param request The request.
+ * @param count Where to keep the number of selected devices, it has to live
+ *        as long as the list.
+ *
+ * @return The first element of the list (an array), NULL if no devices were
+ *         selected or on failure.
+ */
+static ssdp_cache_s *select_devices(const ssdp_snapshot_s *snapshot,
+    ssdp_server_request_s *request, unsigned int *count) {
+  ssdp_cache_s *selected = NULL;
+  unsigned int i = 0;
+  unsigned int j;
+
+  *count = 0;
+  if (snapshot->count == 0) {
+    return NULL;
+  }
+
+  selected = (ssdp_cache_s *)calloc(snapshot->count, sizeof(ssdp_cache_s));
+  if (!selected) {
+    PRINT_ERROR("Failed to allocate memory for the selected devices");
+    return NULL;
+  }
+
+  for (j = 0; j < snapshot->count; j++) {
+    ssdp_snapshot_entry_s *entry = snapshot->entries[j];
+    if (request->since_set && entry->changed < request->since) {
+      continue;
+    }
+    if (request->filters && filter(entry->ssdp_message, request->filters)) {
+      continue;
+    }
+    selected[i].first = selected;
+    selected[i].ssdp_message = entry->ssdp_message;
+    selected[i].ssdp_messages_count = count;
+    if (i > 0) {
+      selected[i - 1].next = &selected[i];
+    }
+    i++;
+  }
+
+  if (i == 0) {
+    free(selected);
+    return NULL;
+  }
+  *count = i;
+
+  return selected;
+}
+
+/**
+ * Append the devices in a format to a buffer.
+ *
+ * @param buffer The buffer to append to.
+ * @param format The format.
+ * @param devices The devices, NULL for none.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL append_devices(string_buffer_s *buffer,
+    ssdp_server_format_e format, ssdp_cache_s *devices) {
+  switch (format) {
+  case SSDP_SERVER_FORMAT_JSON:
+    if (!devices) {
+      return string_buffer_append_str(buffer, "{\"root\":[]}\n");
+    }
+    return cache_to_json(devices, buffer) > 0;
+  case SSDP_SERVER_FORMAT_BINARY:
+    if (!devices) {
+      /* No strings and no messages */
+      return string_buffer_append_str(buffer, SSDP_BINARY_MAGIC) &&
+          string_buffer_append_char(buffer, SSDP_BINARY_VERSION) &&
+          string_buffer_append_char(buffer, 0) &&
+          string_buffer_append_char(buffer, 0);
+    }
+    return cache_to_binary(devices, buffer) > 0;
+  default:
+    if (!devices) {
+      return string_buffer_append_str(buffer,
+          "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<root>\n</root>\n");
+    }
+    return cache_to_xml(devices, buffer) > 0;
+  }
+}
+
+/**
+ * Append the IPs of the devices removed since a time to a buffer, as a
+ * comma separated list.
+ *
+ * @param snapshot The snapshot.
+ * @param since The time.
+ * @param buffer The buffer to append to.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL append_removed(const ssdp_snapshot_s *snapshot,
+    unsigned long long since, string_buffer_s *buffer) {
+  BOOL first = TRUE;
+  unsigned int i;
+
+  for (i = 0; i < snapshot->removed_count; i++) {
+    if (snapshot->removed[i].time < since) {
+      continue;
+    }
+    if ((!first && !string_buffer_append_char(buffer, ',')) ||
+        !string_buffer_append_str(buffer, snapshot->removed[i].ip)) {
+      return FALSE;
+    }
+    first = FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * Set the response of a client to an error.
+ *
+ * @param client The client.
+ * @param status The HTTP status line (code and reason).
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL respond_error(ssdp_server_client_s *client, const char *status) {
+  string_buffer_reset(&client->response);
+
+  return string_buffer_append_str(&client->response, "HTTP/1.0 ") &&
+      string_buffer_append_str(&client->response, status) &&
+      string_buffer_append_str(&client->response, "\r\n"
+      "Content-Type: text/plain\r\n"
+      "Connection: close\r\n"
+      "\r\n") &&
+      string_buffer_append_str(&client->response, status) &&
+      string_buffer_append_char(&client->response, '\n');
+}
+
+/**
+ * Build the response to a parsed request from the current snapshot.
+ *
+ * @param client The client.
+ * @param request The request.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL respond_devices(ssdp_server_client_s *client,
+    ssdp_server_request_s *request) {
+  ssdp_server_s *server = client->server;
+  string_buffer_s *response = &client->response;
+  string_buffer_s body;
+  const ssdp_snapshot_s *snapshot = NULL;
+  ssdp_cache_s *devices = NULL;
+  unsigned int count = 0;
+  char number[32];
+  BOOL since_requested = request->since_set;
+  BOOL delta = FALSE;
+  BOOL ok;
+
+  if (!string_buffer_init(&body, XML_BUFFER_SIZE)) {
+    return FALSE;
+  }
+
+  /* The snapshot stays valid until the response is built */
+  snapshot = ssdp_snapshots_enter(server->snapshots, server->reader);
+
+  /* The removals since then are not all known, send everything */
+  delta = since_requested && request->since >= snapshot->complete_since;
+  if (since_requested && !delta) {
+    request->since_set = FALSE;
+  }
+
+  devices = select_devices(snapshot, request, &count);
+  ok = append_devices(&body, request->format, devices);
+  free(devices);
+  if (!ok) {
+    ssdp_snapshots_leave(server->snapshots, server->reader);
+    string_buffer_free(&body);
+    return FALSE;
+  }
+
+  snprintf(number, sizeof(number), "%llu", snapshot->time);
+  string_buffer_reset(response);
+  ok = string_buffer_append_str(response, "HTTP/1.0 200 OK\r\n"
+      "Content-Type: ") &&
+      string_buffer_append_str(response,
+      request->format == SSDP_SERVER_FORMAT_JSON ? "application/json" :
+      request->format == SSDP_SERVER_FORMAT_BINARY ?
+      "application/octet-stream" : "application/xml") &&
+      string_buffer_append_str(response, "\r\nContent-Length: ") &&
+      string_buffer_append_uint(response, (unsigned long)body.length) &&
+      string_buffer_append_str(response, "\r\nX-Abused-Time: ") &&
+      string_buffer_append_str(response, number);
+  if (ok && since_requested) {
+    ok = string_buffer_append_str(response, "\r\nX-Abused-Delta: ") &&
+        string_buffer_append_str(response, delta ? "yes" : "no");
+    if (ok && delta) {
+      ok = string_buffer_append_str(response, "\r\nX-Abused-Removed: ") &&
+          append_removed(snapshot, request->since, response);
+    }
+  }
+  ok = ok && string_buffer_append_str(response, "\r\n"
+      "Connection: close\r\n"
+      "\r\n") &&
+      string_buffer_append(response, body.data, body.length);
+  ssdp_snapshots_leave(server->snapshots, server->reader);
+  string_buffer_free(&body);
+
+  PRINT_DEBUG("Serving %d devices", (int)count);
+
+  return ok;
+}
+
+/**
+ * Parse a complete request and build the response.
+ *
+ * @param client The client.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL respond(ssdp_server_client_s *client) {
+  configuration_s *conf = client->server->conf;
+  ssdp_server_request_s request;
+  char *line = client->request.data;
+  char *line_end = strchr(line, '\n');
+  char *target = NULL;
+  char *target_end = NULL;
+  char *query = NULL;
+  size_t path_length;
+  BOOL ok;
+
+  memset(&request, 0, sizeof(request));
+  request.format = conf->json_output ? SSDP_SERVER_FORMAT_JSON :
+      conf->binary_output ? SSDP_SERVER_FORMAT_BINARY :
+      SSDP_SERVER_FORMAT_XML;
+
+  if (line_end) {
+    *line_end = '\0';
+  }
+  if (strncmp(line, "GET ", 4) != 0) {
+    return respond_error(client, "405 Method Not Allowed");
+  }
+
+  target = line + 4;
+  while (*target == ' ') {
+    target++;
+  }
+  target_end = target + strcspn(target, " \r");
+  query = memchr(target, '?', target_end - target);
+  path_length = (query ? query : target_end) - target;
+  if (!((path_length == 1 && *target == '/') ||
+      (path_length == 8 && strncmp(target, "/devices", 8) == 0))) {
+    return respond_error(client, "404 Not Found");
+  }
+
+  if (query && !parse_query(query + 1, target_end - query - 1, &request)) {
+    free_ssdp_filters_factory(request.filters);
+    return respond_error(client, "400 Bad Request");
+  }
+
+  ok = respond_devices(client, &request);
+  free_ssdp_filters_factory(request.filters);
+
+  return ok;
+}
+
+/**
+ * Send as much of the response to a client as it takes, and disconnect it
+ * when it is all sent.
+ *
+ * @param client The client.
+ */
+static void send_response(ssdp_server_client_s *client) {
+  while (client->response_sent < client->response.length) {
+    ssize_t bytes = send(client->sock,
+        client->response.data + client->response_sent,
+        client->response.length - client->response_sent, MSG_NOSIGNAL);
+    if (bytes < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return;
+      }
+      PRINT_DEBUG("send(): %s", strerror(errno));
+      break;
+    }
+    client->response_sent += bytes;
+  }
+
+  free_client(client);
+}
+
+/**
+ * Check if a request has been received in full.
+ *
+ * @param request The request received so far.
+ * @param closed The client will not send more.
+ *
+ * @return TRUE if it is complete, FALSE otherwise.
+ */
+static BOOL is_request_complete(string_buffer_s *request, BOOL closed) {
+  if (strstr(request->data, "\r\n\r\n") || strstr(request->data, "\n\n")) {
+    return TRUE;
+  }
+
+  /* A bare request line is enough from clients that close their end */
+  return closed && strchr(request->data, '\n') != NULL;
+}
+
+/**
+ * Handle a client connection becoming ready.
+ *
+ * @param data The client.
+ * @param events The EVENT_LOOP_* flags that are set.
+ */
+static void on_client_ready(void *data, unsigned int events) {
+  ssdp_server_client_s *client = (ssdp_server_client_s *)data;
+  char bytes[1024];
+  BOOL closed = FALSE;
+
+  if (client->responding) {
+    send_response(client);
+    return;
+  }
+
+  if (!(events & (EVENT_LOOP_READ | EVENT_LOOP_ERROR))) {
+    return;
+  }
+
+  while (TRUE) {
+    ssize_t received = recv(client->sock, bytes, sizeof(bytes), 0);
+    if (received < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        break;
+      }
+      PRINT_DEBUG("recv(): %s", strerror(errno));
+      free_client(client);
+      return;
+    }
+    if (received == 0) {
+      closed = TRUE;
+      break;
+    }
+    if (client->request.length + received > SSDP_SERVER_MAX_REQUEST) {
+      client->responding = TRUE;
+      if (!respond_error(client, "400 Bad Request")) {
+        free_client(client);
+        return;
+      }
+      break;
+    }
+    if (!string_buffer_append(&client->request, bytes, received)) {
+      free_client(client);
+      return;
+    }
+  }
+
+  if (!client->responding) {
+    if (!is_request_complete(&client->request, closed)) {
+      if (closed) {
+        free_client(client);
+      }
+      return;
+    }
+    client->responding = TRUE;
+    if (!respond(client)) {
+      PRINT_ERROR("Failed to build the response to a client");
+      free_client(client);
+      return;
+    }
+  }
+
+  if (!event_loop_modify(&client->server->loop, client->sock,
+      EVENT_LOOP_WRITE)) {
+    free_client(client);
+    return;
+  }
+  send_response(client);
+}
+
+/**
+ * Accept the waiting clients.
+ *
+ * @param data The server.
+ * @param events The EVENT_LOOP_* flags that are set.
+ */
+static void on_accept(void *data, unsigned int events) {
+  ssdp_server_s *server = (ssdp_server_s *)data;
+  ssdp_server_client_s *client = NULL;
+  SOCKET sock;
+
+  (void)events;
+
+  while ((sock = accept(server->sock, NULL, NULL)) != SOCKET_ERROR) {
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    if (server->clients_count >= SSDP_SERVER_MAX_CLIENTS) {
+      static const char busy[] = "HTTP/1.0 503 Service Unavailable\r\n"
+          "Connection: close\r\n\r\n";
+      PRINT_DEBUG("Too many clients, turning one away");
+      if (send(sock, busy, sizeof(busy) - 1, MSG_NOSIGNAL) < 0) {
+        PRINT_DEBUG("send(): %s", strerror(errno));
+      }
+      close(sock);
+      continue;
+    }
+
+    client = (ssdp_server_client_s *)calloc(1, sizeof(ssdp_server_client_s));
+    if (!client) {
+      PRINT_ERROR("Failed to allocate memory for a client");
+      close(sock);
+      continue;
+    }
+    client->server = server;
+    client->sock = sock;
+    clock_gettime(CLOCK_MONOTONIC, &client->connected);
+    if (!string_buffer_init(&client->request, 512) ||
+        !string_buffer_init(&client->response, 512)) {
+      string_buffer_free(&client->request);
+      free(client);
+      close(sock);
+      continue;
+    }
+    if (!event_loop_add(&server->loop, sock, EVENT_LOOP_READ,
+        on_client_ready, client)) {
+      string_buffer_free(&client->request);
+      string_buffer_free(&client->response);
+      free(client);
+      close(sock);
+      continue;
+    }
+    client->next = server->clients;
+    server->clients = client;
+    server->clients_count++;
+  }
+
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    PRINT_DEBUG("accept(): %s", strerror(errno));
+  }
+}
+
+/**
+ * Create the server socket.
+ *
+ * @param conf The global configuration.
+ *
+ * @return The socket, SOCKET_ERROR on failure.
+ */
+static SOCKET create_server_socket(configuration_s *conf) {
+  struct sockaddr_storage addr;
+  socklen_t addr_length;
+  SOCKET sock;
+
+  memset(&addr, 0, sizeof(addr));
+  if (conf->use_ipv6) {
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_port = htons(DAEMON_PORT);
+    addr6->sin6_addr = in6addr_any;
+    if (strlen(conf->ip) > 0 &&
+        inet_pton(AF_INET6, conf->ip, &addr6->sin6_addr) < 1) {
+      PRINT_ERROR("Erroneous IPv6 address to serve on (%s)", conf->ip);
+      return SOCKET_ERROR;
+    }
+    addr_length = sizeof(struct sockaddr_in6);
+  }
+  else {
+    struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
+    addr4->sin_family = AF_INET;
+    addr4->sin_port = htons(DAEMON_PORT);
+    addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+    if (strlen(conf->ip) > 0 &&
+        inet_pton(AF_INET, conf->ip, &addr4->sin_addr) < 1) {
+      PRINT_ERROR("Erroneous IPv4 address to serve on (%s)", conf->ip);
+      return SOCKET_ERROR;
+    }
+    addr_length = sizeof(struct sockaddr_in);
+  }
+
+  sock = socket(addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+  if (sock == SOCKET_ERROR) {
+    PRINT_ERROR("socket(): %s", strerror(errno));
+    return SOCKET_ERROR;
+  }
+  if (set_reuseaddr(sock)) {
+    close(sock);
+    return SOCKET_ERROR;
+  }
+  if (bind(sock, (struct sockaddr *)&addr, addr_length) < 0) {
+    PRINT_ERROR("Could not bind the server to port %d: %s", DAEMON_PORT,
+        strerror(errno));
+    close(sock);
+    return SOCKET_ERROR;
+  }
+  if (listen(sock, SSDP_SERVER_LISTEN_QUEUE) < 0) {
+    PRINT_ERROR("listen(): %s", strerror(errno));
+    close(sock);
+    return SOCKET_ERROR;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+  return sock;
+}
+
+BOOL ssdp_server_init(ssdp_server_s *server, configuration_s *conf,
+    ssdp_snapshots_s *snapshots) {
+  memset(server, 0, sizeof(ssdp_server_s));
+  server->conf = conf;
+  server->snapshots = snapshots;
+  server->reader = ssdp_snapshots_register(snapshots);
+  if (server->reader < 0) {
+    return FALSE;
+  }
+
+  server->sock = create_server_socket(conf);
+  if (server->sock == SOCKET_ERROR) {
+    ssdp_snapshots_unregister(snapshots, server->reader);
+    return FALSE;
+  }
+
+  if (!event_loop_init(&server->loop)) {
+    close(server->sock);
+    ssdp_snapshots_unregister(snapshots, server->reader);
+    return FALSE;
+  }
+  if (!event_loop_add(&server->loop, server->sock, EVENT_LOOP_READ,
+      on_accept, server)) {
+    event_loop_close(&server->loop);
+    close(server->sock);
+    ssdp_snapshots_unregister(snapshots, server->reader);
+    return FALSE;
+  }
+
+  PRINT_DEBUG("Serving the device table on port %d", DAEMON_PORT);
+
+  return TRUE;
+}
+
+int ssdp_server_fd(ssdp_server_s *server) {
+  return server->loop.epoll_fd;
+}
+
+int ssdp_server_timeout(ssdp_server_s *server) {
+  ssdp_server_client_s *client;
+  long timeout = -1;
+
+  for (client = server->clients; client; client = client->next) {
+    long left = SSDP_SERVER_CLIENT_TIMEOUT - elapsed_ms(&client->connected);
+    if (left < 0) {
+      left = 0;
+    }
+    if (timeout < 0 || left < timeout) {
+      timeout = left;
+    }
+  }
+
+  /* Without a file descriptor to wait for, check back regularly */
+  if (ssdp_server_fd(server) < 0 &&
+      (timeout < 0 || timeout > SSDP_SERVER_POLL_INTERVAL)) {
+    timeout = SSDP_SERVER_POLL_INTERVAL;
+  }
+
+  return (int)timeout;
+}
+
+void ssdp_server_process(ssdp_server_s *server) {
+  ssdp_server_client_s *client = NULL;
+
+  event_loop_wait(&server->loop, 0);
+
+  client = server->clients;
+
+  while (client) {
+    ssdp_server_client_s *next = client->next;
+    if (elapsed_ms(&client->connected) >= SSDP_SERVER_CLIENT_TIMEOUT) {
+      PRINT_DEBUG("A client timed out");
+      free_client(client);
+    }
+    client = next;
+  }
+}
+
+void ssdp_server_close(ssdp_server_s *server) {
+  while (server->clients) {
+    free_client(server->clients);
+  }
+  event_loop_remove(&server->loop, server->sock);
+  event_loop_close(&server->loop);
+  close(server->sock);
+  ssdp_snapshots_unregister(server->snapshots, server->reader);
+}
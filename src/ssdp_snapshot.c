@@ -0,0 +1,330 @@
+/** \file ssdp_snapshot.c
+ * Lock-free, epoch based snapshots of the device table.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common_definitions.h"
+#include "log.h"
+#include "ssdp_cache.h"
+#include "ssdp_message.h"
+#include "ssdp_snapshot.h"
+#include "string_intern.h"
+
+/**
+ * Get the number of milliseconds since a point in time.
+ *
+ * @param since The point in time.
+ *
+ * @return The elapsed milliseconds.
+ */
+static long elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000 +
+      (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * Release an entry held by a snapshot, it is freed with the last one.
+ *
+ * @param entry The entry to release.
+ */
+static void release_entry(ssdp_snapshot_entry_s *entry) {
+  if (--entry->refs == 0) {
+    free_ssdp_message(&entry->ssdp_message);
+    free(entry);
+  }
+}
+
+/**
+ * Free a snapshot and release its entries.
+ *
+ * @param snapshot The snapshot to free.
+ */
+static void free_snapshot(ssdp_snapshot_s *snapshot) {
+  unsigned int i;
+
+  for (i = 0; i < snapshot->count; i++) {
+    release_entry(snapshot->entries[i]);
+  }
+  for (i = 0; i < snapshot->removed_count; i++) {
+    string_intern_release(snapshot->removed[i].ip);
+  }
+  free(snapshot->entries);
+  free(snapshot->removed);
+  free(snapshot);
+}
+
+/**
+ * Free the replaced snapshots that no reader can be using anymore. A reader
+ * that entered in epoch e may use any snapshot replaced in epoch e or later.
+ *
+ * @param snapshots The snapshots.
+ */
+static void reclaim(ssdp_snapshots_s *snapshots) {
+  unsigned long oldest = ULONG_MAX;
+  ssdp_snapshot_s **link = &snapshots->retired;
+  unsigned int i;
+
+  for (i = 0; i < SSDP_SNAPSHOT_MAX_READERS; i++) {
+    unsigned long epoch = __atomic_load_n(&snapshots->readers[i].epoch,
+        __ATOMIC_SEQ_CST);
+    if (epoch != 0 && epoch < oldest) {
+      oldest = epoch;
+    }
+  }
+
+  while (*link) {
+    ssdp_snapshot_s *snapshot = *link;
+    if (snapshot->retired_epoch < oldest) {
+      *link = snapshot->next_retired;
+      free_snapshot(snapshot);
+    }
+    else {
+      link = &snapshot->next_retired;
+    }
+  }
+}
+
+/**
+ * Remember that a device was removed from the table.
+ *
+ * @param snapshots The snapshots.
+ * @param ip The (interned) IP of the device.
+ * @param time When it was removed.
+ */
+static void record_removed(ssdp_snapshots_s *snapshots, const char *ip,
+    unsigned long long time) {
+  ssdp_snapshot_removed_s *removed = NULL;
+
+  /* Forget the oldest, the readers cannot tell what was removed before */
+  if (snapshots->removed_count == SSDP_SNAPSHOT_MAX_REMOVED) {
+    removed = &snapshots->removed[snapshots->removed_first];
+    snapshots->complete_since = removed->time + 1;
+    string_intern_release(removed->ip);
+    snapshots->removed_first = (snapshots->removed_first + 1) %
+        SSDP_SNAPSHOT_MAX_REMOVED;
+    snapshots->removed_count--;
+  }
+
+  removed = &snapshots->removed[(snapshots->removed_first +
+      snapshots->removed_count) % SSDP_SNAPSHOT_MAX_REMOVED];
+  removed->ip = string_intern_ref(ip);
+  removed->time = time;
+  snapshots->removed_count++;
+}
+
+/**
+ * Copy the remembered removals to a new snapshot.
+ *
+ * @param snapshots The snapshots.
+ * @param snapshot The new snapshot.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL copy_removed(ssdp_snapshots_s *snapshots,
+    ssdp_snapshot_s *snapshot) {
+  unsigned int i;
+
+  snapshot->complete_since = snapshots->complete_since;
+  if (snapshots->removed_count == 0) {
+    return TRUE;
+  }
+
+  snapshot->removed = (ssdp_snapshot_removed_s *)malloc(
+      sizeof(ssdp_snapshot_removed_s) * snapshots->removed_count);
+  if (!snapshot->removed) {
+    return FALSE;
+  }
+  for (i = 0; i < snapshots->removed_count; i++) {
+    ssdp_snapshot_removed_s *removed = &snapshots->removed[
+        (snapshots->removed_first + i) % SSDP_SNAPSHOT_MAX_REMOVED];
+    snapshot->removed[i].ip = string_intern_ref(removed->ip);
+    snapshot->removed[i].time = removed->time;
+  }
+  snapshot->removed_count = snapshots->removed_count;
+
+  return TRUE;
+}
+
+BOOL ssdp_snapshots_init(ssdp_snapshots_s *snapshots) {
+  memset(snapshots, 0, sizeof(ssdp_snapshots_s));
+  snapshots->epoch = 1;
+  snapshots->complete_since = ssdp_cache_now();
+
+  return ssdp_snapshots_publish(snapshots, NULL);
+}
+
+int ssdp_snapshots_register(ssdp_snapshots_s *snapshots) {
+  int i;
+
+  for (i = 0; i < SSDP_SNAPSHOT_MAX_READERS; i++) {
+    int unused = 0;
+    if (__atomic_compare_exchange_n(&snapshots->readers[i].used, &unused, 1,
+        FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      return i;
+    }
+  }
+
+  PRINT_ERROR("All the %d snapshot reader slots are taken",
+      SSDP_SNAPSHOT_MAX_READERS);
+
+  return -1;
+}
+
+void ssdp_snapshots_unregister(ssdp_snapshots_s *snapshots, int reader) {
+  __atomic_store_n(&snapshots->readers[reader].epoch, 0, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&snapshots->readers[reader].used, 0, __ATOMIC_SEQ_CST);
+}
+
+const ssdp_snapshot_s *ssdp_snapshots_enter(ssdp_snapshots_s *snapshots,
+    int reader) {
+  /* The epoch is announced before the snapshot is loaded, so the writer
+     sees the reader before it can free anything the reader loads */
+  __atomic_store_n(&snapshots->readers[reader].epoch,
+      __atomic_load_n(&snapshots->epoch, __ATOMIC_SEQ_CST),
+      __ATOMIC_SEQ_CST);
+
+  return __atomic_load_n(&snapshots->current, __ATOMIC_SEQ_CST);
+}
+
+void ssdp_snapshots_leave(ssdp_snapshots_s *snapshots, int reader) {
+  __atomic_store_n(&snapshots->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+void ssdp_snapshots_changed(ssdp_snapshots_s *snapshots) {
+  snapshots->dirty = TRUE;
+}
+
+int ssdp_snapshots_timeout(ssdp_snapshots_s *snapshots) {
+  long left;
+
+  if (!snapshots->dirty) {
+    return -1;
+  }
+
+  left = SSDP_SNAPSHOT_INTERVAL - elapsed_ms(&snapshots->published);
+
+  return left > 0 ? (int)left : 0;
+}
+
+void ssdp_snapshots_update(ssdp_snapshots_s *snapshots,
+    ssdp_cache_s *ssdp_cache) {
+  if (ssdp_snapshots_timeout(snapshots) == 0) {
+    ssdp_snapshots_publish(snapshots, ssdp_cache);
+  }
+  else if (snapshots->retired) {
+    reclaim(snapshots);
+  }
+}
+
+BOOL ssdp_snapshots_publish(ssdp_snapshots_s *snapshots,
+    ssdp_cache_s *ssdp_cache) {
+  /* Only the writer replaces the current snapshot */
+  ssdp_snapshot_s *previous = snapshots->current;
+  ssdp_snapshot_s *snapshot = NULL;
+  ssdp_cache_s *element = NULL;
+  unsigned int count = ssdp_cache ? *ssdp_cache->ssdp_messages_count : 0;
+  unsigned long long now = ssdp_cache_now();
+  unsigned int i = 0;
+
+  snapshot = (ssdp_snapshot_s *)calloc(1, sizeof(ssdp_snapshot_s));
+  if (!snapshot || !(snapshot->entries = (ssdp_snapshot_entry_s **)calloc(
+      count > 0 ? count : 1, sizeof(ssdp_snapshot_entry_s *)))) {
+    PRINT_ERROR("Failed to allocate memory for a snapshot");
+    free(snapshot);
+    return FALSE;
+  }
+  snapshot->generation = previous ? previous->generation + 1 : 1;
+  snapshot->time = now;
+
+  /* Only the devices that changed since the last snapshot are copied */
+  for (element = ssdp_cache ? ssdp_cache->first : NULL; element;
+      element = element->next) {
+    ssdp_snapshot_entry_s *entry = element->snapshot_entry;
+    if (!entry || element->published_revision != element->revision) {
+      entry = (ssdp_snapshot_entry_s *)calloc(1,
+          sizeof(ssdp_snapshot_entry_s));
+      if (!entry ||
+          !(entry->ssdp_message = copy_ssdp_message(element->ssdp_message))) {
+        PRINT_ERROR("Failed to copy a device to a snapshot");
+        free(entry);
+        snapshot->count = i;
+        free_snapshot(snapshot);
+        return FALSE;
+      }
+      entry->changed = element->changed;
+    }
+    entry->refs++;
+    snapshot->entries[i++] = entry;
+  }
+  snapshot->count = i;
+
+  /* The devices of the last snapshot that were not carried over (nor
+     replaced by a newer copy) have been removed */
+  i = 0;
+  for (element = ssdp_cache ? ssdp_cache->first : NULL; element;
+      element = element->next) {
+    if (element->snapshot_entry) {
+      element->snapshot_entry->generation = snapshot->generation;
+    }
+    snapshot->entries[i]->generation = snapshot->generation;
+    element->snapshot_entry = snapshot->entries[i++];
+    element->published_revision = element->revision;
+  }
+  if (previous) {
+    for (i = 0; i < previous->count; i++) {
+      if (previous->entries[i]->generation != snapshot->generation) {
+        record_removed(snapshots, previous->entries[i]->ssdp_message->ip,
+            now);
+      }
+    }
+  }
+  if (!copy_removed(snapshots, snapshot)) {
+    PRINT_ERROR("Failed to copy the removed devices to a snapshot");
+  }
+
+  /* Replace the current snapshot, the readers that may have loaded the
+     previous one entered in this epoch or earlier */
+  __atomic_store_n(&snapshots->current, snapshot, __ATOMIC_SEQ_CST);
+  if (previous) {
+    previous->retired_epoch = __atomic_load_n(&snapshots->epoch,
+        __ATOMIC_SEQ_CST);
+    previous->next_retired = snapshots->retired;
+    snapshots->retired = previous;
+  }
+  __atomic_add_fetch(&snapshots->epoch, 1, __ATOMIC_SEQ_CST);
+
+  snapshots->dirty = FALSE;
+  clock_gettime(CLOCK_MONOTONIC, &snapshots->published);
+  reclaim(snapshots);
+
+  return TRUE;
+}
+
+void ssdp_snapshots_close(ssdp_snapshots_s *snapshots) {
+  unsigned int i;
+
+  while (snapshots->retired) {
+    ssdp_snapshot_s *next = snapshots->retired->next_retired;
+    free_snapshot(snapshots->retired);
+    snapshots->retired = next;
+  }
+  if (snapshots->current) {
+    free_snapshot(snapshots->current);
+    snapshots->current = NULL;
+  }
+  for (i = 0; i < snapshots->removed_count; i++) {
+    string_intern_release(snapshots->removed[
+        (snapshots->removed_first + i) % SSDP_SNAPSHOT_MAX_REMOVED].ip);
+  }
+  snapshots->removed_count = 0;
+}
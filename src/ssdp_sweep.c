@@ -0,0 +1,279 @@
+/** \file ssdp_sweep.c
+ * A rate limited unicast M-SEARCH sweep across IPv4 CIDR ranges.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <arpa/inet.h> /* inet_pton() */
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "common_definitions.h"
+#include "log.h"
+#include "net_definitions.h"
+#include "ssdp_probe_scheduler.h"
+#include "ssdp_static_defs.h"
+#include "ssdp_sweep.h"
+#include "string_buffer.h"
+
+/** The shortest prefix length that is swept (a /8 is 16M addresses). */
+#define SSDP_SWEEP_MIN_PREFIX 8
+/** The largest burst, as the part of a second's sends. */
+#define SSDP_SWEEP_BURST_DIVISOR 20
+/** The most packets sent in one call when the rate is not limited. */
+#define SSDP_SWEEP_UNLIMITED_BATCH 256
+
+/**
+ * Get the number of seconds since a point in time.
+ *
+ * @param since The point in time.
+ *
+ * @return The elapsed seconds.
+ */
+static double elapsed_seconds(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (double)(now.tv_sec - since->tv_sec) +
+      (double)(now.tv_nsec - since->tv_nsec) / 1000000000.0;
+}
+
+/**
+ * Parse a CIDR range into the first and last address to sweep. The network
+ * and broadcast addresses are left out of ranges bigger than a /31.
+ *
+ * @param cidr The range (a.b.c.d/n or a.b.c.d).
+ * @param length The length of the range string.
+ * @param range The range to fill.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL parse_range(const char *cidr, size_t length,
+    ssdp_sweep_range_s *range) {
+  char address[IPv4_STR_MAX_SIZE + 4];
+  char range_string[IPv4_STR_MAX_SIZE + 4];
+  char *prefix_string = NULL;
+  char *pend = NULL;
+  long prefix = 32;
+  struct in_addr addr;
+  uint32_t mask;
+
+  if (length >= sizeof(address)) {
+    PRINT_ERROR("Erroneous sweep range, too long");
+    return FALSE;
+  }
+  memcpy(address, cidr, length);
+  address[length] = '\0';
+  memcpy(range_string, address, length + 1);
+
+  prefix_string = strchr(address, '/');
+  if (prefix_string) {
+    *prefix_string++ = '\0';
+    prefix = strtol(prefix_string, &pend, 10);
+    if (pend == prefix_string || *pend != '\0' || prefix < 0 || prefix > 32) {
+      PRINT_ERROR("Erroneous prefix length in sweep range '%s'",
+          range_string);
+      return FALSE;
+    }
+  }
+
+  if (inet_pton(AF_INET, address, &addr) < 1) {
+    PRINT_ERROR("Sweep range '%s' is not an IPv4 range", range_string);
+    return FALSE;
+  }
+
+  if (prefix < SSDP_SWEEP_MIN_PREFIX) {
+    PRINT_ERROR("Sweep range '%s' is too big, the largest is a /%d",
+        range_string, SSDP_SWEEP_MIN_PREFIX);
+    return FALSE;
+  }
+
+  mask = prefix == 0 ? 0 : 0xffffffffu << (32 - prefix);
+  range->first = ntohl(addr.s_addr) & mask;
+  range->last = range->first | ~mask;
+  if (prefix < 31) {
+    range->first++;
+    range->last--;
+  }
+
+  return TRUE;
+}
+
+BOOL ssdp_sweep_init(ssdp_sweep_s *sweep, const char *ranges,
+    unsigned int rate) {
+  const char *range = ranges;
+
+  memset(sweep, 0, sizeof(ssdp_sweep_s));
+  sweep->rate = rate;
+
+  while (*range) {
+    size_t length = strcspn(range, ",");
+    ssdp_sweep_range_s *sweep_range = &sweep->ranges[sweep->range_count];
+
+    if (length == 0) {
+      range++;
+      continue;
+    }
+
+    if (sweep->range_count == SSDP_SWEEP_MAX_RANGES) {
+      PRINT_ERROR("Too many sweep ranges, the maximum is %d",
+          SSDP_SWEEP_MAX_RANGES);
+      return FALSE;
+    }
+
+    if (!parse_range(range, length, sweep_range)) {
+      return FALSE;
+    }
+    sweep->total += (unsigned long)(sweep_range->last - sweep_range->first) +
+        1;
+    sweep->range_count++;
+    range += length;
+  }
+
+  if (sweep->range_count == 0) {
+    PRINT_ERROR("No address range to sweep");
+    return FALSE;
+  }
+
+  sweep->next = sweep->ranges[0].first;
+
+  /* Start with a full bucket, a burst is 1/20 of a second's sends */
+  sweep->burst = (double)rate / SSDP_SWEEP_BURST_DIVISOR;
+  if (sweep->burst < 1) {
+    sweep->burst = 1;
+  }
+  sweep->tokens = sweep->burst;
+  clock_gettime(CLOCK_MONOTONIC, &sweep->start);
+  sweep->last_refill = sweep->start;
+
+  return string_buffer_init(&sweep->message, 256);
+}
+
+/**
+ * Add the tokens earned since the last refill to the bucket.
+ *
+ * @param sweep The sweep to refill.
+ */
+static void refill_tokens(ssdp_sweep_s *sweep) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  sweep->tokens += elapsed_seconds(&sweep->last_refill) * sweep->rate;
+  if (sweep->tokens > sweep->burst) {
+    sweep->tokens = sweep->burst;
+  }
+  sweep->last_refill = now;
+}
+
+int ssdp_sweep_timeout(ssdp_sweep_s *sweep) {
+  double missing;
+
+  if (sweep->range >= sweep->range_count) {
+    return -1;
+  }
+
+  /* Without a rate only a full socket buffer holds the sweep back */
+  if (sweep->rate == 0) {
+    return sweep->tokens < 1 ? 1 : 0;
+  }
+
+  refill_tokens(sweep);
+  missing = 1 - sweep->tokens;
+
+  return missing > 0 ? (int)(missing * 1000 / sweep->rate) + 1 : 0;
+}
+
+unsigned int ssdp_sweep_send(ssdp_sweep_s *sweep, SOCKET sock,
+    ssdp_probe_target_s *targets, unsigned int target_count) {
+  unsigned int sent = 0;
+
+  if (sweep->rate) {
+    refill_tokens(sweep);
+  }
+  else {
+    sweep->tokens = sweep->burst;
+  }
+
+  while (sweep->range < sweep->range_count && (sweep->rate ?
+      sweep->tokens >= 1 : sent < SSDP_SWEEP_UNLIMITED_BATCH)) {
+    ssdp_probe_target_s *target = &targets[sweep->target];
+    string_buffer_s *message = &sweep->message;
+    struct sockaddr_in addr;
+    char ip[IPv4_STR_MAX_SIZE];
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SSDP_PORT);
+    addr.sin_addr.s_addr = htonl(sweep->next);
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+
+    /* Unicast searches have no MX, devices answer right away */
+    string_buffer_reset(message);
+    if (!string_buffer_append_str(message, "M-SEARCH * HTTP/1.1\r\nHost:") ||
+        !string_buffer_append_str(message, ip) ||
+        !string_buffer_append_str(message, ":1900\r\nST:") ||
+        !string_buffer_append_str(message, target->st) ||
+        !string_buffer_append_str(message,
+        "\r\nMan:\"ssdp:discover\"\r\n\r\n")) {
+      PRINT_ERROR("Failed to create the M-SEARCH message");
+      break;
+    }
+
+    if (sendto(sock, message->data, message->length, 0,
+        (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        /* The socket buffer is full, retry when the next token is due */
+        sweep->tokens = 0;
+        break;
+      }
+      PRINT_DEBUG("sendto(): Failed sending to %s: %s", ip, strerror(errno));
+    }
+    else {
+      target->sent++;
+      sent++;
+    }
+
+    sweep->tokens--;
+
+    /* Move on to the next search target, or the next address */
+    if (++sweep->target < target_count) {
+      continue;
+    }
+    sweep->target = 0;
+    sweep->swept++;
+    if (sweep->next != sweep->ranges[sweep->range].last) {
+      sweep->next++;
+    }
+    else if (++sweep->range < sweep->range_count) {
+      sweep->next = sweep->ranges[sweep->range].first;
+    }
+    else {
+      clock_gettime(CLOCK_MONOTONIC, &sweep->end);
+    }
+  }
+
+  return sent;
+}
+
+void ssdp_sweep_print_stats(ssdp_sweep_s *sweep, FILE *stream) {
+  double seconds = elapsed_seconds(&sweep->start);
+
+  if (sweep->range >= sweep->range_count) {
+    seconds -= elapsed_seconds(&sweep->end);
+  }
+
+  fprintf(stream, "Swept %lu of %lu addresses in %.1f s\n", sweep->swept,
+      sweep->total, seconds);
+}
+
+void ssdp_sweep_close(ssdp_sweep_s *sweep) {
+  string_buffer_free(&sweep->message);
+  memset(sweep, 0, sizeof(ssdp_sweep_s));
+}
@@ -0,0 +1,116 @@
+/** \file string_buffer.c
+ * A growable output buffer for building large strings without knowing their
+ * size up-front.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common_definitions.h"
+#include "log.h"
+#include "string_buffer.h"
+
+/** The smallest allocation a buffer will make. */
+#define STRING_BUFFER_MIN_SIZE 256
+
+BOOL string_buffer_init(string_buffer_s *buffer, size_t initial_size) {
+  if (initial_size < STRING_BUFFER_MIN_SIZE) {
+    initial_size = STRING_BUFFER_MIN_SIZE;
+  }
+
+  buffer->data = (char *)malloc(initial_size);
+  if (!buffer->data) {
+    PRINT_ERROR("Failed to allocate memory for the string buffer");
+    buffer->length = 0;
+    buffer->size = 0;
+    return FALSE;
+  }
+  buffer->data[0] = '\0';
+  buffer->length = 0;
+  buffer->size = initial_size;
+
+  return TRUE;
+}
+
+void string_buffer_free(string_buffer_s *buffer) {
+  if (buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->size = 0;
+  }
+}
+
+void string_buffer_reset(string_buffer_s *buffer) {
+  buffer->length = 0;
+  if (buffer->data) {
+    buffer->data[0] = '\0';
+  }
+}
+
+BOOL string_buffer_reserve(string_buffer_s *buffer, size_t extra) {
+  size_t needed = buffer->length + extra + 1;
+  size_t new_size;
+  char *new_data;
+
+  if (needed <= buffer->size) {
+    return TRUE;
+  }
+
+  /* Grow geometrically so appending stays amortized O(1) */
+  new_size = buffer->size ? buffer->size : STRING_BUFFER_MIN_SIZE;
+  while (new_size < needed) {
+    new_size *= 2;
+  }
+
+  new_data = (char *)realloc(buffer->data, new_size);
+  if (!new_data) {
+    PRINT_ERROR("Failed to grow the string buffer to %d bytes",
+        (int)new_size);
+    return FALSE;
+  }
+  buffer->data = new_data;
+  buffer->size = new_size;
+
+  return TRUE;
+}
+
+BOOL string_buffer_append(string_buffer_s *buffer, const char *data,
+    size_t length) {
+  if (!string_buffer_reserve(buffer, length)) {
+    return FALSE;
+  }
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+  buffer->data[buffer->length] = '\0';
+
+  return TRUE;
+}
+
+BOOL string_buffer_append_str(string_buffer_s *buffer, const char *string) {
+  return string_buffer_append(buffer, string, strlen(string));
+}
+
+BOOL string_buffer_append_char(string_buffer_s *buffer, char c) {
+  if (!string_buffer_reserve(buffer, 1)) {
+    return FALSE;
+  }
+  buffer->data[buffer->length++] = c;
+  buffer->data[buffer->length] = '\0';
+
+  return TRUE;
+}
+
+BOOL string_buffer_append_uint(string_buffer_s *buffer, unsigned long value) {
+  char digits[20];
+  int pos = sizeof(digits);
+
+  do {
+    digits[--pos] = '0' + (value % 10);
+    value /= 10;
+  } while (value > 0);
+
+  return string_buffer_append(buffer, digits + pos, sizeof(digits) - pos);
+}
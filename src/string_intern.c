@@ -0,0 +1,236 @@
+/** \file string_intern.c
+ * A global, reference-counted string interning table. Header values and
+ * device description fields repeat a lot between devices (SERVER, NT, OPT,
+ * manufacturer, modelName...), interning them makes all the messages share
+ * one copy of each distinct value.
+ *
+ * @copyright 2017 Andreas Bank, andreas.mikael.bank@gmail.com
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common_definitions.h"
+#include "log.h"
+#include "string_intern.h"
+
+/** The number of buckets the table starts with (must be a power of 2). */
+#define INTERN_INITIAL_BUCKETS 256
+
+/** An interned string entry. */
+typedef struct interned_string_struct {
+  /** The next entry in the same bucket. */
+  struct interned_string_struct *next;
+  /** The hash of the string. */
+  unsigned int hash;
+  /** The number of references held to the string. */
+  unsigned int refcount;
+  /** The length of the string. */
+  size_t length;
+  /** The string itself. */
+  char string[];
+} interned_string_s;
+
+/** The interning table. */
+static struct {
+  /** The buckets (chained entries). */
+  interned_string_s **buckets;
+  /** The number of buckets (always a power of 2). */
+  unsigned int buckets_count;
+  /** The number of entries in the table. */
+  unsigned int entries_count;
+} intern_table = { NULL, 0, 0 };
+
+/** Guards the interning table. */
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Get the table entry holding the given interned string.
+ *
+ * @param interned The interned string.
+ *
+ * @return The entry the string belongs to.
+ */
+static interned_string_s *get_entry(const char *interned) {
+  return (interned_string_s *)(interned -
+      offsetof(interned_string_s, string));
+}
+
+/**
+ * Calculate the (FNV-1a) hash of a string.
+ *
+ * @param string The string to hash.
+ * @param length The length of the string.
+ *
+ * @return The hash of the string.
+ */
+static unsigned int hash_string(const char *string, size_t length) {
+  unsigned int hash = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    hash ^= (unsigned char)string[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/**
+ * Double the number of buckets and rehash all the entries. Must be called
+ * with the table lock held.
+ *
+ * @return TRUE on success, FALSE otherwise.
+ */
+static BOOL grow_table(void) {
+  unsigned int new_count = intern_table.buckets_count ?
+      intern_table.buckets_count * 2 : INTERN_INITIAL_BUCKETS;
+  interned_string_s **new_buckets = NULL;
+  unsigned int i;
+
+  new_buckets = (interned_string_s **)calloc(new_count,
+      sizeof(interned_string_s *));
+  if (!new_buckets) {
+    PRINT_ERROR("Failed to allocate memory for the string intern table");
+    return FALSE;
+  }
+
+  for (i = 0; i < intern_table.buckets_count; i++) {
+    interned_string_s *entry = intern_table.buckets[i];
+    while (entry) {
+      interned_string_s *next = entry->next;
+      unsigned int pos = entry->hash & (new_count - 1);
+      entry->next = new_buckets[pos];
+      new_buckets[pos] = entry;
+      entry = next;
+    }
+  }
+
+  free(intern_table.buckets);
+  intern_table.buckets = new_buckets;
+  intern_table.buckets_count = new_count;
+
+  return TRUE;
+}
+
+const char *string_intern_n(const char *string, size_t length) {
+  interned_string_s *entry = NULL;
+  unsigned int hash;
+
+  if (!string) {
+    return NULL;
+  }
+
+  hash = hash_string(string, length);
+
+  pthread_mutex_lock(&intern_lock);
+
+  if (intern_table.buckets_count > 0) {
+    entry = intern_table.buckets[hash & (intern_table.buckets_count - 1)];
+    while (entry) {
+      if (entry->hash == hash && entry->length == length &&
+          0 == memcmp(entry->string, string, length)) {
+        entry->refcount++;
+        pthread_mutex_unlock(&intern_lock);
+        return entry->string;
+      }
+      entry = entry->next;
+    }
+  }
+
+  /* Keep the load factor under 0.75 */
+  if ((intern_table.entries_count + 1) * 4 >
+      intern_table.buckets_count * 3 && !grow_table()) {
+    pthread_mutex_unlock(&intern_lock);
+    return NULL;
+  }
+
+  entry = (interned_string_s *)malloc(sizeof(interned_string_s) + length + 1);
+  if (!entry) {
+    PRINT_ERROR("Failed to allocate memory for an interned string");
+    pthread_mutex_unlock(&intern_lock);
+    return NULL;
+  }
+  entry->hash = hash;
+  entry->refcount = 1;
+  entry->length = length;
+  memcpy(entry->string, string, length);
+  entry->string[length] = '\0';
+
+  entry->next = intern_table.buckets[hash & (intern_table.buckets_count - 1)];
+  intern_table.buckets[hash & (intern_table.buckets_count - 1)] = entry;
+  intern_table.entries_count++;
+
+  pthread_mutex_unlock(&intern_lock);
+
+  return entry->string;
+}
+
+const char *string_intern(const char *string) {
+  if (!string) {
+    return NULL;
+  }
+
+  return string_intern_n(string, strlen(string));
+}
+
+const char *string_intern_ref(const char *interned) {
+  if (interned) {
+    pthread_mutex_lock(&intern_lock);
+    get_entry(interned)->refcount++;
+    pthread_mutex_unlock(&intern_lock);
+  }
+
+  return interned;
+}
+
+void string_intern_release(const char *interned) {
+  interned_string_s *entry = NULL;
+  interned_string_s **link = NULL;
+
+  if (!interned) {
+    return;
+  }
+
+  entry = get_entry(interned);
+
+  pthread_mutex_lock(&intern_lock);
+
+  if (--entry->refcount > 0) {
+    pthread_mutex_unlock(&intern_lock);
+    return;
+  }
+
+  /* Last reference, unlink and free the entry */
+  link = &intern_table.buckets[entry->hash & (intern_table.buckets_count - 1)];
+  while (*link && *link != entry) {
+    link = &(*link)->next;
+  }
+  if (*link) {
+    *link = entry->next;
+    intern_table.entries_count--;
+  }
+  else {
+    PRINT_ERROR("Released string is not in the intern table");
+  }
+
+  pthread_mutex_unlock(&intern_lock);
+
+  free(entry);
+}
+
+size_t string_intern_length(const char *interned) {
+  return interned ? get_entry(interned)->length : 0;
+}
+
+unsigned int string_intern_count(void) {
+  unsigned int count;
+
+  pthread_mutex_lock(&intern_lock);
+  count = intern_table.entries_count;
+  pthread_mutex_unlock(&intern_lock);
+
+  return count;
+}